@@ -74,6 +74,10 @@ void SetGPIO12toUART();
 bool GPIO_subscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
     uint32_t pull_up_down,
     void (*callback)(void*), void* ctx);
+bool GPIO_subscribe_edges(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
+    void (*callback)(void*), void* ctx);
+void GPIO_set_edges_enabled(uint16_t GPIO_pins, bool enable);
+void GPIO_unsubscribe_edges(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin);
 void GPIO_unsubscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin);
 void GPIO_set_to_analog(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin);
 
@@ -192,7 +192,8 @@ void SetGPIO12toUART() {
 }
 
 // Expected subscriptions: 2x step signal + 2x encoder index signal
-#define MAX_SUBSCRIPTIONS 10
+// + up to 2x3 encoder edge timing signals
+#define MAX_SUBSCRIPTIONS 16
 struct subscription_t {
   GPIO_TypeDef* GPIO_port;
   uint16_t GPIO_pin;
@@ -201,20 +202,32 @@ struct subscription_t {
 } subscriptions[MAX_SUBSCRIPTIONS] = { 0 };
 size_t n_subscriptions = 0;
 
-// Sets up the specified GPIO to trigger the specified callback
-// on a rising edge of the GPIO.
-// @param pull_up_down: one of GPIO_NOPULL, GPIO_PULLUP or GPIO_PULLDOWN
-bool GPIO_subscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
-    uint32_t pull_up_down,
+static uint32_t get_pin_position(uint16_t GPIO_pin) {
+  uint32_t position = 0;
+  while (!((GPIO_pin >> position) & 1))
+    ++position;
+  return position;
+}
+
+// Returns the index of the port that is connected to the EXTI line of the given pin
+static uint32_t get_exti_port_index(uint16_t GPIO_pin) {
+  uint32_t position = get_pin_position(GPIO_pin);
+  return (SYSCFG->EXTICR[position >> 2] >> (4U * (position & 0x03U))) & 0x0FU;
+}
+
+// Registers the handler (or reuses an existing registration)
+// Pins of the same number on different ports share one EXTI line, so only
+// one of them can be subscribed at a time.
+// TODO: make thread safe
+static bool register_subscription(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
     void (*callback)(void*), void* ctx) {
-  
-  // Register handler (or reuse existing registration)
-  // TODO: make thread safe
   struct subscription_t* subscription = NULL;
   for (size_t i = 0; i < n_subscriptions; ++i) {
     if (subscriptions[i].GPIO_port == GPIO_port &&
         subscriptions[i].GPIO_pin == GPIO_pin)
       subscription = &subscriptions[i];
+    else if (subscriptions[i].GPIO_pin == GPIO_pin && subscriptions[i].callback)
+      return false;
   }
   if (!subscription) {
     if (n_subscriptions >= MAX_SUBSCRIPTIONS)
@@ -228,6 +241,18 @@ bool GPIO_subscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
     .callback = callback,
     .ctx = ctx
   };
+  return true;
+}
+
+// Sets up the specified GPIO to trigger the specified callback
+// on a rising edge of the GPIO.
+// @param pull_up_down: one of GPIO_NOPULL, GPIO_PULLUP or GPIO_PULLDOWN
+bool GPIO_subscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
+    uint32_t pull_up_down,
+    void (*callback)(void*), void* ctx) {
+  
+  if (!register_subscription(GPIO_port, GPIO_pin, callback, ctx))
+    return false;
 
   // Set up GPIO
   GPIO_InitTypeDef GPIO_InitStruct;
@@ -244,6 +269,68 @@ bool GPIO_subscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
   return true;
 }
 
+// Sets up the specified GPIO to trigger the specified callback on both
+// edges, without changing the mode of the pin. This allows timestamping
+// the edges of a pin that is used by a timer, such as an encoder input.
+// The interrupt stays masked until enabled by GPIO_set_edges_enabled().
+// @returns false if the EXTI line is taken by a pin of another port
+bool GPIO_subscribe_edges(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin,
+    void (*callback)(void*), void* ctx) {
+
+  __HAL_RCC_SYSCFG_CLK_ENABLE();
+  if ((EXTI->IMR & GPIO_pin) && get_exti_port_index(GPIO_pin) != GPIO_GET_INDEX(GPIO_port))
+    return false;
+  if (!register_subscription(GPIO_port, GPIO_pin, callback, ctx))
+    return false;
+
+  // Connect the EXTI line to the port
+  uint32_t position = get_pin_position(GPIO_pin);
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t exticr = SYSCFG->EXTICR[position >> 2];
+  exticr &= ~(0x0FU << (4U * (position & 0x03U)));
+  exticr |= (uint32_t)GPIO_GET_INDEX(GPIO_port) << (4U * (position & 0x03U));
+  SYSCFG->EXTICR[position >> 2] = exticr;
+  EXTI->IMR &= ~GPIO_pin;
+  EXTI->EMR &= ~GPIO_pin;
+  EXTI->RTSR |= GPIO_pin;
+  EXTI->FTSR |= GPIO_pin;
+  __set_PRIMASK(primask);
+
+  HAL_NVIC_SetPriority(get_irq_number(GPIO_pin), 0, 0);
+  HAL_NVIC_EnableIRQ(get_irq_number(GPIO_pin));
+  return true;
+}
+
+// Unmasks or masks the interrupts of GPIOs set up by GPIO_subscribe_edges().
+// Edges that occurred while masked are discarded.
+// @param GPIO_pins: any combination of GPIO_PIN_x
+void GPIO_set_edges_enabled(uint16_t GPIO_pins, bool enable) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (enable) {
+    __HAL_GPIO_EXTI_CLEAR_IT(GPIO_pins);
+    EXTI->IMR |= GPIO_pins;
+  } else {
+    EXTI->IMR &= ~GPIO_pins;
+  }
+  __set_PRIMASK(primask);
+}
+
+// Undoes GPIO_subscribe_edges(): masks the interrupt and removes the callback.
+// The NVIC interrupt stays enabled, because lines 5 to 9 and 10 to 15 share
+// one and other lines may still be in use.
+void GPIO_unsubscribe_edges(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
+  GPIO_set_edges_enabled(GPIO_pin, false);
+  for (size_t i = 0; i < n_subscriptions; ++i) {
+    if (subscriptions[i].GPIO_port == GPIO_port &&
+        subscriptions[i].GPIO_pin == GPIO_pin) {
+      subscriptions[i].callback = NULL;
+      subscriptions[i].ctx = NULL;
+    }
+  }
+}
+
 void GPIO_unsubscribe(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
   bool is_pin_in_use = false;
   for (size_t i = 0; i < n_subscriptions; ++i) {
@@ -272,8 +359,10 @@ void GPIO_set_to_analog(GPIO_TypeDef* GPIO_port, uint16_t GPIO_pin) {
 
 //Dispatch processing of external interrupts based on source
 void HAL_GPIO_EXTI_Callback(uint16_t GPIO_pin) {
+  uint32_t port_index = get_exti_port_index(GPIO_pin);
   for (size_t i = 0; i < n_subscriptions; ++i) {
-    if (subscriptions[i].GPIO_pin == GPIO_pin) // TODO: check for port
+    if (subscriptions[i].GPIO_pin == GPIO_pin
+        && GPIO_GET_INDEX(subscriptions[i].GPIO_port) == port_index)
       if (subscriptions[i].callback)
         subscriptions[i].callback(subscriptions[i].ctx);
   }
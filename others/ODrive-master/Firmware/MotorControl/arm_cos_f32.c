@@ -29,6 +29,15 @@
 #define ARM_MATH_CM4 // TODO: might change in future board versions
 #include "arm_math.h"
 #include "arm_common_tables.h"
+#include "utils.h"
+
+#ifdef ENABLE_RAM_HOT_PATH
+// Copy of the CMSIS sine table in SRAM, see init_fast_math_tables()
+extern float32_t fast_math_sin_table[FAST_MATH_TABLE_SIZE + 1];
+#define FAST_MATH_SIN_TABLE fast_math_sin_table
+#else
+#define FAST_MATH_SIN_TABLE sinTable_f32
+#endif
 /**
  * @ingroup groupFastMath
  */
@@ -68,7 +77,7 @@
  * @return cos(x).
  */
 
-float32_t our_arm_cos_f32(
+RAM_FUNCTION float32_t our_arm_cos_f32(
   float32_t x)
 {
   float32_t cosVal, fract, in;                   /* Temporary variables for input, output */
@@ -107,8 +116,8 @@ float32_t our_arm_cos_f32(
   fract = findex - (float32_t) index;
 
   /* Read two nearest values of input value from the cos table */
-  a = sinTable_f32[index];
-  b = sinTable_f32[index+1];
+  a = FAST_MATH_SIN_TABLE[index];
+  b = FAST_MATH_SIN_TABLE[index+1];
 
   /* Linear interpolation process */
   cosVal = (1.0f-fract)*a + fract*b;
@@ -30,6 +30,30 @@
 #define ARM_MATH_CM4 // TODO: might change in future board versions
 #include "arm_math.h"
 #include "arm_common_tables.h"
+#include "utils.h"
+
+#ifdef ENABLE_RAM_HOT_PATH
+// Copy of the CMSIS sine table in SRAM (shared with our_arm_cos_f32)
+float32_t fast_math_sin_table[FAST_MATH_TABLE_SIZE + 1];
+#define FAST_MATH_SIN_TABLE fast_math_sin_table
+#else
+#define FAST_MATH_SIN_TABLE sinTable_f32
+#endif
+
+/**
+ * @brief  Copies the lookup table used by our_arm_sin_f32 and our_arm_cos_f32
+ * from flash to SRAM if CONFIG_RAM_HOT_PATH is enabled.
+ * Must be called before the first use of either function.
+ */
+void init_fast_math_tables(void)
+{
+#ifdef ENABLE_RAM_HOT_PATH
+  for (int i = 0; i < FAST_MATH_TABLE_SIZE + 1; ++i)
+  {
+    fast_math_sin_table[i] = sinTable_f32[i];
+  }
+#endif
+}
 
 /**
  * @ingroup groupFastMath
@@ -70,7 +94,7 @@
  * @return  sin(x).
  */
 
-float32_t our_arm_sin_f32(
+RAM_FUNCTION float32_t our_arm_sin_f32(
   float32_t x)
 {
   float32_t sinVal, fract, in;                           /* Temporary variables for input, output */
@@ -109,8 +133,8 @@ float32_t our_arm_sin_f32(
   fract = findex - (float32_t) index;
 
   /* Read two nearest values of input value from the sin table */
-  a = sinTable_f32[index];
-  b = sinTable_f32[index+1];
+  a = FAST_MATH_SIN_TABLE[index];
+  b = FAST_MATH_SIN_TABLE[index+1];
 
   /* Linear interpolation process */
   sinVal = (1.0f-fract)*a + fract*b;
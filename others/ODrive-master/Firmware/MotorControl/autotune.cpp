@@ -0,0 +1,305 @@
+#include <math.h>
+#include "odrive_main.h"
+#include "utils.h"
+
+// The first relay cycles of each experiment are discarded
+static constexpr uint32_t NUM_DISCARD = 2;
+// Half period of the inertia experiment in ultimate periods
+static constexpr float HALF_PERIODS_PER_ULTIMATE = 5.0f;
+// Relay current of the inertia experiment relative to relay_current, at least
+static constexpr float MIN_INERTIA_CURRENT = 0.2f;
+// Phase lag of the integrator at the crossover, at least
+static constexpr float MIN_INTEGRATOR_LAG = 5.0f * M_PI / 180.0f;
+// vel_gain is at most the ultimate gain over this (8 dB)
+static constexpr float GAIN_MARGIN = 2.5f;
+// First frequency of the sweep relative to the ultimate frequency
+static constexpr float SWEEP_START = 0.25f;
+// Frequency ratio of consecutive sweep steps
+static constexpr float SWEEP_STEP = 1.1f;
+// Periods of each sweep step before and during the correlation. A lightly
+// damped resonance rings for several periods after the frequency changes.
+static constexpr float SWEEP_SETTLE_PERIODS = 6.0f;
+static constexpr float SWEEP_MEASURE_PERIODS = 4.0f;
+// The sweep ends where the position amplitude of the inertia falls below this [counts]
+static constexpr float SWEEP_MIN_AMPLITUDE = 0.5f;
+// Velocity amplitude of the sweep relative to the velocity limit, at most
+static constexpr float SWEEP_MAX_VEL = 0.25f;
+// Bandwidth of the velocity loop that holds the motor during the sweep,
+// relative to the first frequency, with vel_gain's limit
+static constexpr float SWEEP_DAMPING = 2.0f;
+// A resonance peaks this far above the first step of the sweep
+static constexpr float RESONANCE_PEAK = 2.0f;
+
+// @brief Starts the experiments
+// @param vel_limit: the experiments fail if the velocity exceeds this [counts/s]
+// @param pos: position estimate at the start, the center of the travel limit [counts]
+void Autotune::start(const Config_t& config, float vel_limit, float pos) {
+    config_ = config;
+    vel_limit_ = vel_limit;
+    start_pos_ = pos;
+    result_ = Result_t();
+    time_ = 0.0f;
+    current_ = config_.relay_current;
+    output_ = current_;
+    band_ = config_.noise_band;
+    cycles_ = 0;
+    cycle_time_ = 0.0f;
+    half_time_ = 0.0f;
+    last_half_period_ = 0.0f;
+    vel_max_ = -INFINITY;
+    vel_min_ = INFINITY;
+    period_sum_ = 0.0f;
+    amplitude_sum_ = 0.0f;
+    vel_last_ = 0.0f;
+    output_last_ = 0.0f;
+    sample_dt_ = 0.0f;
+    for (size_t i = 0; i < sizeof(sums_) / sizeof(sums_[0]); ++i)
+        sums_[i] = 0.0f;
+    sweep_steps_ = 0;
+    sweep_step_ = 0;
+    bool valid = config_.relay_current > 0.0f && config_.noise_band > 0.0f && config_.num_cycles > 0
+            && config_.max_travel > 0.0f && config_.sweep_current >= 0.0f
+            && config_.phase_margin * (M_PI / 180.0f) < 0.5f * M_PI - MIN_INTEGRATOR_LAG;
+    phase_ = valid ? AUTOTUNE_ULTIMATE : AUTOTUNE_FAILED;
+}
+
+// @brief Steps the experiments, to be called once per control period
+// @param pos: position estimate [counts]
+// @param vel: velocity estimate [counts/s]
+// @param dt: time since the previous call [s]
+// @returns the current command [A], zero once the experiments are over
+float Autotune::update(float pos, float vel, float dt) {
+    if (!busy())
+        return 0.0f;
+
+    time_ += dt;
+    cycle_time_ += dt;
+    half_time_ += dt;
+    if (time_ > config_.timeout || !(fabsf(vel) <= vel_limit_)
+            || !(fabsf(pos - start_pos_) <= config_.max_travel)) {
+        phase_ = AUTOTUNE_FAILED;
+        return 0.0f;
+    }
+
+    if (phase_ == AUTOTUNE_ULTIMATE) {
+        vel_max_ = std::max(vel_max_, vel);
+        vel_min_ = std::min(vel_min_, vel);
+        if (relay(vel)) {
+            if (cycles_ >= NUM_DISCARD) {
+                period_sum_ += cycle_time_;
+                amplitude_sum_ += 0.5f * (vel_max_ - vel_min_);
+            }
+            ++cycles_;
+            cycle_time_ = 0.0f;
+            vel_max_ = -INFINITY;
+            vel_min_ = INFINITY;
+            if (cycles_ == NUM_DISCARD + config_.num_cycles)
+                start_inertia();
+        }
+    } else if (phase_ == AUTOTUNE_INERTIA) {
+        // Fit dv = theta0 * I + theta1 * sign(v) + theta2 to the ramps. The
+        // first quarter of each half period is skipped, where the current and
+        // the velocity estimate still respond to the switch.
+        if (cycles_ > NUM_DISCARD && half_time_ > 0.25f * last_half_period_) {
+            float phi[3] = {output_last_, vel_last_ >= 0.0f ? 1.0f : -1.0f, 1.0f};
+            float dv = vel - vel_last_;
+            sums_[0] += phi[0] * phi[0];
+            sums_[1] += phi[0] * phi[1];
+            sums_[2] += phi[0];
+            sums_[3] += phi[1] * phi[1];
+            sums_[4] += phi[1];
+            sums_[5] += 1.0f;
+            sums_[6] += phi[0] * dv;
+            sums_[7] += phi[1] * dv;
+            sums_[8] += dv;
+            sample_dt_ = dt;
+        }
+        if (relay(vel)) {
+            ++cycles_;
+            if (cycles_ == NUM_DISCARD + config_.num_cycles)
+                finish();
+        }
+    } else {
+        output_ = sweep(vel, dt);
+    }
+
+    vel_last_ = vel;
+    output_last_ = output_;
+    return busy() ? output_ : 0.0f;
+}
+
+// @returns true on a rising switch, which starts a new cycle
+bool Autotune::relay(float vel) {
+    if (vel > band_ && output_ > 0.0f) {
+        output_ = -current_;
+        last_half_period_ = half_time_;
+        half_time_ = 0.0f;
+    } else if (vel < -band_ && output_ < 0.0f) {
+        output_ = current_;
+        last_half_period_ = half_time_;
+        half_time_ = 0.0f;
+        return true;
+    }
+    return false;
+}
+
+void Autotune::start_inertia() {
+    float period = period_sum_ / (float)config_.num_cycles;
+    float amplitude = amplitude_sum_ / (float)config_.num_cycles;
+    if (!(period > 0.0f && amplitude > 0.0f)) {
+        phase_ = AUTOTUNE_FAILED;
+        return;
+    }
+    result_.ultimate_frequency = 2.0f * M_PI / period;
+    result_.ultimate_gain = 4.0f * config_.relay_current / (M_PI * amplitude);
+    result_.ultimate_phase = asinf(std::min(band_ / amplitude, 1.0f));
+
+    // Rough inertia for the band of the inertia experiment, assuming that the
+    // lags don't change the magnitude at the ultimate frequency. If that band
+    // would exceed half the velocity limit, the relay current is reduced instead.
+    float inertia_rough = result_.ultimate_gain / result_.ultimate_frequency;
+    float half_period = HALF_PERIODS_PER_ULTIMATE * period;
+    float band = config_.relay_current * half_period / (2.0f * inertia_rough);
+    band_ = std::max(std::min(band, 0.5f * vel_limit_), 4.0f * config_.noise_band);
+    current_ = config_.relay_current * std::max(std::min(band_ / band, 1.0f), MIN_INERTIA_CURRENT);
+    output_ = output_ > 0.0f ? current_ : -current_;
+    cycles_ = 0;
+    phase_ = AUTOTUNE_INERTIA;
+}
+
+void Autotune::finish() {
+    // Least squares solution of the normal equations by Cramer's rule
+    const float* s = sums_;
+    float a00 = s[0], a01 = s[1], a02 = s[2];
+    float a11 = s[3], a12 = s[4], a22 = s[5];
+    float b0 = s[6], b1 = s[7], b2 = s[8];
+    float c00 = a11 * a22 - a12 * a12;
+    float c01 = a02 * a12 - a01 * a22;
+    float c02 = a01 * a12 - a02 * a11;
+    float det = a00 * c00 + a01 * c01 + a02 * c02;
+    float theta0 = (b0 * c00 + b1 * c01 + b2 * c02) / det;
+    float theta1 = (a00 * (b1 * a22 - a12 * b2) - b0 * (a01 * a22 - a12 * a02) + a02 * (a01 * b2 - b1 * a02)) / det;
+    if (!(theta0 > 0.0f && fabsf(theta1) < INFINITY)) {
+        phase_ = AUTOTUNE_FAILED;
+        return;
+    }
+    result_.inertia = sample_dt_ / theta0;
+    result_.friction = -theta1 / theta0;
+    compute_gains();
+    start_sweep();
+}
+
+// @brief PI velocity gains with the integrator zero placed such that the
+// phase at the crossover meets the phase margin
+void Autotune::compute_gains() {
+    // Lags of the loop apart from the inertia, modelled as a delay that
+    // accounts for the 90 degrees left at the ultimate frequency
+    float delay = (0.5f * M_PI - result_.ultimate_phase) / result_.ultimate_frequency;
+    float max_lag = 0.5f * M_PI - config_.phase_margin * (M_PI / 180.0f);
+    float omega_c = config_.bandwidth;
+    float integrator_lag = max_lag - omega_c * delay;
+    if (integrator_lag < MIN_INTEGRATOR_LAG) {
+        omega_c = std::max(max_lag - MIN_INTEGRATOR_LAG, 0.0f) / delay;
+        integrator_lag = MIN_INTEGRATOR_LAG;
+    }
+    float vel_gain = result_.inertia * omega_c * cosf(integrator_lag);
+    float max_vel_gain = result_.ultimate_gain / GAIN_MARGIN;
+    if (vel_gain > max_vel_gain) {
+        omega_c *= max_vel_gain / vel_gain;
+        vel_gain = max_vel_gain;
+    }
+    result_.bandwidth = omega_c;
+    result_.vel_gain = vel_gain;
+    result_.vel_integrator_gain = vel_gain * omega_c * tanf(integrator_lag);
+    result_.pos_gain = config_.pos_bandwidth_ratio * omega_c;
+}
+
+void Autotune::start_sweep() {
+    // The steps stop where the position amplitude of the inertia would fall
+    // below the resolution needed for the correlation
+    sweep_start_ = SWEEP_START * result_.ultimate_frequency;
+    float end = sqrtf(config_.sweep_current / (result_.inertia * SWEEP_MIN_AMPLITUDE));
+    sweep_steps_ = 0;
+    for (float frequency = sweep_start_; frequency <= end && sweep_steps_ < NUM_SWEEP_STEPS; frequency *= SWEEP_STEP)
+        ++sweep_steps_;
+    if (sweep_steps_ < 3) {
+        phase_ = AUTOTUNE_DONE; // too short to tell a peak
+        return;
+    }
+    sweep_step_ = 0;
+    sweep_frequency_ = sweep_start_;
+    sweep_amplitude_ = std::min(config_.sweep_current, SWEEP_MAX_VEL * vel_limit_ * result_.inertia * sweep_frequency_);
+    // Below the ultimate gain the weak velocity loop can't become unstable
+    sweep_damping_ = std::min(SWEEP_DAMPING * sweep_start_ * result_.inertia, result_.ultimate_gain / GAIN_MARGIN);
+    sweep_phase_ = 0.0f;
+    for (size_t i = 0; i < sizeof(sweep_sums_) / sizeof(sweep_sums_[0]); ++i)
+        sweep_sums_[i] = 0.0f;
+    phase_ = AUTOTUNE_SWEEP;
+}
+
+// @brief Steps the sweep. Each step starts with the cosine at zero phase and
+// runs for whole periods, which leaves a rigid inertia at rest, and a weak
+// velocity loop keeps the motor from drifting. Both the current and the
+// velocity are correlated, so that the loop doesn't bias the response.
+// @returns the current command [A]
+float Autotune::sweep(float vel, float dt) {
+    float hold = -sweep_damping_ * vel;
+    hold = std::max(std::min(hold, config_.relay_current), -config_.relay_current);
+    float c = cosf(sweep_phase_);
+    float s = sinf(sweep_phase_);
+    float output = sweep_amplitude_ * c + hold;
+    if (sweep_phase_ >= 2.0f * M_PI * SWEEP_SETTLE_PERIODS) {
+        sweep_sums_[0] += output * c;
+        sweep_sums_[1] += output * s;
+        sweep_sums_[2] += vel * c;
+        sweep_sums_[3] += vel * s;
+    }
+    sweep_phase_ += sweep_frequency_ * dt;
+    float step_phase = 2.0f * M_PI * (SWEEP_SETTLE_PERIODS + SWEEP_MEASURE_PERIODS);
+    if (sweep_phase_ < step_phase)
+        return output;
+
+    // Response relative to the velocity of the identified inertia
+    float current = sqrtf(sweep_sums_[0] * sweep_sums_[0] + sweep_sums_[1] * sweep_sums_[1]);
+    float velocity = sqrtf(sweep_sums_[2] * sweep_sums_[2] + sweep_sums_[3] * sweep_sums_[3]);
+    sweep_gains_[sweep_step_] = velocity / current * sweep_frequency_ * result_.inertia;
+    if (!(sweep_gains_[sweep_step_] < INFINITY)) {
+        phase_ = AUTOTUNE_FAILED;
+        return 0.0f;
+    }
+    if (++sweep_step_ == sweep_steps_) {
+        finish_sweep();
+        return 0.0f;
+    }
+    sweep_phase_ -= step_phase;
+    sweep_frequency_ *= SWEEP_STEP;
+    sweep_amplitude_ = std::min(config_.sweep_current, SWEEP_MAX_VEL * vel_limit_ * result_.inertia * sweep_frequency_);
+    for (size_t i = 0; i < sizeof(sweep_sums_) / sizeof(sweep_sums_[0]); ++i)
+        sweep_sums_[i] = 0.0f;
+    return output;
+}
+
+// @brief Finds the resonance in the sweep. Below the resonances, the response
+// is that of the identified inertia, about 1, and falls off with the lags at
+// higher frequencies. Above a resonance it is that of the motor alone, so it
+// may end higher than it starts. A resonance is a peak within the sweep.
+void Autotune::finish_sweep() {
+    const float* gains = sweep_gains_;
+    size_t last = sweep_steps_ - 1;
+    size_t peak = 0;
+    for (size_t i = 1; i <= last; ++i) {
+        if (gains[i] > gains[peak])
+            peak = i;
+    }
+    if (peak > 0 && peak < last && gains[peak] > RESONANCE_PEAK * gains[0]) {
+        // Vertex of the parabola through the logarithms of the peak and its
+        // neighbours, in steps
+        float min_gain = 1e-6f * gains[peak];
+        float l = logf(std::max(gains[peak - 1], min_gain));
+        float c = logf(gains[peak]);
+        float r = logf(std::max(gains[peak + 1], min_gain));
+        float offset = 0.5f * (l - r) / (l - 2.0f * c + r);
+        result_.resonance_frequency = sweep_start_ * powf(SWEEP_STEP, (float)peak + offset);
+    }
+    phase_ = AUTOTUNE_DONE;
+}
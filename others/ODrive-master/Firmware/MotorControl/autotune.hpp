@@ -0,0 +1,110 @@
+#ifndef __AUTOTUNE_HPP
+#define __AUTOTUNE_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Relay feedback identification and tuning of the velocity loop
+//
+// A relay with hysteresis on the velocity estimate drives the motor current.
+// The first experiment switches at the noise band and settles into a limit
+// cycle at the ultimate frequency of the loop, where the lags of the current
+// loop, the encoder estimate and any compliance between motor and load add up
+// to 180 degrees. The second experiment switches at a band wide enough for a
+// half period of several ultimate periods, so that the velocity ramps are
+// dominated by the inertia, and fits inertia and Coulomb friction to them by
+// least squares. The gains then follow from the requested bandwidth and phase
+// margin, treating the lags seen by the first experiment as a delay.
+// A resonance that sets the ultimate frequency is indistinguishable from the
+// lags, so a sine sweep around the ultimate frequency follows. It measures the
+// velocity response to the current, relative to the identified inertia, and
+// reports the largest peak as the resonance frequency. The gains don't depend
+// on it, but a notch filter can be placed there.
+// See tools/control_simulation/Autotune.py for the plant simulation.
+class Autotune {
+public:
+    enum Phase_t {
+        AUTOTUNE_IDLE = 0,
+        AUTOTUNE_ULTIMATE = 1,  // limit cycle at the noise band
+        AUTOTUNE_INERTIA = 2,   // limit cycle with a wide band
+        AUTOTUNE_SWEEP = 3,     // sine sweep for resonances
+        AUTOTUNE_DONE = 4,      // results are valid
+        AUTOTUNE_FAILED = 5,
+    };
+
+    struct Config_t {
+        float relay_current = 2.0f;         // [A]
+        float noise_band = 300.0f;          // [counts/s] hysteresis of the first experiment, above the velocity noise
+        uint32_t num_cycles = 8;            // relay cycles averaged in each experiment
+        float timeout = 20.0f;              // [s] of all experiments
+        float max_travel = 8192.0f;         // [counts] the experiments fail if the position leaves +-max_travel around the start
+        float bandwidth = 100.0f;           // [rad/s] requested crossover of the velocity loop
+        float phase_margin = 60.0f;         // [deg]
+        float pos_bandwidth_ratio = 0.25f;  // position loop bandwidth relative to the velocity loop
+        float sweep_current = 2.0f;         // [A] amplitude of the sine sweep, 0 skips it
+    };
+
+    struct Result_t {
+        float inertia = 0.0f;               // [A/(counts/s^2)]
+        float friction = 0.0f;              // [A] Coulomb friction
+        float ultimate_frequency = 0.0f;    // [rad/s]
+        float ultimate_gain = 0.0f;         // [A/(counts/s)]
+        float ultimate_phase = 0.0f;        // [rad] delay of the relay switches due to the hysteresis
+        float bandwidth = 0.0f;             // [rad/s] achieved crossover, may be below the requested one
+        float pos_gain = 0.0f;              // [(counts/s) / counts]
+        float vel_gain = 0.0f;              // [A/(counts/s)]
+        float vel_integrator_gain = 0.0f;   // [A/(counts/s * s)]
+        float resonance_frequency = 0.0f;   // [rad/s] largest peak of the sweep, 0 if there is none
+    };
+
+    // Steps of the sweep, a factor of SWEEP_STEP apart in frequency
+    static constexpr size_t NUM_SWEEP_STEPS = 24;
+
+    void start(const Config_t& config, float vel_limit, float pos);
+    float update(float pos, float vel, float dt);
+    bool busy() { return phase_ == AUTOTUNE_ULTIMATE || phase_ == AUTOTUNE_INERTIA || phase_ == AUTOTUNE_SWEEP; }
+
+    Phase_t phase_ = AUTOTUNE_IDLE;
+    Result_t result_;
+
+private:
+    bool relay(float vel);
+    void start_inertia();
+    void finish();
+    void compute_gains();
+    void start_sweep();
+    float sweep(float vel, float dt);
+    void finish_sweep();
+
+    Config_t config_;
+    float vel_limit_ = 0.0f;
+    float start_pos_ = 0.0f;        // [counts]
+    float time_ = 0.0f;
+    float current_ = 0.0f;          // [A] relay amplitude of the running experiment
+    float output_ = 0.0f;           // [A]
+    float band_ = 0.0f;             // [counts/s]
+    uint32_t cycles_ = 0;
+    float cycle_time_ = 0.0f;
+    float half_time_ = 0.0f;
+    float last_half_period_ = 0.0f;
+    float vel_max_ = 0.0f;
+    float vel_min_ = 0.0f;
+    float period_sum_ = 0.0f;
+    float amplitude_sum_ = 0.0f;
+    float vel_last_ = 0.0f;
+    float output_last_ = 0.0f;
+    float sample_dt_ = 0.0f;
+    float sums_[9];                 // upper triangle of phi * phi^T, then phi * dv
+    size_t sweep_steps_ = 0;
+    size_t sweep_step_ = 0;
+    float sweep_start_ = 0.0f;      // [rad/s] frequency of the first step
+    float sweep_frequency_ = 0.0f;  // [rad/s]
+    float sweep_amplitude_ = 0.0f;  // [A]
+    float sweep_damping_ = 0.0f;    // [A/(counts/s)]
+    float sweep_phase_ = 0.0f;      // [rad] since the start of the step
+    float sweep_sums_[4];           // current and velocity correlated with cos and sin
+    float sweep_gains_[NUM_SWEEP_STEPS]; // velocity response of each step relative to the rigid inertia
+};
+
+#endif // __AUTOTUNE_HPP
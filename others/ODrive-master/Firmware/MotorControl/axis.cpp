@@ -13,7 +13,9 @@ Axis::Axis(int axis_num,
            SensorlessEstimator& sensorless_estimator,
            Controller& controller,
            Motor& motor,
-           TrapezoidalTrajectory& trap)
+           TrapezoidalTrajectory& trap,
+           SCurveTrajectory& scurve,
+           PvtTrajectory& pvt)
     : axis_num_(axis_num),
       hw_config_(hw_config),
       config_(config),
@@ -21,16 +23,21 @@ Axis::Axis(int axis_num,
       sensorless_estimator_(sensorless_estimator),
       controller_(controller),
       motor_(motor),
-      trap_(trap)
+      trap_(trap),
+      scurve_(scurve),
+      pvt_(pvt)
 {
     encoder_.axis_ = this;
     sensorless_estimator_.axis_ = this;
     controller_.axis_ = this;
     motor_.axis_ = this;
     trap_.axis_ = this;
+    scurve_.axis_ = this;
+    pvt_.axis_ = this;
 
     decode_step_dir_pins();
     update_watchdog_settings();
+    update_checks_divisor();
 }
 
 Axis::LockinConfig_t Axis::default_calibration() {
@@ -91,6 +98,49 @@ void Axis::signal_current_meas() {
         osSignalSet(thread_id_, M_SIGNAL_PH_CURRENT_MEAS);
 }
 
+// @brief Runs the estimators and the current controller to completion.
+// This is called from the current sense interrupt handler, right before
+// signal_current_meas(). It does nothing unless the axis thread has handed
+// over the inner loop by setting isr_current_loop_source_.
+RAM_FUNCTION void Axis::run_isr_current_loop() {
+    IsrCurrentLoopSource_t source = isr_current_loop_source_;
+    if (source == ISR_CURRENT_LOOP_INACTIVE)
+        return;
+
+    uint16_t start_time = get_timing_clocks();
+    encoder_.update();
+    sensorless_estimator_.update();
+    stage_done(CONTROL_STAGE_ESTIMATORS, start_time);
+    if (!check_for_errors()) {
+        // An estimator failed. The thread exits the control loop on the error,
+        // but until then nobody would provide valid timings, so float the phases now.
+        set_isr_current_loop_source(ISR_CURRENT_LOOP_INACTIVE);
+        safety_critical_disarm_motor_pwm(motor_);
+        update_brake_current();
+        return;
+    }
+
+    float phase, phase_vel;
+    if (source == ISR_CURRENT_LOOP_ENCODER) {
+        phase = encoder_.phase_;
+        phase_vel = 2*M_PI * encoder_.vel_estimate_ / (float)encoder_.config_.cpr * motor_.config_.pole_pairs;
+    } else {
+        phase = sensorless_estimator_.phase_;
+        phase_vel = sensorless_estimator_.vel_estimate_;
+    }
+    start_time = get_timing_clocks();
+    if (!motor_.update(isr_current_setpoint_, phase, phase_vel))
+        set_isr_current_loop_source(ISR_CURRENT_LOOP_INACTIVE); // set_error already disarmed the motor
+    stage_done(CONTROL_STAGE_CURRENT, start_time);
+}
+
+// @brief Hands the inner loop over to the interrupt or takes it back.
+// The non-volatile mirror is what the protocol reports.
+RAM_FUNCTION void Axis::set_isr_current_loop_source(IsrCurrentLoopSource_t source) {
+    isr_current_loop_source_ = source;
+    isr_current_loop_source_mirror_ = source;
+}
+
 // @brief Blocks until a current measurement is completed
 // @returns True on success, false otherwise
 bool Axis::wait_for_current_meas() {
@@ -134,6 +184,19 @@ void Axis::update_watchdog_settings() {
     watchdog_feed();
 }
 
+// @brief Derives the divisor of the checks stage from config_.checks_rate and the
+// current measurement rate, which depends on the PWM frequency and double update.
+// The result is stored like the divisors of the other stages, but it is
+// recomputed on startup, so a stored value never outlives a change of the rate.
+void Axis::update_checks_divisor() {
+    float divisor = roundf((float)current_meas_hz / config_.checks_rate);
+    if (!(divisor >= 1.0f)) // Funny polarity to also catch NaN
+        divisor = 1.0f;
+    else if (divisor > (float)current_meas_hz)
+        divisor = (float)current_meas_hz;
+    config_.control_stages[CONTROL_STAGE_CHECKS].divisor = (uint32_t)divisor;
+}
+
 // @brief (de)activates step/dir input
 void Axis::set_step_dir_active(bool active) {
     if (active) {
@@ -144,11 +207,10 @@ void Axis::set_step_dir_active(bool active) {
         GPIO_InitStruct.Pull = GPIO_NOPULL;
         HAL_GPIO_Init(dir_port_, &GPIO_InitStruct);
 
-        // Subscribe to rising edges of the step GPIO
-        GPIO_subscribe(step_port_, step_pin_, GPIO_PULLDOWN,
+        // Subscribe to rising edges of the step GPIO. This fails if the EXTI
+        // line is taken by a pin of the same number, e.g. for encoder edge timing.
+        step_dir_active_ = GPIO_subscribe(step_port_, step_pin_, GPIO_PULLDOWN,
                 step_cb_wrapper, this);
-
-        step_dir_active_ = true;
     } else {
         step_dir_active_ = false;
 
@@ -171,8 +233,13 @@ bool Axis::do_checks() {
         error_ |= ERROR_DC_BUS_OVER_VOLTAGE;
 
     // Sub-components should use set_error which will propegate to this error_
-    motor_.do_checks();
-    encoder_.do_checks();
+    // The thermal and fault checks of the sub-components run at a reduced rate
+    if (stage_due(CONTROL_STAGE_CHECKS)) {
+        uint16_t start_time = get_timing_clocks();
+        motor_.do_checks();
+        encoder_.do_checks();
+        stage_done(CONTROL_STAGE_CHECKS, start_time);
+    }
     // sensorless_estimator_.do_checks();
     // controller_.do_checks();
 
@@ -182,16 +249,73 @@ bool Axis::do_checks() {
 // @brief Update all esitmators
 bool Axis::do_updates() {
     // Sub-components should use set_error which will propegate to this error_
-    encoder_.update();
-    sensorless_estimator_.update();
+    // If the current loop runs in the interrupt, the estimators are updated there
+    if (isr_current_loop_source_ == ISR_CURRENT_LOOP_INACTIVE) {
+        uint16_t start_time = get_timing_clocks();
+        encoder_.update();
+        sensorless_estimator_.update();
+        stage_done(CONTROL_STAGE_ESTIMATORS, start_time);
+    }
     return check_for_errors();
 }
 
+// @brief Acceleration due to the measured current, the input of the Kalman
+// filters in the estimators. It is in the units of the controller, which are
+// electrical radians in sensorless control and counts otherwise.
+// @param sensorless: true for the sensorless estimator, false for the encoder
+// @returns [rad/s^2] or [counts/s^2], zero if the current isn't applied or
+// the estimator doesn't drive the controller
+RAM_FUNCTION float Axis::get_estimator_accel(bool sensorless) {
+    if (sensorless != (current_state_ == AXIS_STATE_SENSORLESS_CONTROL))
+        return 0.0f;
+    if (motor_.armed_state_ != Motor::ARMED_STATE_ARMED || !(controller_.config_.inertia > 0.0f))
+        return 0.0f;
+    return (float)motor_.config_.direction * motor_.Iq_last_ / controller_.config_.inertia;
+}
+
 // @brief Feed the watchdog to prevent watchdog timeouts.
 void Axis::watchdog_feed() {
     watchdog_current_value_ = watchdog_reset_value_;
 }
 
+// @brief Returns true if the given control stage is scheduled to run
+// in the current iteration of the control loop.
+bool Axis::stage_due(ControlStage_t stage) {
+    uint32_t divisor = config_.control_stages[stage].divisor;
+    return divisor <= 1 || (loop_counter_ % divisor) == 0;
+}
+
+// @brief Returns the time between two runs of the given control stage [s]
+float Axis::stage_period(ControlStage_t stage) {
+    uint32_t divisor = config_.control_stages[stage].divisor;
+    return (divisor <= 1) ? current_meas_period : (float)divisor * current_meas_period;
+}
+
+// @brief Records the execution time of a control stage and checks it against its deadline.
+// @param start_time: timestamp obtained from get_timing_clocks() before running the stage
+// This is called from both the axis thread and the current measurement interrupt,
+// so the statistics are updated under a critical section.
+RAM_FUNCTION void Axis::stage_done(ControlStage_t stage, uint16_t start_time) {
+    uint16_t time = get_timing_clocks_since(start_time);
+    uint16_t deadline = config_.control_stages[stage].deadline;
+    uint32_t mask = cpu_enter_critical();
+    ControlStageStats_t& stats = control_stage_stats_[stage];
+    stats.last_time = time;
+    if (time > stats.max_time)
+        stats.max_time = time;
+    if (deadline > 0 && time > deadline)
+        ++stats.deadline_misses;
+    cpu_exit_critical(mask);
+}
+
+void Axis::reset_stage_stats() {
+    uint32_t mask = cpu_enter_critical();
+    for (size_t i = 0; i < CONTROL_STAGE_NUM; ++i) {
+        control_stage_stats_[i] = { 0, 0, 0 };
+    }
+    cpu_exit_critical(mask);
+}
+
 // @brief Check the watchdog timer for expiration. Also sets the watchdog error bit if expired. 
 bool Axis::watchdog_check() {
     // reset value = 0 means watchdog disabled. 
@@ -272,36 +396,109 @@ bool Axis::run_lockin_spin(const LockinConfig_t &lockin_config) {
 
 // Note run_sensorless_control_loop and run_closed_loop_control_loop are very similar and differ only in where we get the estimate from.
 bool Axis::run_sensorless_control_loop() {
-    run_control_loop([this](){
+    // Double update was only accepted at boot with the interrupt current loop,
+    // so it keeps the loop there even if the option was cleared since.
+    bool isr_current_loop = config_.enable_isr_current_loop || pwm_double_update;
+    if (isr_current_loop) {
+        isr_current_setpoint_ = 0.0f;
+        set_isr_current_loop_source(ISR_CURRENT_LOOP_SENSORLESS);
+    }
+    run_control_loop([this, isr_current_loop](){
         if (controller_.config_.control_mode >= Controller::CTRL_MODE_POSITION_CONTROL)
             return error_ |= ERROR_POS_CTRL_DURING_SENSORLESS, false;
 
         // Note that all estimators are updated in the loop prefix in run_control_loop
+        // (or in the interrupt if the current loop runs there, so take a consistent snapshot)
+        uint32_t mask = cpu_enter_critical();
+        float pll_pos = sensorless_estimator_.pll_pos_;
+        float phase = sensorless_estimator_.phase_;
+        float vel_estimate = sensorless_estimator_.vel_estimate_;
+        cpu_exit_critical(mask);
+
         float current_setpoint;
-        if (!controller_.update(sensorless_estimator_.pll_pos_, sensorless_estimator_.vel_estimate_, &current_setpoint))
+        if (!controller_.update(pll_pos, pll_pos, vel_estimate, &current_setpoint))
             return error_ |= ERROR_CONTROLLER_FAILED, false;
-        if (!motor_.update(current_setpoint, sensorless_estimator_.phase_, sensorless_estimator_.vel_estimate_))
+        if (isr_current_loop) {
+            isr_current_setpoint_ = current_setpoint;
+            return true;
+        }
+        uint16_t start_time = get_timing_clocks();
+        if (!motor_.update(current_setpoint, phase, vel_estimate))
             return false; // set_error should update axis.error_
+        stage_done(CONTROL_STAGE_CURRENT, start_time);
         return true;
     });
+    set_isr_current_loop_source(ISR_CURRENT_LOOP_INACTIVE);
     return check_for_errors();
 }
 
 bool Axis::run_closed_loop_control_loop() {
     // To avoid any transient on startup, we intialize the setpoint to be the current position
     controller_.pos_setpoint_ = encoder_.pos_estimate_;
+    // A cogging model from an earlier boot only fits once the count is referenced
+    if (controller_.anticogging_.model_restored && encoder_.is_referenced()) {
+        controller_.anticogging_.model_restored = false;
+        controller_.anticogging_.use_anticogging = true;
+    }
     set_step_dir_active(config_.enable_step_dir);
-    run_control_loop([this](){
+    // Double update was only accepted at boot with the interrupt current loop,
+    // so it keeps the loop there even if the option was cleared since.
+    bool isr_current_loop = config_.enable_isr_current_loop || pwm_double_update;
+    if (isr_current_loop) {
+        isr_current_setpoint_ = 0.0f;
+        set_isr_current_loop_source(ISR_CURRENT_LOOP_ENCODER);
+    }
+    run_control_loop([this, isr_current_loop](){
         // Note that all estimators are updated in the loop prefix in run_control_loop
+        // (or in the interrupt if the current loop runs there, so take a consistent snapshot)
+        uint32_t mask = cpu_enter_critical();
+        float pos_estimate = encoder_.pos_estimate_;
+        float pos_cpr = encoder_.pos_cpr_;
+        float vel_estimate = encoder_.vel_estimate_;
+        float phase = encoder_.phase_;
+        cpu_exit_critical(mask);
+
         float current_setpoint;
-        if (!controller_.update(encoder_.pos_estimate_, encoder_.vel_estimate_, &current_setpoint))
+        if (!controller_.update(pos_estimate, pos_cpr, vel_estimate, &current_setpoint))
             return error_ |= ERROR_CONTROLLER_FAILED, false; //TODO: Make controller.set_error
+        if (isr_current_loop) {
+            isr_current_setpoint_ = current_setpoint;
+            return true;
+        }
+        uint16_t start_time = get_timing_clocks();
+        float phase_vel = 2*M_PI * vel_estimate / (float)encoder_.config_.cpr * motor_.config_.pole_pairs;
+        if (!motor_.update(current_setpoint, phase, phase_vel))
+            return false; // set_error should update axis.error_
+        stage_done(CONTROL_STAGE_CURRENT, start_time);
+        return true;
+    });
+    set_isr_current_loop_source(ISR_CURRENT_LOOP_INACTIVE);
+    set_step_dir_active(false);
+    return check_for_errors();
+}
+
+// @brief Runs the relay feedback experiments of controller_.autotune_ in
+// current control. The results are reported on the controller and only take
+// effect with controller.apply_autotune_gains().
+bool Axis::run_autotune() {
+    Autotune& autotune = controller_.autotune_;
+    autotune.start(controller_.config_.autotune, controller_.config_.vel_limit, encoder_.pos_estimate_);
+    run_control_loop([this, &autotune](){
+        // Note that all estimators are updated in the loop prefix in run_control_loop
+        float current_setpoint = autotune.update(encoder_.pos_estimate_, encoder_.vel_estimate_, current_meas_period);
+        if (!autotune.busy())
+            return false;
+        controller_.current_setpoint_ = current_setpoint;
         float phase_vel = 2*M_PI * encoder_.vel_estimate_ / (float)encoder_.config_.cpr * motor_.config_.pole_pairs;
         if (!motor_.update(current_setpoint, encoder_.phase_, phase_vel))
             return false; // set_error should update axis.error_
         return true;
     });
-    set_step_dir_active(false);
+    controller_.current_setpoint_ = 0.0f;
+    if (autotune.busy())
+        autotune.phase_ = Autotune::AUTOTUNE_IDLE; // interrupted by a state request or an error
+    else if (autotune.phase_ == Autotune::AUTOTUNE_FAILED)
+        controller_.set_error(Controller::ERROR_AUTOTUNE_FAILED);
     return check_for_errors();
 }
 
@@ -317,18 +514,25 @@ bool Axis::run_idle_loop() {
 
 // Infinite loop that does calibration and enters main control loop as appropriate
 void Axis::run_state_machine_loop() {
-
-    // Allocate the map for anti-cogging algorithm and initialize all values to 0.0f
-    // TODO: Move this somewhere else
-    // TODO: respect changes of CPR
-    int encoder_cpr = encoder_.config_.cpr;
-    controller_.anticogging_.cogging_map = (float*)malloc(encoder_cpr * sizeof(float));
-    if (controller_.anticogging_.cogging_map != NULL) {
-        for (int i = 0; i < encoder_cpr; i++) {
-            controller_.anticogging_.cogging_map[i] = 0.0f;
-        }
+    // The current sense offset calibration runs in the background since
+    // start_adc_pwm(). Wait until it has settled, but at least for
+    // dc_calib_min_duration and at most as long as the fixed delay that used to
+    // be there.
+    static const uint32_t max_dc_calib_wait_ms = 1500;
+    uint32_t min_dc_calib_wait_ms = (uint32_t)(motor_.config_.dc_calib_min_duration * 1000.0f);
+    for (uint32_t ms = 0; ms < max_dc_calib_wait_ms; ++ms) {
+        if (ms >= min_dc_calib_wait_ms && motor_.get_DC_calib_uncertainty() < motor_.config_.dc_calib_tolerance)
+            break;
+        osDelay(1);
     }
 
+    // Load the calibration tables that are too large for the config structs
+    load_calibration_tables(*this);
+    // The filter coefficients and estimator gains depend on the control rate, which is known by now
+    controller_.update_filters();
+    encoder_.update_estimator_gains();
+    sensorless_estimator_.update_estimator_gains();
+
     // arm!
     motor_.arm();
     
@@ -422,6 +626,14 @@ void Axis::run_state_machine_loop() {
                 status = run_closed_loop_control_loop();
             } break;
 
+            case AXIS_STATE_AUTOTUNE: {
+                if (!motor_.is_calibrated_ || motor_.config_.direction==0)
+                    goto invalid_state_label;
+                if (!encoder_.is_ready_)
+                    goto invalid_state_label;
+                status = run_autotune();
+            } break;
+
             case AXIS_STATE_IDLE: {
                 run_idle_loop();
                 status = motor_.arm(); // done with idling - try to arm the motor
@@ -35,6 +35,7 @@ public:
         AXIS_STATE_CLOSED_LOOP_CONTROL = 8,  //<! run closed loop control
         AXIS_STATE_LOCKIN_SPIN = 9,       //<! run lockin spin
         AXIS_STATE_ENCODER_DIR_FIND = 10,
+        AXIS_STATE_AUTOTUNE = 11,           //<! identify the mechanics and compute controller gains, then idle
     };
 
     struct LockinConfig_t {
@@ -49,6 +50,27 @@ public:
         bool finish_on_enc_idx = false;
     };
 
+    // Stages of the control loop that are scheduled at their own rate
+    enum ControlStage_t {
+        CONTROL_STAGE_CHECKS,       //<! thermal and fault checks
+        CONTROL_STAGE_ESTIMATORS,   //<! encoder and sensorless estimator updates
+        CONTROL_STAGE_POSITION,     //<! trajectory and position loop
+        CONTROL_STAGE_VELOCITY,     //<! velocity loop and anticogging
+        CONTROL_STAGE_CURRENT,      //<! current loop and modulation
+        CONTROL_STAGE_NUM
+    };
+
+    struct ControlStageConfig_t {
+        uint32_t divisor;   //<! the stage runs on every n-th current measurement
+        uint16_t deadline;  //<! [TIM_1_8 clocks] maximum execution time of one run (0 disables the check)
+    };
+
+    struct ControlStageStats_t {
+        uint16_t last_time;         // [TIM_1_8 clocks]
+        uint16_t max_time;          // [TIM_1_8 clocks]
+        uint32_t deadline_misses;
+    };
+
     static LockinConfig_t default_calibration();
     static LockinConfig_t default_sensorless();
     static LockinConfig_t default_lockin();
@@ -66,10 +88,27 @@ public:
 
         float watchdog_timeout = 0.0f; // [s] (0 disables watchdog)
 
+        bool enable_isr_current_loop = false; //<! run the estimators and the current controller inside the
+                                              //   current measurement interrupt during closed loop and sensorless control.
+                                              //   The outer loops and the state machine stay in the axis thread.
+
         // Defaults loaded from hw_config in load_configuration in main.cpp
         uint16_t step_gpio_pin = 0;
         uint16_t dir_gpio_pin = 0;
 
+        // Multi-rate control scheduling, see stage_due()
+        // The estimators and the current loop run on every current measurement,
+        // their divisor is ignored. The divisor of the checks is derived from
+        // checks_rate in update_checks_divisor().
+        float checks_rate = 1000.0f; // [Hz]
+        ControlStageConfig_t control_stages[CONTROL_STAGE_NUM] = {
+            { .divisor = 1, .deadline = 0 }, // CONTROL_STAGE_CHECKS
+            { .divisor = 1, .deadline = 0 }, // CONTROL_STAGE_ESTIMATORS
+            { .divisor = 1, .deadline = 0 }, // CONTROL_STAGE_POSITION
+            { .divisor = 1, .deadline = 0 }, // CONTROL_STAGE_VELOCITY
+            { .divisor = 1, .deadline = 0 }, // CONTROL_STAGE_CURRENT
+        };
+
         LockinConfig_t calibration_lockin = default_calibration();
         LockinConfig_t sensorless_ramp = default_sensorless();
         LockinConfig_t lockin;
@@ -79,6 +118,12 @@ public:
         M_SIGNAL_PH_CURRENT_MEAS = 1u << 0
     };
 
+    enum IsrCurrentLoopSource_t {
+        ISR_CURRENT_LOOP_INACTIVE,
+        ISR_CURRENT_LOOP_ENCODER,
+        ISR_CURRENT_LOOP_SENSORLESS,
+    };
+
     enum LockinState_t {
         LOCKIN_STATE_INACTIVE,
         LOCKIN_STATE_RAMP,
@@ -93,17 +138,22 @@ public:
             SensorlessEstimator& sensorless_estimator,
             Controller& controller,
             Motor& motor,
-            TrapezoidalTrajectory& trap);
+            TrapezoidalTrajectory& trap,
+            SCurveTrajectory& scurve,
+            PvtTrajectory& pvt);
 
     void setup();
     void start_thread();
     void signal_current_meas();
+    void run_isr_current_loop();
+    void set_isr_current_loop_source(IsrCurrentLoopSource_t source);
     bool wait_for_current_meas();
 
     void step_cb();
     void set_step_dir_active(bool enable);
     void decode_step_dir_pins();
     void update_watchdog_settings();
+    void update_checks_divisor();
 
     static void load_default_step_dir_pin_config(
         const AxisHardwareConfig_t& hw_config, Config_t* config);
@@ -112,10 +162,16 @@ public:
     bool check_PSU_brownout();
     bool do_checks();
     bool do_updates();
+    float get_estimator_accel(bool sensorless);
 
     void watchdog_feed();
     bool watchdog_check();
 
+    bool stage_due(ControlStage_t stage);
+    float stage_period(ControlStage_t stage);
+    void stage_done(ControlStage_t stage, uint16_t start_time);
+    void reset_stage_stats();
+
 
     // True if there are no errors
     bool inline check_for_errors() {
@@ -186,6 +242,7 @@ public:
     bool run_lockin_spin(const LockinConfig_t &lockin_config);
     bool run_sensorless_control_loop();
     bool run_closed_loop_control_loop();
+    bool run_autotune();
     bool run_idle_loop();
 
     void run_state_machine_loop();
@@ -199,6 +256,8 @@ public:
     Controller& controller_;
     Motor& motor_;
     TrapezoidalTrajectory& trap_;
+    SCurveTrajectory& scurve_;
+    PvtTrajectory& pvt_;
 
     osThreadId thread_id_;
     volatile bool thread_id_valid_ = false;
@@ -219,6 +278,15 @@ public:
     uint32_t loop_counter_ = 0;
     LockinState_t lockin_state_ = LOCKIN_STATE_INACTIVE;
 
+    // ISR current loop
+    // Written by the axis thread, read by the current measurement interrupt.
+    // The setpoint must be written before the source is published.
+    volatile IsrCurrentLoopSource_t isr_current_loop_source_ = ISR_CURRENT_LOOP_INACTIVE;
+    volatile float isr_current_setpoint_ = 0.0f; // [A]
+    IsrCurrentLoopSource_t isr_current_loop_source_mirror_ = ISR_CURRENT_LOOP_INACTIVE; // for the protocol, see set_isr_current_loop_source()
+
+    ControlStageStats_t control_stage_stats_[CONTROL_STAGE_NUM] = { { 0, 0, 0 } };
+
     // watchdog
     uint32_t watchdog_reset_value_ = 0; //computed from config_.watchdog_timeout in update_watchdog_settings()
     uint32_t watchdog_current_value_= 0;
@@ -232,6 +300,7 @@ public:
             make_protocol_property("requested_state", &requested_state_),
             make_protocol_ro_property("loop_counter", &loop_counter_),
             make_protocol_ro_property("lockin_state", &lockin_state_),
+            make_protocol_ro_property("isr_current_loop_source", &isr_current_loop_source_mirror_),
             make_protocol_object("config",
                 make_protocol_property("startup_motor_calibration", &config_.startup_motor_calibration),
                 make_protocol_property("startup_encoder_index_search", &config_.startup_encoder_index_search),
@@ -242,6 +311,30 @@ public:
                 make_protocol_property("counts_per_step", &config_.counts_per_step),
                 make_protocol_property("watchdog_timeout", &config_.watchdog_timeout,
                     [](void* ctx) { static_cast<Axis*>(ctx)->update_watchdog_settings(); }, this),
+                make_protocol_property("enable_isr_current_loop", &config_.enable_isr_current_loop),
+                make_protocol_object("control_stages",
+                    make_protocol_object("checks",
+                        make_protocol_property("rate", &config_.checks_rate,
+                            [](void* ctx) { static_cast<Axis*>(ctx)->update_checks_divisor(); }, this),
+                        make_protocol_ro_property("divisor", &config_.control_stages[CONTROL_STAGE_CHECKS].divisor),
+                        make_protocol_property("deadline", &config_.control_stages[CONTROL_STAGE_CHECKS].deadline)
+                    ),
+                    make_protocol_object("estimators",
+                        make_protocol_property("deadline", &config_.control_stages[CONTROL_STAGE_ESTIMATORS].deadline)
+                    ),
+                    make_protocol_object("position",
+                        make_protocol_property("divisor", &config_.control_stages[CONTROL_STAGE_POSITION].divisor),
+                        make_protocol_property("deadline", &config_.control_stages[CONTROL_STAGE_POSITION].deadline)
+                    ),
+                    make_protocol_object("velocity",
+                        make_protocol_property("divisor", &config_.control_stages[CONTROL_STAGE_VELOCITY].divisor,
+                            [](void* ctx) { static_cast<Axis*>(ctx)->controller_.update_filters(); }, this),
+                        make_protocol_property("deadline", &config_.control_stages[CONTROL_STAGE_VELOCITY].deadline)
+                    ),
+                    make_protocol_object("current",
+                        make_protocol_property("deadline", &config_.control_stages[CONTROL_STAGE_CURRENT].deadline)
+                    )
+                ),
                 make_protocol_property("step_gpio_pin", &config_.step_gpio_pin,
                     [](void* ctx) { static_cast<Axis*>(ctx)->decode_step_dir_pins(); }, this),
                 make_protocol_property("dir_gpio_pin", &config_.dir_gpio_pin,
@@ -276,12 +369,42 @@ public:
                     make_protocol_property("finish_on_enc_idx", &config_.lockin.finish_on_enc_idx)
                 )
             ),
+            make_protocol_object("control_stage_stats",
+                make_protocol_object("checks",
+                    make_protocol_ro_property("last_time", &control_stage_stats_[CONTROL_STAGE_CHECKS].last_time),
+                    make_protocol_ro_property("max_time", &control_stage_stats_[CONTROL_STAGE_CHECKS].max_time),
+                    make_protocol_ro_property("deadline_misses", &control_stage_stats_[CONTROL_STAGE_CHECKS].deadline_misses)
+                ),
+                make_protocol_object("estimators",
+                    make_protocol_ro_property("last_time", &control_stage_stats_[CONTROL_STAGE_ESTIMATORS].last_time),
+                    make_protocol_ro_property("max_time", &control_stage_stats_[CONTROL_STAGE_ESTIMATORS].max_time),
+                    make_protocol_ro_property("deadline_misses", &control_stage_stats_[CONTROL_STAGE_ESTIMATORS].deadline_misses)
+                ),
+                make_protocol_object("position",
+                    make_protocol_ro_property("last_time", &control_stage_stats_[CONTROL_STAGE_POSITION].last_time),
+                    make_protocol_ro_property("max_time", &control_stage_stats_[CONTROL_STAGE_POSITION].max_time),
+                    make_protocol_ro_property("deadline_misses", &control_stage_stats_[CONTROL_STAGE_POSITION].deadline_misses)
+                ),
+                make_protocol_object("velocity",
+                    make_protocol_ro_property("last_time", &control_stage_stats_[CONTROL_STAGE_VELOCITY].last_time),
+                    make_protocol_ro_property("max_time", &control_stage_stats_[CONTROL_STAGE_VELOCITY].max_time),
+                    make_protocol_ro_property("deadline_misses", &control_stage_stats_[CONTROL_STAGE_VELOCITY].deadline_misses)
+                ),
+                make_protocol_object("current",
+                    make_protocol_ro_property("last_time", &control_stage_stats_[CONTROL_STAGE_CURRENT].last_time),
+                    make_protocol_ro_property("max_time", &control_stage_stats_[CONTROL_STAGE_CURRENT].max_time),
+                    make_protocol_ro_property("deadline_misses", &control_stage_stats_[CONTROL_STAGE_CURRENT].deadline_misses)
+                )
+            ),
             make_protocol_object("motor", motor_.make_protocol_definitions()),
             make_protocol_object("controller", controller_.make_protocol_definitions()),
             make_protocol_object("encoder", encoder_.make_protocol_definitions()),
             make_protocol_object("sensorless_estimator", sensorless_estimator_.make_protocol_definitions()),
             make_protocol_object("trap_traj", trap_.make_protocol_definitions()),
-            make_protocol_function("watchdog_feed", *this, &Axis::watchdog_feed)
+            make_protocol_object("scurve_traj", scurve_.make_protocol_definitions()),
+            make_protocol_object("pvt", pvt_.make_protocol_definitions()),
+            make_protocol_function("watchdog_feed", *this, &Axis::watchdog_feed),
+            make_protocol_function("reset_stage_stats", *this, &Axis::reset_stage_stats)
         );
     }
 };
@@ -0,0 +1,65 @@
+#include <math.h>
+#include "odrive_main.h"
+#include "utils.h"
+
+// @brief Designs the coefficients for the given configuration.
+// The analog prototype is H(s) = (b0 s^2 + b1 s + b2) / (a0 s^2 + a1 s + a2)
+// in the normalized variable s / w, where w is the configured frequency.
+// @param sample_period: time between two calls to update() [s]
+// @returns false if the configuration is invalid, in which case the filter passes the signal through
+bool Biquad::configure(const Config_t& config, float sample_period) {
+    b0_ = 1.0f;
+    b1_ = b2_ = a1_ = a2_ = 0.0f;
+    reset();
+    if (config.type == BIQUAD_NONE)
+        return true;
+
+    // Stay clear of the Nyquist frequency, where the prewarping diverges
+    if (!(config.frequency > 0.0f && config.frequency < 0.45f / sample_period))
+        return false;
+
+    float b[3], a[3];
+    switch (config.type) {
+        case BIQUAD_LOWPASS: {
+            if (!(config.q > 0.0f))
+                return false;
+            b[0] = 0.0f; b[1] = 0.0f; b[2] = 1.0f;
+            a[0] = 1.0f; a[1] = 1.0f / config.q; a[2] = 1.0f;
+        } break;
+        case BIQUAD_NOTCH: {
+            if (!(config.q > 0.0f && config.gain >= 0.0f))
+                return false;
+            b[0] = 1.0f; b[1] = config.gain / config.q; b[2] = 1.0f;
+            a[0] = 1.0f; a[1] = 1.0f / config.q; a[2] = 1.0f;
+        } break;
+        case BIQUAD_LEAD_LAG: {
+            // Zero and pole are placed symmetrically around the center frequency
+            if (!(config.gain > 0.0f))
+                return false;
+            float ratio = sqrtf(config.gain);
+            b[0] = 0.0f; b[1] = ratio; b[2] = 1.0f;
+            a[0] = 0.0f; a[1] = 1.0f / ratio; a[2] = 1.0f;
+        } break;
+        default:
+            return false;
+    }
+
+    // Bilinear transform of s / w with prewarping at w
+    float K = 1.0f / tanf(M_PI * config.frequency * sample_period);
+    if (a[0] == 0.0f) {
+        // First-order prototype, the second-order mapping would add a pole and a zero at z = -1
+        float inv_a0 = 1.0f / (a[1] * K + a[2]);
+        b0_ = (b[1] * K + b[2]) * inv_a0;
+        b1_ = (b[2] - b[1] * K) * inv_a0;
+        a1_ = (a[2] - a[1] * K) * inv_a0;
+    } else {
+        float K2 = K * K;
+        float inv_a0 = 1.0f / (a[0] * K2 + a[1] * K + a[2]);
+        b0_ = (b[0] * K2 + b[1] * K + b[2]) * inv_a0;
+        b1_ = 2.0f * (b[2] - b[0] * K2) * inv_a0;
+        b2_ = (b[0] * K2 - b[1] * K + b[2]) * inv_a0;
+        a1_ = 2.0f * (a[2] - a[0] * K2) * inv_a0;
+        a2_ = (a[0] * K2 - a[1] * K + a[2]) * inv_a0;
+    }
+    return true;
+}
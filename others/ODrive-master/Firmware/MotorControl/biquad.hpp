@@ -0,0 +1,48 @@
+#ifndef _BIQUAD_H
+#define _BIQUAD_H
+
+// @brief Second-order IIR filter section
+//
+// The coefficients are designed from an analog prototype with the bilinear
+// transform, prewarped to match the prototype at the configured frequency.
+// The filter runs in direct form II transposed, which needs two states and
+// five multiplications per sample.
+class Biquad {
+public:
+    enum Type_t {
+        BIQUAD_NONE = 0,        // passes the signal through
+        BIQUAD_LOWPASS = 1,     // second-order low-pass with quality factor q
+        BIQUAD_NOTCH = 2,       // notch of width frequency / q, with a gain of gain at its center
+        BIQUAD_LEAD_LAG = 3,    // first-order lead (gain > 1) or lag (gain < 1) centered at frequency
+    };
+
+    struct Config_t {
+        Type_t type = BIQUAD_NONE;
+        float frequency = 1000.0f;  // [Hz] cutoff, notch or lead/lag center frequency
+        float q = 0.707f;           // quality factor of the low-pass and notch
+        float gain = 0.1f;          // notch: gain at frequency, lead/lag: high frequency gain relative to DC
+    };
+
+    bool configure(const Config_t& config, float sample_period);
+    void reset() {
+        z1_ = 0.0f;
+        z2_ = 0.0f;
+    }
+
+    float update(float x) {
+        float y = b0_ * x + z1_;
+        z1_ = b1_ * x - a1_ * y + z2_;
+        z2_ = b2_ * x - a2_ * y;
+        return y;
+    }
+
+    float b0_ = 1.0f;
+    float b1_ = 0.0f;
+    float b2_ = 0.0f;
+    float a1_ = 0.0f;
+    float a2_ = 0.0f;
+    float z1_ = 0.0f;
+    float z2_ = 0.0f;
+};
+
+#endif
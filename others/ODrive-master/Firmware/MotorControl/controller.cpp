@@ -11,6 +11,17 @@ void Controller::reset() {
     vel_setpoint_ = 0.0f;
     vel_integrator_current_ = 0.0f;
     current_setpoint_ = 0.0f;
+    pos_loop_vel_ = 0.0f;
+    current_output_ = 0.0f;
+    observer_state_ = 0.0f;
+    load_current_ = 0.0f;
+    run_all_stages_ = true;
+    traj_done_ = true;
+    pvt_active_ = false;
+    traj_armed_ = false;
+    input_filter_.active = false;
+    // Restart an interrupted anticogging calibration from the beginning
+    anticogging_.calib_phase = ANTICOGGING_CALIB_IDLE;
 }
 
 void Controller::set_error(Error_t error) {
@@ -22,10 +33,18 @@ void Controller::set_error(Error_t error) {
 // Command Handling
 //--------------------------------
 
+// @brief Sets the position setpoint and feed-forward terms.
+// If an input filter is selected, pos_setpoint becomes the next command for the
+// filter instead and the feed-forward terms are derived from the filtered commands.
 void Controller::set_pos_setpoint(float pos_setpoint, float vel_feed_forward, float current_feed_forward) {
-    pos_setpoint_ = pos_setpoint;
-    vel_setpoint_ = vel_feed_forward;
-    current_setpoint_ = current_feed_forward;
+    if (config_.input_filter_mode != INPUT_FILTER_NONE) {
+        input_pos_ = pos_setpoint;
+        input_filter_.updated = true;
+    } else {
+        pos_setpoint_ = pos_setpoint;
+        vel_setpoint_ = vel_feed_forward;
+        current_setpoint_ = current_feed_forward;
+    }
     config_.control_mode = CTRL_MODE_POSITION_CONTROL;
 #ifdef DEBUG_PRINT
     printf("POSITION_CONTROL %6.0f %3.3f %3.3f\n", pos_setpoint, vel_setpoint_, current_setpoint_);
@@ -49,16 +68,91 @@ void Controller::set_current_setpoint(float current_setpoint) {
 #endif
 }
 
+// @brief Plans a trajectory to goal_point and starts it.
+// The jerk-limited planner is used if the S-curve trajectory mode is selected,
+// the trapezoidal planner otherwise.
 void Controller::move_to_pos(float goal_point) {
-    axis_->trap_.planTrapezoidal(goal_point, pos_setpoint_, vel_setpoint_,
-                                 axis_->trap_.config_.vel_limit,
-                                 axis_->trap_.config_.accel_limit,
-                                 axis_->trap_.config_.decel_limit);
-    traj_start_loop_count_ = axis_->loop_counter_;
-    config_.control_mode = CTRL_MODE_TRAJECTORY_CONTROL;
+    traj_armed_ = false; // the planner state is about to be replaced
+    if (config_.control_mode == CTRL_MODE_SCURVE_TRAJECTORY_CONTROL) {
+        traj_done_ = true; // stop evaluating the old trajectory while planning
+        if (!axis_->scurve_.planSCurve(goal_point, pos_setpoint_, vel_setpoint_,
+                                       axis_->scurve_.config_.vel_limit,
+                                       axis_->scurve_.config_.accel_limit,
+                                       axis_->scurve_.config_.decel_limit,
+                                       axis_->scurve_.config_.jerk_limit))
+            return;
+        traj_start_loop_count_ = axis_->loop_counter_;
+        traj_done_ = false;
+    } else {
+        axis_->trap_.planTrapezoidal(goal_point, pos_setpoint_, vel_setpoint_,
+                                     axis_->trap_.config_.vel_limit,
+                                     axis_->trap_.config_.accel_limit,
+                                     axis_->trap_.config_.decel_limit);
+        traj_start_loop_count_ = axis_->loop_counter_;
+        config_.control_mode = CTRL_MODE_TRAJECTORY_CONTROL;
+    }
     goal_point_ = goal_point;
 }
 
+// @brief Plans a move from standstill to goal_point without starting it, see start_armed_move().
+// All limits of the selected planner are scaled such that the move takes
+// time_scale (>= 1) times as long as it would at the configured limits.
+// The axis must be holding position in position or S-curve trajectory control.
+// @returns the duration of the planned move [s], or a negative value on failure
+float Controller::arm_move(float goal_point, float time_scale) {
+    traj_armed_ = false;
+    bool scurve = config_.control_mode == CTRL_MODE_SCURVE_TRAJECTORY_CONTROL;
+    if (!(config_.control_mode == CTRL_MODE_POSITION_CONTROL || (scurve && traj_done_)))
+        return -1.0f;
+
+    // Velocity scales with 1/time_scale, acceleration with 1/time_scale^2 and jerk with
+    // 1/time_scale^3, which stretches a move from standstill in time without changing its shape
+    float k1 = 1.0f / time_scale;
+    float k2 = k1 * k1;
+    float duration;
+    if (scurve) {
+        SCurveTrajectory& traj = axis_->scurve_;
+        if (!traj.planSCurve(goal_point, pos_setpoint_, 0.0f,
+                             traj.config_.vel_limit * k1,
+                             traj.config_.accel_limit * k2,
+                             traj.config_.decel_limit * k2,
+                             traj.config_.jerk_limit * k2 * k1))
+            return -1.0f;
+        duration = traj.Tf_;
+    } else {
+        TrapezoidalTrajectory& traj = axis_->trap_;
+        traj.planTrapezoidal(goal_point, pos_setpoint_, 0.0f,
+                             traj.config_.vel_limit * k1,
+                             traj.config_.accel_limit * k2,
+                             traj.config_.decel_limit * k2);
+        duration = traj.Tf_;
+    }
+
+    traj_armed_mode_ = config_.control_mode;
+    traj_armed_start_ = pos_setpoint_;
+    traj_armed_ = true;
+    return duration;
+}
+
+// @brief Starts the move planned by arm_move() as if it was started on the given loop count.
+// The move is dropped if the setpoint or control mode changed since it was planned.
+void Controller::start_armed_move(uint32_t start_loop_count) {
+    if (!traj_armed_)
+        return;
+    traj_armed_ = false;
+    if (config_.control_mode != traj_armed_mode_ || pos_setpoint_ != traj_armed_start_)
+        return;
+
+    traj_start_loop_count_ = start_loop_count;
+    if (config_.control_mode == CTRL_MODE_SCURVE_TRAJECTORY_CONTROL) {
+        traj_done_ = false;
+        goal_point_ = axis_->scurve_.Xf_;
+    } else {
+        config_.control_mode = CTRL_MODE_TRAJECTORY_CONTROL;
+        goal_point_ = axis_->trap_.Xf_;
+    }
+}
+
 void Controller::move_incremental(float displacement, bool from_goal_point = true){
     if(from_goal_point){
         move_to_pos(goal_point_ + displacement);
@@ -67,46 +161,384 @@ void Controller::move_incremental(float displacement, bool from_goal_point = tru
     }
 }
 
+// @brief Copies the gains found by the last AXIS_STATE_AUTOTUNE into the config.
+// The inertia is taken over as well, for the disturbance observer.
+void Controller::apply_autotune_gains() {
+    if (autotune_.phase_ != Autotune::AUTOTUNE_DONE)
+        return;
+    config_.pos_gain = autotune_.result_.pos_gain;
+    config_.vel_gain = autotune_.result_.vel_gain;
+    config_.vel_integrator_gain = autotune_.result_.vel_integrator_gain;
+    config_.inertia = autotune_.result_.inertia;
+}
+
 void Controller::start_anticogging_calibration() {
-    // Ensure the cogging map was correctly allocated earlier and that the motor is capable of calibrating
-    if (anticogging_.cogging_map != NULL && axis_->error_ == Axis::ERROR_NONE) {
-        anticogging_.calib_anticogging = true;
+    // Ensure that the motor is capable of calibrating
+    if (axis_->error_ != Axis::ERROR_NONE)
+        return;
+    // The calibration needs an encoder position that resolves every bin
+    if (!axis_->encoder_.is_ready_ || axis_->encoder_.config_.cpr < (int32_t)ANTICOGGING_CALIB_BINS) {
+        set_error(ERROR_INVALID_ESTIMATE);
+        return;
     }
+    anticogging_.calib_phase = ANTICOGGING_CALIB_IDLE;
+    anticogging_.calib_anticogging = true;
 }
 
 /*
- * This anti-cogging implementation iterates through each encoder position,
- * waits for zero velocity & position error,
- * then samples the current required to maintain that position.
- * 
- * This holding current is added as a feedforward term in the control loop.
+ * This anti-cogging implementation sweeps the rotor at a constant low velocity,
+ * first forward and then in reverse, and bins the current command of the
+ * velocity loop over one turn. Averaging both directions cancels friction.
+ * The binned current is then correlated with each harmonic order, one order
+ * per control loop iteration, and the strongest harmonics are kept.
+ *
+ * This harmonic model is added as a current feed-forward term in the control loop.
  */
-bool Controller::anticogging_calibration(float pos_estimate, float vel_estimate) {
-    if (anticogging_.calib_anticogging && anticogging_.cogging_map != NULL) {
-        float pos_err = anticogging_.index - pos_estimate;
-        if (fabsf(pos_err) <= anticogging_.calib_pos_threshold &&
-            fabsf(vel_estimate) < anticogging_.calib_vel_threshold) {
-            anticogging_.cogging_map[anticogging_.index++] = vel_integrator_current_;
-        }
-        if (anticogging_.index < axis_->encoder_.config_.cpr) { // TODO: remove the dependency on encoder CPR
-            set_pos_setpoint(anticogging_.index, 0.0f, 0.0f);
-            return false;
-        } else {
-            anticogging_.index = 0;
-            set_pos_setpoint(0.0f, 0.0f, 0.0f);  // Send the motor home
-            anticogging_.use_anticogging = true;  // We're good to go, enable anti-cogging
-            anticogging_.calib_anticogging = false;
-            return true;
-        }
+bool Controller::anticogging_calibration(float pos_estimate) {
+    if (!anticogging_.calib_anticogging)
+        return false;
+
+    auto enter_phase = [&](AnticoggingCalibPhase_t phase) {
+        anticogging_.calib_phase = phase;
+        anticogging_.calib_phase_start_pos = pos_estimate;
+    };
+    auto finish = [&]() {
+        vPortFree(anticogging_.calib_bin_sum);
+        vPortFree(anticogging_.calib_bin_count);
+        anticogging_.calib_bin_sum = nullptr;
+        anticogging_.calib_bin_count = nullptr;
+        anticogging_.calib_phase = ANTICOGGING_CALIB_IDLE;
+        anticogging_.calib_anticogging = false;
+        set_pos_setpoint(pos_estimate, 0.0f, 0.0f); // Hold the current position
+    };
+
+    float cpr = (float)axis_->encoder_.config_.cpr;
+    float distance = fabsf(pos_estimate - anticogging_.calib_phase_start_pos);
+    float calib_vel = fabsf(config_.anticogging_calib_vel);
+
+    switch (anticogging_.calib_phase) {
+        case ANTICOGGING_CALIB_IDLE: {
+            if (!anticogging_.calib_bin_sum)
+                anticogging_.calib_bin_sum = (float*)pvPortMalloc(ANTICOGGING_CALIB_BINS * sizeof(float));
+            if (!anticogging_.calib_bin_count)
+                anticogging_.calib_bin_count = (uint16_t*)pvPortMalloc(ANTICOGGING_CALIB_BINS * sizeof(uint16_t));
+            if (!anticogging_.calib_bin_sum || !anticogging_.calib_bin_count) {
+                finish();
+                return false;
+            }
+            for (size_t i = 0; i < ANTICOGGING_CALIB_BINS; ++i) {
+                anticogging_.calib_bin_sum[i] = 0.0f;
+                anticogging_.calib_bin_count[i] = 0;
+            }
+            anticogging_.use_anticogging = false;
+            anticogging_.model_restored = false;
+            anticogging_.model.num_harmonics = 0;
+            vel_ramp_enable_ = false;
+            set_vel_setpoint(calib_vel, 0.0f);
+            enter_phase(ANTICOGGING_CALIB_SETTLE_FORWARD);
+        } break;
+
+        case ANTICOGGING_CALIB_SETTLE_FORWARD:
+        case ANTICOGGING_CALIB_SETTLE_REVERSE: {
+            // Let the velocity loop settle for a quarter turn before recording
+            if (distance >= 0.25f * cpr) {
+                enter_phase(anticogging_.calib_phase == ANTICOGGING_CALIB_SETTLE_FORWARD ?
+                            ANTICOGGING_CALIB_RECORD_FORWARD : ANTICOGGING_CALIB_RECORD_REVERSE);
+            }
+        } break;
+
+        case ANTICOGGING_CALIB_RECORD_FORWARD:
+        case ANTICOGGING_CALIB_RECORD_REVERSE: {
+            size_t bin = (size_t)(fmodf_pos(pos_estimate, cpr) * ((float)ANTICOGGING_CALIB_BINS / cpr));
+            if (bin >= ANTICOGGING_CALIB_BINS)
+                bin = ANTICOGGING_CALIB_BINS - 1;
+            if (anticogging_.calib_bin_count[bin] < UINT16_MAX) {
+                anticogging_.calib_bin_sum[bin] += current_output_;
+                anticogging_.calib_bin_count[bin]++;
+            }
+            if (distance >= config_.anticogging_calib_turns * cpr) {
+                if (anticogging_.calib_phase == ANTICOGGING_CALIB_RECORD_FORWARD) {
+                    set_vel_setpoint(-calib_vel, 0.0f);
+                    enter_phase(ANTICOGGING_CALIB_SETTLE_REVERSE);
+                } else {
+                    set_pos_setpoint(pos_estimate, 0.0f, 0.0f);
+                    enter_phase(ANTICOGGING_CALIB_FIT);
+
+                    // Turn the sums into the mean cogging current of each bin, without the DC part
+                    float mean = 0.0f;
+                    for (size_t i = 0; i < ANTICOGGING_CALIB_BINS; ++i) {
+                        if (anticogging_.calib_bin_count[i] == 0) {
+                            finish(); // sweep too fast for the bin size
+                            return false;
+                        }
+                        anticogging_.calib_bin_sum[i] /= (float)anticogging_.calib_bin_count[i];
+                        mean += anticogging_.calib_bin_sum[i];
+                    }
+                    mean /= (float)ANTICOGGING_CALIB_BINS;
+                    for (size_t i = 0; i < ANTICOGGING_CALIB_BINS; ++i)
+                        anticogging_.calib_bin_sum[i] -= mean;
+                    anticogging_.calib_fit_order = 1;
+                }
+            }
+        } break;
+
+        case ANTICOGGING_CALIB_FIT: {
+            anticogging_fit_order(anticogging_.calib_fit_order++);
+            if (anticogging_.calib_fit_order >= ANTICOGGING_CALIB_BINS / 2) {
+                finish();
+                anticogging_.use_anticogging = (anticogging_.model.num_harmonics > 0); // We're good to go, enable anti-cogging
+                return true;
+            }
+        } break;
     }
     return false;
 }
 
-bool Controller::update(float pos_estimate, float vel_estimate, float* current_setpoint_output) {
+// @brief Correlates the binned cogging current with one harmonic order
+// and inserts the result into the model if it is among the strongest harmonics so far.
+// The model is kept sorted by descending amplitude.
+void Controller::anticogging_fit_order(uint32_t order) {
+    const float* bins = anticogging_.calib_bin_sum;
+    size_t max_harmonics = std::min<size_t>(config_.anticogging_num_harmonics, ANTICOGGING_MAX_HARMONICS);
+    if (max_harmonics == 0)
+        return;
+
+    // Rotate a unit phasor by one bin per step, starting at the center of the first bin
+    float step = 2.0f * M_PI * (float)order / (float)ANTICOGGING_CALIB_BINS;
+    float step_c = our_arm_cos_f32(step);
+    float step_s = our_arm_sin_f32(step);
+    float c = our_arm_cos_f32(0.5f * step);
+    float s = our_arm_sin_f32(0.5f * step);
+    float acc_c = 0.0f;
+    float acc_s = 0.0f;
+    for (size_t i = 0; i < ANTICOGGING_CALIB_BINS; ++i) {
+        acc_c += bins[i] * c;
+        acc_s += bins[i] * s;
+        float c_next = c * step_c - s * step_s;
+        s = s * step_c + c * step_s;
+        c = c_next;
+    }
+
+    CoggingHarmonic_t harmonic = {
+        .order = order,
+        .cos_coeff = (2.0f / (float)ANTICOGGING_CALIB_BINS) * acc_c,
+        .sin_coeff = (2.0f / (float)ANTICOGGING_CALIB_BINS) * acc_s,
+    };
+    auto amplitude_sq = [](const CoggingHarmonic_t& h) {
+        return h.cos_coeff * h.cos_coeff + h.sin_coeff * h.sin_coeff;
+    };
+
+    size_t i;
+    if (anticogging_.model.num_harmonics < max_harmonics) {
+        i = anticogging_.model.num_harmonics++;
+    } else if (amplitude_sq(anticogging_.model.harmonics[max_harmonics - 1]) < amplitude_sq(harmonic)) {
+        i = max_harmonics - 1;
+    } else {
+        return;
+    }
+    while (i > 0 && amplitude_sq(anticogging_.model.harmonics[i - 1]) < amplitude_sq(harmonic)) {
+        anticogging_.model.harmonics[i] = anticogging_.model.harmonics[i - 1];
+        --i;
+    }
+    anticogging_.model.harmonics[i] = harmonic;
+}
+
+// @returns the number of bytes of the cogging model that hold harmonics
+size_t Controller::get_anticogging_model_size() {
+    return offsetof(CoggingModel_t, harmonics) + anticogging_.model.num_harmonics * sizeof(CoggingHarmonic_t);
+}
+
+// @brief Replaces the cogging model, e.g. with one that was loaded from NVM,
+// and enables anticogging if the model is not empty.
+// @param length: number of valid bytes in model, see get_anticogging_model_size()
+bool Controller::set_anticogging_model(const CoggingModel_t& model, size_t length) {
+    if (anticogging_.calib_anticogging ||
+        length < offsetof(CoggingModel_t, harmonics) ||
+        model.num_harmonics > ANTICOGGING_MAX_HARMONICS ||
+        length != offsetof(CoggingModel_t, harmonics) + model.num_harmonics * sizeof(CoggingHarmonic_t))
+        return false;
+    // The model is relative to the index, so it is only enabled by
+    // Axis::run_closed_loop_control_loop() once the encoder is referenced
+    anticogging_.use_anticogging = false;
+    anticogging_.model = model;
+    anticogging_.model_restored = (model.num_harmonics > 0);
+    return true;
+}
+
+// @brief Evaluates the cogging model
+// @param pos: position [counts]
+// @returns the current that cancels the cogging torque at this position [A]
+float Controller::anticogging_current(float pos) {
+    float cpr = (float)axis_->encoder_.config_.cpr;
+    float turns = fmodf_pos(pos, cpr) / cpr;
+    float current = 0.0f;
+    for (size_t i = 0; i < anticogging_.model.num_harmonics; ++i) {
+        const CoggingHarmonic_t& harmonic = anticogging_.model.harmonics[i];
+        float cycles = turns * (float)harmonic.order;
+        float theta = 2.0f * M_PI * (cycles - (float)(int)cycles);
+        current += harmonic.cos_coeff * our_arm_cos_f32(theta) + harmonic.sin_coeff * our_arm_sin_f32(theta);
+    }
+    return current;
+}
+
+// @brief Runs the position and velocity stages that are due in this iteration
+// of the control loop (see Axis::stage_due). Between runs, a stage holds its output.
+// All stages run on the first update after reset().
+bool Controller::update(float pos_estimate, float pos_cpr, float vel_estimate, float* current_setpoint_output) {
     // Only runs if anticogging_.calib_anticogging is true; non-blocking
-    anticogging_calibration(pos_estimate, vel_estimate);
-    float anticogging_pos = pos_estimate;
+    anticogging_calibration(pos_estimate);
+
+    bool run_all_stages = run_all_stages_;
+    run_all_stages_ = false;
+
+    if (run_all_stages || axis_->stage_due(Axis::CONTROL_STAGE_POSITION)) {
+        uint16_t start_time = get_timing_clocks();
+        update_position(pos_estimate, pos_cpr);
+        axis_->stage_done(Axis::CONTROL_STAGE_POSITION, start_time);
+    }
+
+    if (run_all_stages || axis_->stage_due(Axis::CONTROL_STAGE_VELOCITY)) {
+        uint16_t start_time = get_timing_clocks();
+        if (!update_velocity(pos_estimate, vel_estimate, axis_->stage_period(Axis::CONTROL_STAGE_VELOCITY)))
+            return false;
+        axis_->stage_done(Axis::CONTROL_STAGE_VELOCITY, start_time);
+    }
+
+    if (current_setpoint_output) *current_setpoint_output = current_output_;
+    return true;
+}
+
+// @brief Designs the filter chains from config_.filters at the rate of the velocity stage.
+// Entries that are disabled or can't be designed are left out and the latter are flagged in invalid_filters_.
+// Called when a filter or the velocity stage divisor is configured, and when the axis thread starts.
+void Controller::update_filters() {
+    float sample_period = axis_->stage_period(Axis::CONTROL_STAGE_VELOCITY);
+    Biquad vel_error_filters[NUM_FILTERS];
+    Biquad current_filters[NUM_FILTERS];
+    size_t num_vel_error_filters = 0;
+    size_t num_current_filters = 0;
+    uint32_t invalid_filters = 0;
+
+    for (size_t i = 0; i < NUM_FILTERS; ++i) {
+        const FilterConfig_t& config = config_.filters[i];
+        if (config.biquad.type == Biquad::BIQUAD_NONE)
+            continue;
+        Biquad* dst;
+        if (config.location == FILTER_ON_CURRENT)
+            dst = &current_filters[num_current_filters++];
+        else
+            dst = &vel_error_filters[num_vel_error_filters++];
+        if (!dst->configure(config.biquad, sample_period))
+            invalid_filters |= 1 << i;
+    }
+
+    // Swap in the new chains between two runs of the velocity stage
+    uint32_t mask = cpu_enter_critical();
+    std::copy(vel_error_filters, vel_error_filters + NUM_FILTERS, vel_error_filters_);
+    std::copy(current_filters, current_filters + NUM_FILTERS, current_filters_);
+    num_vel_error_filters_ = num_vel_error_filters;
+    num_current_filters_ = num_current_filters;
+    invalid_filters_ = invalid_filters;
+    cpu_exit_critical(mask);
+}
+
+// @brief Starts the input filter at rest at the current position setpoint.
+// A command that arrived while the filter was inactive is stale, the host
+// may have been driving the axis in another mode since, so it is dropped.
+void Controller::start_input_filter() {
+    input_filter_.updated = false;
+    input_filter_.streaming = false;
+    input_filter_.sample_pos = pos_setpoint_;
+    input_filter_.sample_vel = 0.0f;
+    input_filter_.segment_duration = 0.0f;
+    input_filter_.pos = pos_setpoint_;
+    input_filter_.vel = 0.0f;
+    input_filter_.active = true;
+}
 
+// @brief Upsamples the position commands in input_pos_ to the control rate.
+// The command period is estimated from the arrival times of the commands.
+// The filter output and its derivatives become the position setpoint
+// and the velocity and current feed-forward.
+void Controller::update_input_filter() {
+    InputFilter_t& f = input_filter_;
+    uint32_t now = axis_->loop_counter_;
+
+    if (f.updated) {
+        f.updated = false;
+        float pos = input_pos_;
+        if (config_.setpoints_in_cpr) {
+            // Take the short way around, commands are within [0, cpr)
+            float cpr = (float)(axis_->encoder_.config_.cpr);
+            pos = f.sample_pos + wrap_pm(pos - fmodf_pos(f.sample_pos, cpr), 0.5f * cpr);
+        }
+
+        float interval = (now - f.sample_loop_count) * current_meas_period;
+        if (f.streaming && interval > 0.0f && interval <= config_.input_period_timeout) {
+            f.period = (f.period > 0.0f) ? f.period + 0.125f * (interval - f.period) : interval;
+            f.sample_vel = (pos - f.sample_pos) / interval;
+        } else {
+            // The first command after a pause starts from rest
+            f.sample_vel = 0.0f;
+        }
+        f.streaming = true;
+        f.sample_pos = pos;
+        f.sample_loop_count = now;
+
+        // Interpolate from the current output to the new command over one command period.
+        // The period is unknown until two commands arrived, so the first one is applied directly.
+        float T = f.period;
+        f.segment_loop_count = now;
+        f.segment_duration = T;
+        f.c0 = f.pos;
+        if (T <= 0.0f) {
+            f.c1 = f.c2 = f.c3 = 0.0f;
+        } else if (config_.input_filter_mode == INPUT_FILTER_CUBIC) {
+            float inv_T = 1.0f / T;
+            float slope = (pos - f.pos) * inv_T;
+            f.c1 = f.vel;
+            f.c2 = (3.0f * slope - 2.0f * f.vel - f.sample_vel) * inv_T;
+            f.c3 = (f.vel + f.sample_vel - 2.0f * slope) * SQ(inv_T);
+        } else {
+            f.c1 = (pos - f.pos) / T;
+            f.c2 = 0.0f;
+            f.c3 = 0.0f;
+        }
+    }
+
+    float acc;
+    if (config_.input_filter_mode == INPUT_FILTER_SECOND_ORDER) {
+        float dt = axis_->stage_period(Axis::CONTROL_STAGE_POSITION);
+        float bandwidth = config_.input_filter_bandwidth;
+        if (bandwidth <= 0.0f)
+            bandwidth = (f.period > 0.0f) ? 2.0f / f.period : INFINITY; // lags by about one command period
+        bandwidth = std::min(bandwidth, 0.5f / dt); // keep the discretization stable and well damped
+        acc = SQ(bandwidth) * (f.sample_pos - f.pos) - 2.0f * bandwidth * f.vel;
+        f.vel += acc * dt;
+        f.pos += f.vel * dt;
+    } else {
+        float t = (now - f.segment_loop_count) * current_meas_period;
+        if (t < f.segment_duration) {
+            f.pos = f.c0 + t * (f.c1 + t * (f.c2 + t * f.c3));
+            f.vel = f.c1 + t * (2.0f * f.c2 + t * 3.0f * f.c3);
+            acc = 2.0f * f.c2 + t * 6.0f * f.c3;
+        } else {
+            // Hold the latest command until the next one arrives
+            f.pos = f.sample_pos;
+            f.vel = 0.0f;
+            acc = 0.0f;
+        }
+    }
+
+    pos_setpoint_ = f.pos;
+    vel_setpoint_ = f.vel;
+    current_setpoint_ = acc * config_.input_A_per_css;
+}
+
+// @brief Trajectory and position loop
+// Updates the setpoints from the trajectory and the velocity command of the position loop.
+// Neither depends on the stage period: the trajectory is evaluated on the loop counter.
+void Controller::update_position(float pos_estimate, float pos_cpr) {
     // Trajectory control
     if (config_.control_mode == CTRL_MODE_TRAJECTORY_CONTROL) {
         // Note: uint32_t loop count delta is OK across overflow
@@ -124,40 +556,88 @@ bool Controller::update(float pos_estimate, float vel_estimate, float* current_s
             vel_setpoint_ = traj_step.Yd;
             current_setpoint_ = traj_step.Ydd * axis_->trap_.config_.A_per_css;
         }
-        anticogging_pos = pos_setpoint_; // FF the position setpoint instead of the pos_estimate
     }
 
-    // Ramp rate limited velocity setpoint
-    if (config_.control_mode == CTRL_MODE_VELOCITY_CONTROL && vel_ramp_enable_) {
-        float max_step_size = current_meas_period * config_.vel_ramp_rate;
-        float full_step = vel_ramp_target_ - vel_setpoint_;
-        float step;
-        if (fabsf(full_step) > max_step_size) {
-            step = std::copysignf(max_step_size, full_step);
+    // Jerk-limited trajectory control
+    // Stays in this mode when done so that the next move is planned with the same profile
+    if (config_.control_mode == CTRL_MODE_SCURVE_TRAJECTORY_CONTROL && !traj_done_) {
+        float t = (axis_->loop_counter_ - traj_start_loop_count_) * current_meas_period;
+        if (t > axis_->scurve_.Tf_) {
+            traj_done_ = true;
+            // pos_setpoint already set by trajectory
+            vel_setpoint_ = 0.0f;
+            current_setpoint_ = 0.0f;
         } else {
-            step = full_step;
+            SCurveTrajectory::Step_t traj_step = axis_->scurve_.eval(t);
+            pos_setpoint_ = traj_step.Y;
+            vel_setpoint_ = traj_step.Yd;
+            current_setpoint_ = traj_step.Ydd * axis_->scurve_.config_.A_per_css;
         }
-        vel_setpoint_ += step;
+    }
+
+    // Streamed PVT control
+    // The queue is consumed from the current setpoint when this mode is entered
+    if (config_.control_mode == CTRL_MODE_PVT_CONTROL) {
+        if (!pvt_active_) {
+            axis_->pvt_.start(pos_setpoint_, vel_setpoint_, axis_->loop_counter_);
+            pvt_active_ = true;
+        }
+        PvtTrajectory::Step_t traj_step = axis_->pvt_.update(axis_->loop_counter_);
+        pos_setpoint_ = traj_step.Y;
+        vel_setpoint_ = traj_step.Yd;
+        current_setpoint_ = traj_step.Ydd * axis_->pvt_.config_.A_per_css;
+    } else {
+        pvt_active_ = false;
+    }
+
+    // Input filter for position commands from slow hosts
+    if (config_.control_mode == CTRL_MODE_POSITION_CONTROL && config_.input_filter_mode != INPUT_FILTER_NONE) {
+        if (!input_filter_.active)
+            start_input_filter();
+        update_input_filter();
+    } else {
+        input_filter_.active = false;
     }
 
     // Position control
     // TODO Decide if we want to use encoder or pll position here
-    float vel_des = vel_setpoint_;
+    pos_loop_vel_ = 0.0f;
     if (config_.control_mode >= CTRL_MODE_POSITION_CONTROL) {
         float pos_err;
         if (config_.setpoints_in_cpr) {
-            // TODO this breaks the semantics that estimates come in on the arguments.
-            // It's probably better to call a get_estimate that will arbitrate (enc vs sensorless) instead.
             float cpr = (float)(axis_->encoder_.config_.cpr);
             // Keep pos setpoint from drifting
             pos_setpoint_ = fmodf_pos(pos_setpoint_, cpr);
             // Circular delta
-            pos_err = pos_setpoint_ - axis_->encoder_.pos_cpr_;
+            pos_err = pos_setpoint_ - pos_cpr;
             pos_err = wrap_pm(pos_err, 0.5f * cpr);
         } else {
             pos_err = pos_setpoint_ - pos_estimate;
         }
-        vel_des += config_.pos_gain * pos_err;
+        pos_loop_vel_ = config_.pos_gain * pos_err;
+    }
+}
+
+// @brief Velocity loop and anticogging
+// Computes the current command from the velocity setpoint and the output of the position stage.
+// @param dt: time since the last run of this stage [s]
+bool Controller::update_velocity(float pos_estimate, float vel_estimate, float dt) {
+    // Ramp rate limited velocity setpoint
+    if (config_.control_mode == CTRL_MODE_VELOCITY_CONTROL && vel_ramp_enable_) {
+        float max_step_size = dt * config_.vel_ramp_rate;
+        float full_step = vel_ramp_target_ - vel_setpoint_;
+        float step;
+        if (fabsf(full_step) > max_step_size) {
+            step = std::copysignf(max_step_size, full_step);
+        } else {
+            step = full_step;
+        }
+        vel_setpoint_ += step;
+    }
+
+    float vel_des = vel_setpoint_;
+    if (config_.control_mode >= CTRL_MODE_POSITION_CONTROL) {
+        vel_des += pos_loop_vel_;
     }
 
     // Velocity limiting
@@ -177,13 +657,33 @@ bool Controller::update(float pos_estimate, float vel_estimate, float* current_s
     float Iq = current_setpoint_;
 
     // Anti-cogging is enabled after calibration
-    // We get the current position and apply a current feed-forward
-    // ensuring that we handle negative encoder positions properly (-1 == motor->encoder.encoder_cpr - 1)
+    // We get the current position and apply a current feed-forward from the cogging model
+    // In trajectory control we FF the position setpoint instead of the pos_estimate
     if (anticogging_.use_anticogging) {
-        Iq += anticogging_.cogging_map[mod(static_cast<int>(anticogging_pos), axis_->encoder_.config_.cpr)];
+        float anticogging_pos = (config_.control_mode >= CTRL_MODE_TRAJECTORY_CONTROL) ? pos_setpoint_ : pos_estimate;
+        Iq += anticogging_current(anticogging_pos);
+    }
+
+    // Disturbance observer
+    // The load current is the part of the measured current that doesn't accelerate the inertia.
+    // It is low-passed as LPF(Iq + inertia * w * vel) - inertia * w * vel,
+    // which equals LPF(Iq - inertia * d/dt vel) without differentiating the velocity.
+    float inertia_term = config_.inertia * config_.observer_bandwidth * vel_estimate;
+    if (config_.enable_disturbance_observer && config_.control_mode >= CTRL_MODE_VELOCITY_CONTROL) {
+        float Iq_measured = (float)axis_->motor_.config_.direction * axis_->motor_.current_control_.Iq_measured;
+        float alpha = std::min(config_.observer_bandwidth * dt, 1.0f);
+        observer_state_ += alpha * (Iq_measured + inertia_term - observer_state_);
+        load_current_ = observer_state_ - inertia_term;
+        Iq += load_current_;
+    } else {
+        // Start from a zero estimate when enabled
+        observer_state_ = inertia_term;
+        load_current_ = 0.0f;
     }
 
     float v_err = vel_des - vel_estimate;
+    for (size_t i = 0; i < num_vel_error_filters_; ++i)
+        v_err = vel_error_filters_[i].update(v_err);
     if (config_.control_mode >= CTRL_MODE_VELOCITY_CONTROL) {
         Iq += config_.vel_gain * v_err;
     }
@@ -191,6 +691,9 @@ bool Controller::update(float pos_estimate, float vel_estimate, float* current_s
     // Velocity integral action before limiting
     Iq += vel_integrator_current_;
 
+    for (size_t i = 0; i < num_current_filters_; ++i)
+        Iq = current_filters_[i].update(Iq);
+
     // Current limiting
     bool limited = false;
     float Ilim = axis_->motor_.effective_current_lim();
@@ -212,10 +715,10 @@ bool Controller::update(float pos_estimate, float vel_estimate, float* current_s
             // TODO make decayfactor configurable
             vel_integrator_current_ *= 0.99f;
         } else {
-            vel_integrator_current_ += (config_.vel_integrator_gain * current_meas_period) * v_err;
+            vel_integrator_current_ += (config_.vel_integrator_gain * dt) * v_err;
         }
     }
 
-    if (current_setpoint_output) *current_setpoint_output = Iq;
+    current_output_ = Iq;
     return true;
 }
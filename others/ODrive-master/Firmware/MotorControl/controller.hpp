@@ -10,6 +10,8 @@ public:
     enum Error_t {
         ERROR_NONE = 0,
         ERROR_OVERSPEED = 0x01,
+        ERROR_AUTOTUNE_FAILED = 0x02,
+        ERROR_INVALID_ESTIMATE = 0x04,
     };
 
     // Note: these should be sorted from lowest level of control to
@@ -19,7 +21,28 @@ public:
         CTRL_MODE_CURRENT_CONTROL = 1,
         CTRL_MODE_VELOCITY_CONTROL = 2,
         CTRL_MODE_POSITION_CONTROL = 3,
-        CTRL_MODE_TRAJECTORY_CONTROL = 4
+        CTRL_MODE_TRAJECTORY_CONTROL = 4,
+        CTRL_MODE_SCURVE_TRAJECTORY_CONTROL = 5,  // jerk-limited trajectory, stays active after the move
+        CTRL_MODE_PVT_CONTROL = 6                 // interpolates the points streamed to axis.pvt
+    };
+
+    enum InputFilterMode_t {
+        INPUT_FILTER_NONE = 0,              // position commands are applied as received
+        INPUT_FILTER_FIRST_ORDER_HOLD = 1,  // linear interpolation over one command period
+        INPUT_FILTER_SECOND_ORDER = 2,      // critically damped second-order low-pass
+        INPUT_FILTER_CUBIC = 3,             // cubic Hermite interpolation over one command period
+    };
+
+    enum FilterLocation_t {
+        FILTER_ON_VEL_ERROR = 0,    // filters the velocity error before the velocity gain and integrator
+        FILTER_ON_CURRENT = 1,      // filters the current command before current limiting
+    };
+
+    static constexpr size_t NUM_FILTERS = 4;
+
+    struct FilterConfig_t {
+        Biquad::Config_t biquad;
+        FilterLocation_t location = FILTER_ON_VEL_ERROR;
     };
 
     struct Config_t {
@@ -32,6 +55,46 @@ public:
         float vel_limit_tolerance = 1.2f;  // ratio to vel_lim. 0.0f to disable
         float vel_ramp_rate = 10000.0f;  // [(counts/s) / s]
         bool setpoints_in_cpr = false;
+        float anticogging_calib_vel = 2000.0f;     // [counts/s] sweep velocity of the anticogging calibration
+        float anticogging_calib_turns = 1.0f;      // [turns] recorded in each direction
+        uint32_t anticogging_num_harmonics = 16;   // number of harmonics kept in the cogging model, at most ANTICOGGING_MAX_HARMONICS
+        InputFilterMode_t input_filter_mode = INPUT_FILTER_NONE;  // upsampling of position commands in position control
+        float input_filter_bandwidth = 0.0f;   // [rad/s] of INPUT_FILTER_SECOND_ORDER, 0 to derive it from the command period
+        float input_period_timeout = 0.1f;     // [s] longer gaps between commands are not taken as the command period
+        float input_A_per_css = 0.0f;          // [A/(counts/s^2)] acceleration feed-forward of the input filter
+        FilterConfig_t filters[NUM_FILTERS];   // applied in this order at their respective location
+        bool enable_disturbance_observer = false;
+        float inertia = 0.0f;                  // [A/(counts/s^2)] of motor and load, like A_per_css of the trajectories
+        float observer_bandwidth = 200.0f;     // [rad/s] of the disturbance observer, well below the current control bandwidth
+        Autotune::Config_t autotune;           // see AXIS_STATE_AUTOTUNE
+    };
+
+    enum AnticoggingCalibPhase_t {
+        ANTICOGGING_CALIB_IDLE,
+        ANTICOGGING_CALIB_SETTLE_FORWARD,
+        ANTICOGGING_CALIB_RECORD_FORWARD,
+        ANTICOGGING_CALIB_SETTLE_REVERSE,
+        ANTICOGGING_CALIB_RECORD_REVERSE,
+        ANTICOGGING_CALIB_FIT,
+    };
+
+    // The cogging current is binned over one turn during the calibration sweep.
+    // This bounds the highest harmonic order that can be fitted to ANTICOGGING_CALIB_BINS / 2 - 1.
+    static constexpr size_t ANTICOGGING_CALIB_BINS = 512;
+    static constexpr size_t ANTICOGGING_MAX_HARMONICS = 24;
+
+    // @brief One term of the cogging model:
+    // I(theta) = cos_coeff * cos(order * theta) + sin_coeff * sin(order * theta)
+    struct CoggingHarmonic_t {
+        uint32_t order;     // [cycles/turn]
+        float cos_coeff;    // [A]
+        float sin_coeff;    // [A]
+    };
+
+    // @brief Cogging model, stored in NVM with a length that depends on num_harmonics
+    struct CoggingModel_t {
+        uint32_t num_harmonics;
+        CoggingHarmonic_t harmonics[ANTICOGGING_MAX_HARMONICS]; // sorted by descending amplitude
     };
 
     explicit Controller(Config_t& config);
@@ -45,54 +108,124 @@ public:
     // Trajectory-Planned control
     void move_to_pos(float goal_point);
     void move_incremental(float displacement, bool from_goal_point);
+    float arm_move(float goal_point, float time_scale);
+    void start_armed_move(uint32_t start_loop_count);
     
     // TODO: make this more similar to other calibration loops
     void start_anticogging_calibration();
-    bool anticogging_calibration(float pos_estimate, float vel_estimate);
+    bool anticogging_calibration(float pos_estimate);
+    void anticogging_fit_order(uint32_t order);
+    float anticogging_current(float pos);
+    size_t get_anticogging_model_size();
+    bool set_anticogging_model(const CoggingModel_t& model, size_t length);
 
-    bool update(float pos_estimate, float vel_estimate, float* current_setpoint);
+    void apply_autotune_gains();
+
+    void update_filters();
+    void start_input_filter();
+    void update_input_filter();
+
+    bool update(float pos_estimate, float pos_cpr, float vel_estimate, float* current_setpoint);
+    void update_position(float pos_estimate, float pos_cpr);
+    bool update_velocity(float pos_estimate, float vel_estimate, float dt);
 
     Config_t& config_;
     Axis* axis_ = nullptr; // set by Axis constructor
 
     // TODO: anticogging overhaul:
-    // - expose selected (all?) variables on protocol
     // - make calibration user experience similar to motor & encoder calibration
-    // - use python tools to Fourier transform and write back the smoothed map or Fourier coefficients
-    // - make the calibration persistent
 
     typedef struct {
-        int index;
-        float *cogging_map;
         bool use_anticogging;
+        bool model_restored;            // loaded at boot, enabled once the encoder is referenced
         bool calib_anticogging;
-        float calib_pos_threshold;
-        float calib_vel_threshold;
+        AnticoggingCalibPhase_t calib_phase;
+        float calib_phase_start_pos;    // [counts]
+        uint32_t calib_fit_order;       // next harmonic order evaluated in ANTICOGGING_CALIB_FIT
+        float* calib_bin_sum;           // [A] allocated for the duration of the calibration only
+        uint16_t* calib_bin_count;
+        CoggingModel_t model;
     } Anticogging_t;
     Anticogging_t anticogging_ = {
-        .index = 0,
-        .cogging_map = nullptr,
         .use_anticogging = false,
+        .model_restored = false,
         .calib_anticogging = false,
-        .calib_pos_threshold = 1.0f,
-        .calib_vel_threshold = 1.0f,
+        .calib_phase = ANTICOGGING_CALIB_IDLE,
+        .calib_phase_start_pos = 0.0f,
+        .calib_fit_order = 0,
+        .calib_bin_sum = nullptr,
+        .calib_bin_count = nullptr,
+        .model = {},
     };
 
+    // Upsamples the position commands of a slow host to the control rate, see update_input_filter()
+    typedef struct {
+        bool active;
+        bool updated;                   // input_pos_ holds a command that wasn't taken in yet
+        bool streaming;                 // the previous command arrived less than input_period_timeout ago
+        float period;                   // [s] estimated command period
+        uint32_t sample_loop_count;     // loop count at which the latest command was taken in
+        float sample_pos;               // [counts] latest command, unwrapped if setpoints_in_cpr
+        float sample_vel;               // [counts/s] average velocity between the latest two commands
+        uint32_t segment_loop_count;    // start of the interpolated segment
+        float segment_duration;         // [s]
+        float c0, c1, c2, c3;           // segment polynomial in the time since its start
+        float pos;                      // [counts] filter output, unwrapped if setpoints_in_cpr
+        float vel;                      // [counts/s]
+    } InputFilter_t;
+    InputFilter_t input_filter_ = {};
+
+    // Filter chains built from config_.filters by update_filters()
+    Biquad vel_error_filters_[NUM_FILTERS];
+    size_t num_vel_error_filters_ = 0;
+    Biquad current_filters_[NUM_FILTERS];
+    size_t num_current_filters_ = 0;
+    uint32_t invalid_filters_ = 0;  // bit mask of the entries of config_.filters that could not be designed
+
+    // Relay feedback experiments of AXIS_STATE_AUTOTUNE, the results stay until the next run
+    Autotune autotune_;
+
     Error_t error_ = ERROR_NONE;
     // variables exposed on protocol
     float pos_setpoint_ = 0.0f;
     float vel_setpoint_ = 0.0f;
+    float input_pos_ = 0.0f;    // [counts] position command that is filtered into pos_setpoint_ if an input filter is selected
     // float vel_setpoint = 800.0f; <sensorless example>
     float vel_integrator_current_ = 0.0f;  // [A]
     float current_setpoint_ = 0.0f;        // [A]
     float vel_ramp_target_ = 0.0f;
     bool vel_ramp_enable_ = false;
 
+    // Stage outputs, held between runs of the respective stage
+    float pos_loop_vel_ = 0.0f;     // [counts/s] velocity command of the position loop
+    float observer_state_ = 0.0f;   // [A] low-passed measured current plus inertia term, see update_velocity()
+    float load_current_ = 0.0f;     // [A] estimated load, compensated if the disturbance observer is enabled
+    float current_output_ = 0.0f;   // [A] current command of the velocity loop
+    bool run_all_stages_ = true;
+
     uint32_t traj_start_loop_count_ = 0;
+    bool traj_done_ = true;
+    bool pvt_active_ = false;
+
+    // Move planned by arm_move(), waiting for start_armed_move()
+    bool traj_armed_ = false;
+    ControlMode_t traj_armed_mode_ = CTRL_MODE_POSITION_CONTROL;
+    float traj_armed_start_ = 0.0f;
 
     float goal_point_ = 0.0f;
 
     // Communication protocol definitions
+    auto make_filter_definitions(FilterConfig_t& config) {
+        void (*written_hook)(void*) = [](void* ctx) { static_cast<Controller*>(ctx)->update_filters(); };
+        return make_protocol_member_list(
+            make_protocol_property("type", &config.biquad.type, written_hook, this),
+            make_protocol_property("frequency", &config.biquad.frequency, written_hook, this),
+            make_protocol_property("q", &config.biquad.q, written_hook, this),
+            make_protocol_property("gain", &config.biquad.gain, written_hook, this),
+            make_protocol_property("location", &config.location, written_hook, this)
+        );
+    }
+
     auto make_protocol_definitions() {
         return make_protocol_member_list(
             make_protocol_property("error", &error_),
@@ -102,6 +235,29 @@ public:
             make_protocol_property("current_setpoint", &current_setpoint_),
             make_protocol_property("vel_ramp_target", &vel_ramp_target_),
             make_protocol_property("vel_ramp_enable", &vel_ramp_enable_),
+            make_protocol_property("input_pos", &input_pos_,
+                [](void* ctx) { static_cast<Controller*>(ctx)->input_filter_.updated = true; }, this),
+            make_protocol_ro_property("input_period", &input_filter_.period),
+            make_protocol_ro_property("invalid_filters", &invalid_filters_),
+            make_protocol_ro_property("load_current", &load_current_),
+            make_protocol_object("anticogging",
+                make_protocol_property("use_anticogging", &anticogging_.use_anticogging),
+                make_protocol_ro_property("calib_anticogging", &anticogging_.calib_anticogging),
+                make_protocol_ro_property("calib_phase", &anticogging_.calib_phase),
+                make_protocol_ro_property("num_harmonics", &anticogging_.model.num_harmonics)
+            ),
+            make_protocol_object("autotune",
+                make_protocol_ro_property("phase", &autotune_.phase_),
+                make_protocol_ro_property("inertia", &autotune_.result_.inertia),
+                make_protocol_ro_property("friction", &autotune_.result_.friction),
+                make_protocol_ro_property("ultimate_frequency", &autotune_.result_.ultimate_frequency),
+                make_protocol_ro_property("ultimate_gain", &autotune_.result_.ultimate_gain),
+                make_protocol_ro_property("bandwidth", &autotune_.result_.bandwidth),
+                make_protocol_ro_property("pos_gain", &autotune_.result_.pos_gain),
+                make_protocol_ro_property("vel_gain", &autotune_.result_.vel_gain),
+                make_protocol_ro_property("vel_integrator_gain", &autotune_.result_.vel_integrator_gain),
+                make_protocol_ro_property("resonance_frequency", &autotune_.result_.resonance_frequency)
+            ),
             make_protocol_object("config",
                 make_protocol_property("control_mode", &config_.control_mode),
                 make_protocol_property("pos_gain", &config_.pos_gain),
@@ -110,7 +266,32 @@ public:
                 make_protocol_property("vel_limit", &config_.vel_limit),
                 make_protocol_property("vel_limit_tolerance", &config_.vel_limit_tolerance),
                 make_protocol_property("vel_ramp_rate", &config_.vel_ramp_rate),
-                make_protocol_property("setpoints_in_cpr", &config_.setpoints_in_cpr)
+                make_protocol_property("setpoints_in_cpr", &config_.setpoints_in_cpr),
+                make_protocol_property("anticogging_calib_vel", &config_.anticogging_calib_vel),
+                make_protocol_property("anticogging_calib_turns", &config_.anticogging_calib_turns),
+                make_protocol_property("anticogging_num_harmonics", &config_.anticogging_num_harmonics),
+                make_protocol_property("input_filter_mode", &config_.input_filter_mode),
+                make_protocol_property("input_filter_bandwidth", &config_.input_filter_bandwidth),
+                make_protocol_property("input_period_timeout", &config_.input_period_timeout),
+                make_protocol_property("input_A_per_css", &config_.input_A_per_css),
+                make_protocol_object("filter0", make_filter_definitions(config_.filters[0])),
+                make_protocol_object("filter1", make_filter_definitions(config_.filters[1])),
+                make_protocol_object("filter2", make_filter_definitions(config_.filters[2])),
+                make_protocol_object("filter3", make_filter_definitions(config_.filters[3])),
+                make_protocol_property("enable_disturbance_observer", &config_.enable_disturbance_observer),
+                make_protocol_property("inertia", &config_.inertia),
+                make_protocol_property("observer_bandwidth", &config_.observer_bandwidth),
+                make_protocol_object("autotune",
+                    make_protocol_property("relay_current", &config_.autotune.relay_current),
+                    make_protocol_property("noise_band", &config_.autotune.noise_band),
+                    make_protocol_property("num_cycles", &config_.autotune.num_cycles),
+                    make_protocol_property("timeout", &config_.autotune.timeout),
+                    make_protocol_property("max_travel", &config_.autotune.max_travel),
+                    make_protocol_property("bandwidth", &config_.autotune.bandwidth),
+                    make_protocol_property("phase_margin", &config_.autotune.phase_margin),
+                    make_protocol_property("pos_bandwidth_ratio", &config_.autotune.pos_bandwidth_ratio),
+                    make_protocol_property("sweep_current", &config_.autotune.sweep_current)
+                )
             ),
             make_protocol_function("set_pos_setpoint", *this, &Controller::set_pos_setpoint,
                 "pos_setpoint", "vel_feed_forward", "current_feed_forward"),
@@ -120,7 +301,8 @@ public:
                                    "current_setpoint"),
             make_protocol_function("move_to_pos", *this, &Controller::move_to_pos, "pos_setpoint"),
             make_protocol_function("move_incremental", *this, &Controller::move_incremental, "displacement", "from_goal_point"),
-            make_protocol_function("start_anticogging_calibration", *this, &Controller::start_anticogging_calibration)
+            make_protocol_function("start_anticogging_calibration", *this, &Controller::start_anticogging_calibration),
+            make_protocol_function("apply_autotune_gains", *this, &Controller::apply_autotune_gains)
         );
     }
 };
@@ -7,7 +7,7 @@ Encoder::Encoder(const EncoderHardwareConfig_t& hw_config,
         hw_config_(hw_config),
         config_(config)
 {
-    update_pll_gains();
+    update_estimator_gains();
 
     if (config.pre_calibrated && (config.mode == Encoder::MODE_HALL || config.mode == Encoder::MODE_SINCOS)) {
         is_ready_ = true;
@@ -18,9 +18,39 @@ static void enc_index_cb_wrapper(void* ctx) {
     reinterpret_cast<Encoder*>(ctx)->enc_index_cb();
 }
 
+static void enc_edge_cb_wrapper(void* ctx) {
+    reinterpret_cast<Encoder*>(ctx)->enc_edge_cb();
+}
+
 void Encoder::setup() {
     HAL_TIM_Encoder_Start(hw_config_.timer, TIM_CHANNEL_ALL);
     set_idx_subscribe();
+
+    // The edges of the timer inputs (and hall C) are timestamped by the EXTI
+    // interrupts of the same pins, because the timer channels are taken by
+    // the encoder mode and can't capture.
+    if (config_.enable_edge_timing && (config_.mode == MODE_INCREMENTAL || config_.mode == MODE_HALL)) {
+        // An EXTI line that is taken by a GPIO of the same number (e.g. a
+        // step input) is refused.
+        start_cycle_counter();
+        GPIO_TypeDef* ports[] = {hw_config_.hallA_port, hw_config_.hallB_port, hw_config_.hallC_port};
+        uint16_t pins[] = {hw_config_.hallA_pin, hw_config_.hallB_pin, hw_config_.hallC_pin};
+        size_t num_pins = config_.mode == MODE_HALL ? 3 : 2;
+        size_t subscribed = 0;
+        while (subscribed < num_pins
+                && GPIO_subscribe_edges(ports[subscribed], pins[subscribed], enc_edge_cb_wrapper, this))
+            ++subscribed;
+        if (subscribed == num_pins) {
+            for (size_t i = 0; i < num_pins; ++i)
+                edge_pins_ |= pins[i];
+        } else {
+            // Only the lines that were taken are released. GPIO_unsubscribe()
+            // would disable the NVIC interrupt that lines 5 to 9 share.
+            for (size_t i = 0; i < subscribed; ++i)
+                GPIO_unsubscribe_edges(ports[i], pins[i]);
+            set_error(ERROR_EDGE_TIMING_CONFLICT);
+        }
+    }
 }
 
 void Encoder::set_error(Error_t error) {
@@ -59,6 +89,12 @@ void Encoder::enc_index_cb() {
     GPIO_unsubscribe(hw_config_.index_port, hw_config_.index_pin);
 }
 
+// Triggered by every edge of the encoder (or hall) signals while the edge
+// timing is active
+RAM_FUNCTION void Encoder::enc_edge_cb() {
+    last_edge_time_ = DWT->CYCCNT;
+}
+
 void Encoder::set_idx_subscribe(bool override_enable) {
     if (config_.use_index && (override_enable || !config_.find_idx_on_lockin_only)) {
         GPIO_subscribe(hw_config_.index_port, hw_config_.index_pin, GPIO_PULLDOWN,
@@ -68,16 +104,26 @@ void Encoder::set_idx_subscribe(bool override_enable) {
     }
 }
 
-void Encoder::update_pll_gains() {
-    pll_kp_ = 2.0f * config_.bandwidth;  // basic conversion to discrete time
-    pll_ki_ = 0.25f * (pll_kp_ * pll_kp_); // Critically damped
-
-    // Check that we don't get problems with discrete time approximation
-    if (!(current_meas_period * pll_kp_ < 1.0f)) {
+// @brief Computes the estimator gains and swaps them in between two updates.
+// This runs in the communication thread while the estimator is in use.
+void Encoder::update_estimator_gains() {
+    PosVelEstimator estimator;
+    bool stable = estimator.configure(config_.estimator, config_.bandwidth, current_meas_period);
+    uint32_t mask = cpu_enter_critical();
+    estimator_ = estimator;
+    cpu_exit_critical(mask);
+    if (!stable) {
         set_error(ERROR_UNSTABLE_GAIN);
     }
 }
 
+// @brief Returns true if pos_estimate_ is zeroed at the index, so that position
+// dependent calibrations from an earlier boot apply
+bool Encoder::is_referenced() {
+    return config_.mode == MODE_INCREMENTAL && config_.use_index
+            && config_.zero_count_on_find_idx && index_found_;
+}
+
 void Encoder::check_pre_calibrated() {
     if (!is_ready_)
         config_.pre_calibrated = false;
@@ -158,10 +204,14 @@ bool Encoder::run_direction_find() {
 // @brief Turns the motor in one direction for a bit and then in the other
 // direction in order to find the offset between the electrical phase 0
 // and the encoder state 0.
-// TODO: Do the scan with current, not voltage!
+// With config.calib_current_control, run_current_offset_calibration() is used
+// instead for high current motors.
 bool Encoder::run_offset_calibration() {
+    if (config_.calib_current_control && axis_->motor_.config_.motor_type == Motor::MOTOR_TYPE_HIGH_CURRENT)
+        return run_current_offset_calibration();
+
     static const float start_lock_duration = 1.0f;
-    static const int num_steps = (int)(config_.calib_scan_distance / config_.calib_scan_omega * (float)current_meas_hz);
+    const int num_steps = (int)(config_.calib_scan_distance / config_.calib_scan_omega * (float)current_meas_hz);
 
     // Require index found if enabled
     if (config_.use_index && !index_found_) {
@@ -257,10 +307,198 @@ bool Encoder::run_offset_calibration() {
     int32_t residual = encvaluesum - ((int64_t)config_.offset * (int64_t)(num_steps * 2));
     config_.offset_float = (float)residual / (float)(num_steps * 2) + 0.5f; // add 0.5 to center-align state to phase
 
+    // The voltage scan doesn't fit pole pair offsets, and ones from an earlier
+    // calibration are relative to the old offset
+    for (int k = 0; k < MAX_POLE_PAIR_OFFSETS; ++k)
+        config_.pole_pair_offsets[k] = 0.0f;
+
     is_ready_ = true;
     return true;
 }
 
+// Least squares fit of a line y = slope * x + intercept
+struct LineFit {
+    float n = 0.0f, sx = 0.0f, sy = 0.0f, sxx = 0.0f, sxy = 0.0f;
+
+    void add(float x, float y) {
+        n += 1.0f;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    float slope() {
+        return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+    }
+
+    float intercept(float slope) {
+        return (sy - slope * sx) / n;
+    }
+};
+
+// @brief Offset calibration with the calibration current on the d axis of the
+// commanded phase, so that the rotor is pulled along with the full torque
+// regardless of the back-EMF and the resistance estimate.
+// The initial lock ends as soon as the rotor has settled. Then the phase is
+// swept forward and back and a line count = slope * phase + intercept is
+// fitted to each sweep. The slopes give the direction and check the CPR. The
+// intercepts are then taken with the nominal slope, so that the errors of the
+// individual pole pairs can't tilt the line, and as the rotor lags the field by
+// about the same angle in both directions, their mean is the offset.
+// With config.use_pole_pair_offsets, the mean deviation from the line in each
+// electrical revolution is stored as well. The samples are binned on the
+// commanded phase, which is zero where the line crosses the offset, so that
+// the bins are those of (count - offset) mod cpr up to the lag of the rotor.
+// Samples closer than pole_pair_guard to a boundary are skipped, and if the lag
+// exceeds that, no pole pair offsets are stored.
+bool Encoder::run_current_offset_calibration() {
+    static const float max_lock_duration = 1.0f;
+    static const float pole_pair_guard = 0.125f; // [electrical revolutions]
+    Motor& motor = axis_->motor_;
+    const float scan_distance = config_.calib_scan_distance;
+    const float scan_omega = config_.calib_current_scan_omega;
+    const float current = motor.config_.calibration_current;
+    const int num_steps = (int)(scan_distance / scan_omega * (float)current_meas_hz);
+    const int num_skip = num_steps / 8; // acceleration transient at the start of each sweep
+    const int32_t pole_pairs = motor.config_.pole_pairs;
+    const bool fit_pole_pairs = config_.use_pole_pair_offsets && pole_pairs > 0 && pole_pairs <= MAX_POLE_PAIR_OFFSETS;
+    float elec_rad_per_enc = pole_pairs * 2 * M_PI * (1.0f / (float)(config_.cpr));
+
+    // Require index found if enabled
+    if (config_.use_index && !index_found_) {
+        set_error(ERROR_INDEX_NOT_FOUND_YET);
+        return false;
+    }
+
+    // We use shadow_count_ to do the calibration, but the offset is used by count_in_cpr_
+    // Therefore we have to sync them for calibration
+    shadow_count_ = count_in_cpr_;
+    motor.reset_current_control();
+
+    // Lock the rotor at the start of the scan until it stops moving
+    float lock_phase = wrap_pm_pi(-scan_distance / 2.0f);
+    int i = 0;
+    int settled = 0;
+    axis_->run_control_loop([&](){
+        if (!motor.FOC_current(current, 0.0f, lock_phase, lock_phase, 0.0f))
+            return false; // error set inside FOC_current
+        motor.log_timing(Motor::TIMING_LOG_ENC_CALIB);
+
+        if (fabsf(vel_estimate_) * elec_rad_per_enc < config_.calib_lock_vel_tolerance)
+            ++settled;
+        else
+            settled = 0;
+        return ++i < max_lock_duration * current_meas_hz
+            && settled < config_.calib_lock_settle_time * current_meas_hz;
+    });
+    if (axis_->error_ != Axis::ERROR_NONE)
+        return false;
+
+    int32_t init_enc_val = shadow_count_;
+    float residual_sum[MAX_POLE_PAIR_OFFSETS] = {0};
+    float residual_n[MAX_POLE_PAIR_OFFSETS] = {0};
+
+    // @param dir: 1 to scan forward, -1 to scan backward
+    // @param slope: fitted slope [count/rad]
+    // @param intercept: intercept with the nominal slope [count]
+    auto scan = [&](float dir, float* slope, float* intercept) {
+        LineFit fit;
+        float bin_n[MAX_POLE_PAIR_OFFSETS] = {0};
+        float bin_x[MAX_POLE_PAIR_OFFSETS] = {0};
+        float bin_y[MAX_POLE_PAIR_OFFSETS] = {0};
+        int step = 0;
+        axis_->run_control_loop([&](){
+            float x = dir * (scan_distance * (float)step / (float)num_steps - scan_distance / 2.0f);
+            float phase = wrap_pm_pi(x);
+            float pwm_phase = wrap_pm_pi(x + dir * motor.get_control_delay() * scan_omega);
+            if (!motor.FOC_current(current, 0.0f, phase, pwm_phase, 0.0f))
+                return false; // error set inside FOC_current
+            motor.log_timing(Motor::TIMING_LOG_ENC_CALIB);
+
+            if (step >= num_skip) {
+                float y = (float)(shadow_count_ - init_enc_val);
+                fit.add(x, y);
+                float revs = x * (0.5f / M_PI);
+                float frac = revs - floorf(revs);
+                if (fit_pole_pairs && frac >= pole_pair_guard && frac <= 1.0f - pole_pair_guard) {
+                    int k = mod((int)floorf(revs), pole_pairs);
+                    bin_n[k] += 1.0f;
+                    bin_x[k] += x;
+                    bin_y[k] += y;
+                }
+            }
+            return ++step < num_steps;
+        });
+        if (axis_->error_ != Axis::ERROR_NONE)
+            return false;
+
+        *slope = fit.slope();
+        float nominal_slope = (*slope < 0.0f ? -1.0f : 1.0f) / elec_rad_per_enc;
+        *intercept = fit.intercept(nominal_slope);
+        for (int k = 0; k < pole_pairs && fit_pole_pairs; ++k) {
+            residual_sum[k] += bin_y[k] - nominal_slope * bin_x[k] - *intercept * bin_n[k];
+            residual_n[k] += bin_n[k];
+        }
+        return true;
+    };
+
+    float slope_fwd, intercept_fwd, slope_back, intercept_back;
+    if (!scan(1.0f, &slope_fwd, &intercept_fwd))
+        return false;
+    if (!scan(-1.0f, &slope_back, &intercept_back))
+        return false;
+
+    // Check response and direction, written such that NaN fails
+    float min_slope = 8.0f / scan_distance;
+    if (slope_fwd > min_slope && slope_back > min_slope) {
+        // motor same dir as encoder
+        motor.config_.direction = 1;
+    } else if (slope_fwd < -min_slope && slope_back < -min_slope) {
+        // motor opposite dir as encoder
+        motor.config_.direction = -1;
+    } else {
+        // Encoder response error
+        set_error(ERROR_NO_RESPONSE);
+        return false;
+    }
+
+    // Check CPR
+    float expected_encoder_delta = scan_distance / elec_rad_per_enc;
+    calib_scan_response_ = 0.5f * (fabsf(slope_fwd) + fabsf(slope_back)) * scan_distance;
+    if(fabsf(calib_scan_response_ - expected_encoder_delta)/expected_encoder_delta > config_.calib_range)
+    {
+        set_error(ERROR_CPR_OUT_OF_RANGE);
+        return false;
+    }
+
+    float offset = 0.5f * (intercept_fwd + intercept_back);
+    int32_t offset_counts = (int32_t)floorf(offset);
+    config_.offset = init_enc_val + offset_counts;
+    config_.offset_float = offset - (float)offset_counts + 0.5f; // add 0.5 to center-align state to phase
+
+    // The rotor lags the line of each sweep by half the distance between them.
+    // Up to pole_pair_guard, no sample left the pole pair of its bin.
+    float lag = 0.5f * fabsf(intercept_fwd - intercept_back) * (float)pole_pairs / (float)config_.cpr;
+    for (int k = 0; k < MAX_POLE_PAIR_OFFSETS; ++k)
+        config_.pole_pair_offsets[k] = 0.0f;
+    for (int k = 0; k < pole_pairs && fit_pole_pairs && lag < pole_pair_guard; ++k) {
+        // The commanded phase runs against the counts if the direction is -1
+        int pole_pair = motor.config_.direction > 0 ? k : mod(-k - 1, pole_pairs);
+        if (residual_n[k] > 0.0f)
+            config_.pole_pair_offsets[pole_pair] = residual_sum[k] / residual_n[k];
+    }
+
+    is_ready_ = true;
+    return true;
+}
+
+float Encoder::get_pole_pair_offset(uint32_t index) {
+    if (index >= (uint32_t)MAX_POLE_PAIR_OFFSETS)
+        return 0.0f;
+    return config_.pole_pair_offsets[index];
+}
+
 static bool decode_hall(uint8_t hall_state, int32_t* hall_cnt) {
     switch (hall_state) {
         case 0b001: *hall_cnt = 0; return true;
@@ -276,11 +514,19 @@ static bool decode_hall(uint8_t hall_state, int32_t* hall_cnt) {
 void Encoder::sample_now() {
     switch (config_.mode) {
         case MODE_INCREMENTAL: {
-            tim_cnt_sample_ = (int16_t)hw_config_.timer->Instance->CNT;
+            // Retry if an edge interrupt came in between, so that the edge
+            // time belongs to the count
+            uint32_t edge_time;
+            do {
+                edge_time = last_edge_time_;
+                tim_cnt_sample_ = (int16_t)hw_config_.timer->Instance->CNT;
+            } while (edge_time != last_edge_time_);
+            edge_time_sample_ = edge_time;
         } break;
 
         case MODE_HALL: {
-            // do nothing: samples already captured in general GPIO capture
+            // samples already captured in general GPIO capture, just before
+            edge_time_sample_ = last_edge_time_;
         } break;
 
         case MODE_SINCOS: {
@@ -292,9 +538,80 @@ void Encoder::sample_now() {
            set_error(ERROR_UNSUPPORTED_ENCODER_MODE);
         } break;
     }
+    sample_time_ = DWT->CYCCNT;
 }
 
-bool Encoder::update() {
+// @brief Measures the velocity from the time between encoder edges (M/T
+// method) and blends it into vel_estimate_ below config_.edge_timing_vel.
+// At a few counts per control period or less, this is far smoother than the
+// PLL, which only sees whole counts. The edge interrupts are masked at higher
+// speeds to bound their load.
+// See tools/control_simulation/EdgeTiming.py for the simulation.
+// @returns true if the edge velocity was blended in
+RAM_FUNCTION bool Encoder::update_edge_timing() {
+    if (!edge_pins_)
+        return false;
+
+    // Unmask the interrupts below 2.2 and mask them above 2.5 times edge_timing_vel
+    bool active = config_.edge_timing_vel > 0.0f
+            && fabsf(vel_estimate_) < (edge_timing_active_ ? 2.5f : 2.2f) * config_.edge_timing_vel;
+    if (active != edge_timing_active_) {
+        GPIO_set_edges_enabled(edge_pins_, active);
+        edge_timing_active_ = active;
+        edge_timing_valid_ = false;
+        edge_ref_valid_ = false;
+        edge_count_ = shadow_count_;
+        edge_time_ = edge_time_sample_;
+        return false;
+    }
+    if (!edge_timing_active_)
+        return false;
+
+    if (edge_time_sample_ != edge_time_) {
+        // The interrupt of an edge may come a period after its count
+        int32_t delta = shadow_count_ - edge_count_;
+        int32_t dir = (delta > 0) - (delta < 0);
+        edge_count_ = shadow_count_;
+        edge_time_ = edge_time_sample_;
+        edge_timing_valid_ = true;
+        if (edge_ref_valid_ && dir == edge_dir_) {
+            float window = (float)(int32_t)(edge_time_ - edge_ref_time_) / (float)SystemCoreClock;
+            if (window >= config_.edge_timing_window) {
+                vel_edge_ = (float)(shadow_count_ - edge_ref_count_) / window;
+                edge_ref_count_ = shadow_count_;
+                edge_ref_time_ = edge_time_;
+            }
+        } else {
+            // First edge after a stop or a reversal
+            vel_edge_ = 0.0f;
+            edge_ref_valid_ = dir != 0;
+            edge_ref_count_ = shadow_count_;
+            edge_ref_time_ = edge_time_;
+        }
+        edge_dir_ = dir;
+    } else if (shadow_count_ - edge_count_ > 1 || shadow_count_ - edge_count_ < -1) {
+        // Counts without edge timestamps: the interrupts don't work
+        edge_timing_valid_ = false;
+        edge_ref_valid_ = false;
+    }
+    if (!edge_timing_valid_)
+        return false;
+
+    // No edge since then means the velocity is lower
+    float since = (float)(int32_t)(sample_time_ - edge_time_) / (float)SystemCoreClock;
+    if (since > config_.edge_timing_timeout) {
+        vel_edge_ = 0.0f;
+        edge_ref_valid_ = false;
+    } else if (fabsf(vel_edge_) * since > 1.0f) {
+        vel_edge_ = (float)edge_dir_ / since;
+    }
+
+    float weight = std::min(std::max(2.0f - fabsf(vel_estimate_) / config_.edge_timing_vel, 0.0f), 1.0f);
+    vel_estimate_ += weight * (vel_edge_ - vel_estimate_);
+    return true;
+}
+
+RAM_FUNCTION bool Encoder::update() {
     // update internal encoder state.
     int32_t delta_enc = 0;
     switch (config_.mode) {
@@ -341,21 +658,23 @@ bool Encoder::update() {
     count_in_cpr_ += delta_enc;
     count_in_cpr_ = mod(count_in_cpr_, config_.cpr);
 
-    //// run pll (for now pll is in units of encoder counts)
+    //// run pll or kalman filter (in units of encoder counts)
     // Predict current pos
-    pos_estimate_ += current_meas_period * vel_estimate_;
-    pos_cpr_      += current_meas_period * vel_estimate_;
+    float delta_pred = estimator_.predict(&vel_estimate_, axis_->get_estimator_accel(false));
+    pos_estimate_ += delta_pred;
+    pos_cpr_      += delta_pred;
     // discrete phase detector
     float delta_pos     = (float)(shadow_count_ - (int32_t)floorf(pos_estimate_));
     float delta_pos_cpr = (float)(count_in_cpr_ - (int32_t)floorf(pos_cpr_));
     delta_pos_cpr = wrap_pm(delta_pos_cpr, 0.5f * (float)(config_.cpr));
-    // pll feedback
-    pos_estimate_ += current_meas_period * pll_kp_ * delta_pos;
-    pos_cpr_      += current_meas_period * pll_kp_ * delta_pos_cpr;
+    // feedback
+    pos_estimate_ += estimator_.pos_gain_ * delta_pos;
+    pos_cpr_      += estimator_.correct(&vel_estimate_, delta_pos_cpr);
     pos_cpr_ = fmodf_pos(pos_cpr_, (float)(config_.cpr));
-    vel_estimate_      += current_meas_period * pll_ki_ * delta_pos_cpr;
     bool snap_to_zero_vel = false;
-    if (fabsf(vel_estimate_) < 0.5f * current_meas_period * pll_ki_) {
+    if (update_edge_timing()) {
+        snap_to_zero_vel = vel_estimate_ == 0.0f;
+    } else if (fabsf(vel_estimate_) < 0.5f * estimator_.vel_gain_) {
         vel_estimate_ = 0.0f; //align delta-sigma on zero to prevent jitter
         snap_to_zero_vel = true;
     }
@@ -383,6 +702,11 @@ bool Encoder::update() {
     //TODO avoid recomputing elec_rad_per_enc every time
     float elec_rad_per_enc = axis_->motor_.config_.pole_pairs * 2 * M_PI * (1.0f / (float)(config_.cpr));
     float ph = elec_rad_per_enc * (interpolated_enc - config_.offset_float);
+    int32_t pole_pairs = axis_->motor_.config_.pole_pairs;
+    if (config_.use_pole_pair_offsets && pole_pairs > 0 && pole_pairs <= MAX_POLE_PAIR_OFFSETS) {
+        int32_t pole_pair = mod(corrected_enc, config_.cpr) * pole_pairs / config_.cpr;
+        ph -= elec_rad_per_enc * config_.pole_pair_offsets[pole_pair];
+    }
     // ph = fmodf(ph, 2*M_PI);
     phase_ = wrap_pm_pi(ph);
 
@@ -15,6 +15,7 @@ public:
         ERROR_UNSUPPORTED_ENCODER_MODE = 0x08,
         ERROR_ILLEGAL_HALL_STATE = 0x10,
         ERROR_INDEX_NOT_FOUND_YET = 0x20,
+        ERROR_EDGE_TIMING_CONFLICT = 0x40,
     };
 
     enum Mode_t {
@@ -23,6 +24,8 @@ public:
         MODE_SINCOS
     };
 
+    static constexpr int MAX_POLE_PAIR_OFFSETS = 24;
+
     struct Config_t {
         Encoder::Mode_t mode = Encoder::MODE_INCREMENTAL;
         bool use_index = false;
@@ -39,7 +42,18 @@ public:
         float calib_range = 0.02f; // Accuracy required to pass encoder cpr check
         float calib_scan_distance = 16.0f * M_PI; // rad electrical
         float calib_scan_omega = 4.0f * M_PI; // rad/s electrical
-        float bandwidth = 1000.0f;
+        bool calib_current_control = false; // Scan with calibration_current instead of a voltage (high current motors only)
+        float calib_current_scan_omega = 16.0f * M_PI; // rad/s electrical, scan velocity with calib_current_control
+        float calib_lock_vel_tolerance = 1.0f; // [rad/s electrical] rotor counts as settled below this velocity
+        float calib_lock_settle_time = 0.05f; // [s] the initial lock ends after the rotor stayed settled this long
+        bool use_pole_pair_offsets = false; // Fit (with calib_current_control) and apply an offset per pole pair
+        float pole_pair_offsets[MAX_POLE_PAIR_OFFSETS] = {0}; // [count] relative to offset, one per electrical revolution
+        float bandwidth = 1000.0f;  // [rad/s] of the PLL
+        PosVelEstimator::Config_t estimator; // PLL or Kalman filter, in [count]
+        bool enable_edge_timing = false; // Timestamp the edges for the velocity at low speed (incremental and hall mode, takes effect after reboot)
+        float edge_timing_vel = 2000.0f; // [count/s] below this the edge velocity replaces the estimate, faded out up to twice this
+        float edge_timing_window = 0.001f; // [s] shortest time between the edges of a velocity measurement
+        float edge_timing_timeout = 0.1f; // [s] the velocity is zero after this long without edges
         bool find_idx_on_lockin_only = false; // Only be sensitive during lockin scan constant vel state
         bool idx_search_unidirectional = false; // Only allow index search in known direction
         bool ignore_illegal_hall_state = false; // dont error on bad states like 000 or 111
@@ -54,8 +68,9 @@ public:
 
     void enc_index_cb();
     void set_idx_subscribe(bool override_enable = false);
-    void update_pll_gains();
+    void update_estimator_gains();
     void check_pre_calibrated();
+    bool is_referenced();
 
     void set_linear_count(int32_t count);
     void set_circular_count(int32_t count, bool update_offset);
@@ -64,7 +79,11 @@ public:
     bool run_index_search();
     bool run_direction_find();
     bool run_offset_calibration();
+    bool run_current_offset_calibration();
+    float get_pole_pair_offset(uint32_t index);
+    void enc_edge_cb();
     void sample_now();
+    bool update_edge_timing();
     bool update();
 
 
@@ -83,8 +102,7 @@ public:
     float pos_estimate_ = 0.0f;  // [count]
     float pos_cpr_ = 0.0f;  // [count]
     float vel_estimate_ = 0.0f;  // [count/s]
-    float pll_kp_ = 0.0f;   // [count/s / count]
-    float pll_ki_ = 0.0f;   // [(count/s^2) / count]
+    PosVelEstimator estimator_;
     float calib_scan_response_ = 0.0f; // debug report from offset calib
 
     int16_t tim_cnt_sample_ = 0; // 
@@ -93,6 +111,21 @@ public:
     float sincos_sample_s_ = 0.0f;
     float sincos_sample_c_ = 0.0f;
 
+    // Edge timing, times in [cycles] of DWT->CYCCNT
+    uint16_t edge_pins_ = 0; // EXTI lines subscribed by setup(), none if disabled
+    volatile uint32_t last_edge_time_ = 0; // written by the edge interrupt
+    uint32_t edge_time_sample_ = 0; // last_edge_time_ latched by sample_now()
+    uint32_t sample_time_ = 0;
+    bool edge_timing_active_ = false; // interrupts unmasked
+    bool edge_timing_valid_ = false;
+    bool edge_ref_valid_ = false;
+    int32_t edge_count_ = 0; // shadow_count_ at edge_time_
+    uint32_t edge_time_ = 0;
+    int32_t edge_ref_count_ = 0; // start of the measurement window
+    uint32_t edge_ref_time_ = 0;
+    int32_t edge_dir_ = 0;
+    float vel_edge_ = 0.0f; // [count/s]
+
     // Communication protocol definitions
     auto make_protocol_definitions() {
         return make_protocol_member_list(
@@ -108,8 +141,8 @@ public:
             make_protocol_ro_property("hall_state", &hall_state_),
             make_protocol_property("vel_estimate", &vel_estimate_),
             make_protocol_ro_property("calib_scan_response", &calib_scan_response_),
-            // make_protocol_property("pll_kp", &pll_kp_),
-            // make_protocol_property("pll_ki", &pll_ki_),
+            make_protocol_ro_property("accel_disturbance", &estimator_.disturbance_),
+            make_protocol_ro_property("vel_edge", &vel_edge_),
             make_protocol_object("config",
                 make_protocol_property("mode", &config_.mode),
                 make_protocol_property("use_index", &config_.use_index,
@@ -124,14 +157,26 @@ public:
                 make_protocol_property("offset_float", &config_.offset_float),
                 make_protocol_property("enable_phase_interpolation", &config_.enable_phase_interpolation),
                 make_protocol_property("bandwidth", &config_.bandwidth,
-                    [](void* ctx) { static_cast<Encoder*>(ctx)->update_pll_gains(); }, this),
+                    [](void* ctx) { static_cast<Encoder*>(ctx)->update_estimator_gains(); }, this),
+                make_protocol_object("estimator", PosVelEstimator::make_config_definitions(config_.estimator,
+                    [](void* ctx) { static_cast<Encoder*>(ctx)->update_estimator_gains(); }, this)),
+                make_protocol_property("enable_edge_timing", &config_.enable_edge_timing),
+                make_protocol_property("edge_timing_vel", &config_.edge_timing_vel),
+                make_protocol_property("edge_timing_window", &config_.edge_timing_window),
+                make_protocol_property("edge_timing_timeout", &config_.edge_timing_timeout),
                 make_protocol_property("calib_range", &config_.calib_range),
                 make_protocol_property("calib_scan_distance", &config_.calib_scan_distance),
                 make_protocol_property("calib_scan_omega", &config_.calib_scan_omega),
+                make_protocol_property("calib_current_control", &config_.calib_current_control),
+                make_protocol_property("calib_current_scan_omega", &config_.calib_current_scan_omega),
+                make_protocol_property("calib_lock_vel_tolerance", &config_.calib_lock_vel_tolerance),
+                make_protocol_property("calib_lock_settle_time", &config_.calib_lock_settle_time),
+                make_protocol_property("use_pole_pair_offsets", &config_.use_pole_pair_offsets),
                 make_protocol_property("idx_search_unidirectional", &config_.idx_search_unidirectional),
                 make_protocol_property("ignore_illegal_hall_state", &config_.ignore_illegal_hall_state)
             ),
-            make_protocol_function("set_linear_count", *this, &Encoder::set_linear_count, "count")
+            make_protocol_function("set_linear_count", *this, &Encoder::set_linear_count, "count"),
+            make_protocol_function("get_pole_pair_offset", *this, &Encoder::get_pole_pair_offset, "index")
         );
     }
 };
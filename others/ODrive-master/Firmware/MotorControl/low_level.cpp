@@ -36,9 +36,22 @@ const float adc_ref_voltage = 3.3f;
 // Arbitrary non-zero inital value to avoid division by zero if ADC reading is late
 float vbus_voltage = 12.0f;
 bool brake_resistor_armed = false;
+
+// PWM timing, set up by configure_pwm_timing()
+uint16_t tim_1_8_period_clocks = TIM_1_8_PERIOD_CLOCKS;
+uint8_t tim_1_8_rcr = TIM_1_8_RCR;
+bool pwm_double_update = false;
+float current_meas_period = CURRENT_MEAS_PERIOD;
+int current_meas_hz = CURRENT_MEAS_HZ;
 /* Private constant data -----------------------------------------------------*/
 static const GPIO_TypeDef* GPIOs_to_samp[] = { GPIOA, GPIOB, GPIOC };
 static const int num_GPIO = sizeof(GPIOs_to_samp) / sizeof(GPIOs_to_samp[0]); 
+// Supported range of the PWM period
+static const uint16_t min_tim_1_8_period_clocks = 1400;  // 60kHz PWM
+static const uint16_t max_tim_1_8_period_clocks = 10500; // 8kHz PWM, keeps one current measurement period below 2^16 clocks
+// Minimum on-time of the low side before a current sample, and of the high side before a DC calibration sample.
+// This covers the dead time and the settling of the shunt amplifiers. Only violated in over-modulation.
+static const uint16_t meas_window_clocks = TIM_1_8_DEADTIME_CLOCKS + (uint16_t)(0.5e-6f * TIM_1_8_CLOCK_HZ);
 /* Private variables ---------------------------------------------------------*/
 
 // Two motors, sampling port A,B,C (coherent with current meas timing)
@@ -122,7 +135,7 @@ bool safety_critical_disarm_motor_pwm(Motor& motor) {
 // If this is called at a rate higher than the motor's timer period,
 // the actual PMW timings on the pins can be undefined for up to one
 // timer period.
-void safety_critical_apply_motor_pwm_timings(Motor& motor, uint16_t timings[3]) {
+RAM_FUNCTION void safety_critical_apply_motor_pwm_timings(Motor& motor, uint16_t timings[3]) {
     uint32_t mask = cpu_enter_critical();
     if (!brake_resistor_armed) {
         motor.armed_state_ = Motor::ARMED_STATE_DISARMED;
@@ -131,6 +144,9 @@ void safety_critical_apply_motor_pwm_timings(Motor& motor, uint16_t timings[3])
     motor.hw_config_.timer->Instance->CCR1 = timings[0];
     motor.hw_config_.timer->Instance->CCR2 = timings[1];
     motor.hw_config_.timer->Instance->CCR3 = timings[2];
+    motor.applied_timings_[0] = timings[0];
+    motor.applied_timings_[1] = timings[1];
+    motor.applied_timings_[2] = timings[2];
 
     if (motor.armed_state_ == Motor::ARMED_STATE_WAITING_FOR_TIMINGS) {
         // timings were just loaded into the timer registers
@@ -178,7 +194,7 @@ void safety_critical_disarm_brake_resistor() {
 
 // @brief Updates the brake resistor PWM timings unless
 // the brake resistor is disarmed.
-void safety_critical_apply_brake_resistor_timings(uint32_t low_off, uint32_t high_on) {
+RAM_FUNCTION void safety_critical_apply_brake_resistor_timings(uint32_t low_off, uint32_t high_on) {
     if (high_on - low_off < TIM_APB1_DEADTIME_CLOCKS)
         low_level_fault(Motor::ERROR_BRAKE_DEADTIME_VIOLATION);
     uint32_t mask = cpu_enter_critical();
@@ -196,6 +212,34 @@ void safety_critical_apply_brake_resistor_timings(uint32_t low_off, uint32_t hig
 
 /* Function implementations --------------------------------------------------*/
 
+// @brief Derives the PWM timer period and the current measurement period
+// from the requested PWM frequency. Unsupported frequencies fall back to the default.
+// @returns The PWM frequency in effect [Hz], which the caller should report
+// in place of the requested one.
+//
+// In double update mode, the repetition counter is cleared so that the timers
+// generate an update event (and thereby an ADC trigger) at both counter extremes.
+// The low-side shunts only see the phase currents in the valley (SVM vector 0),
+// so the current is still measured once per PWM period, but the timings computed
+// from it can be latched at the following peak (see pwm_trig_adc_cb).
+// This must run before the axis objects are constructed, since they derive
+// their gains and timeouts from current_meas_period. The timers pick up
+// the new period in start_adc_pwm().
+float configure_pwm_timing(float pwm_frequency, bool double_update) {
+    // Rounded, so that the returned frequency maps back to the same period
+    float period_clocks = roundf((float)TIM_1_8_CLOCK_HZ / (2.0f * pwm_frequency));
+    if (!(period_clocks >= (float)min_tim_1_8_period_clocks && period_clocks <= (float)max_tim_1_8_period_clocks))
+        period_clocks = (float)TIM_1_8_PERIOD_CLOCKS; // Funny polarity to also catch NaN
+    tim_1_8_period_clocks = (uint16_t)period_clocks;
+    pwm_double_update = double_update;
+    tim_1_8_rcr = double_update ? 0 : TIM_1_8_RCR;
+
+    uint32_t current_meas_period_clocks = 2 * (uint32_t)tim_1_8_period_clocks * (tim_1_8_rcr + 1);
+    current_meas_period = (float)current_meas_period_clocks / (float)TIM_1_8_CLOCK_HZ;
+    current_meas_hz = (int)((float)TIM_1_8_CLOCK_HZ / (float)current_meas_period_clocks);
+    return (float)TIM_1_8_CLOCK_HZ / (float)(2 * tim_1_8_period_clocks);
+}
+
 void start_adc_pwm() {
     // Enable ADC and interrupts
     __HAL_ADC_ENABLE(&hadc1);
@@ -213,10 +257,26 @@ void start_adc_pwm() {
     __HAL_DBGMCU_FREEZE_TIM1();
     __HAL_DBGMCU_FREEZE_TIM8();
 
+    // Apply the PWM period from configure_pwm_timing(). The timers are initialized
+    // with the compile time default and not running yet, and ARR is not buffered.
+    __HAL_TIM_SET_AUTORELOAD(&htim1, tim_1_8_period_clocks);
+    __HAL_TIM_SET_AUTORELOAD(&htim8, tim_1_8_period_clocks);
+    // RCR is buffered, so force an update event to load it. This also resets
+    // the counters, which sync_timers sets up again anyway.
+    htim1.Instance->RCR = tim_1_8_rcr;
+    htim8.Instance->RCR = tim_1_8_rcr;
+    htim1.Instance->EGR = TIM_EGR_UG;
+    htim8.Instance->EGR = TIM_EGR_UG;
+    __HAL_TIM_CLEAR_IT(&htim1, TIM_IT_UPDATE);
+    __HAL_TIM_CLEAR_IT(&htim8, TIM_IT_UPDATE);
+    // The timebase wraps once per current measurement period
+    __HAL_TIM_SET_AUTORELOAD(&htim13, (uint32_t)((2 * (uint32_t)tim_1_8_period_clocks * (tim_1_8_rcr+1))
+            * ((float)TIM_APB1_CLOCK_HZ / (float)TIM_1_8_CLOCK_HZ)) - 1);
+
     start_pwm(&htim1);
     start_pwm(&htim8);
     // TODO: explain why this offset
-    sync_timers(&htim1, &htim8, TIM_CLOCKSOURCE_ITR0, TIM_1_8_PERIOD_CLOCKS / 2 - 1 * 128,
+    sync_timers(&htim1, &htim8, TIM_CLOCKSOURCE_ITR0, tim_1_8_period_clocks / 2 - 1 * 128,
             &htim13);
 
     // Motor output starts in the disabled state
@@ -242,7 +302,7 @@ void start_adc_pwm() {
 
 void start_pwm(TIM_HandleTypeDef* htim) {
     // Init PWM
-    int half_load = TIM_1_8_PERIOD_CLOCKS / 2;
+    int half_load = tim_1_8_period_clocks / 2;
     htim->Instance->CCR1 = half_load;
     htim->Instance->CCR2 = half_load;
     htim->Instance->CCR3 = half_load;
@@ -433,7 +493,7 @@ void vbus_sense_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
     }
 }
 
-static void decode_hall_samples(Encoder& enc, uint16_t GPIO_samples[num_GPIO]) {
+RAM_FUNCTION static void decode_hall_samples(Encoder& enc, uint16_t GPIO_samples[num_GPIO]) {
     GPIO_TypeDef* hall_ports[] = {
         enc.hw_config_.hallC_port,
         enc.hw_config_.hallB_port,
@@ -462,12 +522,24 @@ static void decode_hall_samples(Encoder& enc, uint16_t GPIO_samples[num_GPIO]) {
     enc.hall_state_ = hall_state;
 }
 
+// Current sense offset calibration of one phase: a cumulative average until it
+// has as many samples as the filter length, then a first order low pass.
+// This way, the offset settles within a few milliseconds after startup.
+// The variance of the samples is tracked alongside for Motor::get_DC_calib_uncertainty().
+static inline void update_DC_calib(float current, float filter_k, float* offset, float* variance, uint32_t* n) {
+    float k = 1.0f / (float)(*n + 1);
+    if (k > filter_k)
+        ++*n;
+    else
+        k = filter_k;
+    float err = current - *offset;
+    *offset += err * k;
+    *variance += (err * (current - *offset) - *variance) * k;
+}
+
 // This is the callback from the ADC that we expect after the PWM has triggered an ADC conversion.
 // TODO: Document how the phasing is done, link to timing diagram
-void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
-#define calib_tau 0.2f  //@TOTO make more easily configurable
-    static const float calib_filter_k = CURRENT_MEAS_PERIOD / calib_tau;
-
+RAM_FUNCTION void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
     // Ensure ADCs are expected ones to simplify the logic below
     if (!(hadc == &hadc2 || hadc == &hadc3)) {
         low_level_fault(Motor::ERROR_ADC_FAILED);
@@ -484,6 +556,17 @@ void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
     bool counting_down = axis.motor_.hw_config_.timer->Instance->CR1 & TIM_CR1_DIR;
     bool current_meas_not_DC_CAL = !counting_down;
 
+    // Every update event of the timer triggers this callback. The timings that
+    // were in effect before the sample were latched at the previous one, the
+    // ones applied since are latched now.
+    uint16_t phB_timing = axis.motor_.latched_timings_[1];
+    uint16_t phC_timing = axis.motor_.latched_timings_[2];
+    if (hadc == &hadc3) {
+        axis.motor_.latched_timings_[0] = axis.motor_.applied_timings_[0];
+        axis.motor_.latched_timings_[1] = axis.motor_.applied_timings_[1];
+        axis.motor_.latched_timings_[2] = axis.motor_.applied_timings_[2];
+    }
+
     // Check the timing of the sequencing
     if (current_meas_not_DC_CAL)
         axis.motor_.log_timing(Motor::TIMING_LOG_ADC_CB_I);
@@ -491,28 +574,46 @@ void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
         axis.motor_.log_timing(Motor::TIMING_LOG_ADC_CB_DC);
 
     bool update_timings = false;
+    bool update_timings_early = false;
     if (hadc == &hadc2) {
         if (&axis == axes[1] && counting_down)
             update_timings = true; // update timings of M0
         else if (&axis == axes[0] && !counting_down)
             update_timings = true; // update timings of M1
+        else if (pwm_double_update)
+            // In double update mode, the events in between give each motor the chance
+            // to have its timings latched at the counter peak right after its current
+            // measurement, if the control loop already finished by then.
+            update_timings_early = true;
     }
 
     // Load next timings for the motor that we're not currently sampling
-    if (update_timings) {
-        if (!other_axis.motor_.next_timings_valid_) {
+    if (update_timings_early) {
+        if (other_axis.motor_.next_timings_valid_) {
+            other_axis.motor_.next_timings_valid_ = false;
+            other_axis.motor_.timings_latched_early_ = true;
+            other_axis.motor_.last_timings_latched_early_ = true;
+            safety_critical_apply_motor_pwm_timings(
+                other_axis.motor_, other_axis.motor_.next_timings_
+            );
+            update_brake_current();
+        }
+    } else if (update_timings) {
+        if (other_axis.motor_.next_timings_valid_) {
+            other_axis.motor_.next_timings_valid_ = false;
+            other_axis.motor_.last_timings_latched_early_ = false;
+            safety_critical_apply_motor_pwm_timings(
+                other_axis.motor_, other_axis.motor_.next_timings_
+            );
+        } else if (!other_axis.motor_.timings_latched_early_) {
             // the motor control loop failed to update the timings in time
             // we must assume that it died and therefore float all phases
             bool was_armed = safety_critical_disarm_motor_pwm(other_axis.motor_);
             if (was_armed) {
                 other_axis.motor_.error_ |= Motor::ERROR_CONTROL_DEADLINE_MISSED;
             }
-        } else {
-            other_axis.motor_.next_timings_valid_ = false;
-            safety_critical_apply_motor_pwm_timings(
-                other_axis.motor_, other_axis.motor_.next_timings_
-            );
         }
+        other_axis.motor_.timings_latched_early_ = false;
         update_brake_current();
     }
 
@@ -531,29 +632,61 @@ void pwm_trig_adc_cb(ADC_HandleTypeDef* hadc, bool injected) {
         // Therefore we store the value from ADC2 and signal the thread that the
         // measurement is ready when we receive the ADC3 measurement
 
+        // Samples are only valid if the low side of the phase was on for long
+        // enough before the counter bottom, which isn't the case in over-modulation.
+        // Motor::FOC_current() reconstructs the others.
+
         // return or continue
         if (hadc == &hadc2) {
-            axis.motor_.current_meas_.phB = current - axis.motor_.DC_calib_.phB;
+            axis.motor_.phB_meas_valid_ = phB_timing >= meas_window_clocks;
+            if (axis.motor_.phB_meas_valid_)
+                axis.motor_.current_meas_.phB = current - axis.motor_.DC_calib_.phB;
             return;
         } else {
-            axis.motor_.current_meas_.phC = current - axis.motor_.DC_calib_.phC;
+            axis.motor_.phC_meas_valid_ = phC_timing >= meas_window_clocks;
+            if (axis.motor_.phC_meas_valid_)
+                axis.motor_.current_meas_.phC = current - axis.motor_.DC_calib_.phC;
         }
         // Prepare hall readings
         // TODO move this to inside encoder update function
         decode_hall_samples(axis.encoder_, GPIO_port_samples[axis_num]);
+        // Run the inner loop right here if the axis thread handed it over
+        axis.run_isr_current_loop();
         // Trigger axis thread
         axis.signal_current_meas();
     } else {
         // DC_CAL measurement
+        float calib_filter_k = current_meas_period / axis.motor_.config_.dc_calib_tau;
+        // In double update mode, this event also latches timings and runs once per
+        // PWM period, so only every (TIM_1_8_RCR+1)-th sample is used. This keeps
+        // the calibration at the same rate and cost as in single update mode.
+        if (pwm_double_update) {
+            if (hadc == &hadc2 && ++axis.motor_.DC_calib_skip_ > TIM_1_8_RCR)
+                axis.motor_.DC_calib_skip_ = 0;
+            if (axis.motor_.DC_calib_skip_ != 0)
+                return;
+            calib_filter_k *= (float)(TIM_1_8_RCR + 1);
+        }
+        // A dc_calib_tau of zero, negative, NaN or below the sample period
+        // would make the filter diverge, and at k = 1 the variance estimate
+        // reads 0. The time constant is kept at two samples at least.
+        if (!(calib_filter_k > 0.0f && calib_filter_k <= 0.5f))
+            calib_filter_k = 0.5f;
+        // Likewise, the offset is only measured if the high side was on before the counter peak
+        uint16_t max_timing = tim_1_8_period_clocks - meas_window_clocks;
         if (hadc == &hadc2) {
-            axis.motor_.DC_calib_.phB += (current - axis.motor_.DC_calib_.phB) * calib_filter_k;
+            if (phB_timing <= max_timing)
+                update_DC_calib(current, calib_filter_k, &axis.motor_.DC_calib_.phB,
+                        &axis.motor_.DC_calib_var_.phB, &axis.motor_.DC_calib_n_phB_);
         } else {
-            axis.motor_.DC_calib_.phC += (current - axis.motor_.DC_calib_.phC) * calib_filter_k;
+            if (phC_timing <= max_timing)
+                update_DC_calib(current, calib_filter_k, &axis.motor_.DC_calib_.phC,
+                        &axis.motor_.DC_calib_var_.phC, &axis.motor_.DC_calib_n_phC_);
         }
     }
 }
 
-void tim_update_cb(TIM_HandleTypeDef* htim) {
+RAM_FUNCTION void tim_update_cb(TIM_HandleTypeDef* htim) {
     
     // If the corresponding timer is counting up, we just sampled in SVM vector 0, i.e. real current
     // If we are counting down, we just sampled in SVM vector 7, with zero current
@@ -574,16 +707,43 @@ void tim_update_cb(TIM_HandleTypeDef* htim) {
         return;
     }
 
-    axis->encoder_.sample_now();
-
     for (int i = 0; i < num_GPIO; ++i) {
         GPIO_port_samples[sample_ch][i] = GPIOs_to_samp[i]->IDR;
     }
+
+    // After the GPIO samples, so that the latched hall edge time is never
+    // older than the sampled hall state
+    axis->encoder_.sample_now();
+}
+
+// @brief Returns the time since the start of the current measurement period
+// in TIM_1_8 clock cycles, based on htim13 which is synchronised to the PWM timers.
+RAM_FUNCTION uint16_t get_timing_clocks() {
+    static const uint16_t clocks_per_cnt = (uint16_t)((float)TIM_1_8_CLOCK_HZ / (float)TIM_APB1_CLOCK_HZ);
+    return clocks_per_cnt * htim13.Instance->CNT;
+}
+
+// @brief Returns the time since the given get_timing_clocks() timestamp
+// in TIM_1_8 clock cycles. Intervals longer than one current measurement
+// period are not representable and wrap around.
+RAM_FUNCTION uint16_t get_timing_clocks_since(uint16_t start) {
+    static const uint16_t clocks_per_cnt = (uint16_t)((float)TIM_1_8_CLOCK_HZ / (float)TIM_APB1_CLOCK_HZ);
+    uint16_t now = get_timing_clocks();
+    if (now >= start)
+        return now - start;
+    return now + clocks_per_cnt * (htim13.Instance->ARR + 1) - start;
+}
+
+// @brief Starts the free running CPU cycle counter DWT->CYCCNT, which
+// timestamps events to one core clock and wraps around every 2^32 cycles.
+void start_cycle_counter() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 }
 
 // @brief Sums up the Ibus contribution of each motor and updates the
 // brake resistor PWM accordingly.
-void update_brake_current() {
+RAM_FUNCTION void update_brake_current() {
     float Ibus_sum = 0.0f;
     for (size_t i = 0; i < AXIS_COUNT; ++i) {
         if (axes[i]->motor_.armed_state_ == Motor::ARMED_STATE_ARMED) {
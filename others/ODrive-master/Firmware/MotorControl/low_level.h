@@ -24,6 +24,9 @@ extern const float adc_ref_voltage;
 extern float vbus_voltage;
 extern bool brake_resistor_armed;
 extern uint16_t adc_measurements_[ADC_CHANNEL_COUNT];
+extern uint16_t tim_1_8_period_clocks;
+extern uint8_t tim_1_8_rcr;
+extern bool pwm_double_update;
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions --------------------------------------------------------*/
 
@@ -43,6 +46,7 @@ void pwm_in_cb(int channel, uint32_t timestamp);
 }
 
 // Initalisation
+float configure_pwm_timing(float pwm_frequency, bool double_update);
 void start_adc_pwm();
 void start_pwm(TIM_HandleTypeDef* htim);
 void sync_timers(TIM_HandleTypeDef* htim_a, TIM_HandleTypeDef* htim_b,
@@ -55,6 +59,11 @@ void start_analog_thread();
 
 void update_brake_current();
 
+// Control period timebase
+uint16_t get_timing_clocks();
+uint16_t get_timing_clocks_since(uint16_t start);
+void start_cycle_counter();
+
 inline uint32_t cpu_enter_critical() {
     uint32_t primask = __get_PRIMASK();
     __disable_irq();
@@ -15,6 +15,8 @@ Controller::Config_t controller_configs[AXIS_COUNT];
 Motor::Config_t motor_configs[AXIS_COUNT];
 Axis::Config_t axis_configs[AXIS_COUNT];
 TrapezoidalTrajectory::Config_t trap_configs[AXIS_COUNT];
+SCurveTrajectory::Config_t scurve_configs[AXIS_COUNT];
+PvtTrajectory::Config_t pvt_configs[AXIS_COUNT];
 bool user_config_loaded_;
 
 SystemStats_t system_stats_ = { 0 };
@@ -28,17 +30,37 @@ typedef Config<
     Controller::Config_t[AXIS_COUNT],
     Motor::Config_t[AXIS_COUNT],
     TrapezoidalTrajectory::Config_t[AXIS_COUNT],
-    Axis::Config_t[AXIS_COUNT]> ConfigFormat;
+    Axis::Config_t[AXIS_COUNT],
+    SCurveTrajectory::Config_t[AXIS_COUNT],
+    PvtTrajectory::Config_t[AXIS_COUNT]> ConfigFormat;
+
+// Names of the calibration tables that are stored as blobs behind the config structs.
+// The encoder linearisation (encoder.config.pole_pair_offsets) is a small fixed-size
+// array and stays in Encoder::Config_t, so it isn't a blob.
+static const char* anticogging_blob_names[] = { "axis0.cogging", "axis1.cogging" };
+static_assert(sizeof(anticogging_blob_names) / sizeof(anticogging_blob_names[0]) == AXIS_COUNT,
+              "one blob name per axis required");
 
 void save_configuration(void) {
-    if (ConfigFormat::safe_store_config(
+    ConfigBlob blobs[AXIS_COUNT];
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        Controller& controller = axes[i]->controller_;
+        blobs[i] = {
+            .name = anticogging_blob_names[i],
+            .data = &controller.anticogging_.model,
+            .length = controller.get_anticogging_model_size(),
+        };
+    }
+    if (ConfigFormat::safe_store_config(blobs, AXIS_COUNT,
             &board_config,
             &encoder_configs,
             &sensorless_configs,
             &controller_configs,
             &motor_configs,
             &trap_configs,
-            &axis_configs)) {
+            &axis_configs,
+            &scurve_configs,
+            &pvt_configs)) {
         //printf("saving configuration failed\r\n"); osDelay(5);
     } else {
         user_config_loaded_ = true;
@@ -55,7 +77,9 @@ extern "C" int load_configuration(void) {
                 &controller_configs,
                 &motor_configs,
                 &trap_configs,
-                &axis_configs)) {
+                &axis_configs,
+                &scurve_configs,
+                &pvt_configs)) {
         //If loading failed, restore defaults
         board_config = BoardConfig_t();
         for (size_t i = 0; i < AXIS_COUNT; ++i) {
@@ -65,6 +89,8 @@ extern "C" int load_configuration(void) {
             motor_configs[i] = Motor::Config_t();
             trap_configs[i] = TrapezoidalTrajectory::Config_t();
             axis_configs[i] = Axis::Config_t();
+            scurve_configs[i] = SCurveTrajectory::Config_t();
+            pvt_configs[i] = PvtTrajectory::Config_t();
             // Default step/dir pins are different, so we need to explicitly load them
             Axis::load_default_step_dir_pin_config(hw_configs[i].axis_config, &axis_configs[i]);
         }
@@ -74,6 +100,58 @@ extern "C" int load_configuration(void) {
     return user_config_loaded_;
 }
 
+// @brief Loads the calibration tables of an axis that were stored by save_configuration().
+// This is called by the axis thread after boot, so the tables don't delay load_configuration().
+void load_calibration_tables(Axis& axis) {
+    if (!user_config_loaded_)
+        return;
+    Controller::CoggingModel_t model;
+    size_t length;
+    if (!ConfigFormat::load_blob(anticogging_blob_names[axis.axis_num_], &model, sizeof(model), &length))
+        axis.controller_.set_anticogging_model(model, length);
+}
+
+// @brief Plans a coordinated move of all axes without starting it, see start_coordinated_move().
+// Each axis is planned with its own limits first, then every move is slowed down
+// to the duration of the slowest one, or to min_duration if that is longer.
+// Passing the longest duration reported by several boards as min_duration
+// gives the axes of all boards the same time base.
+// @returns the common duration [s], or a negative value if any axis could not be planned
+float plan_coordinated_move(const float goal_points[AXIS_COUNT], float min_duration) {
+    float durations[AXIS_COUNT];
+    float duration = min_duration;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        durations[i] = axes[i]->controller_.arm_move(goal_points[i], 1.0f);
+        if (durations[i] < 0.0f)
+            duration = -1.0f;
+        else if (duration >= 0.0f)
+            duration = std::max(duration, durations[i]);
+    }
+    if (duration < 0.0f) {
+        for (size_t i = 0; i < AXIS_COUNT; ++i)
+            axes[i]->controller_.traj_armed_ = false;
+        return -1.0f;
+    }
+
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        // Zero-length moves can't be stretched and don't need to be
+        if (durations[i] > 0.0f && durations[i] < duration)
+            axes[i]->controller_.arm_move(goal_points[i], duration / durations[i]);
+    }
+    return duration;
+}
+
+// @brief Starts the moves planned by plan_coordinated_move() on all axes.
+// The loop counters are sampled together so that every axis evaluates its
+// trajectory at t = 0 on its next control loop iteration.
+// This is also called from the CAN receive interrupt on a sync message.
+void start_coordinated_move(void) {
+    uint32_t mask = cpu_enter_critical();
+    for (size_t i = 0; i < AXIS_COUNT; ++i)
+        axes[i]->controller_.start_armed_move(axes[i]->loop_counter_);
+    cpu_exit_critical(mask);
+}
+
 void erase_configuration(void) {
     NVM_erase();
 }
@@ -159,6 +237,20 @@ int odrive_main(void) {
     HAL_GPIO_Init(GPIO_5_GPIO_Port, &GPIO_InitStruct);
 #endif
 
+    // The PWM frequency determines the control loop timing that
+    // the objects derive their gains from, so this must come first.
+    // A rejected frequency is replaced by the one in effect.
+    // Double update runs the control loop at the full PWM frequency. The axis thread
+    // can't be relied on to keep up with that, so it is refused unless every
+    // axis runs its current loop in the interrupt.
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        if (!axis_configs[i].enable_isr_current_loop)
+            board_config.enable_pwm_double_update = false;
+    }
+    board_config.pwm_frequency = configure_pwm_timing(board_config.pwm_frequency, board_config.enable_pwm_double_update);
+
+    init_fast_math_tables();
+
     // Construct all objects.
     for (size_t i = 0; i < AXIS_COUNT; ++i) {
         Encoder *encoder = new Encoder(hw_configs[i].encoder_config,
@@ -169,8 +261,10 @@ int odrive_main(void) {
                                  hw_configs[i].gate_driver_config,
                                  motor_configs[i]);
         TrapezoidalTrajectory *trap = new TrapezoidalTrajectory(trap_configs[i]);
+        SCurveTrajectory *scurve = new SCurveTrajectory(scurve_configs[i]);
+        PvtTrajectory *pvt = new PvtTrajectory(pvt_configs[i]);
         axes[i] = new Axis(i, hw_configs[i].axis_config, axis_configs[i],
-                *encoder, *sensorless_estimator, *controller, *motor, *trap);
+                *encoder, *sensorless_estimator, *controller, *motor, *trap, *scurve, *pvt);
     }
     
     // Start ADC for temperature measurements and user measurements
@@ -198,16 +292,12 @@ int odrive_main(void) {
     // Start PWM and enable adc interrupts/callbacks
     start_adc_pwm();
 
-    // This delay serves two purposes:
-    //  - Let the current sense calibration converge (the current
-    //    sense interrupts are firing in background by now)
-    //  - Allow a user to interrupt the code, e.g. by flashing a new code,
-    //    before it does anything crazy
-    // TODO make timing a function of calibration filter tau
-    osDelay(1500);
-
-    // Start state machine threads. Each thread will go through various calibration
-    // procedures and then run the actual controller loops.
+    // Start state machine threads. Each thread first waits for the current sense
+    // calibration of its motor to converge (the current sense interrupts are
+    // firing in background by now), and for motor.config.dc_calib_min_duration
+    // to allow a user to interrupt the code, e.g. by flashing a new code,
+    // before it does anything crazy. Then it will go through various calibration
+    // procedures and run the actual controller loops.
     // TODO: generalize for AXIS_COUNT != 2
     for (size_t i = 0; i < AXIS_COUNT; ++i) {
         axes[i]->start_thread();
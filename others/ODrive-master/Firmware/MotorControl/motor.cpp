@@ -19,6 +19,7 @@ Motor::Motor(const MotorHardwareConfig_t& hw_config,
             .nCSgpioNumber = gate_driver_config_.nCS_pin,
         }) {
     update_current_controller_gains();
+    update_mtpa_table();
 }
 
 // @brief Arms the PWM outputs that belong to this motor.
@@ -43,6 +44,8 @@ bool Motor::arm() {
     if (!axis_->wait_for_current_meas())
         return axis_->error_ |= Axis::ERROR_CURRENT_MEASUREMENT_TIMEOUT, false;
     next_timings_valid_ = false;
+    timings_latched_early_ = false;
+    last_timings_latched_early_ = false;
     safety_critical_arm_motor_pwm(*this);
     return true;
 }
@@ -50,6 +53,23 @@ bool Motor::arm() {
 void Motor::reset_current_control() {
     current_control_.v_current_control_integral_d = 0.0f;
     current_control_.v_current_control_integral_q = 0.0f;
+    current_control_.Id_field_weakening = 0.0f;
+    Id_last_ = 0.0f;
+    Iq_last_ = 0.0f;
+}
+
+// @brief Standard deviation of the current sense offset estimates in DC_calib_,
+// the larger one of both phases [A].
+// While DC_calib_ is a plain average, this is the standard deviation of the
+// samples over the square root of their number. Once the low pass takes over,
+// the number of samples stays at the filter length, which is conservative.
+float Motor::get_DC_calib_uncertainty() {
+    static const uint32_t min_samples = 16; // for a meaningful variance
+    if (DC_calib_n_phB_ < min_samples || DC_calib_n_phC_ < min_samples)
+        return INFINITY;
+    float var_phB = DC_calib_var_.phB / (float)DC_calib_n_phB_;
+    float var_phC = DC_calib_var_.phC / (float)DC_calib_n_phC_;
+    return sqrtf(std::max(var_phB, var_phC));
 }
 
 // @brief Tune the current controller based on phase resistance and inductance
@@ -62,6 +82,55 @@ void Motor::update_current_controller_gains() {
     current_control_.i_gain = plant_pole * current_control_.p_gain;
 }
 
+// @brief Tabulates the d axis current of maximum torque per amp over 0 <= Iq <= current_lim.
+// With the torque proportional to flux_linkage * Iq + (Ld - Lq) * Id * Iq, the optimum is
+//   Id = a - sqrt(a^2 + Iq^2) where a = flux_linkage / (2 * (Lq - Ld)),
+// which is evaluated as -Iq^2 / (a + sqrt(a^2 + Iq^2)) to avoid cancellation for small saliencies.
+// Invoked whenever one of these values changes.
+void Motor::update_mtpa_table() {
+    if (!(config_.flux_linkage > 0.0f && config_.saliency_inductance > 0.0f && config_.current_lim > 0.0f)) {
+        std::fill(mtpa_table_, mtpa_table_ + MTPA_TABLE_SIZE, 0.0f);
+        mtpa_table_scale_ = 0.0f;
+        return;
+    }
+    float a = config_.flux_linkage / (2.0f * config_.saliency_inductance);
+    float step = config_.current_lim / (float)(MTPA_TABLE_SIZE - 1);
+    for (size_t i = 0; i < MTPA_TABLE_SIZE; ++i) {
+        float Iq = (float)i * step;
+        mtpa_table_[i] = -SQ(Iq) / (a + sqrtf(SQ(a) + SQ(Iq)));
+    }
+    mtpa_table_scale_ = 1.0f / step;
+}
+
+// @brief Interpolates the MTPA table, see update_mtpa_table()
+// @returns the d axis current that maximizes the torque per amp at the given q axis current [A]
+RAM_FUNCTION float Motor::mtpa_current(float Iq) {
+    float x = fabsf(Iq) * mtpa_table_scale_;
+    if (!(x < (float)(MTPA_TABLE_SIZE - 1)))
+        return mtpa_table_[MTPA_TABLE_SIZE - 1];
+    size_t i = (size_t)x;
+    float frac = x - (float)i;
+    return mtpa_table_[i] + frac * (mtpa_table_[i + 1] - mtpa_table_[i]);
+}
+
+// @brief Integrates the voltage margin into the field weakening current.
+// The d axis current grows negative while the PI controllers request more than
+// fw_mod_margin of the maximum modulation, and decays when there is headroom again.
+// @param phase_vel: electrical velocity [rad/s]
+// @returns the field weakening current [A]
+RAM_FUNCTION float Motor::field_weakening_current(float phase_vel) {
+    CurrentControl_t& ictrl = current_control_;
+    float mod_error = config_.fw_mod_margin - ictrl.mod_demand;
+    // Near standstill the modulation saturates on the resistive voltage, e.g.
+    // on a low bus voltage or a stalled rotor, which a d axis current can't
+    // reduce. The integrator is frozen there, apart from decaying.
+    if (fabsf(phase_vel) < config_.fw_min_vel)
+        mod_error = std::max(mod_error, 0.0f);
+    ictrl.Id_field_weakening += mod_error * (config_.fw_gain * current_meas_period);
+    ictrl.Id_field_weakening = std::min(std::max(ictrl.Id_field_weakening, -config_.fw_current_lim), 0.0f);
+    return ictrl.Id_field_weakening;
+}
+
 // @brief Set up the gate drivers
 void Motor::DRV8301_setup() {
     // for reference:
@@ -161,14 +230,133 @@ bool Motor::update_thermal_limits() {
         set_error(ERROR_INVERTER_OVER_TEMP);
         return false;
     }
+
+    if (config_.enable_winding_thermal_model) {
+        // current_lim can be set to the peak current of the motor, the model
+        // takes it down to the continuous current as the winding heats up
+        temp_margin = config_.winding_temp_limit_upper - winding_temp_;
+        derating_range = config_.winding_temp_limit_upper - config_.winding_temp_limit_lower;
+        float winding_current_lim = config_.current_lim * std::min(temp_margin / derating_range, 1.0f);
+        if (!(winding_current_lim >= 0.0f))
+            winding_current_lim = 0.0f;
+        thermal_current_lim_ = std::min(thermal_current_lim_, winding_current_lim);
+        if (winding_temp_ > config_.winding_temp_limit_upper + 5) {
+            set_error(ERROR_MOTOR_OVER_TEMP);
+            return false;
+        }
+    }
     return true;
 }
 
+// @brief Steps the thermal model of the winding and the housing.
+// The resistance rises by the temperature coefficient of copper above ambient_temp.
+// @param I_sq_integral: of the current amplitude since the last call [A^2 s]
+// @param dt: time since the last call [s]
+void Motor::update_winding_temp(float I_sq_integral, float dt) {
+    if (!(config_.winding_thermal_resistance > 0.0f && config_.winding_thermal_time_constant > 0.0f))
+        return;
+
+    static const float copper_temp_coeff = 0.00393f; // [1/K]
+    float R = config_.phase_resistance * (1.0f + copper_temp_coeff * (winding_temp_ - config_.ambient_temp));
+    float heat = 1.5f * R * I_sq_integral; // [J]
+
+    // Forward Euler, the checks run far faster than the time constants
+    float C_winding = config_.winding_thermal_time_constant / config_.winding_thermal_resistance; // [J/K]
+    float flow = dt * (winding_temp_ - housing_temp_) / config_.winding_thermal_resistance;    // [J] winding to housing
+    winding_temp_ += (heat - flow) / C_winding;
+    if (config_.housing_thermal_resistance > 0.0f) {
+        float C_housing = config_.housing_thermal_time_constant / config_.housing_thermal_resistance;
+        housing_temp_ += (flow - dt * (housing_temp_ - config_.ambient_temp) / config_.housing_thermal_resistance) / C_housing;
+    } else {
+        housing_temp_ = config_.ambient_temp;
+    }
+}
+
+// @brief Restarts the thermal model with the winding and the housing at temp,
+// for a motor that is known to be warm, e.g. after a reboot [°C]
+void Motor::reset_thermal_model(float temp) {
+    // Atomic with respect to update_winding_temp() in the control loop
+    uint32_t mask = cpu_enter_critical();
+    winding_temp_ = temp;
+    housing_temp_ = temp;
+    cpu_exit_critical(mask);
+}
+
+// Adds a sum of FOC_current to a 64 bit accumulator. The fraction of a unit
+// that doesn't make it into the accumulator is carried over to the next call.
+static inline void accumulate(uint64_t* acc, float* carry, float value) {
+    float x = value + *carry;
+    uint64_t whole = (x > 0.0f) ? (uint64_t)x : 0;
+    *carry = x - (float)whole;
+    *acc += whole;
+}
+
+// @brief Moves the sums of FOC_current since the last call into the power meter
+// and the winding thermal model. The meter advances by the time the sums
+// cover, which is longer than dt after a calibration, where FOC_current runs
+// but the checks don't, and zero while the motor is disarmed.
+// @param dt: time since the last call [s]
+void Motor::update_power_meter(float dt) {
+    // Atomic with respect to FOC_current, which may run in the interrupt, and
+    // to reset_power_meter()
+    uint32_t mask = cpu_enter_critical();
+    PowerSums_t sums = power_sums_;
+    power_sums_ = PowerSums_t();
+    PowerMeter_t& meter = power_meter_;
+    accumulate(&meter.time, &meter.carry[0], sums.time * 1e6f);
+    accumulate(&meter.energy_in, &meter.carry[1], sums.energy_in * 1e6f);
+    accumulate(&meter.energy_regen, &meter.carry[2], sums.energy_regen * 1e6f);
+    accumulate(&meter.brake_energy, &meter.carry[3], sums.brake_energy * 1e6f);
+    accumulate(&meter.I_sq_time, &meter.carry[4], sums.I_sq_integral * 1e6f);
+    cpu_exit_critical(mask);
+
+    update_winding_temp(sums.I_sq_integral, std::max(dt, sums.time));
+}
+
+void Motor::reset_power_meter() {
+    uint32_t mask = cpu_enter_critical();
+    power_meter_ = PowerMeter_t();
+    cpu_exit_critical(mask);
+}
+
+// @returns the RMS phase current since reset_power_meter(), for sinusoidal currents [A]
+float Motor::get_rms_current() {
+    uint32_t mask = cpu_enter_critical();
+    float I_sq_time = (float)power_meter_.I_sq_time;
+    float time = (float)power_meter_.time;
+    cpu_exit_critical(mask);
+    if (!(time > 0.0f))
+        return 0.0f;
+    // [mA^2 s] / [us] = [A^2], the RMS value of a sine is its amplitude over sqrt(2)
+    return sqrtf(0.5f * I_sq_time / time);
+}
+
+// @brief Share of the brake resistor current that is regenerated by this motor [A]
+// The brake resistor takes the regenerated current that the other motors
+// don't consume, see update_brake_current(). It is split among the motors by
+// their regenerated current.
+RAM_FUNCTION float Motor::brake_current_share() {
+    float Ibus_sum = 0.0f;
+    float regen_sum = 0.0f;
+    for (size_t i = 0; i < AXIS_COUNT; ++i) {
+        if (axes[i]->motor_.armed_state_ == Motor::ARMED_STATE_ARMED) {
+            float Ibus = axes[i]->motor_.current_control_.Ibus;
+            Ibus_sum += Ibus;
+            regen_sum += std::max(-Ibus, 0.0f);
+        }
+    }
+    float regen = -current_control_.Ibus;
+    if (!(regen > 0.0f && -Ibus_sum > 0.0f))
+        return 0.0f;
+    return -Ibus_sum * (regen / regen_sum);
+}
+
 bool Motor::do_checks() {
     if (!check_DRV_fault()) {
         set_error(ERROR_DRV_FAULT);
         return false;
     }
+    update_power_meter(axis_->stage_period(Axis::CONTROL_STAGE_CHECKS));
     if (!update_thermal_limits()) {
         //error already set in function
         return false;
@@ -176,7 +364,7 @@ bool Motor::do_checks() {
     return true;
 }
 
-float Motor::effective_current_lim() {
+RAM_FUNCTION float Motor::effective_current_lim() {
     // Configured limit
     float current_lim = config_.current_lim;
     // Hardware limit
@@ -191,16 +379,15 @@ float Motor::effective_current_lim() {
     return current_lim;
 }
 
-void Motor::log_timing(TimingLog_t log_idx) {
-    static const uint16_t clocks_per_cnt = (uint16_t)((float)TIM_1_8_CLOCK_HZ / (float)TIM_APB1_CLOCK_HZ);
-    uint16_t timing = clocks_per_cnt * htim13.Instance->CNT; // TODO: Use a hw_config
+RAM_FUNCTION void Motor::log_timing(TimingLog_t log_idx) {
+    uint16_t timing = get_timing_clocks(); // TODO: Use a hw_config
 
     if (log_idx < TIMING_LOG_NUM_SLOTS) {
         timing_log_[log_idx] = timing;
     }
 }
 
-float Motor::phase_current_from_adcval(uint32_t ADCValue) {
+RAM_FUNCTION float Motor::phase_current_from_adcval(uint32_t ADCValue) {
     int adcval_bal = (int)ADCValue - (1 << 11);
     float amp_out_volt = (3.3f / (float)(1 << 12)) * (float)adcval_bal;
     float shunt_volt = amp_out_volt * phase_current_rev_gain_;
@@ -215,7 +402,7 @@ float Motor::phase_current_from_adcval(uint32_t ADCValue) {
 // TODO check Ibeta balance to verify good motor connection
 bool Motor::measure_phase_resistance(float test_current, float max_voltage) {
     static const float kI = 10.0f;                                 // [(V/s)/A]
-    static const int num_test_cycles = static_cast<int>(3.0f / CURRENT_MEAS_PERIOD); // Test runs for 3s
+    const size_t num_test_cycles = static_cast<size_t>(3.0f / current_meas_period); // Test runs for 3s
     float test_voltage = 0.0f;
     
     size_t i = 0;
@@ -247,7 +434,7 @@ bool Motor::measure_phase_resistance(float test_current, float max_voltage) {
 bool Motor::measure_phase_inductance(float voltage_low, float voltage_high) {
     float test_voltages[2] = {voltage_low, voltage_high};
     float Ialphas[2] = {0.0f};
-    static const int num_cycles = 5000;
+    const size_t num_cycles = static_cast<size_t>(0.625f / current_meas_period); // 5000 cycles at 8kHz
 
     size_t t = 0;
     axis_->run_control_loop([&](){
@@ -282,12 +469,228 @@ bool Motor::measure_phase_inductance(float voltage_low, float voltage_high) {
 }
 
 
+// @brief Identifies phase resistance and inductance together in rl_identification_duration.
+// A DC current along phase A is held by an integrator, so that the dead time only adds a
+// constant voltage, and a PRBS test voltage is superimposed on it. Recursive least squares
+// fits the exact discretization of the R-L circuit
+//   I[k] = alpha * I[k-1] + beta1 * v[k-1] + beta2 * v[k-2] + gamma
+// where the voltage of one cycle is split over two coefficients as it is applied one to two
+// cycles later, depending on the PWM update mode. With beta = beta1 + beta2,
+//   R = (1 - alpha) / beta and L = -R * T / ln(alpha).
+// See tools/control_simulation/RLIdentification.py for the reference implementation.
+bool Motor::identify_phase_rl(float test_current, float max_voltage) {
+    static const float settle_time = 0.05f;     // [s] ramp up of the DC current before the fit
+    static const float bias_tau = 0.01f;        // [s] time constant of the DC current integrator
+    static const float bias_period = 0.04f;     // [s] the DC current alternates between full and half test_current
+    static const float ripple_target = 0.05f;   // PRBS current change per cycle relative to test_current
+    static const float initial_P = 1e4f;
+    const size_t ramp_cycles = static_cast<size_t>(0.5f * settle_time / current_meas_period);
+    const size_t settle_cycles = 2 * ramp_cycles;
+    const size_t bias_cycles = static_cast<size_t>(bias_period / current_meas_period);
+    const size_t num_cycles = std::max(static_cast<size_t>(config_.rl_identification_duration / current_meas_period), 2 * settle_cycles);
+    const float R_max = max_voltage / test_current;
+
+    float theta[4] = { 0.0f };                  // alpha, beta1, beta2, gamma
+    float P[4][4] = { { 0.0f } };
+    for (size_t r = 0; r < 4; ++r)
+        P[r][r] = initial_P;
+    float R_hat = R_max;
+    float v_bias = 0.0f;
+    float v_prbs = 0.02f * max_voltage;
+    uint16_t lfsr = 0x7fff;                     // 15 bit maximum length LFSR, x^15 + x^14 + 1
+    float I_prev = 0.0f;
+    float v_prev[2] = { 0.0f };                 // v[k-1], v[k-2]
+    float sum_e2 = 0.0f;
+    float sum_dI2 = 0.0f;
+
+    size_t i = 0;
+    axis_->run_control_loop([&](){
+        float I = -(current_meas_.phB + current_meas_.phC);
+
+        if (i >= ramp_cycles) {
+            // RLS update: gain = P * phi / (1 + phi' * P * phi), P -= gain * phi' * P
+            const float phi[4] = { I_prev, v_prev[0], v_prev[1], 1.0f };
+            float Pphi[4];
+            float denom = 1.0f;
+            float e = I;
+            for (size_t r = 0; r < 4; ++r) {
+                Pphi[r] = P[r][0] * phi[0] + P[r][1] * phi[1] + P[r][2] * phi[2] + P[r][3] * phi[3];
+                denom += phi[r] * Pphi[r];
+                e -= phi[r] * theta[r];
+            }
+            float denom_inv = 1.0f / denom;
+            for (size_t r = 0; r < 4; ++r) {
+                theta[r] += Pphi[r] * denom_inv * e;
+                for (size_t c = 0; c < 4; ++c)
+                    P[r][c] -= Pphi[r] * Pphi[c] * denom_inv;
+            }
+            if (i >= settle_cycles) {
+                sum_e2 += e * e;
+                sum_dI2 += SQ(I - I_prev);
+            }
+
+            // Adapt the DC current integrator and the PRBS amplitude to the estimates
+            float alpha = theta[0];
+            float beta = theta[1] + theta[2];
+            if (beta > 0.0f && alpha > 0.0f && alpha < 1.0f) {
+                R_hat = std::min(std::max((1.0f - alpha) / beta, 0.01f * R_max), R_max);
+                v_prbs = ripple_target * test_current / beta;
+            }
+        }
+        I_prev = I;
+
+        float I_bias = test_current * std::min((float)i / (float)ramp_cycles, 1.0f);
+        if (i >= settle_cycles && ((i - settle_cycles) / bias_cycles) % 2 == 1)
+            I_bias *= 0.5f;
+        v_bias += current_meas_period * (R_hat / bias_tau) * (I_bias - I);
+        v_prbs = std::min(v_prbs, 0.5f * (max_voltage - fabsf(v_bias)));
+
+        uint16_t bit = ((lfsr >> 14) ^ (lfsr >> 13)) & 1;
+        lfsr = ((lfsr << 1) | bit) & 0x7fff;
+        float test_voltage = v_bias + (bit ? v_prbs : -v_prbs);
+        if (test_voltage > max_voltage || test_voltage < -max_voltage)
+            return set_error(ERROR_PHASE_RESISTANCE_OUT_OF_RANGE), false;
+
+        // Test voltage along phase A
+        if (!enqueue_voltage_timings(test_voltage, 0.0f))
+            return false; // error set inside enqueue_voltage_timings
+        log_timing(TIMING_LOG_MEAS_R);
+
+        v_prev[1] = v_prev[0];
+        v_prev[0] = test_voltage;
+        return ++i < num_cycles;
+    });
+    if (axis_->error_ != Axis::ERROR_NONE)
+        return false;
+
+    rl_fit_error_ = sqrtf(sum_e2 / sum_dI2);
+    float alpha = theta[0];
+    float beta = theta[1] + theta[2];
+    if (!(beta > 0.0f && alpha > 0.0f && alpha < 1.0f) || !(rl_fit_error_ <= config_.rl_identification_max_fit_error))
+        return set_error(ERROR_RL_IDENTIFICATION_FIT), false;
+
+    float R = (1.0f - alpha) / beta;
+    float L = -R * current_meas_period / logf(alpha);
+    config_.phase_resistance = R;
+    config_.phase_inductance = L;
+    // Same limits as measure_phase_inductance
+    if (L < 2e-6f || L > 4000e-6f)
+        return set_error(ERROR_PHASE_INDUCTANCE_OUT_OF_RANGE), false;
+    return true;
+}
+
+// @brief Identifies the dead time compensation from the voltage needed for DC currents along phase A.
+// Each phase loses deadtime_voltage() * s(I / deadtime_comp_current_band) with s(x) clamped to [-1, 1].
+// For the phase currents I, -I/2, -I/2 this results in
+//   V = R * I + deadtime_voltage() * g(I) with g(I) = 2/3 * (s(I / band) + s(I / (2 * band)))
+// which is fitted by least squares over a sweep of test currents.
+// Replaces phase_resistance by the fitted resistance, as the dead time biases
+// the value found by measure_phase_resistance.
+bool Motor::measure_deadtime_compensation(float max_current, float max_voltage) {
+    static const float test_currents[] = {
+        -1.0f, -0.6f, -0.35f, -0.2f, -0.1f, -0.05f, -0.02f,
+        0.02f, 0.05f, 0.1f, 0.2f, 0.35f, 0.6f, 1.0f
+    };
+    static constexpr size_t num_points = sizeof(test_currents) / sizeof(test_currents[0]);
+    static constexpr size_t num_bands = 16;
+    const size_t settle_cycles = static_cast<size_t>(0.2f / current_meas_period);
+    const size_t average_cycles = static_cast<size_t>(0.2f / current_meas_period);
+    const float kI = config_.phase_resistance / 0.02f; // [(V/s)/A] settles in about 20ms
+    float currents[num_points] = { 0.0f };
+    float voltages[num_points] = { 0.0f };
+    float test_voltage = 0.0f;
+
+    size_t point = 0;
+    size_t i = 0;
+    axis_->run_control_loop([&](){
+        float test_current = test_currents[point] * max_current;
+        float Ialpha = -(current_meas_.phB + current_meas_.phC);
+        test_voltage += (kI * current_meas_period) * (test_current - Ialpha);
+        if (test_voltage > max_voltage || test_voltage < -max_voltage)
+            return set_error(ERROR_PHASE_RESISTANCE_OUT_OF_RANGE), false;
+
+        // Test voltage along phase A
+        if (!enqueue_voltage_timings(test_voltage, 0.0f))
+            return false; // error set inside enqueue_voltage_timings
+        log_timing(TIMING_LOG_MEAS_R);
+
+        if (i >= settle_cycles) {
+            currents[point] += Ialpha;
+            voltages[point] += test_voltage;
+        }
+        if (++i < settle_cycles + average_cycles)
+            return true;
+        currents[point] /= (float)average_cycles;
+        voltages[point] /= (float)average_cycles;
+        i = 0;
+        return ++point < num_points;
+    });
+    if (axis_->error_ != Axis::ERROR_NONE)
+        return false;
+
+    // Least squares fit of R and the dead time voltage for a range of current bands
+    float best_residual = INFINITY;
+    float best_R = 0.0f, best_Vdt = 0.0f, best_band = 0.0f;
+    for (size_t b = 0; b < num_bands; ++b) {
+        float band = 0.01f * max_current * powf(50.0f, (float)b / (float)(num_bands - 1));
+        float sII = 0.0f, sIg = 0.0f, sgg = 0.0f, sIV = 0.0f, sgV = 0.0f;
+        for (size_t k = 0; k < num_points; ++k) {
+            float I = currents[k];
+            float g = (2.0f / 3.0f) * (std::min(std::max(I / band, -1.0f), 1.0f)
+                                     + std::min(std::max(0.5f * I / band, -1.0f), 1.0f));
+            sII += I * I; sIg += I * g; sgg += g * g;
+            sIV += I * voltages[k]; sgV += g * voltages[k];
+        }
+        float det = sII * sgg - sIg * sIg;
+        if (!(det > 0.0f))
+            continue;
+        float R = (sgg * sIV - sIg * sgV) / det;
+        float Vdt = (sII * sgV - sIg * sIV) / det;
+        float residual = 0.0f;
+        for (size_t k = 0; k < num_points; ++k) {
+            float I = currents[k];
+            float g = (2.0f / 3.0f) * (std::min(std::max(I / band, -1.0f), 1.0f)
+                                     + std::min(std::max(0.5f * I / band, -1.0f), 1.0f));
+            residual += SQ(voltages[k] - R * I - Vdt * g);
+        }
+        if (residual < best_residual) {
+            best_residual = residual;
+            best_R = R;
+            best_Vdt = Vdt;
+            best_band = band;
+        }
+    }
+    if (!(best_R > 0.0f && best_Vdt >= 0.0f))
+        return set_error(ERROR_PHASE_RESISTANCE_OUT_OF_RANGE), false;
+
+    // The vbus dependent part of the dead time voltage is attributed to the dead time
+    float pwm_period = (float)(2 * tim_1_8_period_clocks) / (float)TIM_1_8_CLOCK_HZ;
+    config_.deadtime = std::max(best_Vdt - config_.switch_voltage_drop, 0.0f) * pwm_period / vbus_voltage;
+    config_.deadtime_comp_current_band = best_band;
+    config_.phase_resistance = best_R;
+    return true;
+}
+
+// @returns the phase voltage lost to the dead time and the switches at large currents [V]
+RAM_FUNCTION float Motor::deadtime_voltage() {
+    float pwm_frequency = (float)TIM_1_8_CLOCK_HZ / (float)(2 * tim_1_8_period_clocks);
+    return config_.deadtime * pwm_frequency * vbus_voltage + config_.switch_voltage_drop;
+}
+
 bool Motor::run_calibration() {
     float R_calib_max_voltage = config_.resistance_calib_max_voltage;
     if (config_.motor_type == MOTOR_TYPE_HIGH_CURRENT) {
-        if (!measure_phase_resistance(config_.calibration_current, R_calib_max_voltage))
-            return false;
-        if (!measure_phase_inductance(-R_calib_max_voltage, R_calib_max_voltage))
+        if (config_.enable_rl_identification) {
+            if (!identify_phase_rl(config_.calibration_current, R_calib_max_voltage))
+                return false;
+        } else {
+            if (!measure_phase_resistance(config_.calibration_current, R_calib_max_voltage))
+                return false;
+            if (!measure_phase_inductance(-R_calib_max_voltage, R_calib_max_voltage))
+                return false;
+        }
+        if (config_.enable_deadtime_compensation
+            && !measure_deadtime_compensation(config_.calibration_current, R_calib_max_voltage))
             return false;
     } else if (config_.motor_type == MOTOR_TYPE_GIMBAL) {
         // no calibration needed
@@ -301,18 +704,18 @@ bool Motor::run_calibration() {
     return true;
 }
 
-bool Motor::enqueue_modulation_timings(float mod_alpha, float mod_beta) {
+RAM_FUNCTION bool Motor::enqueue_modulation_timings(float mod_alpha, float mod_beta) {
     float tA, tB, tC;
     if (SVM(mod_alpha, mod_beta, &tA, &tB, &tC) != 0)
         return set_error(ERROR_MODULATION_MAGNITUDE), false;
-    next_timings_[0] = (uint16_t)(tA * (float)TIM_1_8_PERIOD_CLOCKS);
-    next_timings_[1] = (uint16_t)(tB * (float)TIM_1_8_PERIOD_CLOCKS);
-    next_timings_[2] = (uint16_t)(tC * (float)TIM_1_8_PERIOD_CLOCKS);
+    next_timings_[0] = (uint16_t)(tA * (float)tim_1_8_period_clocks);
+    next_timings_[1] = (uint16_t)(tB * (float)tim_1_8_period_clocks);
+    next_timings_[2] = (uint16_t)(tC * (float)tim_1_8_period_clocks);
     next_timings_valid_ = true;
     return true;
 }
 
-bool Motor::enqueue_voltage_timings(float v_alpha, float v_beta) {
+RAM_FUNCTION bool Motor::enqueue_voltage_timings(float v_alpha, float v_beta) {
     float vfactor = 1.0f / ((2.0f / 3.0f) * vbus_voltage);
     float mod_alpha = vfactor * v_alpha;
     float mod_beta = vfactor * v_beta;
@@ -323,7 +726,7 @@ bool Motor::enqueue_voltage_timings(float v_alpha, float v_beta) {
 }
 
 // We should probably make FOC Current call FOC Voltage to avoid duplication.
-bool Motor::FOC_voltage(float v_d, float v_q, float pwm_phase) {
+RAM_FUNCTION bool Motor::FOC_voltage(float v_d, float v_q, float pwm_phase) {
     float c = our_arm_cos_f32(pwm_phase);
     float s = our_arm_sin_f32(pwm_phase);
     float v_alpha = c*v_d - s*v_q;
@@ -331,7 +734,8 @@ bool Motor::FOC_voltage(float v_d, float v_q, float pwm_phase) {
     return enqueue_voltage_timings(v_alpha, v_beta);
 }
 
-bool Motor::FOC_current(float Id_des, float Iq_des, float I_phase, float pwm_phase) {
+// @param phase_vel: electrical velocity [rad/s] for the feed-forward terms
+RAM_FUNCTION bool Motor::FOC_current(float Id_des, float Iq_des, float I_phase, float pwm_phase, float phase_vel) {
     // Syntactic sugar
     CurrentControl_t& ictrl = current_control_;
 
@@ -345,15 +749,36 @@ bool Motor::FOC_current(float Id_des, float Iq_des, float I_phase, float pwm_pha
         return false;
     }
 
+    float c_I = our_arm_cos_f32(I_phase);
+    float s_I = our_arm_sin_f32(I_phase);
+
+    // In over-modulation, phases can stay on the high side for the whole PWM period,
+    // leaving no time to sample their current. Such samples are reconstructed from
+    // the currents of the last cycle, rotated to the present phase.
+    if (!phB_meas_valid_ || !phC_meas_valid_) {
+        float Ialpha_pred = c_I * Id_last_ - s_I * Iq_last_;
+        float Ibeta_pred = s_I * Id_last_ + c_I * Iq_last_;
+        if (phB_meas_valid_) {
+            current_meas_.phC = -current_meas_.phB - Ialpha_pred;
+        } else if (phC_meas_valid_) {
+            current_meas_.phB = -current_meas_.phC - Ialpha_pred;
+        } else {
+            current_meas_.phB = -0.5f * Ialpha_pred + sqrt3_by_2 * Ibeta_pred;
+            current_meas_.phC = -0.5f * Ialpha_pred - sqrt3_by_2 * Ibeta_pred;
+        }
+    }
+
     // Clarke transform
     float Ialpha = -current_meas_.phB - current_meas_.phC;
     float Ibeta = one_by_sqrt3 * (current_meas_.phB - current_meas_.phC);
 
     // Park transform
-    float c_I = our_arm_cos_f32(I_phase);
-    float s_I = our_arm_sin_f32(I_phase);
     float Id = c_I * Ialpha + s_I * Ibeta;
     float Iq = c_I * Ibeta - s_I * Ialpha;
+    Id_last_ = Id;
+    Iq_last_ = Iq;
+    power_sums_.I_sq_integral += (SQ(Id) + SQ(Iq)) * current_meas_period;
+    power_sums_.time += current_meas_period;
     ictrl.Iq_measured += ictrl.I_measured_report_filter_k * (Iq - ictrl.Iq_measured);
     ictrl.Id_measured += ictrl.I_measured_report_filter_k * (Id - ictrl.Id_measured);
 
@@ -368,42 +793,94 @@ bool Motor::FOC_current(float Id_des, float Iq_des, float I_phase, float pwm_pha
     float Ierr_d = Id_des - Id;
     float Ierr_q = Iq_des - Iq;
 
-    // TODO look into feed forward terms (esp omega, since PI pole maps to RL tau)
+    // Feed forward the speed dependent terms of the motor voltage equations
+    //   Vd = R * Id + L * dId/dt - omega * L * Iq
+    //   Vq = R * Iq + L * dIq/dt + omega * L * Id + omega * flux_linkage
+    // so that the integrators don't have to build them up.
+    // The cross-coupling follows the measured currents, as the setpoints
+    // lead them by the response time of the current loop.
+    float Vd_ff = 0.0f;
+    float Vq_ff = 0.0f;
+    if (config_.enable_current_decoupling) {
+        Vd_ff -= phase_vel * config_.phase_inductance * Iq;
+        Vq_ff += phase_vel * config_.phase_inductance * Id;
+    }
+    if (config_.enable_bemf_feedforward) {
+        Vq_ff += phase_vel * config_.flux_linkage;
+    }
+
     // Apply PI control
-    float Vd = ictrl.v_current_control_integral_d + Ierr_d * ictrl.p_gain;
-    float Vq = ictrl.v_current_control_integral_q + Ierr_q * ictrl.p_gain;
+    float Vd = ictrl.v_current_control_integral_d + Ierr_d * ictrl.p_gain + Vd_ff;
+    float Vq = ictrl.v_current_control_integral_q + Ierr_q * ictrl.p_gain + Vq_ff;
 
     float mod_to_V = (2.0f / 3.0f) * vbus_voltage;
     float V_to_mod = 1.0f / mod_to_V;
     float mod_d = V_to_mod * Vd;
     float mod_q = V_to_mod * Vq;
 
-    // Vector modulation saturation, lock integrator if saturated
-    // TODO make maximum modulation configurable
-    float mod_scalefactor = 0.80f * sqrt3_by_2 * 1.0f / sqrtf(mod_d * mod_d + mod_q * mod_q);
+    // Vector modulation saturation
+    float max_mod = config_.max_modulation * sqrt3_by_2;
+    ictrl.mod_demand = sqrtf(mod_d * mod_d + mod_q * mod_q) * (1.0f / max_mod);
+    float mod_scalefactor = 1.0f / ictrl.mod_demand;
     if (mod_scalefactor < 1.0f) {
         mod_d *= mod_scalefactor;
         mod_q *= mod_scalefactor;
-        // TODO make decayfactor configurable
-        ictrl.v_current_control_integral_d *= 0.99f;
-        ictrl.v_current_control_integral_q *= 0.99f;
-    } else {
-        ictrl.v_current_control_integral_d += Ierr_d * (ictrl.i_gain * current_meas_period);
-        ictrl.v_current_control_integral_q += Ierr_q * (ictrl.i_gain * current_meas_period);
     }
 
+    // Back-calculation anti-windup: while saturated, the integrators are pulled
+    // towards the voltage that was actually applied.
+    float antiwindup_k = 0.0f;
+    if (ictrl.p_gain > 0.0f)
+        antiwindup_k = std::min(config_.current_control_antiwindup_gain * ictrl.i_gain / ictrl.p_gain * current_meas_period, 1.0f);
+    ictrl.v_current_control_integral_d += Ierr_d * (ictrl.i_gain * current_meas_period) + antiwindup_k * (mod_to_V * mod_d - Vd);
+    ictrl.v_current_control_integral_q += Ierr_q * (ictrl.i_gain * current_meas_period) + antiwindup_k * (mod_to_V * mod_q - Vq);
+
     // Compute estimated bus current
     ictrl.Ibus = mod_d * Id + mod_q * Iq;
 
+    // Power metering, see update_power_meter()
+    electrical_power_ = vbus_voltage * ictrl.Ibus;
+    if (electrical_power_ >= 0.0f)
+        power_sums_.energy_in += electrical_power_ * current_meas_period;
+    else
+        power_sums_.energy_regen -= electrical_power_ * current_meas_period;
+    power_sums_.brake_energy += vbus_voltage * brake_current_share() * current_meas_period;
+
     // Inverse park transform
     float c_p = our_arm_cos_f32(pwm_phase);
     float s_p = our_arm_sin_f32(pwm_phase);
     float mod_alpha = c_p * mod_d - s_p * mod_q;
     float mod_beta  = c_p * mod_q + s_p * mod_d;
 
-    // Report final applied voltage in stationary frame (for sensorles estimator)
-    ictrl.final_v_alpha = mod_to_V * mod_alpha;
-    ictrl.final_v_beta = mod_to_V * mod_beta;
+    // Dead time compensation: each phase gets the voltage it loses during the
+    // dead time in the direction of its current. The current setpoint is used
+    // for the direction as the measurement is noisy around the zero crossings.
+    float comp_alpha = 0.0f;
+    float comp_beta = 0.0f;
+    if (config_.enable_deadtime_compensation) {
+        float Ialpha_des = c_p * Id_des - s_p * Iq_des;
+        float Ibeta_des = c_p * Iq_des + s_p * Id_des;
+        // A band of zero (or a negative or NaN one) switches at the sign of the
+        // current instead of dividing by zero. The constant comes first so that
+        // std::max() returns it for NaN.
+        float band_k = 1.0f / std::max(1e-3f, config_.deadtime_comp_current_band);
+        float sA = std::min(std::max(Ialpha_des * band_k, -1.0f), 1.0f);
+        float sB = std::min(std::max((-0.5f * Ialpha_des + sqrt3_by_2 * Ibeta_des) * band_k, -1.0f), 1.0f);
+        float sC = std::min(std::max((-0.5f * Ialpha_des - sqrt3_by_2 * Ibeta_des) * band_k, -1.0f), 1.0f);
+        float comp_mod = V_to_mod * deadtime_voltage();
+        comp_alpha = comp_mod * (2.0f / 3.0f) * (sA - 0.5f * (sB + sC));
+        comp_beta = comp_mod * one_by_sqrt3 * (sB - sC);
+        mod_alpha += comp_alpha;
+        mod_beta += comp_beta;
+    }
+
+    // Beyond the linear range, the fundamental is kept by the over-modulation trajectory
+    overmodulate(&mod_alpha, &mod_beta);
+
+    // Report final applied voltage in stationary frame (for sensorles estimator),
+    // without the part that is lost in the inverter
+    ictrl.final_v_alpha = mod_to_V * (mod_alpha - comp_alpha);
+    ictrl.final_v_beta = mod_to_V * (mod_beta - comp_beta);
 
     // Apply SVM
     if (!enqueue_modulation_timings(mod_alpha, mod_beta))
@@ -414,17 +891,34 @@ bool Motor::FOC_current(float Id_des, float Iq_des, float I_phase, float pwm_pha
 }
 
 
-bool Motor::update(float current_setpoint, float phase, float phase_vel) {
+RAM_FUNCTION bool Motor::update(float current_setpoint, float phase, float phase_vel) {
     current_setpoint *= config_.direction;
     phase *= config_.direction;
     phase_vel *= config_.direction;
 
-    float pwm_phase = phase + 1.5f * current_meas_period * phase_vel;
+    // Compensate the delay between current measurement and the middle of the PWM
+    // periods that the new timings are applied in
+    float pwm_phase = phase + get_control_delay() * phase_vel;
 
     // Execute current command
     // TODO: move this into the mot
     if (config_.motor_type == MOTOR_TYPE_HIGH_CURRENT) {
-        if(!FOC_current(0.0f, current_setpoint, phase, pwm_phase)){
+        float Id_setpoint = 0.0f;
+        if (config_.enable_mtpa)
+            Id_setpoint += mtpa_current(current_setpoint);
+        if (config_.enable_field_weakening)
+            Id_setpoint += field_weakening_current(phase_vel);
+        else
+            current_control_.Id_field_weakening = 0.0f;
+
+        // Keep the current vector within the current limit, giving the d axis current priority
+        float Ilim = effective_current_lim();
+        Id_setpoint = std::max(Id_setpoint, -Ilim);
+        float Iq_lim = sqrtf(SQ(Ilim) - SQ(Id_setpoint));
+        current_setpoint = std::min(std::max(current_setpoint, -Iq_lim), Iq_lim);
+        current_control_.Id_setpoint = Id_setpoint;
+
+        if(!FOC_current(Id_setpoint, current_setpoint, phase, pwm_phase, phase_vel)){
             return false;
         }
     } else if (config_.motor_type == MOTOR_TYPE_GIMBAL) {
@@ -23,7 +23,9 @@ public:
         ERROR_UNEXPECTED_TIMER_CALLBACK = 0x0200,
         ERROR_CURRENT_SENSE_SATURATION = 0x0400,
         ERROR_INVERTER_OVER_TEMP = 0x0800,
-        ERROR_CURRENT_UNSTABLE = 0x1000
+        ERROR_CURRENT_UNSTABLE = 0x1000,
+        ERROR_RL_IDENTIFICATION_FIT = 0x2000,
+        ERROR_MOTOR_OVER_TEMP = 0x4000,
     };
 
     enum MotorType_t {
@@ -37,6 +39,25 @@ public:
         float phC;
     };
 
+    // Sums of FOC_current, moved into the power meter and the thermal model by update_power_meter()
+    struct PowerSums_t {
+        float I_sq_integral = 0.0f;         // [A^2 s] of the current amplitude
+        float energy_in = 0.0f;             // [J] drawn from the DC bus
+        float energy_regen = 0.0f;          // [J] fed back to the DC bus
+        float brake_energy = 0.0f;          // [J] share of the brake resistor dissipation
+        float time = 0.0f;                  // [s] covered by the sums
+    };
+
+    // Accumulated since reset_power_meter()
+    struct PowerMeter_t {
+        uint64_t time = 0;                  // [us] metered, while the current controller runs
+        uint64_t energy_in = 0;             // [uJ] drawn from the DC bus
+        uint64_t energy_regen = 0;          // [uJ] fed back to the DC bus
+        uint64_t brake_energy = 0;          // [uJ] dissipated in the brake resistor, share of this motor
+        uint64_t I_sq_time = 0;             // [mA^2 s] of the current amplitude
+        float carry[5] = {0.0f};            // fractions of a unit that are not in the accumulators yet
+    };
+
     struct CurrentControl_t{
         float p_gain; // [V/A]
         float i_gain; // [V/As]
@@ -47,6 +68,9 @@ public:
         float final_v_alpha; // [V]
         float final_v_beta; // [V]
         float Iq_setpoint; // [A]
+        float Id_setpoint; // [A] from MTPA and field weakening
+        float Id_field_weakening; // [A] state of the field weakening controller
+        float mod_demand; // modulation magnitude requested by the PI controllers, relative to the maximum
         float Iq_measured; // [A]
         float Id_measured; // [A]
         float I_measured_report_filter_k;
@@ -64,6 +88,9 @@ public:
         float resistance_calib_max_voltage = 2.0f; // [V] - You may need to increase this if this voltage isn't sufficient to drive calibration_current through the motor.
         float phase_inductance = 0.0f;        // to be set by measure_phase_inductance
         float phase_resistance = 0.0f;        // to be set by measure_phase_resistance
+        bool enable_rl_identification = false; // identify R and L together with identify_phase_rl instead
+        float rl_identification_duration = 0.25f; // [s]
+        float rl_identification_max_fit_error = 0.5f; // see rl_fit_error_
         int32_t direction = 0;                // 1 or -1 (0 = unspecified)
         MotorType_t motor_type = MOTOR_TYPE_HIGH_CURRENT;
         // Read out max_allowed_current to see max supported value for current_lim.
@@ -73,8 +100,38 @@ public:
         // Value used to compute shunt amplifier gains
         float requested_current_range = 60.0f; // [A]
         float current_control_bandwidth = 1000.0f;  // [rad/s]
+        float current_control_antiwindup_gain = 1.0f; // back-calculation gain of the integrators, relative to i_gain / p_gain
+        float max_modulation = 0.80f;               // relative to the largest circle inside the SVM hexagon, see overmodulate().
+                                                    // Above 1.0 is over-modulation, 1.1027 is six-step.
+        bool enable_current_decoupling = false;     // feed forward the d/q cross-coupling voltages through phase_inductance
+        bool enable_bemf_feedforward = false;       // feed forward the back-EMF from flux_linkage
+        float flux_linkage = 0.0f;                  // [V/(rad/s)] back-EMF amplitude per electrical rad/s, about 5.51 / (KV * pole_pairs)
+        bool enable_field_weakening = false;        // inject negative Id when the modulation exceeds fw_mod_margin
+        float fw_mod_margin = 0.95f;                // modulation magnitude, relative to the maximum, that field weakening regulates to
+        float fw_gain = 2000.0f;                    // [A/s] rate of change of the field weakening current per unit of modulation error
+        float fw_current_lim = 4.0f;                // [A] maximum field weakening current, well below current_lim to leave room for torque
+        float fw_min_vel = 200.0f;                  // [rad/s] electrical, below which the field weakening current can't grow
+        bool enable_mtpa = false;                   // add the d axis current of maximum torque per amp, needs flux_linkage
+        float saliency_inductance = 0.0f;           // [H] Lq - Ld of salient (interior magnet) motors
+        bool enable_deadtime_compensation = false;  // also identifies the parameters below during calibration
+        float deadtime = (float)TIM_1_8_DEADTIME_CLOCKS / (float)TIM_1_8_CLOCK_HZ; // [s] effective dead time of the inverter
+        float switch_voltage_drop = 0.0f;           // [V] phase voltage lost in the switches independent of vbus
+        float deadtime_comp_current_band = 0.5f;    // [A] phase current over which the compensation ramps up
+        float dc_calib_tau = 0.2f;                  // [s] time constant of the current sense offset filter
+        float dc_calib_tolerance = 0.01f;           // [A] standard deviation of the offset estimate below which it counts as settled
+        float dc_calib_min_duration = 0.1f;         // [s] the axis waits at least this long for the offset calibration after startup
         float inverter_temp_limit_lower = 100;
         float inverter_temp_limit_upper = 120;
+        // Winding temperature model, see update_winding_temp(). With housing_thermal_resistance = 0
+        // the housing stays at ambient temperature and the model is first order.
+        bool enable_winding_thermal_model = false;  // derate current_lim on the modelled winding temperature
+        float winding_thermal_resistance = 1.0f;    // [K/W] winding to housing
+        float winding_thermal_time_constant = 20.0f; // [s] winding heat capacity times winding_thermal_resistance
+        float housing_thermal_resistance = 0.0f;    // [K/W] housing to ambient
+        float housing_thermal_time_constant = 600.0f; // [s] housing heat capacity times housing_thermal_resistance
+        float ambient_temp = 25.0f;                 // [°C] also the temperature at which phase_resistance was measured
+        float winding_temp_limit_lower = 100.0f;    // [°C] derating starts
+        float winding_temp_limit_upper = 120.0f;    // [°C] no current left
     };
 
     enum TimingLog_t {
@@ -107,25 +164,44 @@ public:
         DRV8301_setup();
     }
     void reset_current_control();
+    float get_DC_calib_uncertainty();
 
     void update_current_controller_gains();
+    void update_mtpa_table();
+    float mtpa_current(float Iq);
+    float field_weakening_current(float phase_vel);
     void DRV8301_setup();
     bool check_DRV_fault();
     void set_error(Error_t error);
     bool do_checks();
     float get_inverter_temp();
     bool update_thermal_limits();
+    void update_winding_temp(float I_sq_integral, float dt);
+    void reset_thermal_model(float temp);
+    void update_power_meter(float dt);
+    void reset_power_meter();
+    float get_rms_current();
+    float brake_current_share();
     float effective_current_lim();
     void log_timing(TimingLog_t log_idx);
     float phase_current_from_adcval(uint32_t ADCValue);
     bool measure_phase_resistance(float test_current, float max_voltage);
     bool measure_phase_inductance(float voltage_low, float voltage_high);
+    bool measure_deadtime_compensation(float max_current, float max_voltage);
+    bool identify_phase_rl(float test_current, float max_voltage);
+    float deadtime_voltage();
     bool run_calibration();
     bool enqueue_modulation_timings(float mod_alpha, float mod_beta);
     bool enqueue_voltage_timings(float v_alpha, float v_beta);
     bool FOC_voltage(float v_d, float v_q, float pwm_phase);
-    bool FOC_current(float Id_des, float Iq_des, float I_phase, float pwm_phase);
+    bool FOC_current(float Id_des, float Iq_des, float I_phase, float pwm_phase, float phase_vel);
     bool update(float current_setpoint, float phase, float phase_vel);
+    // @brief Delay between the current measurement and the middle of the PWM
+    // periods that the next timings are applied in [s]. In double update mode
+    // the timings are latched at the counter peak right after the measurement
+    // if the control loop finished by then, which in practice only the ISR
+    // current loop does. The last latch predicts the next one.
+    float get_control_delay() { return (last_timings_latched_early_ ? 1.0f : 1.5f) * current_meas_period; }
 
     const MotorHardwareConfig_t& hw_config_;
     const GateDriverHardwareConfig_t gate_driver_config_;
@@ -136,11 +212,26 @@ public:
 
     DRV8301_Obj gate_driver_; // initialized in constructor
     uint16_t next_timings_[3] = {
-        TIM_1_8_PERIOD_CLOCKS / 2,
-        TIM_1_8_PERIOD_CLOCKS / 2,
-        TIM_1_8_PERIOD_CLOCKS / 2
+        (uint16_t)(tim_1_8_period_clocks / 2),
+        (uint16_t)(tim_1_8_period_clocks / 2),
+        (uint16_t)(tim_1_8_period_clocks / 2)
     };
     bool next_timings_valid_ = false;
+    // The timer registers are preloaded, so they may already hold the next timings.
+    // The current measurement checks against the ones that were in effect before the sample.
+    uint16_t applied_timings_[3] = {    // last written by safety_critical_apply_motor_pwm_timings()
+        (uint16_t)(tim_1_8_period_clocks / 2),
+        (uint16_t)(tim_1_8_period_clocks / 2),
+        (uint16_t)(tim_1_8_period_clocks / 2)
+    };
+    uint16_t latched_timings_[3] = {    // in effect since the last update event, see pwm_trig_adc_cb()
+        (uint16_t)(tim_1_8_period_clocks / 2),
+        (uint16_t)(tim_1_8_period_clocks / 2),
+        (uint16_t)(tim_1_8_period_clocks / 2)
+    };
+    bool timings_latched_early_ = false; // double update mode: next_timings_ were latched at the counter peak
+    bool last_timings_latched_early_ = false; // the last valid next_timings_ were latched at the counter peak
+    uint8_t DC_calib_skip_ = 0;         // double update mode: decimation counter of the DC calibration
     uint16_t last_cpu_time_ = 0;
     int timing_log_index_ = 0;
     uint16_t timing_log_[TIMING_LOG_NUM_SLOTS] = { 0 };
@@ -152,7 +243,14 @@ public:
     ArmedState_t armed_state_ = ARMED_STATE_DISARMED; 
     bool is_calibrated_ = config_.pre_calibrated;
     Iph_BC_t current_meas_ = {0.0f, 0.0f};
+    bool phB_meas_valid_ = true;        // false if the low side of phase B wasn't on long enough for the last sample
+    bool phC_meas_valid_ = true;
+    float Id_last_ = 0.0f;              // [A] unfiltered, to reconstruct samples that aren't valid
+    float Iq_last_ = 0.0f;              // [A]
     Iph_BC_t DC_calib_ = {0.0f, 0.0f};
+    Iph_BC_t DC_calib_var_ = {0.0f, 0.0f}; // [A^2] variance of the samples around DC_calib_
+    uint32_t DC_calib_n_phB_ = 0;       // number of samples in DC_calib_, until the filter takes over
+    uint32_t DC_calib_n_phC_ = 0;
     float phase_current_rev_gain_ = 0.0f; // Reverse gain for ADC to Amps (to be set by DRV8301_setup)
     CurrentControl_t current_control_ = {
         .p_gain = 0.0f,        // [V/A] should be auto set after resistance and inductance measurement
@@ -163,6 +261,9 @@ public:
         .final_v_alpha = 0.0f,
         .final_v_beta = 0.0f,
         .Iq_setpoint = 0.0f,
+        .Id_setpoint = 0.0f,
+        .Id_field_weakening = 0.0f,
+        .mod_demand = 0.0f,
         .Iq_measured = 0.0f,
         .Id_measured = 0.0f,
         .I_measured_report_filter_k = 1.0f,
@@ -172,6 +273,17 @@ public:
     DRV8301_FaultType_e drv_fault_ = DRV8301_FaultType_NoFault;
     DRV_SPI_8301_Vars_t gate_driver_regs_; //Local view of DRV registers (initialized by DRV8301_setup)
     float thermal_current_lim_ = 10.0f;  //[A]
+    PowerSums_t power_sums_;
+    PowerMeter_t power_meter_;
+    float electrical_power_ = 0.0f;     // [W] drawn from the DC bus in the last current control period, negative when regenerating
+    float winding_temp_ = config_.ambient_temp;  // [°C] modelled
+    float housing_temp_ = config_.ambient_temp;  // [°C] modelled
+    float rl_fit_error_ = 0.0f;         // RMS prediction error of identify_phase_rl relative to the RMS current change per cycle
+
+    // d axis currents of maximum torque per amp, see update_mtpa_table()
+    static constexpr size_t MTPA_TABLE_SIZE = 17;
+    float mtpa_table_[MTPA_TABLE_SIZE] = { 0.0f };  // [A] at Iq = i / mtpa_table_scale_
+    float mtpa_table_scale_ = 0.0f;                 // [1/A]
 
     // Communication protocol definitions
     auto make_protocol_definitions() {
@@ -183,9 +295,24 @@ public:
             make_protocol_ro_property("current_meas_phC", &current_meas_.phC),
             make_protocol_property("DC_calib_phB", &DC_calib_.phB),
             make_protocol_property("DC_calib_phC", &DC_calib_.phC),
+            make_protocol_function("get_DC_calib_uncertainty", *this, &Motor::get_DC_calib_uncertainty),
             make_protocol_property("phase_current_rev_gain", &phase_current_rev_gain_),
             make_protocol_ro_property("thermal_current_lim", &thermal_current_lim_),
+            make_protocol_ro_property("winding_temp", &winding_temp_),
+            make_protocol_ro_property("housing_temp", &housing_temp_),
+            make_protocol_function("reset_thermal_model", *this, &Motor::reset_thermal_model, "temp"),
+            make_protocol_ro_property("rl_fit_error", &rl_fit_error_),
             make_protocol_function("get_inverter_temp", *this, &Motor::get_inverter_temp),
+            make_protocol_object("power_meter",
+                make_protocol_ro_property("electrical_power", &electrical_power_),
+                make_protocol_ro_property("time", &power_meter_.time),
+                make_protocol_ro_property("energy_in", &power_meter_.energy_in),
+                make_protocol_ro_property("energy_regen", &power_meter_.energy_regen),
+                make_protocol_ro_property("brake_energy", &power_meter_.brake_energy),
+                make_protocol_ro_property("I_sq_time", &power_meter_.I_sq_time)
+            ),
+            make_protocol_function("get_rms_current", *this, &Motor::get_rms_current),
+            make_protocol_function("reset_power_meter", *this, &Motor::reset_power_meter),
             make_protocol_object("current_control",
                 make_protocol_property("p_gain", &current_control_.p_gain),
                 make_protocol_property("i_gain", &current_control_.i_gain),
@@ -197,6 +324,9 @@ public:
                 make_protocol_property("Iq_setpoint", &current_control_.Iq_setpoint),
                 make_protocol_property("Iq_measured", &current_control_.Iq_measured),
                 make_protocol_property("Id_measured", &current_control_.Id_measured),
+                make_protocol_ro_property("Id_setpoint", &current_control_.Id_setpoint),
+                make_protocol_ro_property("Id_field_weakening", &current_control_.Id_field_weakening),
+                make_protocol_ro_property("mod_demand", &current_control_.mod_demand),
                 make_protocol_property("I_measured_report_filter_k", &current_control_.I_measured_report_filter_k),
                 make_protocol_ro_property("max_allowed_current", &current_control_.max_allowed_current),
                 make_protocol_ro_property("overcurrent_trip_level", &current_control_.overcurrent_trip_level)
@@ -226,15 +356,48 @@ public:
                 make_protocol_property("resistance_calib_max_voltage", &config_.resistance_calib_max_voltage),
                 make_protocol_property("phase_inductance", &config_.phase_inductance),
                 make_protocol_property("phase_resistance", &config_.phase_resistance),
+                make_protocol_property("enable_rl_identification", &config_.enable_rl_identification),
+                make_protocol_property("rl_identification_duration", &config_.rl_identification_duration),
+                make_protocol_property("rl_identification_max_fit_error", &config_.rl_identification_max_fit_error),
                 make_protocol_property("direction", &config_.direction),
                 make_protocol_property("motor_type", &config_.motor_type),
-                make_protocol_property("current_lim", &config_.current_lim),
+                make_protocol_property("current_lim", &config_.current_lim,
+                    [](void* ctx) { static_cast<Motor*>(ctx)->update_mtpa_table(); }, this),
                 make_protocol_property("current_lim_tolerance", &config_.current_lim_tolerance),
+                make_protocol_property("dc_calib_tau", &config_.dc_calib_tau),
+                make_protocol_property("dc_calib_tolerance", &config_.dc_calib_tolerance),
+                make_protocol_property("dc_calib_min_duration", &config_.dc_calib_min_duration),
                 make_protocol_property("inverter_temp_limit_lower", &config_.inverter_temp_limit_lower),
                 make_protocol_property("inverter_temp_limit_upper", &config_.inverter_temp_limit_upper),
+                make_protocol_property("enable_winding_thermal_model", &config_.enable_winding_thermal_model),
+                make_protocol_property("winding_thermal_resistance", &config_.winding_thermal_resistance),
+                make_protocol_property("winding_thermal_time_constant", &config_.winding_thermal_time_constant),
+                make_protocol_property("housing_thermal_resistance", &config_.housing_thermal_resistance),
+                make_protocol_property("housing_thermal_time_constant", &config_.housing_thermal_time_constant),
+                make_protocol_property("ambient_temp", &config_.ambient_temp),
+                make_protocol_property("winding_temp_limit_lower", &config_.winding_temp_limit_lower),
+                make_protocol_property("winding_temp_limit_upper", &config_.winding_temp_limit_upper),
                 make_protocol_property("requested_current_range", &config_.requested_current_range),
                 make_protocol_property("current_control_bandwidth", &config_.current_control_bandwidth,
-                    [](void* ctx) { static_cast<Motor*>(ctx)->update_current_controller_gains(); }, this)
+                    [](void* ctx) { static_cast<Motor*>(ctx)->update_current_controller_gains(); }, this),
+                make_protocol_property("current_control_antiwindup_gain", &config_.current_control_antiwindup_gain),
+                make_protocol_property("max_modulation", &config_.max_modulation),
+                make_protocol_property("enable_current_decoupling", &config_.enable_current_decoupling),
+                make_protocol_property("enable_bemf_feedforward", &config_.enable_bemf_feedforward),
+                make_protocol_property("flux_linkage", &config_.flux_linkage,
+                    [](void* ctx) { static_cast<Motor*>(ctx)->update_mtpa_table(); }, this),
+                make_protocol_property("enable_field_weakening", &config_.enable_field_weakening),
+                make_protocol_property("fw_mod_margin", &config_.fw_mod_margin),
+                make_protocol_property("fw_gain", &config_.fw_gain),
+                make_protocol_property("fw_current_lim", &config_.fw_current_lim),
+                make_protocol_property("fw_min_vel", &config_.fw_min_vel),
+                make_protocol_property("enable_mtpa", &config_.enable_mtpa),
+                make_protocol_property("saliency_inductance", &config_.saliency_inductance,
+                    [](void* ctx) { static_cast<Motor*>(ctx)->update_mtpa_table(); }, this),
+                make_protocol_property("enable_deadtime_compensation", &config_.enable_deadtime_compensation),
+                make_protocol_property("deadtime", &config_.deadtime),
+                make_protocol_property("switch_voltage_drop", &config_.switch_voltage_drop),
+                make_protocol_property("deadtime_comp_current_band", &config_.deadtime_comp_current_band)
             )
         );
     }
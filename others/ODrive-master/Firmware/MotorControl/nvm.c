@@ -28,12 +28,17 @@
 * To write a new block of data atomically we first mark all associated fields
 * as "invalid" (in the allocation table) then write the data and then mark the
 * fields as "valid" (in the direction of increasing address).
+*
+* A block can contain a list of named, variable-length blobs (see NVM_write_blob).
+* Each blob has a header with its name, length and a CRC of its data, so
+* blobs can be located and validated independently of the rest of the block.
 */
 
 #include "nvm.h"
 
 #include <stm32f405xx.h>
 #include <stm32f4xx_hal.h>
+#include <stddef.h>
 #include <string.h>
 
 #if defined(STM32F405xx)
@@ -50,6 +55,18 @@
 #error "unknown flash sector size"
 #endif
 
+#define NVM_BLOB_MAGIC 0x424f4c42UL // "BLOB"
+#define NVM_BLOB_CRC16_INIT 0xabcd
+#define NVM_BLOB_CRC16_POLYNOMIAL 0x3d65
+
+typedef struct {
+    uint32_t magic;
+    char name[NVM_BLOB_NAME_LENGTH];
+    uint32_t length;        //!< data length in bytes, excluding the header
+    uint16_t data_crc16;
+    uint16_t header_crc16;  //!< CRC over all preceding header fields
+} blob_header_t;
+
 typedef enum {
     VALID = 0,
     INVALID = 1,
@@ -370,6 +387,83 @@ int NVM_commit(void) {
     return status;
 }
 
+static uint16_t blob_crc16(uint16_t crc, const uint8_t *data, size_t length) {
+    for (; length; --length, ++data) {
+        crc ^= (uint16_t)(*data << 8);
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ NVM_BLOB_CRC16_POLYNOMIAL) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+// @brief Returns the number of bytes that a blob of the given data length
+// occupies in a block, including its header and padding.
+size_t NVM_get_blob_size(size_t length) {
+    return (sizeof(blob_header_t) + length + 7) & ~(size_t)7;
+}
+
+// @brief Writes a named blob to the current data block that was opened with NVM_start_write.
+//
+// Blobs that belong to the same list must be written back to back,
+// each at the offset of the previous one plus NVM_get_blob_size().
+//
+// @param offset: The offset in bytes, 0 being the beginning of the staging block.
+// @param name: Null-terminated name, at most NVM_BLOB_NAME_LENGTH - 1 characters long
+// @param data: Pointer to the data that should be written
+// @param length: Data length in bytes
+int NVM_write_blob(size_t offset, const char *name, const uint8_t *data, size_t length) {
+    if (strlen(name) >= NVM_BLOB_NAME_LENGTH)
+        return -1;
+
+    blob_header_t header = {
+        .magic = NVM_BLOB_MAGIC,
+        .length = length,
+        .data_crc16 = blob_crc16(NVM_BLOB_CRC16_INIT, data, length)
+    };
+    strncpy(header.name, name, NVM_BLOB_NAME_LENGTH);
+    header.header_crc16 = blob_crc16(NVM_BLOB_CRC16_INIT, (const uint8_t *)&header, offsetof(blob_header_t, header_crc16));
+
+    int status = NVM_write(offset, (uint8_t *)&header, sizeof(header));
+    if (status)
+        return status;
+    return NVM_write(offset + sizeof(header), (uint8_t *)data, length);
+}
+
+// @brief Finds a named blob in the latest committed block and reads its data.
+//
+// The blob list is searched from the given offset up to the first location
+// that does not hold a valid blob header.
+//
+// @param offset: offset in bytes of the first blob of the list
+// @param name: name of the blob
+// @param data: buffer to write to
+// @param max_length: size of the buffer in bytes
+// @param length: set to the data length of the blob
+// @returns 0 on success or a non-zero error code if the blob was not found,
+//          is too large or its CRC does not match
+int NVM_read_blob(size_t offset, const char *name, uint8_t *data, size_t max_length, size_t *length) {
+    blob_header_t header;
+    for (;;) {
+        if (NVM_read(offset, (uint8_t *)&header, sizeof(header)))
+            return -1;
+        if (header.magic != NVM_BLOB_MAGIC ||
+            header.header_crc16 != blob_crc16(NVM_BLOB_CRC16_INIT, (const uint8_t *)&header, offsetof(blob_header_t, header_crc16)))
+            return -1;
+        if (!strncmp(header.name, name, NVM_BLOB_NAME_LENGTH))
+            break;
+        offset += NVM_get_blob_size(header.length);
+    }
+
+    if (header.length > max_length)
+        return -1;
+    if (NVM_read(offset + sizeof(header), data, header.length))
+        return -1;
+    if (blob_crc16(NVM_BLOB_CRC16_INIT, data, header.length) != header.data_crc16)
+        return -1;
+    *length = header.length;
+    return 0;
+}
+
 
 #include <cmsis_os.h>
 /** @brief Call this at startup to test/demo the NVM driver
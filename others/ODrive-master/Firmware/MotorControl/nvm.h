@@ -12,6 +12,7 @@ extern "C" {
 
 /* Exported types ------------------------------------------------------------*/
 /* Exported constants --------------------------------------------------------*/
+#define NVM_BLOB_NAME_LENGTH 16 // including the terminating null character
 /* Exported variables --------------------------------------------------------*/
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions --------------------------------------------------------*/
@@ -24,6 +25,9 @@ int NVM_read(size_t offset, uint8_t *data, size_t length);
 int NVM_start_write(size_t length);
 int NVM_write(size_t offset, uint8_t *data, size_t length);
 int NVM_commit(void);
+size_t NVM_get_blob_size(size_t length);
+int NVM_write_blob(size_t offset, const char *name, const uint8_t *data, size_t length);
+int NVM_read_blob(size_t offset, const char *name, uint8_t *data, size_t max_length, size_t *length);
 void NVM_demo(void);
 
 #ifdef __cplusplus
@@ -3,6 +3,7 @@
 * 
 * The NVM stores consecutive one-to-one copies of arbitrary objects.
 * The types of these objects are passed as template arguments to Config<Ts...>.
+* These are followed by a list of named, variable-length blobs (see ConfigBlob).
 */
 
 /* Includes ------------------------------------------------------------------*/
@@ -33,6 +34,17 @@ static constexpr uint16_t config_version = 0x0001;
 /* Private function prototypes -----------------------------------------------*/
 /* Function implementations --------------------------------------------------*/
 
+// @brief A named, variable-length object, such as a calibration table,
+// that is stored behind the config objects.
+//
+// Each blob is validated with its own CRC, so it can be loaded on demand
+// (see Config<Ts...>::load_blob) after the config objects were loaded.
+struct ConfigBlob {
+    const char* name;   // at most NVM_BLOB_NAME_LENGTH - 1 characters
+    const void* data;
+    size_t length;      // [bytes]
+};
+
 
 // @brief Manages configuration load and store operations from and to NVM
 //
@@ -65,6 +77,11 @@ struct Config<T, Ts...> {
         return sizeof(T) + Config<Ts...>::get_size();
     }
 
+    // @brief Offset of the blob list in the NVM block: behind the config objects and their CRC
+    static size_t get_blob_offset() {
+        return (get_size() + 2 + 7) & ~(size_t)7;
+    }
+
     // @brief Loads one or more consecutive objects from the NVM.
     // During loading this function also calculates the CRC over the loaded data.
     // @param offset: 0 means that the function should start reading at the beginning
@@ -122,20 +139,39 @@ struct Config<T, Ts...> {
     // changes of the config structs during firmware update. Note that if the total
     // config data length changes, the CRC validation will fail even if the developer
     // forgets to update the config version number.
-    static int safe_store_config(const T* val0, const Ts* ... vals) {
+    //
+    // The blobs are written in the same block, behind the CRC.
+    static int safe_store_config(const ConfigBlob* blobs, size_t n_blobs, const T* val0, const Ts* ... vals) {
         size_t size = Config<T, Ts...>::get_size() + 2;
-        //printf("config is %d bytes\r\n", size); osDelay(5);
-        if (size > NVM_get_max_write_length())
+        size_t blob_offset = get_blob_offset();
+        size_t total_size = blob_offset;
+        for (size_t i = 0; i < n_blobs; ++i)
+            total_size += NVM_get_blob_size(blobs[i].length);
+        //printf("config is %d bytes\r\n", total_size); osDelay(5);
+        if (total_size > NVM_get_max_write_length())
             return -1;
-        if (NVM_start_write(size))
+        if (NVM_start_write(total_size))
             return -1;
         uint16_t crc16 = CONFIG_CRC16_INIT ^ config_version;
         if (Config<T, Ts...>::store_config(0, &crc16, val0, vals...))
             return -1;
         if (Config<uint8_t, uint8_t>::store_config(size - 2, nullptr, (uint8_t *)&crc16 + 1, (uint8_t *)&crc16))
             return -1;
+        for (size_t i = 0; i < n_blobs; ++i) {
+            if (NVM_write_blob(blob_offset, blobs[i].name, (const uint8_t *)blobs[i].data, blobs[i].length))
+                return -1;
+            blob_offset += NVM_get_blob_size(blobs[i].length);
+        }
         if (NVM_commit())
             return -1;
         return 0;
     }
+
+    // @brief Loads a blob that was stored by safe_store_config.
+    // This only reads the blob itself, so it can be called any time after NVM_init.
+    // @param data: buffer of max_length bytes
+    // @param length: set to the length of the loaded blob
+    static int load_blob(const char* name, void* data, size_t max_length, size_t* length) {
+        return NVM_read_blob(get_blob_offset(), name, (uint8_t *)data, max_length, length);
+    }
 };
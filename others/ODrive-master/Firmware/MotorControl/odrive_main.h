@@ -33,9 +33,9 @@ extern "C" {
 //default timeout waiting for phase measurement signals
 #define PH_CURRENT_MEAS_TIMEOUT 2 // [ms]
 
-//TODO clean this up
-static const float current_meas_period = CURRENT_MEAS_PERIOD;
-static const int current_meas_hz = CURRENT_MEAS_HZ;
+// Derived from board_config.pwm_frequency at boot, see configure_pwm_timing()
+extern float current_meas_period; // [s]
+extern int current_meas_hz; // [Hz]
 // extern const float elec_rad_per_enc;
 extern uint32_t _reboot_cookie;
 extern bool user_config_loaded_;
@@ -81,6 +81,13 @@ struct BoardConfig_t {
                                                                         //<! This protects against cases in which the power supply fails to dissipate
                                                                         //<! the brake power if the brake resistor is disabled.
                                                                         //<! The default is 26V for the 24V board version and 52V for the 48V board version.
+    float pwm_frequency = (float)TIM_1_8_CLOCK_HZ / (float)(2 * TIM_1_8_PERIOD_CLOCKS); //<! [Hz] motor PWM frequency, requires a reboot.
+                                                                                        //<! The current control loop runs at pwm_frequency / (TIM_1_8_RCR + 1).
+    bool enable_pwm_double_update = false; //<! requires a reboot. Update the PWM timers at both counter extremes:
+                                           //<! the current loop runs at pwm_frequency and new timings are latched
+                                           //<! half a PWM period after the current measurement if they are ready by then.
+                                           //<! Requires axis.config.enable_isr_current_loop on all axes, otherwise it is
+                                           //<! reset to false at boot. Best used with a pwm_frequency of 16kHz or less.
     PWMMapping_t pwm_mappings[GPIO_COUNT];
     PWMMapping_t analog_mappings[GPIO_COUNT];
 };
@@ -113,14 +120,22 @@ inline ENUMTYPE operator ~ (ENUMTYPE a) { return static_cast<ENUMTYPE>(~static_c
 // ODrive specific includes
 #include <utils.h>
 #include <low_level.h>
+#include <pos_vel_estimator.hpp>
 #include <encoder.hpp>
 #include <sensorless_estimator.hpp>
+#include <biquad.hpp>
+#include <autotune.hpp>
 #include <controller.hpp>
 #include <motor.hpp>
 #include <trapTraj.hpp>
+#include <sCurveTraj.hpp>
+#include <pvtTraj.hpp>
 #include <axis.hpp>
 #include <communication/communication.h>
 
+void load_calibration_tables(Axis& axis);
+float plan_coordinated_move(const float goal_points[AXIS_COUNT], float min_duration);
+
 #endif // __cplusplus
 
 
@@ -128,5 +143,6 @@ inline ENUMTYPE operator ~ (ENUMTYPE a) { return static_cast<ENUMTYPE>(~static_c
 void save_configuration(void);
 void erase_configuration(void);
 void enter_dfu_mode(void);
+void start_coordinated_move(void);
 
 #endif /* __ODRIVE_MAIN_H */
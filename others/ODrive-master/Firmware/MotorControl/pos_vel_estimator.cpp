@@ -0,0 +1,78 @@
+#include <math.h>
+#include "odrive_main.h"
+#include "utils.h"
+
+// The Riccati recursion of the Kalman filter converges in a few thousand
+// periods for any sensible configuration
+static constexpr uint32_t MAX_RICCATI_ITERATIONS = 10000;
+
+// @brief Computes the gains for the given configuration
+// @param bandwidth: of the PLL [rad/s]
+// @param dt: time between two updates [s]
+// @returns false if the gains are unstable or the configuration is invalid
+bool PosVelEstimator::configure(const Config_t& config, float bandwidth, float dt) {
+    dt_ = dt;
+    reset();
+    use_accel_ = false;
+    disturbance_gain_ = 0.0f;
+
+    if (config.mode == ESTIMATOR_PLL) {
+        float kp = 2.0f * bandwidth;    // basic conversion to discrete time
+        float ki = 0.25f * (kp * kp);   // critically damped
+        pos_gain_ = dt * kp;
+        vel_gain_ = dt * ki;
+        // Check that we don't get problems with discrete time approximation
+        return dt * kp < 1.0f;
+    }
+
+    if (config.mode != ESTIMATOR_KALMAN
+            || !(config.accel_noise > 0.0f && config.disturbance_noise >= 0.0f && config.pos_noise > 0.0f && dt > 0.0f))
+        return false;
+
+    // The state is position, velocity and disturbance in units per period
+    // (p, v * dt, d * dt^2), which keeps the covariances well conditioned in
+    // single precision. The transition is F = [1 1 1/2; 0 1 1; 0 0 1], the
+    // acceleration noise enters through [1/2 1 0] and the disturbance is a
+    // random walk. The covariance P = [a b c; b d e; c e f] is symmetric.
+    float q_accel = config.accel_noise * dt * dt;
+    q_accel *= q_accel;
+    float q_dist = config.disturbance_noise * dt * dt * dt;
+    q_dist *= q_dist;
+    float r = config.pos_noise * config.pos_noise;
+    float a = 0.0f, b = 0.0f, c = 0.0f, d = 0.0f, e = 0.0f, f = 0.0f;
+    float k[3] = {0.0f, 0.0f, 0.0f};
+    for (uint32_t i = 0; i < MAX_RICCATI_ITERATIONS; ++i) {
+        // Prediction: P = F P F^T + Q
+        float fp00 = a + b + 0.5f * c, fp01 = b + d + 0.5f * e, fp02 = c + e + 0.5f * f;
+        float fp11 = d + e, fp12 = e + f;
+        a = fp00 + fp01 + 0.5f * fp02 + 0.25f * q_accel;
+        b = fp01 + fp02 + 0.5f * q_accel;
+        c = fp02;
+        d = fp11 + fp12 + q_accel;
+        e = fp12;
+        f = f + q_dist;
+
+        // Correction with the position measurement: P = (I - K H) P
+        float s = a + r;
+        float k_next[3] = {a / s, b / s, c / s};
+        d -= k_next[1] * b;
+        e -= k_next[1] * c;
+        f -= k_next[2] * c;
+        a -= k_next[0] * a;
+        b -= k_next[0] * b;
+        c -= k_next[0] * c;
+
+        bool converged = k_next[0] == k[0] && k_next[1] == k[1] && k_next[2] == k[2];
+        k[0] = k_next[0];
+        k[1] = k_next[1];
+        k[2] = k_next[2];
+        if (converged)
+            break;
+    }
+
+    pos_gain_ = k[0];
+    vel_gain_ = k[1] / dt;
+    disturbance_gain_ = k[2] / (dt * dt);
+    use_accel_ = true;
+    return pos_gain_ > 0.0f && pos_gain_ < 1.0f;
+}
@@ -0,0 +1,75 @@
+#ifndef __POS_VEL_ESTIMATOR_HPP
+#define __POS_VEL_ESTIMATOR_HPP
+
+#ifndef __ODRIVE_MAIN_H
+#error "This file should not be included directly. Include odrive_main.h instead."
+#endif
+
+// @brief Position and velocity tracking loop shared by the encoder and the
+// sensorless estimator
+//
+// The owner keeps the position and velocity estimates and its phase detector:
+// each period it advances the position by predict(), measures the error of the
+// predicted position and applies correct() to it.
+// ESTIMATOR_PLL is the critically damped PLL of the given bandwidth.
+// ESTIMATOR_KALMAN is the steady-state Kalman filter of a rigid inertia that
+// is accelerated by the measured current, with a random walk disturbance
+// acceleration for friction and load, and the position measurement noise. The
+// current is a much better predictor of the velocity than the position error,
+// so the gains can be lower, which reduces both the lag during accelerations
+// and the quantization noise at low speed.
+// See tools/control_simulation/PosVelEstimator.py for the comparison and
+// test/test_pos_vel_estimator.cpp for the unit test.
+class PosVelEstimator {
+public:
+    enum Mode_t {
+        ESTIMATOR_PLL = 0,
+        ESTIMATOR_KALMAN = 1,
+    };
+
+    struct Config_t {
+        Mode_t mode = ESTIMATOR_PLL;
+        float accel_noise = 3.0e4f;         // [units/s^2] RMS acceleration that the current doesn't explain
+        float disturbance_noise = 1.0e6f;   // [units/s^3] how fast friction and load may change
+        float pos_noise = 0.29f;            // [units] RMS noise of the position measurement, 1/sqrt(12) counts for an encoder
+    };
+
+    bool configure(const Config_t& config, float bandwidth, float dt);
+    void reset() { disturbance_ = 0.0f; }
+
+    // @brief Advances the velocity by one period
+    // @param accel: acceleration due to the measured current [units/s^2], ignored by the PLL
+    // @returns the position increment over the period [units]
+    float predict(float* vel, float accel) {
+        accel = use_accel_ ? accel + disturbance_ : 0.0f;
+        float delta = dt_ * (*vel + 0.5f * dt_ * accel);
+        *vel += dt_ * accel;
+        return delta;
+    }
+
+    // @brief Corrects the velocity by the error of the predicted position
+    // @returns the position correction [units]
+    float correct(float* vel, float pos_err) {
+        *vel += vel_gain_ * pos_err;
+        disturbance_ += disturbance_gain_ * pos_err;
+        return pos_gain_ * pos_err;
+    }
+
+    static auto make_config_definitions(Config_t& config, void (*written_hook)(void*), void* ctx) {
+        return make_protocol_member_list(
+            make_protocol_property("mode", &config.mode, written_hook, ctx),
+            make_protocol_property("accel_noise", &config.accel_noise, written_hook, ctx),
+            make_protocol_property("disturbance_noise", &config.disturbance_noise, written_hook, ctx),
+            make_protocol_property("pos_noise", &config.pos_noise, written_hook, ctx)
+        );
+    }
+
+    float dt_ = 0.0f;
+    float pos_gain_ = 0.0f;             // [units / unit]
+    float vel_gain_ = 0.0f;             // [units/s / unit]
+    float disturbance_gain_ = 0.0f;     // [units/s^2 / unit]
+    bool use_accel_ = false;
+    float disturbance_ = 0.0f;          // [units/s^2] acceleration that the current doesn't explain
+};
+
+#endif // __POS_VEL_ESTIMATOR_HPP
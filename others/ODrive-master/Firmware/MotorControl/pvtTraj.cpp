@@ -0,0 +1,117 @@
+#include "odrive_main.h"
+#include "utils.h"
+
+PvtTrajectory::PvtTrajectory(Config_t& config) : config_(config) {}
+
+// @brief Appends a point to the queue
+// @param dt: duration of the segment from the previous point to this one [s]
+// @returns false if the queue is full or dt is not positive
+bool PvtTrajectory::push(float dt, float pos, float vel) {
+    if (!(dt > 0.0f))
+        return false;
+    uint32_t mask = cpu_enter_critical();
+    // Points before a pending clear are free already
+    size_t tail = clear_requested_ ? clear_head_ : queue_tail_;
+    size_t head = queue_head_;
+    size_t next_head = (head + 1) % QUEUE_SIZE;
+    bool full = next_head == tail;
+    if (!full) {
+        queue_[head] = { dt, pos, vel };
+        __DMB(); // the point must be complete before the control loop sees the new head
+        queue_head_ = next_head;
+    }
+    cpu_exit_critical(mask);
+    return !full;
+}
+
+// @brief Discards all queued points. The axis stops at the end of the current segment.
+// The control loop drops the points when it next reads the queue, points
+// pushed after this call are kept.
+void PvtTrajectory::clear() {
+    uint32_t mask = cpu_enter_critical();
+    clear_head_ = queue_head_;
+    clear_requested_ = true;
+    cpu_exit_critical(mask);
+}
+
+// @brief Returns the number of queued points, not counting those discarded by clear()
+uint32_t PvtTrajectory::get_queue_depth() {
+    uint32_t mask = cpu_enter_critical();
+    size_t tail = clear_requested_ ? clear_head_ : queue_tail_;
+    size_t depth = (queue_head_ + QUEUE_SIZE - tail) % QUEUE_SIZE;
+    cpu_exit_critical(mask);
+    return (uint32_t)depth;
+}
+
+// @brief Drops the points discarded by clear(), called by the control loop
+void PvtTrajectory::apply_clear() {
+    if (!clear_requested_)
+        return;
+    uint32_t mask = cpu_enter_critical();
+    queue_tail_ = clear_head_;
+    clear_requested_ = false;
+    cpu_exit_critical(mask);
+    cleared_ = true;
+}
+
+// @brief Starts consuming the queue. The first segment starts at the given state.
+void PvtTrajectory::start(float pos, float vel, uint32_t loop_count) {
+    apply_clear();
+    in_segment_ = false;
+    cleared_ = false;
+    end_ = { 0.0f, pos, vel };
+    last_loop_count_ = loop_count;
+}
+
+// @brief Advances to the given control loop iteration and returns the setpoint
+//
+// If the queue runs empty, the axis stops at the last point. This is counted as
+// an underrun if the last point has a non-zero velocity, unless the queue was
+// emptied by clear(). Streaming resumes from standstill at that point when
+// new points arrive.
+PvtTrajectory::Step_t PvtTrajectory::update(uint32_t loop_count) {
+    apply_clear();
+
+    // Note: uint32_t loop count delta is OK across overflow
+    t_ += (loop_count - last_loop_count_) * current_meas_period;
+    last_loop_count_ = loop_count;
+
+    while (!in_segment_ || t_ >= dt_) {
+        if (in_segment_) {
+            t_ -= dt_;
+        } else {
+            t_ = 0.0f;
+        }
+
+        size_t tail = queue_tail_;
+        if (tail == queue_head_) {
+            if (in_segment_ && end_.vel != 0.0f && !cleared_)
+                underrun_count_++;
+            in_segment_ = false;
+            cleared_ = false;
+            end_.vel = 0.0f;
+            return { end_.pos, 0.0f, 0.0f };
+        }
+
+        // Cubic Hermite segment from the end of the previous one to the next point
+        Point_t start = end_;
+        end_ = queue_[tail];
+        queue_tail_ = (tail + 1) % QUEUE_SIZE;
+        cleared_ = false;
+
+        dt_ = end_.dt;
+        float inv_dt = 1.0f / dt_;
+        float slope = (end_.pos - start.pos) * inv_dt;
+        c0_ = start.pos;
+        c1_ = start.vel;
+        c2_ = (3.0f * slope - 2.0f * start.vel - end_.vel) * inv_dt;
+        c3_ = (start.vel + end_.vel - 2.0f * slope) * SQ(inv_dt);
+        in_segment_ = true;
+    }
+
+    Step_t step;
+    step.Y   = c0_ + t_ * (c1_ + t_ * (c2_ + t_ * c3_));
+    step.Yd  = c1_ + t_ * (2.0f * c2_ + t_ * 3.0f * c3_);
+    step.Ydd = 2.0f * c2_ + t_ * 6.0f * c3_;
+    return step;
+}
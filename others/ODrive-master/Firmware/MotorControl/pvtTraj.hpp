@@ -0,0 +1,78 @@
+#ifndef _PVT_TRAJ_H
+#define _PVT_TRAJ_H
+
+// @brief Queue of streamed position/velocity/time (PVT) points
+//
+// The host appends points to a ring buffer. Each point ends a segment
+// that starts at the previous point and lasts dt. The control loop consumes
+// the points and interpolates between them with cubic Hermite polynomials,
+// which also yields the velocity and acceleration feed-forward.
+//
+// push() and clear() may be called concurrently from several communication
+// threads (USB, UART, CAN) and are serialized by a critical section. The tail
+// is only ever moved by the control loop in start() and update(), clear() just
+// requests that. The queue depth is computed from both ends when it is read.
+class PvtTrajectory {
+public:
+    struct Config_t {
+        float A_per_css = 0.0f;  // [A/(count/s^2)]
+    };
+
+    typedef TrapezoidalTrajectory::Step_t Step_t;
+
+    struct Point_t {
+        float dt;   // [s] duration of the segment that ends at this point
+        float pos;  // [count]
+        float vel;  // [count/s]
+    };
+
+    static constexpr size_t QUEUE_SIZE = 128;
+
+    explicit PvtTrajectory(Config_t& config);
+    bool push(float dt, float pos, float vel);
+    void clear();
+    uint32_t get_queue_depth();
+    void start(float pos, float vel, uint32_t loop_count);
+    Step_t update(uint32_t loop_count);
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_ro_property("queue_capacity", &queue_capacity_),
+            make_protocol_ro_property("underrun_count", &underrun_count_),
+            make_protocol_object("config",
+                make_protocol_property("A_per_css", &config_.A_per_css)
+            ),
+            make_protocol_function("push", *this, &PvtTrajectory::push, "dt", "pos", "vel"),
+            make_protocol_function("clear", *this, &PvtTrajectory::clear),
+            make_protocol_function("get_queue_depth", *this, &PvtTrajectory::get_queue_depth)
+        );
+    }
+
+    Axis* axis_ = nullptr;  // set by Axis constructor
+    Config_t& config_;
+
+    Point_t queue_[QUEUE_SIZE];
+    volatile size_t queue_head_ = 0;  // next index to write, only written by push()
+    volatile size_t queue_tail_ = 0;  // next index to read, only written by apply_clear() and update()
+    volatile size_t clear_head_ = 0;  // the points before this index are discarded by apply_clear()
+    volatile bool clear_requested_ = false;
+
+    uint32_t queue_capacity_ = QUEUE_SIZE - 1;
+    uint32_t underrun_count_ = 0;
+
+private:
+    void apply_clear();
+
+    bool in_segment_ = false;
+    bool cleared_ = false;      // the current segment was kept by clear(), its end isn't an underrun
+    float t_ = 0.0f;            // [s] time since the start of the current segment
+    float dt_ = 0.0f;           // [s] duration of the current segment
+    uint32_t last_loop_count_ = 0;
+    Point_t end_ = { 0.0f, 0.0f, 0.0f };  // end of the current segment, or the held point
+    float c0_ = 0.0f;           // position polynomial of the current segment
+    float c1_ = 0.0f;
+    float c2_ = 0.0f;
+    float c3_ = 0.0f;
+};
+
+#endif
@@ -0,0 +1,156 @@
+#include <math.h>
+#include "odrive_main.h"
+#include "utils.h"
+
+// Symbol                     Description
+// Tj, Tc                     Duration of the jerk and constant acceleration segments of a velocity change
+// Ta, Tv and Td              Duration of the acceleration, coasting and deceleration phases
+// Xi and Vi                  Initial conditions (the initial acceleration is assumed to be zero)
+// Xf                         Position set-point
+// s                          Direction (sign) of the trajectory
+// Vmax, Amax, Dmax and Jmax  Kinematic bounds
+// Vr                         Reached velocity
+
+// Number of bisection steps to find the reached velocity of short moves in
+// which a velocity change doesn't reach its acceleration limit. The search
+// interval is at most max(Amax, Dmax)^2 / Jmax + |Vi| wide, which this
+// resolves to better than 1e-7 of its width.
+static constexpr int kVrSearchSteps = 24;
+
+// @brief Durations of a jerk-limited change of velocity that starts and ends without acceleration
+// @param dV: magnitude of the velocity change [count/s]
+static void plan_velocity_change(float dV, float Amax, float Jmax, float* Tj, float* Tc) {
+    if (dV * Jmax >= SQ(Amax)) {
+        // Acceleration limit is reached
+        *Tj = Amax / Jmax;
+        *Tc = dV / Amax - *Tj;
+    } else {
+        *Tj = sqrtf(dV / Jmax);
+        *Tc = 0.0f;
+    }
+}
+
+// @brief Displacement of the acceleration and deceleration phases of a profile with reached velocity Vr.
+// The velocity during a velocity change is point symmetric, so its mean is
+// the mean of the start and end velocities.
+static float ramp_displacement(float Vi, float Vr, float Amax, float Dmax, float Jmax) {
+    float Tj, Tc;
+    plan_velocity_change(fabsf(Vr - Vi), Amax, Jmax, &Tj, &Tc);
+    float Ta = 2.0f * Tj + Tc;
+    plan_velocity_change(fabsf(Vr), Dmax, Jmax, &Tj, &Tc);
+    float Td = 2.0f * Tj + Tc;
+    return 0.5f * (Vi + Vr) * Ta + 0.5f * Vr * Td;
+}
+
+SCurveTrajectory::SCurveTrajectory(Config_t& config) : config_(config) {}
+
+bool SCurveTrajectory::planSCurve(float Xf, float Xi, float Vi,
+                                  float Vmax, float Amax, float Dmax, float Jmax) {
+    if (!(Vmax > 0.0f && Amax > 0.0f && Dmax > 0.0f && Jmax > 0.0f))
+        return false;
+
+    float dX = Xf - Xi;  // Distance to travel
+    float dXstop = ramp_displacement(Vi, Vi, Amax, Dmax, Jmax); // Minimum stopping displacement
+    float s = std::signbit(dX - dXstop) ? -1.0f : 1.0f; // Sign of coast velocity (if any)
+
+    // The displacement grows monotonically with the reached velocity above max(0, s*Vi).
+    // If the move is too short to reach Vmax, solve for the reached velocity.
+    float v = Vmax;
+    float v_min = std::max(0.0f, s * Vi);
+    float d = s * dX;
+    if (v_min < Vmax && s * ramp_displacement(Vi, s * Vmax, Amax, Dmax, Jmax) > d) {
+        // Above v_lim both velocity changes reach their acceleration limits
+        float u = s * Vi;
+        float v_lim = std::max(std::max(u + SQ(Amax) / Jmax, SQ(Dmax) / Jmax), v_min);
+        if (s * ramp_displacement(Vi, s * v_lim, Amax, Dmax, Jmax) <= d) {
+            // The displacement is quadratic in v:
+            // (v^2 - u^2) / (2 Amax) + (u + v) Amax / (2 Jmax) + v^2 / (2 Dmax) + v Dmax / (2 Jmax) = d
+            float a = 0.5f / Amax + 0.5f / Dmax;
+            float b = 0.5f * (Amax + Dmax) / Jmax;
+            float c = -0.5f * SQ(u) / Amax + 0.5f * u * Amax / Jmax - d;
+            // Numerically stable form of the positive root, c <= 0
+            v = -2.0f * c / (b + sqrtf(SQ(b) - 4.0f * a * c));
+        } else {
+            // At least one velocity change is jerk limited. The displacement then has
+            // terms in sqrt(v) and sqrt(v - u), which lead to a quartic, so bisect instead.
+            float v_max = std::min(v_lim, Vmax);
+            for (int i = 0; i < kVrSearchSteps; ++i) {
+                float v_mid = 0.5f * (v_min + v_max);
+                if (s * ramp_displacement(Vi, s * v_mid, Amax, Dmax, Jmax) > d)
+                    v_max = v_mid;
+                else
+                    v_min = v_mid;
+            }
+            v = v_min;
+        }
+    }
+    Vr_ = s * v;
+
+    // Coasting time (the double deceleration move of a too fast start may overshoot a little)
+    float Tv = 0.0f;
+    if (v > 0.0f)
+        Tv = std::max(0.0f, (dX - ramp_displacement(Vi, Vr_, Amax, Dmax, Jmax)) / Vr_);
+
+    float Tj1, Tc1, Tj2, Tc2;
+    plan_velocity_change(fabsf(Vr_ - Vi), Amax, Jmax, &Tj1, &Tc1);
+    plan_velocity_change(fabsf(Vr_), Dmax, Jmax, &Tj2, &Tc2);
+    float j1 = std::copysign(Jmax, Vr_ - Vi);
+    float j2 = std::copysign(Jmax, -Vr_);
+
+    const float durations[NUM_SEGMENTS] = { Tj1, Tc1, Tj1, Tv, Tj2, Tc2, Tj2 };
+    const float jerks[NUM_SEGMENTS] = { j1, 0.0f, -j1, 0.0f, j2, 0.0f, -j2 };
+
+    // Integrate the segments to get the polynomial coefficients
+    float t = 0.0f;
+    float p = Xi;
+    float vel = Vi;
+    float acc = 0.0f;
+    for (size_t k = 0; k < NUM_SEGMENTS; ++k) {
+        if (k == 3) {
+            // Cruise exactly at Vr
+            vel = Vr_;
+            acc = 0.0f;
+        } else if (k == 4) {
+            // Make the deceleration end exactly at Xf
+            p = Xf - 0.5f * Vr_ * (2.0f * Tj2 + Tc2);
+        }
+        float T = durations[k];
+        float j = jerks[k];
+        segments_[k] = { t, p, vel, 0.5f * acc, j * (1.0f / 6.0f) };
+        p += T * (vel + T * (0.5f * acc + T * j * (1.0f / 6.0f)));
+        vel += T * (acc + 0.5f * T * j);
+        acc += T * j;
+        t += T;
+    }
+
+    Tf_ = t;
+    Xi_ = Xi;
+    Xf_ = Xf;
+    Vi_ = Vi;
+
+    return true;
+}
+
+SCurveTrajectory::Step_t SCurveTrajectory::eval(float t) {
+    Step_t trajStep;
+    if (t < 0.0f) {  // Initial Condition
+        trajStep.Y   = Xi_;
+        trajStep.Yd  = Vi_;
+        trajStep.Ydd = 0.0f;
+    } else if (t < Tf_) {
+        size_t k = NUM_SEGMENTS - 1;
+        while (k > 0 && t < segments_[k].t_start)
+            --k;
+        const Segment_t& seg = segments_[k];
+        float tau = t - seg.t_start;
+        trajStep.Y   = seg.c0 + tau * (seg.c1 + tau * (seg.c2 + tau * seg.c3));
+        trajStep.Yd  = seg.c1 + tau * (2.0f * seg.c2 + tau * 3.0f * seg.c3);
+        trajStep.Ydd = 2.0f * seg.c2 + tau * 6.0f * seg.c3;
+    } else {  // Final Condition
+        trajStep.Y   = Xf_;
+        trajStep.Yd  = 0.0f;
+        trajStep.Ydd = 0.0f;
+    }
+
+    return trajStep;
+}
@@ -0,0 +1,64 @@
+#ifndef _SCURVE_TRAJ_H
+#define _SCURVE_TRAJ_H
+
+// @brief Jerk-limited (7 segment S-curve) point to point trajectory
+//
+// The profile accelerates from the initial velocity to the cruise velocity,
+// coasts and decelerates to standstill at the goal. Each of the two velocity
+// changes consists of a jerk, a constant acceleration and a jerk segment.
+// The position of every segment is stored as a cubic polynomial in the time
+// since the start of the segment, so eval() only has to evaluate one cubic.
+class SCurveTrajectory {
+public:
+    struct Config_t {
+        float vel_limit = 20000.0f;   // [count/s]
+        float accel_limit = 5000.0f;  // [count/s^2]
+        float decel_limit = 5000.0f;  // [count/s^2]
+        float jerk_limit = 50000.0f;  // [count/s^3]
+        float A_per_css = 0.0f;       // [A/(count/s^2)]
+    };
+
+    typedef TrapezoidalTrajectory::Step_t Step_t;
+
+    static constexpr size_t NUM_SEGMENTS = 7;
+
+    // @brief Position over one segment: c0 + c1*tau + c2*tau^2 + c3*tau^3
+    // where tau is the time since t_start
+    struct Segment_t {
+        float t_start;  // [s]
+        float c0;       // [count]
+        float c1;       // [count/s]
+        float c2;       // [count/s^2] half the acceleration
+        float c3;       // [count/s^3] a sixth of the jerk
+    };
+
+    explicit SCurveTrajectory(Config_t& config);
+    bool planSCurve(float Xf, float Xi, float Vi,
+                    float Vmax, float Amax, float Dmax, float Jmax);
+    Step_t eval(float t);
+
+    auto make_protocol_definitions() {
+        return make_protocol_member_list(
+            make_protocol_object("config",
+                make_protocol_property("vel_limit", &config_.vel_limit),
+                make_protocol_property("accel_limit", &config_.accel_limit),
+                make_protocol_property("decel_limit", &config_.decel_limit),
+                make_protocol_property("jerk_limit", &config_.jerk_limit),
+                make_protocol_property("A_per_css", &config_.A_per_css)
+            )
+        );
+    }
+
+    Axis* axis_ = nullptr;  // set by Axis constructor
+    Config_t& config_;
+
+    float Xi_ = 0.0f;
+    float Xf_ = 0.0f;
+    float Vi_ = 0.0f;
+    float Vr_ = 0.0f;
+    float Tf_ = 0.0f;
+
+    Segment_t segments_[NUM_SEGMENTS] = {};
+};
+
+#endif
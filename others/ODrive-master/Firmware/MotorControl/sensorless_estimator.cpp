@@ -3,9 +3,24 @@
 
 SensorlessEstimator::SensorlessEstimator(Config_t& config) :
         config_(config)
-    {};
+    {
+        update_estimator_gains();
+    };
 
-bool SensorlessEstimator::update() {
+// @brief Computes the estimator gains and swaps them in between two updates,
+// see Encoder::update_estimator_gains()
+void SensorlessEstimator::update_estimator_gains() {
+    PosVelEstimator estimator;
+    bool stable = estimator.configure(config_.estimator, config_.pll_bandwidth, current_meas_period);
+    uint32_t mask = cpu_enter_critical();
+    estimator_ = estimator;
+    cpu_exit_critical(mask);
+    if (!stable) {
+        error_ |= ERROR_UNSTABLE_GAIN;
+    }
+}
+
+RAM_FUNCTION bool SensorlessEstimator::update() {
     // Algorithm based on paper: Sensorless Control of Surface-Mount Permanent-Magnet Synchronous Motors Based on a Nonlinear Observer
     // http://cas.ensmp.fr/~praly/Telechargement/Journaux/2010-IEEE_TPEL-Lee-Hong-Nam-Ortega-Praly-Astolfi.pdf
     // In particular, equation 8 (and by extension eqn 4 and 6).
@@ -56,26 +71,17 @@ bool SensorlessEstimator::update() {
     V_alpha_beta_memory_[0] = axis_->motor_.current_control_.final_v_alpha;
     V_alpha_beta_memory_[1] = axis_->motor_.current_control_.final_v_beta * axis_->motor_.config_.direction;
 
-    // PLL
-    // TODO: the PLL part has some code duplication with the encoder PLL
-    // Pll gains as a function of bandwidth
-    float pll_kp = 2.0f * config_.pll_bandwidth;
-    // Critically damped
-    float pll_ki = 0.25f * (pll_kp * pll_kp);
-    // Check that we don't get problems with discrete time approximation
-    if (!(current_meas_period * pll_kp < 1.0f)) {
-        error_ |= ERROR_UNSTABLE_GAIN;
+    // PLL or kalman filter
+    if (error_ & ERROR_UNSTABLE_GAIN)
         return false;
-    }
 
     // predict PLL phase with velocity
-    pll_pos_ = wrap_pm_pi(pll_pos_ + current_meas_period * vel_estimate_);
+    pll_pos_ = wrap_pm_pi(pll_pos_ + estimator_.predict(&vel_estimate_, axis_->get_estimator_accel(true)));
     // update PLL phase with observer permanent magnet phase
     phase_ = fast_atan2(eta[1], eta[0]);
     float delta_phase = wrap_pm_pi(phase_ - pll_pos_);
-    pll_pos_ = wrap_pm_pi(pll_pos_ + current_meas_period * pll_kp * delta_phase);
-    // update PLL velocity
-    vel_estimate_ += current_meas_period * pll_ki * delta_phase;
+    // update PLL phase and velocity
+    pll_pos_ = wrap_pm_pi(pll_pos_ + estimator_.correct(&vel_estimate_, delta_phase));
 
     return true;
 };
@@ -11,11 +11,13 @@ public:
     struct Config_t {
         float observer_gain = 1000.0f; // [rad/s]
         float pll_bandwidth = 1000.0f;  // [rad/s]
+        PosVelEstimator::Config_t estimator = {PosVelEstimator::ESTIMATOR_PLL, 200.0f, 5000.0f, 0.02f}; // PLL or Kalman filter, in [rad] electrical
         float pm_flux_linkage = 1.58e-3f; // [V / (rad/s)]  { 5.51328895422 / (<pole pairs> * <rpm/v>) }
     };
 
     explicit SensorlessEstimator(Config_t& config);
 
+    void update_estimator_gains();
     bool update();
 
     Axis* axis_ = nullptr; // set by Axis constructor
@@ -26,8 +28,7 @@ public:
     float phase_ = 0.0f;                        // [rad]
     float pll_pos_ = 0.0f;                      // [rad]
     float vel_estimate_ = 0.0f;                      // [rad/s]
-    // float pll_kp_ = 0.0f;                       // [rad/s / rad]
-    // float pll_ki_ = 0.0f;                       // [(rad/s^2) / rad]
+    PosVelEstimator estimator_;
     float flux_state_[2] = {0.0f, 0.0f};        // [Vs]
     float V_alpha_beta_memory_[2] = {0.0f, 0.0f}; // [V]
     bool estimator_good_ = false;
@@ -39,11 +40,13 @@ public:
             make_protocol_property("phase", &phase_),
             make_protocol_property("pll_pos", &pll_pos_),
             make_protocol_property("vel_estimate", &vel_estimate_),
-            // make_protocol_property("pll_kp", &pll_kp_),
-            // make_protocol_property("pll_ki", &pll_ki_),
+            make_protocol_ro_property("accel_disturbance", &estimator_.disturbance_),
             make_protocol_object("config",
                 make_protocol_property("observer_gain", &config_.observer_gain),
-                make_protocol_property("pll_bandwidth", &config_.pll_bandwidth),
+                make_protocol_property("pll_bandwidth", &config_.pll_bandwidth,
+                    [](void* ctx) { static_cast<SensorlessEstimator*>(ctx)->update_estimator_gains(); }, this),
+                make_protocol_object("estimator", PosVelEstimator::make_config_definitions(config_.estimator,
+                    [](void* ctx) { static_cast<SensorlessEstimator*>(ctx)->update_estimator_gains(); }, this)),
                 make_protocol_property("pm_flux_linkage", &config_.pm_flux_linkage)
             )
         );
@@ -6,7 +6,7 @@
 #include <stm32f4xx_hal.h>
 
 
-int SVM(float alpha, float beta, float* tA, float* tB, float* tC) {
+RAM_FUNCTION int SVM(float alpha, float beta, float* tA, float* tB, float* tC) {
     int Sextant;
 
     if (beta >= 0.0f) {
@@ -122,8 +122,67 @@ int SVM(float alpha, float beta, float* tA, float* tB, float* tC) {
     return result_valid ? 0 : -1;
 }
 
+// Over-modulation parameter s over the modulation magnitude, uniformly spaced
+// from sqrt(3)/2 to 3/pi. Generated by tools/control_simulation/Overmodulation.py
+#define OVM_TABLE_SIZE 17
+static const float ovm_table[OVM_TABLE_SIZE] = {
+    0.000000f, 0.049185f, 0.107971f, 0.176652f, 0.257573f, 0.355437f,
+    0.480492f, 0.664699f, 1.021345f, 1.085338f, 1.153911f, 1.228288f,
+    1.310345f, 1.403247f, 1.513164f, 1.656044f, 2.000000f,
+};
+
+// Maps modulation vectors beyond the largest circle inside the SVM hexagon onto
+// a trajectory inside the hexagon whose fundamental equals the input vector:
+//  - 0 <= s <= 1 (mode I): a circle of radius sqrt(3)/2 + s * (1 - sqrt(3)/2), cut off by the hexagon
+//  - 1 <= s <= 2 (mode II): the hexagon, with the vector held at the vertices for (s - 1) * pi/6
+//    at both ends of each sextant. s = 2 is six-step operation.
+// See tools/control_simulation/Overmodulation.py for the derivation.
+RAM_FUNCTION void overmodulate(float* alpha, float* beta) {
+    static const float six_step = 0.95492965855f; // 3/pi
+    static const float pi_by_3 = M_PI / 3.0f;
+    static const float pi_by_6 = M_PI / 6.0f;
+
+    float M = sqrtf(SQ(*alpha) + SQ(*beta));
+    if (!(M > sqrt3_by_2))
+        return;
+
+    float x = (M - sqrt3_by_2) * ((float)(OVM_TABLE_SIZE - 1) / (six_step - sqrt3_by_2));
+    float s = 2.0f;
+    if (x < (float)(OVM_TABLE_SIZE - 1)) {
+        int i = (int)x;
+        s = ovm_table[i] + (x - (float)i) * (ovm_table[i + 1] - ovm_table[i]);
+    }
+
+    // Angle from the preceding vertex of the hexagon
+    float theta = fast_atan2(*beta, *alpha);
+    if (theta < 0.0f)
+        theta += 2.0f * M_PI;
+    int sextant = MACRO_MIN((int)(theta * (1.0f / pi_by_3)), 5);
+    float phi = theta - (float)sextant * pi_by_3;
+
+    float r = 1.0f;
+    if (s > 1.0f) {
+        float hold_angle = (s - 1.0f) * pi_by_6;
+        if (hold_angle < pi_by_6) {
+            phi = (phi - hold_angle) * (pi_by_6 / (pi_by_6 - hold_angle));
+            phi = MACRO_MIN(MACRO_MAX(phi, 0.0f), pi_by_3);
+        } else {
+            phi = (phi < pi_by_6) ? 0.0f : pi_by_3;
+        }
+    } else {
+        r = sqrt3_by_2 + s * (1.0f - sqrt3_by_2);
+    }
+
+    // Stay slightly inside the hexagon so that SVM() doesn't reject the result due to rounding
+    float hexagon = 0.9999f * sqrt3_by_2 / our_arm_cos_f32(phi - pi_by_6);
+    float rho = MACRO_MIN(r, hexagon);
+    float angle = (float)sextant * pi_by_3 + phi;
+    *alpha = rho * our_arm_cos_f32(angle);
+    *beta = rho * our_arm_sin_f32(angle);
+}
+
 // based on https://math.stackexchange.com/a/1105038/81278
-float fast_atan2(float y, float x) {
+RAM_FUNCTION float fast_atan2(float y, float x) {
     // a := min (|x|, |y|) / max (|x|, |y|)
     float abs_y = fabsf(y);
     float abs_x = fabsf(x);
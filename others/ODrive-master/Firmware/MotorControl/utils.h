@@ -7,8 +7,19 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 #include <math.h>
 
+// Placement of the time critical code (enabled with CONFIG_RAM_HOT_PATH)
+//  RAM_FUNCTION: code that is copied to SRAM at startup and runs without flash wait states
+// The CCM RAM is entirely taken by the FreeRTOS heap (ucHeap), so the thread
+// stacks are already there.
+#ifdef ENABLE_RAM_HOT_PATH
+#define RAM_FUNCTION __attribute__((section(".ramfunc")))
+#else
+#define RAM_FUNCTION
+#endif
+
 /**
  * @brief Flash size register address
  */
@@ -95,6 +106,10 @@ static inline float fmodf_pos(float x, float y) {
 // Returns 0 on success, and -1 if the input was out of range
 int SVM(float alpha, float beta, float* tA, float* tB, float* tC);
 
+// Maps a modulation vector beyond sqrt(3)/2, up to a fundamental of 3/pi (six-step),
+// into the SVM hexagon while preserving its fundamental over an electrical revolution
+void overmodulate(float* alpha, float* beta);
+
 float fast_atan2(float y, float x);
 float horner_fma(float x, const float *coeffs, size_t count);
 int mod(int dividend, int divisor);
@@ -106,6 +121,7 @@ int is_in_the_future(uint32_t time_ms);
 uint32_t micros(void);
 void delay_us(uint32_t us);
 
+void init_fast_math_tables(void);
 float our_arm_sin_f32(float x);
 float our_arm_cos_f32(float x);
 
@@ -81,6 +81,11 @@ if tup.getconfig("STEP_DIR") == "y" then
     end
 end
 
+-- Memory placement
+if tup.getconfig("RAM_HOT_PATH") == "true" then
+    FLAGS += '-DENABLE_RAM_HOT_PATH'
+end
+
 -- Compiler settings
 if tup.getconfig("STRICT") == "true" then
     FLAGS += '-Werror'
@@ -168,6 +173,11 @@ build{
         'MotorControl/controller.cpp',
         'MotorControl/sensorless_estimator.cpp',
         'MotorControl/trapTraj.cpp',
+        'MotorControl/sCurveTraj.cpp',
+        'MotorControl/pvtTraj.cpp',
+        'MotorControl/biquad.cpp',
+        'MotorControl/autotune.cpp',
+        'MotorControl/pos_vel_estimator.cpp',
         'MotorControl/main.cpp',
         'communication/communication.cpp',
         'communication/ascii_protocol.cpp',
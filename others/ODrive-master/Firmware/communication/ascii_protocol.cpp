@@ -167,6 +167,32 @@ void ASCII_protocol_process_line(const uint8_t* buffer, size_t len, StreamSink&
             axis->watchdog_feed();
         }
 
+    } else if (cmd[0] == 'k') { // PVT points
+        unsigned motor_number;
+        int n_chars = 0;
+        int numscan = sscanf(cmd, "k %u%n", &motor_number, &n_chars);
+        if (numscan < 1) {
+            respond(response_channel, use_checksum, "invalid command format");
+        } else if (motor_number >= AXIS_COUNT) {
+            respond(response_channel, use_checksum, "invalid motor %u", motor_number);
+        } else {
+            Axis* axis = axes[motor_number];
+            const char* pos = cmd + n_chars;
+            unsigned n_pushed = 0;
+            float dt, pos_setpoint, vel_setpoint;
+            int n_point_chars;
+            while (sscanf(pos, "%f %f %f%n", &dt, &pos_setpoint, &vel_setpoint, &n_point_chars) == 3) {
+                if (!axis->pvt_.push(dt, pos_setpoint, vel_setpoint))
+                    break;
+                pos += n_point_chars;
+                n_pushed++;
+            }
+            axis->watchdog_feed();
+            // Number of points that were queued and free space left
+            respond(response_channel, use_checksum, "%u %u", n_pushed,
+                    (unsigned)(axis->pvt_.queue_capacity_ - axis->pvt_.get_queue_depth()));
+        }
+
     } else if (cmd[0] == 'f') { // feedback
         unsigned motor_number;
         int numscan = sscanf(cmd, "f %u", &motor_number);
@@ -188,6 +214,7 @@ void ASCII_protocol_process_line(const uint8_t* buffer, size_t len, StreamSink&
         respond(response_channel, use_checksum, "Position: p axis pos vel-ff I-ff");
         respond(response_channel, use_checksum, "Velocity: v axis vel I-ff");
         respond(response_channel, use_checksum, "Current: c axis I");
+        respond(response_channel, use_checksum, "PVT points: k axis dt pos vel [dt pos vel ...]");
         respond(response_channel, use_checksum, "");
         respond(response_channel, use_checksum, "Properties start at odrive root, such as axis0.requested_state");
         respond(response_channel, use_checksum, "Read: r property");
@@ -109,6 +109,16 @@ public:
     void enter_dfu_mode_helper() { enter_dfu_mode(); }
     float get_oscilloscope_val(uint32_t index) { return oscilloscope[index]; }
     float get_adc_voltage_(uint32_t gpio) { return get_adc_voltage(get_gpio_port_by_pin(gpio), get_gpio_pin_by_pin(gpio)); }
+    float plan_coordinated_move_helper(float goal_point0, float goal_point1, float min_duration) {
+        const float goal_points[AXIS_COUNT] = { goal_point0, goal_point1 };
+        return plan_coordinated_move(goal_points, min_duration);
+    }
+    void start_coordinated_move_helper(bool send_can_sync) {
+        // Queue the sync first so that remote axes lag by no more than the frame time
+        if (send_can_sync)
+            can_send_sync(can1_ctx);
+        start_coordinated_move();
+    }
     int32_t test_function(int32_t delta) { static int cnt = 0; return cnt += delta; }
 } static_functions;
 
@@ -158,6 +168,8 @@ static inline auto make_obj_tree() {
             make_protocol_property("enable_ascii_protocol_on_usb", &board_config.enable_ascii_protocol_on_usb),
             make_protocol_property("dc_bus_undervoltage_trip_level", &board_config.dc_bus_undervoltage_trip_level),
             make_protocol_property("dc_bus_overvoltage_trip_level", &board_config.dc_bus_overvoltage_trip_level),
+            make_protocol_property("pwm_frequency", &board_config.pwm_frequency), // requires a reboot
+            make_protocol_property("enable_pwm_double_update", &board_config.enable_pwm_double_update), // requires a reboot
 #if HW_VERSION_MAJOR == 3 && HW_VERSION_MINOR >= 3
             make_protocol_object("gpio1_pwm_mapping", make_protocol_definitions(board_config.pwm_mappings[0])),
             make_protocol_object("gpio2_pwm_mapping", make_protocol_definitions(board_config.pwm_mappings[1])),
@@ -175,6 +187,9 @@ static inline auto make_obj_tree() {
         make_protocol_function("test_function", static_functions, &StaticFunctions::test_function, "delta"),
         make_protocol_function("get_oscilloscope_val", static_functions, &StaticFunctions::get_oscilloscope_val, "index"),
         make_protocol_function("get_adc_voltage", static_functions, &StaticFunctions::get_adc_voltage_, "gpio"),
+        make_protocol_function("plan_coordinated_move", static_functions, &StaticFunctions::plan_coordinated_move_helper,
+            "goal_point0", "goal_point1", "min_duration"),
+        make_protocol_function("start_coordinated_move", static_functions, &StaticFunctions::start_coordinated_move_helper, "send_can_sync"),
         make_protocol_function("save_configuration", static_functions, &StaticFunctions::save_configuration_helper),
         make_protocol_function("erase_configuration", static_functions, &StaticFunctions::erase_configuration_helper),
         make_protocol_function("reboot", static_functions, &StaticFunctions::NVIC_SystemReset_helper),
@@ -29,6 +29,16 @@
 * -------------------
 *   RX FIFO0:
 *       - filter bank 0: heartbeat messages
+*       - filter bank 1: sync messages
+*
+* Sync message
+* ------------
+*
+* A sync message has the standard ID 0x080 (as the CANopen SYNC object) and
+* no payload. It starts the coordinated moves that were planned on each node
+* with plan_coordinated_move(), so that axes on different boards move on a
+* common time base. Sync messages carry no node ID and are therefore not
+* subject to rule d).
 */
 
 #include "interface_can.hpp"
@@ -41,12 +51,16 @@
 
 #define CAN_HEARTBEAT_INTERVAL  1000 // [ms]
 #define CAN_HEARTBEAT_MARGIN    10 // maximum time that a heartbeat message can be delayed until we stop sending other messages [ms]
+#define CAN_SYNC_ID             0x080u
 
 // defined in can.c
 extern CAN_HandleTypeDef hcan1;
 extern CAN_HandleTypeDef hcan2;
 extern CAN_HandleTypeDef hcan3;
 
+// defined in main.cpp
+void start_coordinated_move(void);
+
 static CAN_context* ctxs[3] = { nullptr, nullptr, nullptr };
 
 struct CAN_context* get_can_ctx(CAN_HandleTypeDef *hcan) {
@@ -168,6 +182,23 @@ bool start_can_server(CAN_context& ctx, CAN_TypeDef *port, uint64_t serial_numbe
     if (status != HAL_OK)
         return false;
 
+    //// Set up sync filter
+    CAN_FilterTypeDef sSyncFilterConfig = {
+        .FilterIdHigh = (CAN_SYNC_ID << 5) | (0x0 << 2), // sync (standard ID, no RTR)
+        .FilterIdLow = (CAN_SYNC_ID << 5) | (0x0 << 2),
+        .FilterMaskIdHigh = (0x7ffu << 5) | (0x3 << 2),
+        .FilterMaskIdLow = (0x7ffu << 5) | (0x3 << 2),
+        .FilterFIFOAssignment = CAN_RX_FIFO0,
+        .FilterBank = 1,
+        .FilterMode = CAN_FILTERMODE_IDMASK,
+        .FilterScale = CAN_FILTERSCALE_16BIT,
+        .FilterActivation = ENABLE,
+        .SlaveStartFilterBank = 0
+    };
+    status = HAL_CAN_ConfigFilter(ctx.handle, &sSyncFilterConfig);
+    if (status != HAL_OK)
+        return false;
+
     status = HAL_CAN_Start(ctx.handle);
     if (status != HAL_OK)
         return false;
@@ -188,6 +219,25 @@ bool start_can_server(CAN_context& ctx, CAN_TypeDef *port, uint64_t serial_numbe
     return true;
 }
 
+// @brief Broadcasts a sync message, see "Sync message" above.
+// Nodes don't receive their own messages, so the sender must start its own
+// coordinated move separately.
+bool can_send_sync(CAN_context& ctx) {
+    if (!ctx.handle)
+        return false;
+    CAN_TxHeaderTypeDef header = {
+        .StdId = CAN_SYNC_ID,
+        .ExtId = 0,
+        .IDE = CAN_ID_STD,
+        .RTR = CAN_RTR_DATA,
+        .DLC = 0,
+        .TransmitGlobalTime = DISABLE
+    };
+    uint8_t data[8] = { 0 }; // the HAL copies all 8 bytes regardless of DLC
+    uint32_t mailbox;
+    return HAL_CAN_AddTxMessage(ctx.handle, &header, data, &mailbox) == HAL_OK;
+}
+
 void tx_complete_callback(CAN_HandleTypeDef *hcan, uint8_t mailbox_idx) {
     CAN_context *ctx = get_can_ctx(hcan);
     if (!ctx) return;
@@ -241,6 +291,9 @@ void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan) {
     if ((header.StdId & 0x780u) == 0x700u) {
         ctx->received_ack++;
         consider_node_id_in_use(ctx, node_id);
+    } else if (header.StdId == CAN_SYNC_ID) {
+        ctx->received_sync++;
+        start_coordinated_move();
     } else {
         ctx->unhandled_messages++;
     }
@@ -36,6 +36,7 @@ struct CAN_context {
     uint32_t received_ack = 0;
     uint32_t unexpected_errors = 0;
     uint32_t unhandled_messages = 0;
+    uint32_t received_sync = 0;
 
     auto make_protocol_definitions() {
         return make_protocol_member_list(
@@ -45,11 +46,13 @@ struct CAN_context {
             make_protocol_ro_property("received_msg_cnt", &received_msg_cnt),
             make_protocol_ro_property("received_ack", &received_ack),
             make_protocol_ro_property("unexpected_errors", &unexpected_errors),
-            make_protocol_ro_property("unhandled_messages", &unhandled_messages)
+            make_protocol_ro_property("unhandled_messages", &unhandled_messages),
+            make_protocol_ro_property("received_sync", &received_sync)
         );
     }
 };
 
 bool start_can_server(CAN_context& ctx, CAN_TypeDef *hcan, uint64_t serial_number);
+bool can_send_sync(CAN_context& ctx);
 
 #endif // __INTERFACE_CAN_HPP
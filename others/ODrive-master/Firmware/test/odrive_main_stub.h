@@ -0,0 +1,29 @@
+// Stands in for odrive_main.h when firmware modules are compiled for the host
+// by the unit tests in this directory. It is force-included (-include), so
+// that the include guard suppresses the real header and its HAL dependencies.
+// Only modules that need nothing but the protocol and the utils may be tested
+// this way, and only the code paths that leave axis_ alone.
+
+#ifndef __ODRIVE_MAIN_H
+#define __ODRIVE_MAIN_H
+
+#ifdef __cplusplus
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <fibre/protocol.hpp>
+#endif
+
+#include "utils.h"
+
+#ifdef __cplusplus
+class Axis; // only referenced through pointers that the tests leave unset
+
+#include <pos_vel_estimator.hpp>
+#include <biquad.hpp>
+#include <trapTraj.hpp>
+#include <sCurveTraj.hpp>
+#include <autotune.hpp>
+#endif
+
+#endif // __ODRIVE_MAIN_H
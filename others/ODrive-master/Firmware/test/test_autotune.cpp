@@ -0,0 +1,205 @@
+// Host test of Autotune (MotorControl/autotune.cpp)
+//
+// The experiments run against the plant of tools/control_simulation/plant.py:
+// a motor inertia, optionally coupled to a load inertia through a lightly
+// damped spring, with Coulomb friction. The current follows the command with
+// a first-order response and one period of delay, the position is quantized
+// to encoder counts and the velocity is estimated by the PLL of
+// Encoder::update(). Each case must finish with:
+//  - the total inertia within 10 %, if the load is rigid
+//  - no resonance if the load is rigid, and the resonance within 6 % if not
+//  - gains that give a well damped velocity step response on the same plant
+// A last case checks that max_travel stops the experiments.
+
+#include <math.h>
+#include <stdio.h>
+
+static const float dt = 1.0f / 8000.0f;             // [s] control loop period
+static const float current_bandwidth = 1000.0f;     // [rad/s]
+static const float encoder_bandwidth = 1000.0f;     // [rad/s]
+static const float vel_limit = 20000.0f;            // [counts/s]
+static const int substeps = 4;
+
+struct TestCase {
+    const char* description;
+    double inertia;         // [A/(counts/s^2)]
+    double load_inertia;    // [A/(counts/s^2)]
+    double resonance;       // [rad/s]
+    double friction;        // [A]
+};
+
+class Plant {
+public:
+    explicit Plant(const TestCase& test_case) : test_case_(test_case) {
+        if (test_case.load_inertia > 0.0) {
+            double J = test_case.inertia, J_load = test_case.load_inertia;
+            k_ = test_case.resonance * test_case.resonance / (1.0 / J + 1.0 / J_load);
+            c_ = 0.02 * 2.0 * sqrt(k_ * J * J_load / (J + J_load));
+        }
+    }
+
+    int count() { return (int)floor(pos_); }
+    double pos() { return pos_; }
+    double vel() { return vel_; }
+
+    void step(float Iq_cmd) {
+        float cmd = Iq_cmd_;
+        Iq_cmd_ = Iq_cmd;
+        double h = dt / substeps;
+        for (int i = 0; i < substeps; ++i) {
+            Iq_ += std::min(current_bandwidth * h, 1.0) * (cmd - Iq_);
+            integrate(Iq_, h);
+        }
+    }
+
+private:
+    void integrate(double torque, double h) {
+        if (test_case_.load_inertia > 0.0) {
+            double spring = k_ * (pos_ - pos_load_) + c_ * (vel_ - vel_load_);
+            torque -= spring;
+            vel_load_ += h * spring / test_case_.load_inertia;
+            pos_load_ += h * vel_load_;
+        }
+        double friction = test_case_.friction;
+        if (vel_ == 0.0 && fabs(torque) <= friction)
+            return; // stiction
+        torque -= friction * copysign(1.0, vel_ != 0.0 ? vel_ : torque);
+        double vel_next = vel_ + h * torque / test_case_.inertia;
+        if (vel_ != 0.0 && (vel_next > 0.0) != (vel_ > 0.0))
+            vel_next = 0.0;
+        pos_ += h * 0.5 * (vel_ + vel_next);
+        vel_ = vel_next;
+    }
+
+    const TestCase& test_case_;
+    double k_ = 0.0;
+    double c_ = 0.0;
+    double pos_ = 0.3;
+    double vel_ = 0.0;
+    double pos_load_ = 0.3;
+    double vel_load_ = 0.0;
+    double Iq_ = 0.0;
+    float Iq_cmd_ = 0.0f;
+};
+
+// Same as the PLL and the velocity snapping in Encoder::update()
+class EncoderPll {
+public:
+    void update(int count) {
+        pos_estimate += dt * vel_estimate;
+        float delta_pos = (float)(count - (int)floorf(pos_estimate));
+        pos_estimate += dt * kp_ * delta_pos;
+        vel_estimate += dt * ki_ * delta_pos;
+        if (fabsf(vel_estimate) < 0.5f * dt * ki_)
+            vel_estimate = 0.0f;
+    }
+
+    float pos_estimate = 0.0f;
+    float vel_estimate = 0.0f;
+
+private:
+    float kp_ = 2.0f * encoder_bandwidth;
+    float ki_ = 0.25f * kp_ * kp_;
+};
+
+// @brief Runs the experiments the way Axis::run_autotune() does
+// @returns the largest distance from the start [counts]
+static double run_autotune(const TestCase& test_case, const Autotune::Config_t& config, Autotune& autotune) {
+    Plant plant(test_case);
+    EncoderPll encoder;
+    double start = plant.pos();
+    double travel = 0.0;
+    autotune.start(config, vel_limit, encoder.pos_estimate);
+    while (autotune.busy()) {
+        encoder.update(plant.count());
+        plant.step(autotune.update(encoder.pos_estimate, encoder.vel_estimate, dt));
+        travel = std::max(travel, fabs(plant.pos() - start));
+    }
+    return travel;
+}
+
+// @brief Velocity loop of Controller::update() with the tuned gains
+// @returns the overshoot and the ripple of the settled velocity, both relative
+// to the step, and the settled velocity
+static void step_response(const TestCase& test_case, const Autotune::Result_t& result,
+                          float* overshoot, float* ripple, float* final_vel) {
+    static const float step = 2000.0f;          // [counts/s]
+    static const float duration = 0.3f;         // [s]
+    Plant plant(test_case);
+    EncoderPll encoder;
+    float integrator = 0.0f;
+    int n = (int)(duration / dt);
+    float vel_max = -INFINITY, tail_max = -INFINITY, tail_min = INFINITY, tail_sum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        encoder.update(plant.count());
+        float err = step - encoder.vel_estimate;
+        float Iq = result.vel_gain * err + integrator;
+        integrator += result.vel_integrator_gain * dt * err;
+        plant.step(Iq);
+        float vel = (float)plant.vel();
+        vel_max = std::max(vel_max, vel);
+        if (i >= n - n / 5) {
+            tail_max = std::max(tail_max, vel);
+            tail_min = std::min(tail_min, vel);
+            tail_sum += vel;
+        }
+    }
+    *final_vel = tail_sum / (float)(n / 5);
+    *overshoot = vel_max / *final_vel - 1.0f;
+    *ripple = (tail_max - tail_min) / *final_vel;
+}
+
+int main(void) {
+    static const TestCase test_cases[] = {
+        // description, inertia, load inertia, resonance, friction
+        { "rigid", 2e-6, 0.0, 0.0, 0.0 },
+        { "rigid with friction", 2e-6, 0.0, 0.0, 0.3 },
+        { "heavy", 2e-5, 0.0, 0.0, 0.3 },
+        { "load behind a resonance", 2e-6, 4e-6, 300.0, 0.1 },
+        { "load behind a stiff coupling", 2e-6, 2e-6, 800.0, 0.1 },
+    };
+    const size_t num_test_cases = sizeof(test_cases) / sizeof(test_cases[0]);
+    Autotune::Config_t config;
+
+    int failures = 0;
+    printf("                     case | inertia [%%] | friction [A] | w_u [rad/s] | resonance [rad/s] | bandwidth | overshoot [%%]\n");
+    for (size_t i = 0; i < num_test_cases; ++i) {
+        const TestCase& test_case = test_cases[i];
+        Autotune autotune;
+        run_autotune(test_case, config, autotune);
+        if (autotune.phase_ != Autotune::AUTOTUNE_DONE) {
+            printf("%26s | failed in phase %d\n", test_case.description, (int)autotune.phase_);
+            ++failures;
+            continue;
+        }
+        const Autotune::Result_t& result = autotune.result_;
+        float overshoot, ripple, final_vel;
+        step_response(test_case, result, &overshoot, &ripple, &final_vel);
+        double inertia_error = result.inertia / (test_case.inertia + test_case.load_inertia) - 1.0;
+        printf("%26s | %11.1f | %12.2f | %11.0f | %17.0f | %9.0f | %13.1f\n", test_case.description,
+               inertia_error * 100.0, result.friction, result.ultimate_frequency, result.resonance_frequency,
+               result.bandwidth, overshoot * 100.0f);
+        bool ok = overshoot <= 0.3f && ripple <= 0.1f && fabsf(final_vel / 2000.0f - 1.0f) <= 0.05f;
+        if (test_case.load_inertia > 0.0)
+            ok = ok && fabs(result.resonance_frequency / test_case.resonance - 1.0) <= 0.06;
+        else
+            ok = ok && fabs(inertia_error) <= 0.1 && result.resonance_frequency == 0.0f;
+        if (!ok) {
+            printf("  FAILED: %s\n", test_case.description);
+            ++failures;
+        }
+    }
+
+    // The travel limit must stop the experiments
+    Autotune::Config_t short_travel = config;
+    short_travel.max_travel = 100.0f;
+    Autotune autotune;
+    double travel = run_autotune(test_cases[0], short_travel, autotune);
+    if (autotune.phase_ != Autotune::AUTOTUNE_FAILED || travel > 150.0) {
+        printf("  FAILED: travel of %.0f counts not limited\n", travel);
+        ++failures;
+    }
+
+    printf("%d of %zu tests failed\n", failures, num_test_cases + 1);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+// Host test of Biquad (MotorControl/biquad.cpp)
+//
+// Each filter type is configured at the control rate and driven with
+// sinusoids below, at and above its design frequency. The gain and phase of
+// update() are measured by correlating the settled output with the input,
+// and compared to the analog prototype at the prewarped frequency, which is
+// what the bilinear transform maps the digital frequency to. As in
+// tools/filter_design/Biquad.py, the prototypes are, in s / (2 pi frequency):
+//   low-pass   1 / (s^2 + s/q + 1)
+//   notch      (s^2 + gain s/q + 1) / (s^2 + s/q + 1)
+//   lead/lag   (sqrt(gain) s + 1) / (s/sqrt(gain) + 1)
+// Invalid configurations must be rejected and leave a pass-through filter.
+
+#include <complex>
+#include <math.h>
+#include <stdio.h>
+
+typedef std::complex<double> Complex;
+
+static const float dt = 1.0f / 8000.0f;     // [s] velocity stage period at the default PWM frequency
+static const double settle_time = 0.2;      // [s]
+static const double measure_time = 0.5;     // [s]
+static const double gain_tolerance = 0.005; // relative
+static const double phase_tolerance = 0.5;  // [deg]
+
+static Complex prototype(const Biquad::Config_t& config, Complex s) {
+    switch (config.type) {
+        case Biquad::BIQUAD_LOWPASS:
+            return 1.0 / (s * s + s / (double)config.q + 1.0);
+        case Biquad::BIQUAD_NOTCH:
+            return (s * s + s * (double)config.gain / (double)config.q + 1.0) / (s * s + s / (double)config.q + 1.0);
+        case Biquad::BIQUAD_LEAD_LAG: {
+            double ratio = sqrt((double)config.gain);
+            return (ratio * s + 1.0) / (s / ratio + 1.0);
+        }
+        default:
+            return 1.0;
+    }
+}
+
+// @brief Expected response of the digital filter at the given frequency [Hz]
+static Complex expected_response(const Biquad::Config_t& config, double frequency) {
+    double w = tan(M_PI * frequency * dt) / tan(M_PI * (double)config.frequency * dt);
+    return prototype(config, Complex(0.0, w));
+}
+
+// @brief Measures the response of update() to a sinusoid of the given frequency [Hz]
+static Complex measured_response(Biquad& filter, double frequency) {
+    filter.reset();
+    int n_settle = (int)(settle_time / dt);
+    // Correlate over a whole number of periods
+    double periods = floor(measure_time * frequency);
+    int n_measure = (int)lround(periods / (frequency * dt));
+    double sum_sin = 0.0, sum_cos = 0.0;
+    for (int k = 0; k < n_settle + n_measure; ++k) {
+        double phase = 2.0 * M_PI * frequency * k * dt;
+        float y = filter.update((float)sin(phase));
+        if (k >= n_settle) {
+            sum_sin += y * sin(phase);
+            sum_cos += y * cos(phase);
+        }
+    }
+    return Complex(sum_sin, sum_cos) * (2.0 / n_measure);
+}
+
+struct TestCase {
+    const char* description;
+    Biquad::Config_t config;
+};
+
+int main(void) {
+    static const TestCase test_cases[] = {
+        // description, {type, frequency, q, gain}
+        { "low-pass 500 Hz", { Biquad::BIQUAD_LOWPASS, 500.0f, 0.707f, 0.1f } },
+        { "resonant low-pass 200 Hz", { Biquad::BIQUAD_LOWPASS, 200.0f, 3.0f, 0.1f } },
+        { "notch 300 Hz", { Biquad::BIQUAD_NOTCH, 300.0f, 2.0f, 0.1f } },
+        { "deep notch 1 kHz", { Biquad::BIQUAD_NOTCH, 1000.0f, 5.0f, 0.0f } },
+        { "lead 200 Hz", { Biquad::BIQUAD_LEAD_LAG, 200.0f, 0.707f, 4.0f } },
+        { "lag 100 Hz", { Biquad::BIQUAD_LEAD_LAG, 100.0f, 0.707f, 0.25f } },
+    };
+    static const double relative_frequencies[] = { 0.2, 0.5, 0.9, 1.0, 1.1, 2.0, 3.5 };
+    const size_t num_test_cases = sizeof(test_cases) / sizeof(test_cases[0]);
+    const size_t num_frequencies = sizeof(relative_frequencies) / sizeof(relative_frequencies[0]);
+
+    int failures = 0;
+    printf("                   filter | freq [Hz] |     gain | expected | phase [deg] | expected\n");
+    for (size_t i = 0; i < num_test_cases; ++i) {
+        const TestCase& test_case = test_cases[i];
+        Biquad filter;
+        if (!filter.configure(test_case.config, dt)) {
+            printf("%25s | rejected\n", test_case.description);
+            ++failures;
+            continue;
+        }
+        bool ok = true;
+        for (size_t j = 0; j < num_frequencies; ++j) {
+            double frequency = relative_frequencies[j] * test_case.config.frequency;
+            if (frequency > 0.45 / dt)
+                continue;
+            Complex measured = measured_response(filter, frequency);
+            Complex expected = expected_response(test_case.config, frequency);
+            double phase_error = remainder(arg(measured / expected) * 180.0 / M_PI, 360.0);
+            // Relative to the expected gain, but not below the gain of a deep notch
+            double gain_error = fabs(abs(measured) - abs(expected)) / std::max(abs(expected), 0.01);
+            printf("%25s | %9.1f | %8.4f | %8.4f | %11.2f | %8.2f\n", test_case.description, frequency,
+                   abs(measured), abs(expected), arg(measured) * 180.0 / M_PI, arg(expected) * 180.0 / M_PI);
+            // The phase of a vanishing output is meaningless
+            if (gain_error > gain_tolerance || (abs(expected) > 0.01 && fabs(phase_error) > phase_tolerance))
+                ok = false;
+        }
+        if (!ok) {
+            printf("  FAILED: %s\n", test_case.description);
+            ++failures;
+        }
+    }
+
+    // Invalid configurations
+    static const TestCase invalid_test_cases[] = {
+        { "above 0.45 of the sample rate", { Biquad::BIQUAD_LOWPASS, 3700.0f, 0.707f, 0.1f } },
+        { "zero frequency", { Biquad::BIQUAD_NOTCH, 0.0f, 2.0f, 0.1f } },
+        { "zero q", { Biquad::BIQUAD_LOWPASS, 100.0f, 0.0f, 0.1f } },
+        { "negative notch gain", { Biquad::BIQUAD_NOTCH, 100.0f, 2.0f, -0.1f } },
+        { "zero lead/lag gain", { Biquad::BIQUAD_LEAD_LAG, 100.0f, 0.707f, 0.0f } },
+        { "NaN frequency", { Biquad::BIQUAD_LOWPASS, NAN, 0.707f, 0.1f } },
+    };
+    const size_t num_invalid_test_cases = sizeof(invalid_test_cases) / sizeof(invalid_test_cases[0]);
+    for (size_t i = 0; i < num_invalid_test_cases; ++i) {
+        const TestCase& test_case = invalid_test_cases[i];
+        Biquad filter;
+        bool accepted = filter.configure(test_case.config, dt);
+        bool passes_through = filter.update(1.0f) == 1.0f && filter.update(-2.0f) == -2.0f;
+        if (accepted || !passes_through) {
+            printf("  FAILED: %s\n", test_case.description);
+            ++failures;
+        }
+    }
+
+    printf("%d of %zu tests failed\n", failures, num_test_cases + num_invalid_test_cases);
+    return failures ? 1 : 0;
+}
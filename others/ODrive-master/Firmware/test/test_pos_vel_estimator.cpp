@@ -0,0 +1,198 @@
+// Host test of PosVelEstimator (MotorControl/pos_vel_estimator.cpp)
+//
+// The estimator is compiled from the firmware sources and driven by the same
+// phase detectors as Encoder::update() and SensorlessEstimator::update(). The
+// plant is a rigid inertia with Coulomb friction and a known current profile,
+// as in tools/control_simulation/PosVelEstimator.py. For every trajectory the
+// RMS and the peak velocity error of both modes must stay within the bounds
+// below, and the Kalman filter must beat the PLL on both.
+
+#include <math.h>
+#include <stdio.h>
+#include <random>
+
+// Firmware defaults
+static const float dt = 1.0f / 8000.0f;        // current measurement period [s]
+static const float bandwidth = 1000.0f;         // [rad/s] PLL
+
+// Plant
+static const double inertia = 2e-6;             // [A/(counts/s^2)]
+static const double inertia_error = 1.1;        // configured over actual inertia
+static const double friction = 0.05;            // [A] Coulomb friction
+static const double current_noise = 0.05;       // [A] RMS noise of the current measurement
+static const int cpr = 8192;
+static const int pole_pairs = 7;
+static const double phase_noise = 0.02;         // [rad] RMS noise of the flux observer phase
+static const int substeps = 4;
+
+struct EncoderTracker {
+    // Phase detector and velocity snapping as in Encoder::update()
+    static constexpr double units_per_count = 1.0;
+    static PosVelEstimator::Config_t config() { return PosVelEstimator::Config_t(); }
+
+    PosVelEstimator estimator;
+    float pos_estimate = 0.0f;
+    float vel_estimate = 0.0f;
+
+    void update(double pos, float accel, std::mt19937&) {
+        pos_estimate += estimator.predict(&vel_estimate, accel);
+        float delta_pos = (float)((int32_t)floor(pos) - (int32_t)floorf(pos_estimate));
+        pos_estimate += estimator.correct(&vel_estimate, delta_pos);
+        if (fabsf(vel_estimate) < 0.5f * estimator.vel_gain_)
+            vel_estimate = 0.0f;
+    }
+};
+
+struct SensorlessTracker {
+    // Phase detector as in SensorlessEstimator::update(), in electrical radians
+    static constexpr double units_per_count = 2.0 * M_PI * pole_pairs / cpr;
+    static PosVelEstimator::Config_t config() {
+        return {PosVelEstimator::ESTIMATOR_PLL, 200.0f, 5000.0f, 0.02f};
+    }
+
+    PosVelEstimator estimator;
+    float pll_pos = 0.0f;
+    float vel_estimate = 0.0f;
+
+    void update(double pos, float accel, std::mt19937& rng) {
+        std::normal_distribution<double> noise(0.0, phase_noise);
+        float phase = wrap_pm_pi((float)fmod(pos * units_per_count + noise(rng), 2.0 * M_PI));
+        pll_pos = wrap_pm_pi(pll_pos + estimator.predict(&vel_estimate, accel));
+        float delta_phase = wrap_pm_pi(phase - pll_pos);
+        pll_pos = wrap_pm_pi(pll_pos + estimator.correct(&vel_estimate, delta_phase));
+    }
+};
+
+// Motor current [A] as a function of time
+static double trapezoid(double t) {
+    // Accelerate, cruise at 25000 counts/s, decelerate
+    const double I = 0.6;
+    if (t < 0.1)
+        return I;
+    else if (t < 0.2)
+        return friction;
+    else if (t < 0.3)
+        return -I + 2.0 * friction;
+    return 0.0;
+}
+
+static double slow(double t) {
+    // Creep at about 100 counts/s against the friction
+    return friction + (t < 0.2 ? 0.001 : 0.0);
+}
+
+static double sine(double t) {
+    return 0.5 * sin(2.0 * M_PI * 20.0 * t);
+}
+
+struct Errors {
+    double rms;     // [counts/s] after the initial settling
+    double peak;    // [counts/s]
+};
+
+// @brief Runs the plant and the estimator and returns the velocity errors
+template<typename TTracker>
+static bool simulate(PosVelEstimator::Mode_t mode, double (*current)(double), double duration, Errors* errors) {
+    TTracker tracker;
+    PosVelEstimator::Config_t config = TTracker::config();
+    config.mode = mode;
+    if (!tracker.estimator.configure(config, bandwidth, dt))
+        return false;
+
+    std::mt19937 rng(0);
+    std::normal_distribution<double> noise(0.0, current_noise);
+    const double scale = TTracker::units_per_count;
+    double pos = 0.3;
+    double vel = 0.0;
+    double sum_sq = 0.0;
+    size_t n_settled = 0;
+    *errors = {0.0, 0.0};
+    int n = (int)(duration / dt);
+    for (int k = 0; k < n; ++k) {
+        double t = k * dt;
+        double Iq = current(t);
+        double Iq_measured = Iq + noise(rng);
+        tracker.update(pos, (float)(Iq_measured / (inertia * inertia_error) * scale), rng);
+        if (t > 0.01) {
+            double err = tracker.vel_estimate / scale - vel;
+            sum_sq += err * err;
+            ++n_settled;
+            if (fabs(err) > errors->peak)
+                errors->peak = fabs(err);
+        }
+
+        double h = dt / substeps;
+        for (int i = 0; i < substeps; ++i) {
+            double torque = Iq;
+            if (vel != 0.0)
+                torque -= copysign(friction, vel);
+            else if (fabs(torque) <= friction)
+                continue;
+            else
+                torque -= copysign(friction, torque);
+            double vel_next = vel + h * torque / inertia;
+            if (vel != 0.0 && (vel_next > 0.0) != (vel > 0.0))
+                vel_next = 0.0;
+            pos += h * 0.5 * (vel + vel_next);
+            vel = vel_next;
+        }
+    }
+    errors->rms = sqrt(sum_sq / n_settled);
+    return true;
+}
+
+struct TestCase {
+    const char* description;
+    double (*current)(double);
+    double duration;        // [s]
+    Errors pll_bounds;      // [counts/s]
+    Errors kalman_bounds;   // [counts/s]
+};
+
+template<typename TTracker>
+static int run_test_cases(const char* name, const TestCase* test_cases, size_t num_test_cases) {
+    int failures = 0;
+    for (size_t i = 0; i < num_test_cases; ++i) {
+        const TestCase& test_case = test_cases[i];
+        Errors pll, kalman;
+        if (!simulate<TTracker>(PosVelEstimator::ESTIMATOR_PLL, test_case.current, test_case.duration, &pll)
+                || !simulate<TTracker>(PosVelEstimator::ESTIMATOR_KALMAN, test_case.current, test_case.duration, &kalman)) {
+            printf("%s, %s: unstable gains\n", name, test_case.description);
+            ++failures;
+            continue;
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "%s, %s", name, test_case.description);
+        printf("%37s | %7.1f | %7.1f | %10.1f | %10.1f\n", label, pll.rms, pll.peak, kalman.rms, kalman.peak);
+        bool ok = pll.rms < test_case.pll_bounds.rms && pll.peak < test_case.pll_bounds.peak
+                && kalman.rms < test_case.kalman_bounds.rms && kalman.peak < test_case.kalman_bounds.peak
+                && kalman.rms < pll.rms && kalman.peak < pll.peak;
+        if (!ok) {
+            printf("  FAILED: %s, %s\n", name, test_case.description);
+            ++failures;
+        }
+    }
+    return failures;
+}
+
+int main(void) {
+    // Bounds with some margin over the errors of the reference simulation
+    static const TestCase encoder_test_cases[] = {
+        // description, current, duration, PLL {rms, peak}, Kalman {rms, peak}
+        { "trapezoidal move", trapezoid, 0.4, { 500.0, 1200.0 }, { 100.0, 300.0 } },
+        { "slow creep", slow, 0.6, { 100.0, 700.0 }, { 60.0, 300.0 } },
+        { "20 Hz sinusoid", sine, 0.4, { 500.0, 1200.0 }, { 160.0, 400.0 } },
+    };
+    static const TestCase sensorless_test_cases[] = {
+        { "trapezoidal move", trapezoid, 0.4, { 1200.0, 4000.0 }, { 320.0, 900.0 } },
+        { "slow creep", slow, 0.6, { 1000.0, 3500.0 }, { 120.0, 450.0 } },
+        { "20 Hz sinusoid", sine, 0.4, { 1200.0, 4000.0 }, { 380.0, 750.0 } },
+    };
+    const size_t num_test_cases = sizeof(encoder_test_cases) / sizeof(encoder_test_cases[0]);
+
+    printf("                           trajectory | PLL RMS | PLL max | Kalman RMS | Kalman max  [counts/s]\n");
+    int failures = run_test_cases<EncoderTracker>("Encoder", encoder_test_cases, num_test_cases)
+            + run_test_cases<SensorlessTracker>("SensorlessEstimator", sensorless_test_cases, num_test_cases);
+    printf("%d of %zu tests failed\n", failures, 2 * num_test_cases);
+    return failures ? 1 : 0;
+}
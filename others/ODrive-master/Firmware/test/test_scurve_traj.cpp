@@ -0,0 +1,144 @@
+// Host test of SCurveTrajectory (MotorControl/sCurveTraj.cpp)
+//
+// Every move is planned with planSCurve() and checked through the segment
+// coefficients and eval(), as the controller uses them:
+//  - it starts at Xi with Vi and ends at rest at Xf
+//  - position, velocity and acceleration are continuous at the segment
+//    boundaries (a wrong reached velocity shows as a position step where the
+//    deceleration starts, since it is anchored to Xf)
+//  - velocity, acceleration and jerk stay within the limits
+//  - the profile either cruises at Vmax or doesn't coast at all
+// The cases cover the closed form and the bisection branch of the reached
+// velocity, initial velocities towards and away from the goal, and a start
+// that is too fast to stop before the goal.
+
+#include <math.h>
+#include <stdio.h>
+
+static const float dt = 1.0f / 8000.0f;     // [s] control loop period
+static const float tolerance = 1e-3f;       // relative
+
+struct Limits {
+    float Vmax;     // [counts/s]
+    float Amax;     // [counts/s^2]
+    float Dmax;     // [counts/s^2]
+    float Jmax;     // [counts/s^3]
+};
+
+struct TestCase {
+    const char* description;
+    float Xi, Xf, Vi;
+    Limits limits;
+};
+
+struct Results {
+    float Tf;       // [s]
+    float Vr;       // [counts/s]
+    float Tv;       // [s] coasting time
+    float jump;     // largest discontinuity at a segment boundary, relative to the limits
+    float excess;   // largest excess over the velocity, acceleration and jerk limits, relative
+    float end;      // [counts] position error just before the end
+};
+
+static float rel_excess(float value, float limit) {
+    return std::max(0.0f, fabsf(value) / limit - 1.0f);
+}
+
+static bool check(const TestCase& test_case, Results* results) {
+    SCurveTrajectory::Config_t config;
+    SCurveTrajectory traj(config);
+    const Limits& l = test_case.limits;
+    if (!traj.planSCurve(test_case.Xf, test_case.Xi, test_case.Vi, l.Vmax, l.Amax, l.Dmax, l.Jmax))
+        return false;
+
+    *results = { traj.Tf_, traj.Vr_, traj.segments_[4].t_start - traj.segments_[3].t_start, 0.0f, 0.0f, 0.0f };
+
+    // Left and right limits at the segment boundaries
+    float x_scale = fabsf(test_case.Xf - test_case.Xi) + 1.0f;
+    for (size_t k = 1; k < SCurveTrajectory::NUM_SEGMENTS; ++k) {
+        const SCurveTrajectory::Segment_t& prev = traj.segments_[k - 1];
+        const SCurveTrajectory::Segment_t& seg = traj.segments_[k];
+        float tau = seg.t_start - prev.t_start;
+        float y = prev.c0 + tau * (prev.c1 + tau * (prev.c2 + tau * prev.c3));
+        float yd = prev.c1 + tau * (2.0f * prev.c2 + tau * 3.0f * prev.c3);
+        float ydd = 2.0f * prev.c2 + tau * 6.0f * prev.c3;
+        results->jump = std::max(results->jump, fabsf(y - seg.c0) / x_scale);
+        results->jump = std::max(results->jump, fabsf(yd - seg.c1) / l.Vmax);
+        results->jump = std::max(results->jump, fabsf(ydd - 2.0f * seg.c2) / std::max(l.Amax, l.Dmax));
+    }
+
+    // Limits, sampled at the control rate
+    float Vlim = std::max(l.Vmax, fabsf(test_case.Vi));
+    float Alim = std::max(l.Amax, l.Dmax);
+    for (size_t k = 0; k < SCurveTrajectory::NUM_SEGMENTS; ++k)
+        results->excess = std::max(results->excess, rel_excess(6.0f * traj.segments_[k].c3, l.Jmax));
+    for (float t = 0.0f; t < traj.Tf_; t += dt) {
+        SCurveTrajectory::Step_t step = traj.eval(t);
+        results->excess = std::max(results->excess, rel_excess(step.Yd, Vlim));
+        results->excess = std::max(results->excess, rel_excess(step.Ydd, Alim));
+    }
+
+    // Initial and final conditions
+    SCurveTrajectory::Step_t start = traj.eval(0.0f);
+    SCurveTrajectory::Step_t end = traj.eval(traj.Tf_ * (1.0f - 1e-6f));
+    results->jump = std::max(results->jump, fabsf(start.Y - test_case.Xi) / x_scale);
+    results->jump = std::max(results->jump, fabsf(start.Yd - test_case.Vi) / l.Vmax);
+    results->jump = std::max(results->jump, fabsf(end.Yd) / l.Vmax);
+    results->end = fabsf(end.Y - test_case.Xf);
+    return true;
+}
+
+int main(void) {
+    // Accelerates within 0.1 s to 500 counts/s and within 0.4 s to the vel_limit default
+    static const Limits defaults = { 20000.0f, 5000.0f, 5000.0f, 50000.0f };
+    static const Limits asymmetric = { 20000.0f, 5000.0f, 2000.0f, 50000.0f };
+
+    static const TestCase test_cases[] = {
+        // description, Xi, Xf, Vi, limits
+        { "long move", 0.0f, 200000.0f, 0.0f, defaults },
+        { "long move backwards", 100000.0f, -100000.0f, 0.0f, defaults },
+        { "short, acceleration limited", 0.0f, 1000.0f, 0.0f, defaults },
+        { "short, jerk limited", 0.0f, 20.0f, 0.0f, defaults },
+        { "short, jerk limited acceleration", 0.0f, 100.0f, 0.0f, asymmetric },
+        { "short, moving towards the goal", 0.0f, 5000.0f, 3000.0f, defaults },
+        { "short, moving away from the goal", 0.0f, 2000.0f, -3000.0f, defaults },
+        { "too fast to stop", 0.0f, 100.0f, 10000.0f, defaults },
+        { "faster than vel_limit", 0.0f, 100000.0f, 30000.0f, defaults },
+        { "large position", 1e6f, 1.001e6f, 0.0f, defaults },
+    };
+    const size_t num_test_cases = sizeof(test_cases) / sizeof(test_cases[0]);
+
+    int failures = 0;
+    printf("                                 move |    Tf [s] | Vr [counts/s] |    Tv [s] |     jump |   excess | end [counts]\n");
+    for (size_t i = 0; i < num_test_cases; ++i) {
+        const TestCase& test_case = test_cases[i];
+        Results results;
+        if (!check(test_case, &results)) {
+            printf("%37s | rejected\n", test_case.description);
+            ++failures;
+            continue;
+        }
+        printf("%37s | %9.4f | %13.1f | %9.5f | %8.1e | %8.1e | %12.4f\n", test_case.description,
+               results.Tf, results.Vr, results.Tv, results.jump, results.excess, results.end);
+        // A move either cruises at Vmax or goes straight from accelerating to decelerating
+        bool cruises = fabsf(results.Vr) >= test_case.limits.Vmax * (1.0f - tolerance);
+        bool ok = results.jump < tolerance && results.excess < tolerance
+                && results.end < tolerance * (fabsf(test_case.Xf - test_case.Xi) + 1.0f)
+                && (cruises || results.Tv < tolerance * results.Tf);
+        if (!ok) {
+            printf("  FAILED: %s\n", test_case.description);
+            ++failures;
+        }
+    }
+
+    // Invalid limits must be rejected
+    SCurveTrajectory::Config_t config;
+    SCurveTrajectory traj(config);
+    if (traj.planSCurve(1000.0f, 0.0f, 0.0f, 20000.0f, 5000.0f, 5000.0f, 0.0f)) {
+        printf("  FAILED: zero jerk limit accepted\n");
+        ++failures;
+    }
+
+    printf("%d of %zu tests failed\n", failures, num_test_cases + 1);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,337 @@
+# Runs the relay feedback auto-tuning of AXIS_STATE_AUTOTUNE
+# (Firmware/MotorControl/autotune.cpp), ported line by line, against a plant.
+#
+# The plant (plant.py) is a motor inertia, optionally coupled to a load inertia
+# through a spring, with Coulomb friction. It is driven by a current loop with
+# a first-order response and one period of delay. The position is quantized to
+# encoder counts and the velocity is estimated with the encoder PLL. The same
+# plant then runs the velocity loop of controller.cpp with the tuned gains,
+# and the step response is checked. The sine sweep must find the resonance of
+# the compliant loads, also one that sets the ultimate frequency, and none on
+# the rigid ones. A last case checks that max_travel stops the experiments.
+
+import numpy as np
+import math
+import matplotlib.pyplot as plt
+from plant import dt, vel_limit, Plant, EncoderPll, Tests, main
+
+# Autotune defaults
+relay_current = 2.0                     # [A]
+noise_band = 300.0                      # [counts/s]
+num_cycles = 8
+timeout = 20.0                          # [s] of all experiments
+max_travel = 8192.0                     # [counts]
+bandwidth = 100.0                       # [rad/s] requested velocity loop bandwidth
+phase_margin = 60.0                     # [deg]
+pos_bandwidth_ratio = 0.25
+sweep_current = 2.0                     # [A] amplitude of the sine sweep, 0 skips it
+
+# Same constants as autotune.cpp
+NUM_DISCARD = 2                         # first relay cycles of each experiment are discarded
+HALF_PERIODS_PER_ULTIMATE = 5.0         # half period of the inertia experiment in ultimate periods
+MIN_INTEGRATOR_LAG = math.radians(5.0)  # phase lag of the integrator at the crossover, at least
+GAIN_MARGIN = 2.5                       # vel_gain is at most the ultimate gain over this (8 dB)
+MIN_INERTIA_CURRENT = 0.2               # relay current of the inertia experiment, relative to relay_current, at least
+NUM_SWEEP_STEPS = 24                    # steps of the sweep, at most
+SWEEP_START = 0.25                      # first frequency of the sweep relative to the ultimate frequency
+SWEEP_STEP = 1.1                        # frequency ratio of consecutive sweep steps
+SWEEP_SETTLE_PERIODS = 6.0              # periods of each sweep step before the correlation
+SWEEP_MEASURE_PERIODS = 4.0             # periods of each sweep step in the correlation
+SWEEP_MIN_AMPLITUDE = 0.5               # [counts] the sweep ends where the position amplitude of the inertia falls below this
+SWEEP_MAX_VEL = 0.25                    # velocity amplitude of the sweep relative to vel_limit, at most
+SWEEP_DAMPING = 2.0                     # bandwidth of the velocity loop that holds the motor, relative to the first frequency
+RESONANCE_PEAK = 2.0                    # a resonance peaks this far above the first step of the sweep
+
+
+class Autotune:
+    IDLE, ULTIMATE, INERTIA, SWEEP, DONE, FAILED = range(6)
+
+    def __init__(self, pos, max_travel=max_travel):
+        self.start_pos = pos
+        self.max_travel = max_travel
+        self.phase = Autotune.ULTIMATE
+        self.time = 0.0
+        self.current = relay_current
+        self.output = relay_current
+        self.band = noise_band
+        self.cycles = 0
+        self.cycle_time = 0.0
+        self.half_time = 0.0
+        self.last_half_period = 0.0
+        self.vel_max = -math.inf
+        self.vel_min = math.inf
+        self.period_sum = 0.0
+        self.amplitude_sum = 0.0
+        self.vel_last = 0.0
+        self.output_last = 0.0
+        self.sums = np.zeros(9, dtype=np.float32)   # upper triangle of phi*phi^T, then phi*dv
+        self.result = {}
+
+    def relay(self, vel):
+        # @returns True on a rising switch, which starts a new cycle
+        if vel > self.band and self.output > 0:
+            self.output = -self.current
+            self.last_half_period = self.half_time
+            self.half_time = 0.0
+        elif vel < -self.band and self.output < 0:
+            self.output = self.current
+            self.last_half_period = self.half_time
+            self.half_time = 0.0
+            return True
+        return False
+
+    def update(self, pos, vel):
+        self.time += dt
+        self.cycle_time += dt
+        self.half_time += dt
+        if self.time > timeout or abs(vel) > vel_limit or abs(pos - self.start_pos) > self.max_travel:
+            self.phase = Autotune.FAILED
+        if self.phase == Autotune.ULTIMATE:
+            self.vel_max = max(self.vel_max, vel)
+            self.vel_min = min(self.vel_min, vel)
+            if self.relay(vel):
+                if self.cycles >= NUM_DISCARD:
+                    self.period_sum += self.cycle_time
+                    self.amplitude_sum += 0.5 * (self.vel_max - self.vel_min)
+                self.cycles += 1
+                self.cycle_time = 0.0
+                self.vel_max = -math.inf
+                self.vel_min = math.inf
+                if self.cycles == NUM_DISCARD + num_cycles:
+                    self.start_inertia()
+        elif self.phase == Autotune.INERTIA:
+            # Skip the first quarter of each half period, where the current and
+            # the velocity estimate still respond to the switch
+            if self.cycles > NUM_DISCARD and self.half_time > 0.25 * self.last_half_period:
+                phi = (self.output_last, math.copysign(1.0, self.vel_last), 1.0)
+                dv = vel - self.vel_last
+                s = self.sums
+                s[0] += phi[0] * phi[0]
+                s[1] += phi[0] * phi[1]
+                s[2] += phi[0]
+                s[3] += phi[1] * phi[1]
+                s[4] += phi[1]
+                s[5] += 1.0
+                s[6] += phi[0] * dv
+                s[7] += phi[1] * dv
+                s[8] += dv
+            if self.relay(vel):
+                self.cycles += 1
+                if self.cycles == NUM_DISCARD + num_cycles:
+                    self.finish()
+        elif self.phase == Autotune.SWEEP:
+            self.output = self.sweep(vel)
+        self.vel_last = vel
+        self.output_last = self.output
+        return self.output if self.busy() else 0.0
+
+    def busy(self):
+        return self.phase in (Autotune.ULTIMATE, Autotune.INERTIA, Autotune.SWEEP)
+
+    def start_inertia(self):
+        n = num_cycles
+        period = self.period_sum / n
+        amplitude = self.amplitude_sum / n
+        r = self.result
+        r['ultimate_frequency'] = 2 * math.pi / period
+        r['ultimate_gain'] = 4 * relay_current / (math.pi * amplitude)
+        # The hysteresis delays the switches by this phase
+        r['ultimate_phase'] = math.asin(min(self.band / amplitude, 1.0))
+        # Rough inertia for the hysteresis of the inertia experiment, assuming
+        # that the lags don't change the magnitude at the ultimate frequency
+        inertia_rough = r['ultimate_gain'] / r['ultimate_frequency']
+        # If that band would exceed half the velocity limit, the relay current
+        # is reduced instead
+        half_period = HALF_PERIODS_PER_ULTIMATE * period
+        band = relay_current * half_period / (2 * inertia_rough)
+        self.band = max(min(band, 0.5 * vel_limit), 4 * noise_band)
+        self.current = relay_current * max(min(self.band / band, 1.0), MIN_INERTIA_CURRENT)
+        self.output = math.copysign(self.current, self.output)
+        self.phase = Autotune.INERTIA
+        self.cycles = 0
+
+    def finish(self):
+        # Least squares solution of the normal equations by Cramer's rule
+        s = self.sums
+        A = np.array([[s[0], s[1], s[2]], [s[1], s[3], s[4]], [s[2], s[4], s[5]]], dtype=np.float32)
+        b = np.array([s[6], s[7], s[8]], dtype=np.float32)
+        det = np.linalg.det(A)
+        theta = [np.linalg.det(np.column_stack([b if j == i else A[:, j] for j in range(3)])) / det for i in range(3)]
+        r = self.result
+        if not theta[0] > 0:
+            self.phase = Autotune.FAILED
+            return
+        r['inertia'] = dt / theta[0]
+        r['friction'] = -theta[1] / theta[0]
+        self.compute_gains()
+        self.start_sweep()
+
+    def compute_gains(self):
+        r = self.result
+        # Lags of the loop apart from the inertia, modelled as a delay that
+        # accounts for the 90 degrees left at the ultimate frequency
+        delay = (0.5 * math.pi - r['ultimate_phase']) / r['ultimate_frequency']
+        max_lag = 0.5 * math.pi - math.radians(phase_margin)
+        omega_c = bandwidth
+        integrator_lag = max_lag - omega_c * delay
+        if integrator_lag < MIN_INTEGRATOR_LAG:
+            omega_c = max(max_lag - MIN_INTEGRATOR_LAG, 0.0) / delay
+            integrator_lag = MIN_INTEGRATOR_LAG
+        vel_gain = r['inertia'] * omega_c * math.cos(integrator_lag)
+        if vel_gain > r['ultimate_gain'] / GAIN_MARGIN:
+            omega_c *= r['ultimate_gain'] / GAIN_MARGIN / vel_gain
+            vel_gain = r['ultimate_gain'] / GAIN_MARGIN
+        r['bandwidth'] = omega_c
+        r['vel_gain'] = vel_gain
+        r['vel_integrator_gain'] = vel_gain * omega_c * math.tan(integrator_lag)
+        r['pos_gain'] = pos_bandwidth_ratio * omega_c
+
+    def start_sweep(self):
+        r = self.result
+        r['resonance_frequency'] = 0.0
+        # The steps stop where the position amplitude of the inertia would
+        # fall below the resolution needed for the correlation
+        self.sweep_start = SWEEP_START * r['ultimate_frequency']
+        end = math.sqrt(sweep_current / (r['inertia'] * SWEEP_MIN_AMPLITUDE))
+        self.sweep_steps = 0
+        frequency = self.sweep_start
+        while frequency <= end and self.sweep_steps < NUM_SWEEP_STEPS:
+            self.sweep_steps += 1
+            frequency *= SWEEP_STEP
+        if self.sweep_steps < 3:
+            self.phase = Autotune.DONE          # too short to tell a peak
+            return
+        self.sweep_gains = []
+        self.sweep_frequency = self.sweep_start
+        self.sweep_amplitude = self.amplitude(self.sweep_frequency)
+        # Below the ultimate gain the weak velocity loop can't become unstable
+        self.sweep_damping = min(SWEEP_DAMPING * self.sweep_start * r['inertia'], r['ultimate_gain'] / GAIN_MARGIN)
+        self.sweep_phase = 0.0
+        self.sweep_sums = np.zeros(4)
+        self.phase = Autotune.SWEEP
+
+    def amplitude(self, frequency):
+        return min(sweep_current, SWEEP_MAX_VEL * vel_limit * self.result['inertia'] * frequency)
+
+    def sweep(self, vel):
+        # Each step starts with the cosine at zero phase and runs for whole
+        # periods, which leaves a rigid inertia at rest, and a weak velocity
+        # loop keeps the motor from drifting. Both the current and the velocity
+        # are correlated, so that the loop doesn't bias the response.
+        # @returns the current command
+        hold = max(min(-self.sweep_damping * vel, relay_current), -relay_current)
+        (c, s) = (math.cos(self.sweep_phase), math.sin(self.sweep_phase))
+        output = self.sweep_amplitude * c + hold
+        if self.sweep_phase >= 2 * math.pi * SWEEP_SETTLE_PERIODS:
+            self.sweep_sums += (output * c, output * s, vel * c, vel * s)
+        self.sweep_phase += self.sweep_frequency * dt
+        step_phase = 2 * math.pi * (SWEEP_SETTLE_PERIODS + SWEEP_MEASURE_PERIODS)
+        if self.sweep_phase < step_phase:
+            return output
+        # Response relative to the velocity of the identified inertia
+        current = abs(complex(*self.sweep_sums[0:2]))
+        velocity = abs(complex(*self.sweep_sums[2:4]))
+        self.sweep_gains.append(velocity / current * self.sweep_frequency * self.result['inertia'])
+        if len(self.sweep_gains) == self.sweep_steps:
+            self.finish_sweep()
+            return 0.0
+        self.sweep_phase -= step_phase
+        self.sweep_frequency *= SWEEP_STEP
+        self.sweep_amplitude = self.amplitude(self.sweep_frequency)
+        self.sweep_sums = np.zeros(4)
+        return output
+
+    def finish_sweep(self):
+        # Below the resonances, the response is that of the identified inertia,
+        # about 1, and falls off with the lags at higher frequencies. Above a
+        # resonance it is that of the motor alone, so it may end higher than it
+        # starts. A resonance is a peak within the sweep.
+        gains = self.sweep_gains
+        peak = int(np.argmax(gains))
+        if 0 < peak < len(gains) - 1 and gains[peak] > RESONANCE_PEAK * gains[0]:
+            # Vertex of the parabola through the logarithms of the peak and its
+            # neighbours, in steps
+            min_gain = 1e-6 * gains[peak]
+            (l, c, r) = (math.log(max(gains[peak - 1], min_gain)), math.log(gains[peak]),
+                         math.log(max(gains[peak + 1], min_gain)))
+            offset = 0.5 * (l - r) / (l - 2 * c + r)
+            self.result['resonance_frequency'] = self.sweep_start * SWEEP_STEP**(peak + offset)
+        self.phase = Autotune.DONE
+
+
+def RunAutotune(plant, max_travel=max_travel):
+    enc = EncoderPll()
+    tune = Autotune(enc.pos_estimate, max_travel)
+    log = []
+    while tune.busy():
+        vel = enc.update(plant.count())
+        Iq = tune.update(enc.pos_estimate, vel)
+        plant.step(Iq)
+        log.append((tune.time, vel, Iq, plant.pos))
+    return (tune, np.array(log))
+
+def StepResponse(plant, result, step=2000.0, duration=0.3):
+    # Velocity loop of Controller::update() with the tuned gains
+    enc = EncoderPll()
+    integrator = 0.0
+    log = []
+    for k in range(int(duration / dt)):
+        vel = enc.update(plant.count())
+        err = step - vel
+        Iq = result['vel_gain'] * err + integrator
+        integrator += result['vel_integrator_gain'] * dt * err
+        plant.step(Iq)
+        log.append((k * dt, plant.vel))
+    return np.array(log)
+
+cases = [
+    # (description, inertia, load inertia, resonance, friction)
+    ("rigid", 2e-6, 0.0, 0.0, 0.0),
+    ("rigid with friction", 2e-6, 0.0, 0.0, 0.3),
+    ("heavy", 2e-5, 0.0, 0.0, 0.3),
+    ("load behind a resonance", 2e-6, 4e-6, 300.0, 0.1),
+    ("load behind a stiff coupling", 2e-6, 2e-6, 800.0, 0.1),
+]
+
+def large_test():
+    tests = Tests()
+    print("                        case | time [s] | inertia [%] | friction [A] | w_u [rad/s] | resonance [rad/s] | bandwidth | overshoot [%]")
+    for (description, J, J_load, resonance, friction) in cases:
+        (tune, _) = RunAutotune(Plant(J, J_load, resonance, friction))
+        if not tests.check(tune.phase == Autotune.DONE, "{} failed".format(description)):
+            continue
+        r = tune.result
+        step = StepResponse(Plant(J, J_load, resonance, friction), r)
+        final = np.mean(step[-len(step) // 5:, 1])
+        overshoot = (np.max(step[:, 1]) / final - 1) * 100
+        # Steady state: the velocity must not keep oscillating
+        tail = step[-len(step) // 5:, 1]
+        ripple = (np.max(tail) - np.min(tail)) / final
+        J_total = J + J_load
+        J_err = (r['inertia'] / J_total - 1) * 100
+        print("{:>28} | {:8.2f} | {:11.1f} | {:12.2f} | {:11.0f} | {:17.0f} | {:9.0f} | {:13.1f}".format(
+            description, tune.time, J_err, r['friction'], r['ultimate_frequency'], r['resonance_frequency'],
+            r['bandwidth'], overshoot))
+        if J_load == 0:
+            tests.check(abs(J_err) <= 10, "inertia not identified")
+            tests.check(r['resonance_frequency'] == 0, "resonance found on a rigid load")
+        else:
+            tests.check(abs(r['resonance_frequency'] / resonance - 1) <= 0.06, "resonance not identified")
+        tests.check(overshoot <= 30 and ripple <= 0.1 and abs(final / 2000.0 - 1) <= 0.05,
+                    "tuned velocity loop not well damped")
+    # The travel limit must stop the experiments
+    (tune, log) = RunAutotune(Plant(*cases[0][1:]), max_travel=100.0)
+    travel = np.max(np.abs(log[:, 3] - log[0, 3]))
+    tests.check(tune.phase == Autotune.FAILED and travel <= 150.0,
+                "travel of {:.0f} counts not limited".format(travel))
+    return tests.summary()
+
+def graphical_test():
+    (tune, log) = RunAutotune(Plant(*cases[1][1:]))
+    fig, axes = plt.subplots(2, 1, sharex=True)
+    axes[0].plot(log[:, 0], log[:, 1])
+    axes[1].plot(log[:, 0], log[:, 2])
+    plt.show()
+
+if __name__ == '__main__':
+    main(large_test, graphical_test)
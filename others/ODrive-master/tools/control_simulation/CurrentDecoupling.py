@@ -0,0 +1,144 @@
+# Plant simulation of the current controller in Motor::FOC_current()
+# (Firmware/MotorControl/motor.cpp) with and without the decoupling and
+# back-EMF feed-forward terms.
+#
+# The motor is simulated in the rotor (dq) frame at a given electrical
+# velocity. Voltages computed from the currents sampled at one control period
+# are applied during the next period, and their magnitude is limited like the
+# modulation in FOC_current().
+
+import numpy as np
+import math
+import matplotlib.pyplot as plt
+from plant import dt, current_control_bandwidth, Tests, main
+
+# Firmware defaults
+max_modulation = 0.80 * math.sqrt(3) / 2
+
+# Motor, roughly a 270KV 7 pole pair outrunner on 24V
+R = 0.05                                # [ohm]
+L = 20e-6                               # [H]
+pole_pairs = 7
+flux_linkage = 5.513 / (270 * pole_pairs)   # [V/(rad/s)]
+vbus = 24.0                             # [V]
+V_max = max_modulation * (2.0 / 3.0) * vbus
+base_speed = V_max / flux_linkage       # [rad/s] electrical, where the back-EMF alone saturates the modulation
+
+substeps = 10                           # plant integration steps per control period
+Iq_step = 10.0                          # [A]
+t_settle = 0.02                         # [s] at Iq = 0 before the step
+
+p_gain = current_control_bandwidth * L
+i_gain = R / L * p_gain
+antiwindup_k = min(i_gain / p_gain * dt, 1.0)
+
+
+class CurrentController:
+    def __init__(self, decoupling, bemf_feedforward):
+        self.decoupling = decoupling
+        self.bemf_feedforward = bemf_feedforward
+        self.integral_d = 0.0
+        self.integral_q = 0.0
+
+    def update(self, Id_des, Iq_des, Id, Iq, omega):
+        Ierr_d = Id_des - Id
+        Ierr_q = Iq_des - Iq
+        Vd_ff = 0.0
+        Vq_ff = 0.0
+        if self.decoupling:
+            Vd_ff -= omega * L * Iq
+            Vq_ff += omega * L * Id
+        if self.bemf_feedforward:
+            Vq_ff += omega * flux_linkage
+        Vd = self.integral_d + Ierr_d * p_gain + Vd_ff
+        Vq = self.integral_q + Ierr_q * p_gain + Vq_ff
+        scale = min(V_max / max(math.hypot(Vd, Vq), 1e-9), 1.0)
+        # Back-calculation anti-windup
+        self.integral_d += Ierr_d * i_gain * dt + antiwindup_k * (scale - 1.0) * Vd
+        self.integral_q += Ierr_q * i_gain * dt + antiwindup_k * (scale - 1.0) * Vq
+        return (Vd * scale, Vq * scale)
+
+def Simulate(omega_profile, Iq_des_profile, decoupling, bemf_feedforward):
+    n = len(omega_profile)
+    ctrl = CurrentController(decoupling, bemf_feedforward)
+    Id = 0.0
+    Iq = 0.0
+    V = (0.0, 0.0)
+    Id_log = np.zeros(n)
+    Iq_log = np.zeros(n)
+    h = dt / substeps
+    for k in range(n):
+        omega = omega_profile[k]
+        Id_log[k] = Id
+        Iq_log[k] = Iq
+        V_next = ctrl.update(0.0, Iq_des_profile[k], Id, Iq, omega)
+        # The voltage computed in the previous period is applied during this one
+        for _ in range(substeps):
+            dId = (V[0] - R * Id + omega * L * Iq) / L
+            dIq = (V[1] - R * Iq - omega * L * Id - omega * flux_linkage) / L
+            Id += h * dId
+            Iq += h * dIq
+        V = V_next
+    return (Id_log, Iq_log)
+
+def StepResponse(omega, decoupling, bemf_feedforward):
+    n = int((t_settle + 0.01) / dt)
+    t = np.arange(n) * dt - t_settle
+    omega_profile = np.full(n, omega)
+    Iq_des = np.where(t >= 0, Iq_step, 0.0)
+    (Id, Iq) = Simulate(omega_profile, Iq_des, decoupling, bemf_feedforward)
+    after = t >= 0
+    reached = np.nonzero(after & (Iq >= 0.9 * Iq_step))[0]
+    rise_time = (t[reached[0]] if len(reached) else float('inf'))
+    Id_peak = max(abs(Id[after]))
+    Iq_overshoot = max(Iq[after]) / Iq_step - 1
+    return (t, Id, Iq, rise_time, Id_peak, Iq_overshoot)
+
+def AccelerationResponse(decoupling, bemf_feedforward, accel=2e5):
+    # Constant current while accelerating to the base speed at accel [rad/s^2]
+    # @returns the speed at which the current drops below 90% of its setpoint
+    n = int(base_speed / accel / dt)
+    omega_profile = np.arange(n) * dt * accel
+    Iq_des = np.full(n, Iq_step)
+    (Id, Iq) = Simulate(omega_profile, Iq_des, decoupling, bemf_feedforward)
+    lost = np.nonzero((np.arange(n) * dt > 0.002) & (Iq < 0.9 * Iq_step))[0]
+    return omega_profile[lost[0]] if len(lost) else base_speed
+
+def large_test():
+    tests = Tests()
+    print("Current step of {} A, base speed {:.0f} rad/s".format(Iq_step, base_speed))
+    print("  speed [rad/s] | feed-forward | rise time [ms] | Id peak [A] | Iq overshoot [%]")
+    for fraction in [0.0, 0.3, 0.6, 0.9]:
+        omega = fraction * base_speed
+        results = {}
+        for ff in [False, True]:
+            (_, _, _, rise_time, Id_peak, overshoot) = StepResponse(omega, ff, ff)
+            results[ff] = (rise_time, Id_peak, overshoot)
+            print("  {:13.0f} | {:12} | {:14.3f} | {:11.3f} | {:16.1f}".format(
+                omega, "on" if ff else "off", rise_time * 1e3, Id_peak, overshoot * 100))
+        # With feed-forward, the step response must stay close to the one at standstill
+        rise_time_0 = StepResponse(0.0, True, True)[3]
+        (rise_time, Id_peak, overshoot) = results[True]
+        tests.check(rise_time <= 1.2 * rise_time_0 and Id_peak <= max(results[False][1], 0.05 * Iq_step) and overshoot <= 0.05,
+                    "feed-forward doesn't improve the step response at {:.0f} rad/s".format(omega))
+
+    omega_off = AccelerationResponse(False, False)
+    omega_on = AccelerationResponse(True, True)
+    print("Accelerating at constant current: current lost at {:.0f} rad/s without and {:.0f} rad/s with feed-forward".format(omega_off, omega_on))
+    tests.check(omega_on > omega_off and omega_on >= 0.9 * base_speed,
+                "feed-forward doesn't extend the usable speed range")
+    return tests.summary()
+
+def graphical_test():
+    fig, axes = plt.subplots(2, 4)
+    for col, fraction in enumerate([0.0, 0.3, 0.6, 0.9]):
+        for ff in [False, True]:
+            (t, Id, Iq, _, _, _) = StepResponse(fraction * base_speed, ff, ff)
+            axes[0, col].plot(t * 1e3, Iq)
+            axes[1, col].plot(t * 1e3, Id)
+        axes[0, col].set_xlim(-1, 10)
+        axes[1, col].set_xlim(-1, 10)
+    plt.show()
+
+if __name__ == '__main__':
+    main(large_test, graphical_test)
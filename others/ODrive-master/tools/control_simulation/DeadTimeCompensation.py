@@ -0,0 +1,150 @@
+# Plant simulation of the dead time compensation in Motor::FOC_current() and
+# its identification in Motor::measure_deadtime_compensation()
+# (Firmware/MotorControl/motor.cpp).
+#
+# The inverter is modelled per phase, averaged over a PWM period: each phase
+# loses V_dt * tanh(i / I_knee) of its commanded voltage, where V_dt is the dead
+# time times the PWM frequency times vbus plus the switch voltage drop. The
+# smooth knee around zero current differs on purpose from the clamped ramp the
+# firmware assumes.
+
+import numpy as np
+import math
+import matplotlib.pyplot as plt
+from plant import dt, current_control_bandwidth, calibration_current, Tests, main
+
+# Firmware defaults
+pwm_frequency = 24000.0                 # [Hz]
+
+# Motor and inverter
+R = 0.05                                # [ohm]
+L = 20e-6                               # [H]
+flux_linkage = 5.513 / (270 * 7)        # [V/(rad/s)]
+vbus = 24.0                             # [V]
+deadtime = 300e-9                       # [s] including the gate driver delays
+switch_voltage_drop = 0.05              # [V]
+I_knee = 0.3                            # [A]
+V_dt = deadtime * pwm_frequency * vbus + switch_voltage_drop
+
+substeps = 10
+p_gain = current_control_bandwidth * L
+i_gain = R / L * p_gain
+
+test_currents = np.array([-1.0, -0.6, -0.35, -0.2, -0.1, -0.05, -0.02,
+                          0.02, 0.05, 0.1, 0.2, 0.35, 0.6, 1.0]) * calibration_current
+num_bands = 16
+
+
+def Clarke(a, b, c):
+    return ((2.0 / 3.0) * (a - 0.5 * (b + c)), (b - c) / math.sqrt(3))
+
+def InverseClarke(alpha, beta):
+    return (alpha, -0.5 * alpha + 0.5 * math.sqrt(3) * beta, -0.5 * alpha - 0.5 * math.sqrt(3) * beta)
+
+def InverterError(i_alpha, i_beta):
+    # Voltage lost in the inverter, in the stationary frame
+    (a, b, c) = InverseClarke(i_alpha, i_beta)
+    return Clarke(*[-V_dt * math.tanh(i / I_knee) for i in (a, b, c)])
+
+def Identify(noise=0.002, seed=0):
+    # Steady state of the test in measure_deadtime_compensation(): DC current along phase A
+    rng = np.random.RandomState(seed)
+    currents = test_currents + rng.randn(len(test_currents)) * noise
+    voltages = np.array([R * I - InverterError(I, 0.0)[0] for I in currents]) + rng.randn(len(currents)) * noise
+    # Same fit as the firmware
+    best = None
+    for b in range(num_bands):
+        band = 0.01 * calibration_current * 50.0 ** (b / (num_bands - 1))
+        g = (2.0 / 3.0) * (np.clip(currents / band, -1, 1) + np.clip(0.5 * currents / band, -1, 1))
+        A = np.stack([currents, g], axis=1)
+        (coeffs, _, _, _) = np.linalg.lstsq(A, voltages, rcond=None)
+        residual = np.sum((voltages - A.dot(coeffs))**2)
+        if best is None or residual < best[0]:
+            best = (residual, coeffs[0], coeffs[1], band)
+    (_, R_fit, Vdt_fit, band) = best
+    return (R_fit, Vdt_fit, band)
+
+def Simulate(compensation, omega=30.0, Iq_des=2.0, duration=0.5):
+    # Current control at a low electrical velocity [rad/s]
+    # @returns the time, the dq current errors and the error of the reported voltage
+    (R_fit, Vdt_fit, band) = Identify()
+    n = int(duration / dt)
+    h = dt / substeps
+    i_alpha = i_beta = 0.0
+    integral_d = integral_q = 0.0
+    v_cmd = (0.0, 0.0)
+    v_report = (0.0, 0.0)
+    theta = 0.0
+    log = np.zeros((n, 4))
+    for k in range(n):
+        c = math.cos(theta)
+        s = math.sin(theta)
+        Id = c * i_alpha + s * i_beta
+        Iq = c * i_beta - s * i_alpha
+
+        # Controller, see FOC_current()
+        Ierr_d = 0.0 - Id
+        Ierr_q = Iq_des - Iq
+        Vd = integral_d + Ierr_d * p_gain
+        Vq = integral_q + Ierr_q * p_gain
+        integral_d += Ierr_d * i_gain * dt
+        integral_q += Ierr_q * i_gain * dt
+        pwm_theta = theta + 1.5 * dt * omega
+        c_p = math.cos(pwm_theta)
+        s_p = math.sin(pwm_theta)
+        v_alpha = c_p * Vd - s_p * Vq
+        v_beta = c_p * Vq + s_p * Vd
+        comp = (0.0, 0.0)
+        if compensation:
+            (a, b, cc) = InverseClarke(-s_p * Iq_des, c_p * Iq_des)
+            comp = Clarke(*[Vdt_fit * min(max(i / band, -1.0), 1.0) for i in (a, b, cc)])
+        v_next = (v_alpha + comp[0], v_beta + comp[1])
+        v_report_next = (v_alpha, v_beta)
+
+        # The voltage computed in the previous period is applied during this one
+        v_err = (0.0, 0.0)
+        for _ in range(substeps):
+            err = InverterError(i_alpha, i_beta)
+            v_err = (v_err[0] + err[0] / substeps, v_err[1] + err[1] / substeps)
+            e_alpha = -omega * flux_linkage * math.sin(theta)
+            e_beta = omega * flux_linkage * math.cos(theta)
+            i_alpha += h * (v_cmd[0] + err[0] - R * i_alpha - e_alpha) / L
+            i_beta += h * (v_cmd[1] + err[1] - R * i_beta - e_beta) / L
+            theta += h * omega
+        applied = (v_cmd[0] + v_err[0], v_cmd[1] + v_err[1])
+        log[k] = (k * dt, Id, Iq - Iq_des, math.hypot(v_report[0] - applied[0], v_report[1] - applied[1]))
+        v_cmd = v_next
+        v_report = v_report_next
+    return log
+
+def large_test():
+    tests = Tests()
+    (R_fit, Vdt_fit, band) = Identify()
+    print("Identified R = {:.4f} ohm (true {:.4f}), dead time voltage = {:.3f} V (true {:.3f}), band = {:.2f} A".format(
+        R_fit, R, Vdt_fit, V_dt, band))
+    R_biased = R + (4.0 / 3.0) * V_dt * math.tanh(calibration_current / I_knee) / calibration_current
+    print("measure_phase_resistance() alone would find {:.4f} ohm".format(R_biased))
+    tests.check(abs(R_fit / R - 1) <= 0.05, "resistance not identified")
+    tests.check(abs(Vdt_fit / V_dt - 1) <= 0.1, "dead time voltage not identified")
+
+    results = {}
+    for compensation in [False, True]:
+        log = Simulate(compensation)
+        steady = log[len(log) // 2:]
+        current_error = math.sqrt(np.mean(steady[:, 1]**2 + steady[:, 2]**2))
+        voltage_error = math.sqrt(np.mean(steady[:, 3]**2))
+        results[compensation] = (current_error, voltage_error)
+        print("Compensation {:3}: RMS current error {:.3f} A, RMS error of the reported voltage {:.3f} V".format(
+            "on" if compensation else "off", current_error, voltage_error))
+    tests.check(results[True][0] <= 0.5 * results[False][0], "compensation doesn't reduce the current distortion")
+    tests.check(results[True][1] <= 0.5 * results[False][1], "compensation doesn't improve the reported voltage")
+    return tests.summary()
+
+def graphical_test():
+    for compensation in [False, True]:
+        log = Simulate(compensation)
+        plt.plot(log[:, 0], log[:, 2])
+    plt.show()
+
+if __name__ == '__main__':
+    main(large_test, graphical_test)
@@ -0,0 +1,108 @@
+# Plant simulation of the position and velocity loops in
+# Firmware/MotorControl/controller.cpp with and without the disturbance observer.
+#
+# The plant (plant.py) is a rigid inertia driven by a current loop with a
+# first-order response. The position is quantized to encoder counts and the
+# velocity is estimated with the encoder PLL. A load step is applied while the axis holds
+# its position, and the position error and recovery time are compared.
+
+import numpy as np
+import matplotlib.pyplot as plt
+from plant import dt, current_lim, Plant, EncoderPll, Tests, main
+
+# Firmware defaults
+pos_gain = 20.0                         # [(counts/s) / counts]
+vel_gain = 5.0 / 10000.0                # [A/(counts/s)]
+vel_integrator_gain = 10.0 / 10000.0    # [A/(counts/s * s)]
+
+# Plant
+inertia = 2e-6                          # [A/(counts/s^2)]
+load_step = 3.0                         # [A]
+t_step = 0.05                           # [s]
+t_end = 1.0                             # [s]
+
+# Recovery is reached when the position error stays within this band
+recovery_band = 5.0                     # [counts]
+
+
+def Simulate(enable_observer, observer_bandwidth=200.0, inertia_estimate=inertia):
+    n = int(t_end / dt)
+    t = np.arange(n) * dt
+    pos_err = np.zeros(n)
+    load_est = np.zeros(n)
+
+    plant = Plant(inertia, delay=False, pos=0.0)
+    enc = EncoderPll()
+    vel_integrator_current = 0.0
+    observer_state = 0.0
+
+    for i in range(n):
+        vel_estimate = enc.update(plant.count())
+        pos_estimate = enc.pos_estimate
+
+        # Position and velocity loops
+        vel_des = pos_gain * (0.0 - pos_estimate)
+        Iq_cmd = 0.0
+        inertia_term = inertia_estimate * observer_bandwidth * vel_estimate
+        if enable_observer:
+            alpha = min(observer_bandwidth * dt, 1.0)
+            observer_state += alpha * (plant.Iq + inertia_term - observer_state)
+            load_current = observer_state - inertia_term
+            Iq_cmd += load_current
+        else:
+            observer_state = inertia_term
+            load_current = 0.0
+        v_err = vel_des - vel_estimate
+        Iq_cmd += vel_gain * v_err + vel_integrator_current
+        limited = abs(Iq_cmd) > current_lim
+        Iq_cmd = max(-current_lim, min(current_lim, Iq_cmd))
+        if limited:
+            vel_integrator_current *= 0.99
+        else:
+            vel_integrator_current += vel_integrator_gain * dt * v_err
+
+        plant.step(Iq_cmd, load_step if t[i] >= t_step else 0.0)
+        pos_err[i] = plant.pos
+        load_est[i] = load_current
+
+    return (t, pos_err, load_est)
+
+def Evaluate(t, pos_err):
+    after = t >= t_step
+    peak = max(abs(pos_err[after]))
+    outside = np.nonzero(after & (abs(pos_err) > recovery_band))[0]
+    recovery = (t[outside[-1]] - t_step) if len(outside) else 0.0
+    return (peak, recovery)
+
+def large_test():
+    tests = Tests()
+    (t, pos_err, _) = Simulate(False)
+    (peak_off, recovery_off) = Evaluate(t, pos_err)
+    print("Without observer: peak error {:.1f} counts, recovery {:.3f} s".format(peak_off, recovery_off))
+
+    for observer_bandwidth in [100.0, 200.0, 400.0]:
+        for inertia_error in [0.7, 1.0, 1.3]:
+            (t, pos_err, load_est) = Simulate(True, observer_bandwidth, inertia * inertia_error)
+            (peak, recovery) = Evaluate(t, pos_err)
+            # The estimate is noisy due to the encoder quantization
+            load_mean = np.mean(load_est[t >= t_end - 0.1])
+            load_error = abs(load_mean - load_step)
+            print("Observer at {:.0f} rad/s, inertia x{:.1f}: peak error {:.1f} counts, recovery {:.3f} s, load estimate {:.3f} A".format(
+                observer_bandwidth, inertia_error, peak, recovery, load_mean))
+            tests.check(peak < peak_off and recovery < 0.5 * recovery_off and load_error < 0.02 * load_step,
+                        "the observer doesn't improve the load step response")
+    return tests.summary()
+
+def graphical_test():
+    fig, axes = plt.subplots(2, 1)
+    for (enable, label) in [(False, "integrator only"), (True, "disturbance observer")]:
+        (t, pos_err, load_est) = Simulate(enable)
+        axes[0].plot(t, pos_err, label=label)
+        axes[1].plot(t, load_est, label=label)
+    axes[0].set_ylabel("position error [counts]")
+    axes[1].set_ylabel("estimated load [A]")
+    axes[0].legend()
+    plt.show()
+
+if __name__ == '__main__':
+    main(large_test, graphical_test)
@@ -0,0 +1,184 @@
+# Low speed velocity from encoder edge timestamps, as computed by
+# Encoder::update_edge_timing() (Firmware/MotorControl/encoder.cpp).
+#
+# The encoder counts follow a given velocity profile. The edges are timestamped
+# by an interrupt with some latency and jitter, and the counter and the time of
+# the last edge are sampled once per control period. The velocity is measured over
+# a window from edge to edge (M/T method) and blended into the PLL velocity
+# below a configured speed. The velocity ripple at a few RPM, the response to
+# a stop and the error in the blending region are compared with the PLL alone.
+
+import numpy as np
+import math
+import matplotlib.pyplot as plt
+from plant import dt, EncoderPll, Tests, main
+
+# Firmware defaults
+edge_timing_vel = 2000.0                # [counts/s] full weight below, faded out up to twice this
+edge_timing_window = 0.001              # [s] shortest measurement window
+edge_timing_timeout = 0.1               # [s] zero velocity without edges for this long
+
+# Encoder
+edge_latency = 1.0e-6                   # [s] interrupt latency
+edge_jitter = 0.5e-6                    # [s] RMS interrupt latency jitter
+substeps = 8
+
+
+class Encoder(EncoderPll):
+    # Same as the edge timing in Encoder::update()
+    def __init__(self, edge_timing):
+        EncoderPll.__init__(self)
+        self.edge_timing = edge_timing
+        self.count = 0
+        self.edge_timing_active = False
+        self.edge_timing_valid = False
+        self.edge_ref_valid = False
+        self.edge_ref_count = 0
+        self.edge_ref_time = 0.0
+        self.edge_count = 0
+        self.edge_time = 0.0
+        self.edge_dir = 0
+        self.vel_edge = 0.0
+
+    def update(self, count, edge_time, sample_time):
+        # @param edge_time: time of the last edge before the sample, as latched in sample_now()
+        self.count = count
+        self.track(count)
+        if self.edge_timing and self.update_edge_timing(edge_time, sample_time):
+            return
+        self.snap()
+
+    def update_edge_timing(self, edge_time, sample_time):
+        # @returns true if the edge velocity was blended in
+        if not self.edge_timing_active:
+            # The interrupts are unmasked below 2.2 and masked above 2.5 times edge_timing_vel
+            if abs(self.vel_estimate) < 2.2 * edge_timing_vel:
+                self.edge_timing_active = True
+                self.edge_timing_valid = False
+                self.edge_ref_valid = False
+                self.edge_count = self.count
+                self.edge_time = edge_time
+            return False
+        if abs(self.vel_estimate) > 2.5 * edge_timing_vel:
+            self.edge_timing_active = False
+            return False
+
+        if edge_time != self.edge_time:
+            # The interrupt of an edge may come a period after its count
+            delta = self.count - self.edge_count
+            direction = (delta > 0) - (delta < 0)
+            self.edge_count = self.count
+            self.edge_time = edge_time
+            self.edge_timing_valid = True
+            if self.edge_ref_valid and direction == self.edge_dir:
+                window = edge_time - self.edge_ref_time
+                if window >= edge_timing_window:
+                    self.vel_edge = (self.count - self.edge_ref_count) / window
+                    self.edge_ref_count = self.count
+                    self.edge_ref_time = edge_time
+            else:
+                # First edge after a stop or a reversal
+                self.vel_edge = 0.0
+                self.edge_ref_valid = direction != 0
+                self.edge_ref_count = self.count
+                self.edge_ref_time = edge_time
+            self.edge_dir = direction
+        elif abs(self.count - self.edge_count) > 1:
+            # Counts without edge timestamps: the interrupts don't work
+            self.edge_timing_valid = False
+            self.edge_ref_valid = False
+        if not self.edge_timing_valid:
+            return False
+
+        # No edge since then means the velocity is lower
+        since = sample_time - self.edge_time
+        if since > edge_timing_timeout:
+            self.vel_edge = 0.0
+            self.edge_ref_valid = False
+        elif abs(self.vel_edge) * since > 1.0:
+            self.vel_edge = self.edge_dir / since
+
+        weight = min(max(2.0 - abs(self.vel_estimate) / edge_timing_vel, 0.0), 1.0)
+        self.vel_estimate += weight * (self.vel_edge - self.vel_estimate)
+        return True
+
+
+def Simulate(vel_profile, duration, edge_timing, interrupts=True, seed=0):
+    # @param vel_profile: true velocity [counts/s] as a function of time
+    # @param interrupts: false if the edge interrupts never fire
+    # @returns the log of time, true velocity and estimated velocity
+    rng = np.random.RandomState(seed)
+    enc = Encoder(edge_timing)
+    pos = 0.4
+    edge_time = -1.0
+    edge_times = []     # timestamps of the interrupts that haven't run yet
+    n = int(duration / dt)
+    log = np.zeros((n, 3))
+    for k in range(n):
+        t = k * dt
+        while edge_times and edge_times[0] <= t:
+            edge_time = edge_times.pop(0)
+        enc.update(int(math.floor(pos)), edge_time, t)
+        log[k] = (t, vel_profile(t), enc.vel_estimate)
+        h = dt / substeps
+        for j in range(substeps):
+            vel = vel_profile(t + (j + 0.5) * h)
+            pos_next = pos + h * vel
+            if interrupts and math.floor(pos_next) != math.floor(pos):
+                edge = math.floor(pos_next) if vel > 0 else math.floor(pos)
+                edge_times.append(t + j * h + (edge - pos) / vel + edge_latency + edge_jitter * abs(rng.randn()))
+            pos = pos_next
+    return log
+
+def Errors(log, t_from=0.05, t_to=None):
+    sel = log[:, 0] >= t_from
+    if t_to is not None:
+        sel &= log[:, 0] < t_to
+    err = log[sel, 2] - log[sel, 1]
+    return (math.sqrt(np.mean(err**2)), np.max(np.abs(err)))
+
+cases = [
+    # (description, velocity profile [counts/s], duration)
+    ("3 RPM, 8192 cpr", lambda t: 3.0 / 60.0 * 8192, 1.0),
+    ("20 RPM, 90 cpr hall", lambda t: 20.0 / 60.0 * 90, 2.0),
+    ("ramp through the blending", lambda t: 12000.0 * t, 0.5),
+    ("slow sinusoid", lambda t: 500.0 * math.sin(2.0 * math.pi * 2.0 * t), 1.0),
+]
+
+def large_test():
+    tests = Tests()
+    print("                      case | PLL RMS | PLL max | edge RMS | edge max  [counts/s]")
+    for (description, profile, duration) in cases:
+        pll = Errors(Simulate(profile, duration, False))
+        edge = Errors(Simulate(profile, duration, True))
+        print("{:>26} | {:7.1f} | {:7.1f} | {:8.1f} | {:8.1f}".format(description, *(pll + edge)))
+        tests.check(edge[0] < pll[0], "edge timing not more accurate")
+
+    # Stop from 3 RPM: the estimate must reach zero within the timeout and stay there
+    log = Simulate(lambda t: 410.0 if t < 0.5 else 0.0, 1.0, True)
+    after = log[log[:, 0] > 0.5 + edge_timing_timeout + dt]
+    print("Stop: largest velocity estimate after the timeout {:.1f} counts/s".format(np.max(np.abs(after[:, 2]))))
+    tests.check(np.all(after[:, 2] == 0.0), "velocity estimate doesn't settle at zero")
+
+    # Without edge interrupts the estimate must fall back to the PLL
+    pll = Simulate(cases[0][1], 0.5, False)
+    edge = Simulate(cases[0][1], 0.5, True, interrupts=False)
+    tests.check(np.array_equal(pll[:, 2], edge[:, 2]), "no fallback to the PLL without edge interrupts")
+
+    # High speed: the edge interrupts are off and the PLL takes over. The PLL
+    # may lock anywhere within one step of its velocity resolution (dt * ki)
+    # after the start.
+    pll = Errors(Simulate(lambda t: 20000.0, 0.2, False), 0.1)
+    edge = Errors(Simulate(lambda t: 20000.0, 0.2, True), 0.1)
+    print("20000 counts/s: RMS error {:.1f} counts/s with the PLL, {:.1f} counts/s with edge timing".format(pll[0], edge[0]))
+    tests.check(edge[1] <= dt * Encoder(False).ki, "edge timing changes the estimate at high speed")
+    return tests.summary()
+
+def graphical_test():
+    for edge_timing in [False, True]:
+        log = Simulate(cases[0][1], 0.5, edge_timing)
+        plt.plot(log[:, 0], log[:, 2])
+    plt.show()
+
+if __name__ == '__main__':
+    main(large_test, graphical_test)
@@ -0,0 +1,223 @@
+# Voltage vs. current controlled encoder offset calibration: both
+# Encoder::run_offset_calibration() and Encoder::run_current_offset_calibration()
+# (Firmware/MotorControl/encoder.cpp) are replayed on a simulated rotor.
+#
+# The rotor is the rigid body of plant.py with viscous and Coulomb friction.
+# With voltage control the stator current follows from the resistance and the
+# back-EMF, with current control the calibration current is assumed to be
+# tracked perfectly along the commanded phase. The magnets of each pole pair
+# can be displaced by a few electrical degrees, which only the per pole pair
+# offsets can take out. These are only right if the samples are binned on the
+# pole pairs relative to the final offset, which the misaligned case checks by
+# locking the rotor half an electrical revolution away from it. The encoder may
+# count against the motor. The calibrations are compared by their duration and
+# the RMS error of the electrical phase they yield over one mechanical
+# revolution.
+
+import numpy as np
+import math
+import cmath
+import matplotlib.pyplot as plt
+import plant
+from plant import dt, calibration_current, EncoderPll, Tests, main
+
+# Firmware defaults
+calib_scan_distance = 16.0 * math.pi    # [rad] electrical
+calib_scan_omega = 4.0 * math.pi        # [rad/s] electrical
+calib_current_scan_omega = 16.0 * math.pi
+calib_lock_vel_tolerance = 1.0          # [rad/s] electrical
+calib_lock_settle_time = 0.05           # [s]
+start_lock_duration = 1.0               # [s] also the maximum lock duration with current control
+pll_bandwidth = 1000.0                  # [rad/s]
+POLE_PAIR_GUARD = 0.125                 # [electrical revolutions] samples this close to a pole pair boundary are skipped
+
+# Motor and encoder
+R = 0.05                                # [ohm]
+pole_pairs = 7
+flux_linkage = 5.513 / (270 * 7)        # [V/(rad/s)]
+cpr = 8192
+inertia = 2e-5                          # [kg m^2]
+viscous_friction = 1e-4                 # [Nm/(rad/s)]
+substeps = 4
+
+peak_torque = 1.5 * pole_pairs * flux_linkage * calibration_current
+
+
+class Plant(plant.Plant):
+    # The rotor of plant.py, in [rad] and [Nm], with the torque of the stator current
+    def __init__(self, coulomb_friction, magnet_errors, R_error, start_angle, encoder_direction=1):
+        # @param coulomb_friction: relative to the peak torque
+        # @param magnet_errors: electrical angle error of each pole pair [rad]
+        # @param R_error: relative error of the resistance used for voltage control
+        # @param encoder_direction: -1 if the encoder counts against the motor
+        plant.Plant.__init__(self, inertia, friction=coulomb_friction * peak_torque, pos=start_angle)
+        self.magnet_errors = magnet_errors
+        self.R_used = R * (1.0 + R_error)
+        self.encoder_direction = encoder_direction
+
+    def electrical_angle(self, theta):
+        pole_pair = int(math.floor(theta / (2 * math.pi) * pole_pairs)) % pole_pairs
+        return pole_pairs * theta + self.magnet_errors[pole_pair]
+
+    def count(self):
+        return int(math.floor(self.encoder_direction * self.pos / (2 * math.pi) * cpr))
+
+    def step(self, field_phase, voltage_control):
+        h = dt / substeps
+        for _ in range(substeps):
+            theta_e = self.electrical_angle(self.pos)
+            if voltage_control:
+                # Stator current of a resistive winding, with the calibration voltage
+                v = self.R_used * calibration_current * cmath.exp(1j * field_phase)
+                e = 1j * pole_pairs * self.vel * flux_linkage * cmath.exp(1j * theta_e)
+                I = (v - e) / R
+            else:
+                I = calibration_current * cmath.exp(1j * field_phase)
+            torque = 1.5 * pole_pairs * flux_linkage * (I * cmath.exp(-1j * theta_e)).imag
+            self.integrate(torque - viscous_friction * self.vel, h)
+
+
+def VoltageCalibration(plant):
+    # Same as Encoder::run_offset_calibration()
+    # @returns the offset, the pole pair offsets, the direction and the duration
+    num_steps = int(calib_scan_distance / calib_scan_omega / dt)
+    for _ in range(int(start_lock_duration / dt)):
+        plant.step(0.0, True)
+    init_enc_val = plant.count()
+    encvaluesum = 0
+    for (start, sign) in [(-1.0, 1.0), (1.0, -1.0)]:
+        for i in range(num_steps):
+            phase = sign * calib_scan_distance * i / num_steps + start * calib_scan_distance / 2
+            plant.step(phase, True)
+            encvaluesum += plant.count()
+        if sign > 0:
+            direction = 1 if plant.count() > init_enc_val else -1
+    duration = start_lock_duration + 2 * num_steps * dt
+    return (encvaluesum / (2.0 * num_steps) + 0.5, np.zeros(pole_pairs), direction, duration)
+
+def CurrentCalibration(plant, scan_distance=calib_scan_distance, use_pole_pair_offsets=True):
+    # Same as Encoder::run_current_offset_calibration()
+    # @param scan_distance: calib_scan_distance, which also sets where the rotor is locked
+    # @returns the offset, the pole pair offsets, the direction and the duration
+    calib_scan_distance = scan_distance
+    enc = EncoderPll(float(plant.count()), pll_bandwidth)
+    num_steps = int(calib_scan_distance / calib_current_scan_omega / dt)
+    num_skip = num_steps // 8
+    elec_rad_per_enc = pole_pairs * 2 * math.pi / cpr
+
+    lock_phase = -calib_scan_distance / 2
+    settled = 0
+    i = 0
+    while True:
+        plant.step(lock_phase, False)
+        enc.update(plant.count())
+        settled = settled + 1 if abs(enc.vel_estimate) * elec_rad_per_enc < calib_lock_vel_tolerance else 0
+        i += 1
+        if not (i < start_lock_duration / dt and settled < calib_lock_settle_time / dt):
+            break
+    duration = i * dt
+
+    init_enc_val = plant.count()
+    residual_sum = np.zeros(pole_pairs)
+    residual_n = np.zeros(pole_pairs)
+    fits = []
+    intercepts = []
+    for direction in [1.0, -1.0]:
+        xs = []
+        ys = []
+        for step in range(num_steps):
+            x = direction * (calib_scan_distance * step / num_steps - calib_scan_distance / 2)
+            plant.step(x, False)
+            if step >= num_skip:
+                xs.append(x)
+                ys.append(plant.count() - init_enc_val)
+        xs = np.array(xs, dtype=np.float32)
+        ys = np.array(ys, dtype=np.float32)
+        # The firmware accumulates the sums in single precision
+        n = np.float32(len(xs))
+        (sx, sy, sxx, sxy) = (np.sum(xs), np.sum(ys), np.sum(xs * xs), np.sum(xs * ys))
+        slope = (n * sxy - sx * sy) / (n * sxx - sx * sx)
+        fits.append(slope)
+        # The intercept is taken with the nominal slope, so that the pattern of
+        # the pole pairs can't tilt the line
+        slope = math.copysign(1.0, slope) / elec_rad_per_enc
+        intercept = (sy - slope * sx) / n
+        intercepts.append(intercept)
+        # Bins of one electrical revolution of the commanded phase, which the
+        # line maps onto (count - offset) mod cpr up to the lag of the rotor
+        revs = xs.astype(np.float64) / (2 * math.pi)
+        frac = revs - np.floor(revs)
+        inside = (frac >= POLE_PAIR_GUARD) & (frac <= 1.0 - POLE_PAIR_GUARD)
+        bins = np.mod(np.floor(revs).astype(int), pole_pairs)
+        for k in range(pole_pairs):
+            sel = inside & (bins == k)
+            residual_sum[k] += np.sum(ys[sel] - slope * xs[sel] - intercept)
+            residual_n[k] += np.sum(sel)
+        duration += num_steps * dt
+
+    direction = 1 if fits[0] > 0 else -1
+    offset = 0.5 * (intercepts[0] + intercepts[1])
+    lag = 0.5 * abs(intercepts[0] - intercepts[1]) * pole_pairs / cpr
+    offset += init_enc_val + 0.5
+    offsets = np.zeros(pole_pairs)
+    if use_pole_pair_offsets and lag < POLE_PAIR_GUARD:
+        for k in range(pole_pairs):
+            if residual_n[k] > 0:
+                offsets[k if direction > 0 else (-k - 1) % pole_pairs] = residual_sum[k] / residual_n[k]
+    return (offset, offsets, direction, duration)
+
+def PhaseError(plant, offset, pole_pair_offsets, direction):
+    # RMS error of the electrical phase of Encoder::update() and Motor::update()
+    # over one mechanical revolution
+    errors = []
+    for count in range(0, cpr, 7):
+        theta = plant.encoder_direction * (count + 0.5) * 2 * math.pi / cpr
+        corrected = count - offset
+        pole_pair = int(np.mod(math.floor(corrected), cpr)) * pole_pairs // cpr
+        ph = pole_pairs * 2 * math.pi / cpr * (corrected + 0.5 - pole_pair_offsets[pole_pair])
+        err = direction * ph - plant.electrical_angle(theta)
+        errors.append((err + math.pi) % (2 * math.pi) - math.pi)
+    return math.sqrt(np.mean(np.square(errors)))
+
+magnet_errors = np.array([0, 3, -2, 4, -4, 1, -2])
+
+cases = [
+    # (description, Coulomb friction, magnet errors [deg electrical], resistance error,
+    #  encoder direction, scan distance [rad] electrical)
+    ("low friction", 0.02, np.zeros(pole_pairs), 0.0, 1, calib_scan_distance),
+    ("high friction", 0.5, np.zeros(pole_pairs), 0.0, 1, calib_scan_distance),
+    ("high friction, R 30% low", 0.5, np.zeros(pole_pairs), -0.3, 1, calib_scan_distance),
+    ("magnet placement errors", 0.05, magnet_errors, 0.0, 1, calib_scan_distance),
+    ("magnets, misaligned lock", 0.05, magnet_errors, 0.0, 1, 14.0 * math.pi),
+    ("magnets, reversed encoder", 0.05, magnet_errors, 0.0, -1, 15.0 * math.pi),
+]
+
+def large_test():
+    tests = Tests()
+    print("                         case | voltage [s] | error [deg] | current [s] | error [deg]")
+    for (description, friction, errors, R_error, encoder_direction, scan_distance) in cases:
+        results = []
+        for calibration in [VoltageCalibration, lambda plant: CurrentCalibration(plant, scan_distance)]:
+            plant = Plant(friction, np.radians(errors), R_error, 0.3, encoder_direction)
+            (offset, offsets, direction, duration) = calibration(plant)
+            results.append((duration, math.degrees(PhaseError(plant, offset, offsets, direction))))
+        print("{:>29} | {:11.2f} | {:11.2f} | {:11.2f} | {:11.2f}".format(description, *(results[0] + results[1])))
+        tests.check(results[1][0] * 3 <= results[0][0], "calibration with current control not faster")
+        tests.check(results[1][1] <= 0.5, "calibration with current control not accurate")
+    return tests.summary()
+
+def graphical_test():
+    plant = Plant(0.5, np.zeros(pole_pairs), 0.0, start_angle=0.3)
+    enc = EncoderPll(float(plant.count()), pll_bandwidth)
+    log = []
+    for k in range(int(0.5 / dt)):
+        plant.step(0.0, False)
+        enc.update(plant.count())
+        log.append((k * dt, plant.pos, enc.vel_estimate))
+    log = np.array(log)
+    plt.plot(log[:, 0], log[:, 1])
+    plt.plot(log[:, 0], log[:, 2] / cpr)
+    plt.show()
+
+if __name__ == '__main__':
+    main(large_test, graphical_test)
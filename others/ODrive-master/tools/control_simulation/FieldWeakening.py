@@ -0,0 +1,187 @@
+# Simulation of the field weakening controller and the MTPA table in
+# Motor::update() (Firmware/MotorControl/motor.cpp).
+#
+# The motor is simulated in the rotor (dq) frame together with the current
+# controller of FOC_current() (with decoupling and back-EMF feed-forward) and
+# a load whose torque grows with the square of the speed, like a propeller.
+# The top speed is compared with and without field weakening. On a stalled
+# rotor with too little bus voltage for the current, the field weakening current
+# must not grow. The MTPA table is checked against a brute force search for the
+# maximum torque per amp.
+
+import numpy as np
+import math
+import matplotlib.pyplot as plt
+from plant import dt, current_control_bandwidth, Tests, main
+
+# Firmware defaults
+max_modulation = 0.80 * math.sqrt(3) / 2
+fw_mod_margin = 0.95
+fw_gain = 2000.0                        # [A/s]
+fw_min_vel = 200.0                      # [rad/s] electrical
+MTPA_TABLE_SIZE = 17
+
+# Motor with a comparatively high inductance, on 24V
+R = 0.1                                 # [ohm]
+L = 200e-6                              # [H]
+pole_pairs = 7
+flux_linkage = 0.005                    # [V/(rad/s)]
+vbus = 24.0                             # [V]
+V_max = max_modulation * (2.0 / 3.0) * vbus
+current_lim = 20.0                      # [A]
+fw_current_lim = 15.0                   # [A]
+inertia = 2e-5                          # [kg m^2]
+load_coefficient = 4e-6                  # [Nm/(rad/s)^2] mechanical
+
+substeps = 10                           # plant integration steps per control period
+
+p_gain = current_control_bandwidth * L
+i_gain = R / L * p_gain
+antiwindup_k = min(i_gain / p_gain * dt, 1.0)
+
+
+def MtpaTable(saliency_inductance):
+    # Same as Motor::update_mtpa_table()
+    a = flux_linkage / (2.0 * saliency_inductance)
+    step = current_lim / (MTPA_TABLE_SIZE - 1)
+    Iq = np.arange(MTPA_TABLE_SIZE) * step
+    return (-Iq**2 / (a + np.sqrt(a**2 + Iq**2)), 1.0 / step)
+
+def MtpaCurrent(table, Iq):
+    # Same as Motor::mtpa_current()
+    (values, scale) = table
+    x = abs(Iq) * scale
+    if not x < MTPA_TABLE_SIZE - 1:
+        return values[-1]
+    i = int(x)
+    frac = x - i
+    return values[i] + frac * (values[i + 1] - values[i])
+
+def Torque(Id, Iq, saliency_inductance):
+    # For Lq = Ld + saliency_inductance
+    return 1.5 * pole_pairs * (flux_linkage * Iq - saliency_inductance * Id * Iq)
+
+
+class CurrentController:
+    def __init__(self, field_weakening, V_limit):
+        self.field_weakening = field_weakening
+        self.V_limit = V_limit
+        self.integral_d = 0.0
+        self.integral_q = 0.0
+        self.Id_fw = 0.0
+        self.mod_demand = 0.0
+
+    def update(self, Iq_des, Id, Iq, omega):
+        # Motor::update()
+        Id_des = 0.0
+        if self.field_weakening:
+            mod_error = fw_mod_margin - self.mod_demand
+            if abs(omega) < fw_min_vel:
+                mod_error = max(mod_error, 0.0)
+            self.Id_fw += mod_error * fw_gain * dt
+            self.Id_fw = min(max(self.Id_fw, -fw_current_lim), 0.0)
+            Id_des += self.Id_fw
+        Id_des = max(Id_des, -current_lim)
+        Iq_lim = math.sqrt(current_lim**2 - Id_des**2)
+        Iq_des = min(max(Iq_des, -Iq_lim), Iq_lim)
+
+        # Motor::FOC_current()
+        Ierr_d = Id_des - Id
+        Ierr_q = Iq_des - Iq
+        Vd = self.integral_d + Ierr_d * p_gain - omega * L * Iq
+        Vq = self.integral_q + Ierr_q * p_gain + omega * L * Id + omega * flux_linkage
+        self.mod_demand = math.hypot(Vd, Vq) / self.V_limit
+        scale = min(1.0 / self.mod_demand, 1.0)
+        # Back-calculation anti-windup
+        self.integral_d += Ierr_d * i_gain * dt + antiwindup_k * (scale - 1.0) * Vd
+        self.integral_q += Ierr_q * i_gain * dt + antiwindup_k * (scale - 1.0) * Vq
+        return (Vd * scale, Vq * scale)
+
+def Simulate(field_weakening, duration=1.5, V_limit=V_max, stalled=False):
+    # @param V_limit: largest voltage magnitude [V]
+    # @param stalled: hold the rotor at standstill
+    n = int(duration / dt)
+    ctrl = CurrentController(field_weakening, V_limit)
+    Id = 0.0
+    Iq = 0.0
+    omega = 0.0                         # electrical [rad/s]
+    V = (0.0, 0.0)
+    h = dt / substeps
+    log = np.zeros((n, 4))
+    for k in range(n):
+        log[k] = (k * dt, omega, Id, Iq)
+        V_next = ctrl.update(current_lim, Id, Iq, omega)
+        for _ in range(substeps):
+            dId = (V[0] - R * Id + omega * L * Iq) / L
+            dIq = (V[1] - R * Iq - omega * L * Id - omega * flux_linkage) / L
+            Id += h * dId
+            Iq += h * dIq
+            omega_mech = omega / pole_pairs
+            torque = Torque(Id, Iq, 0.0) - load_coefficient * omega_mech * abs(omega_mech)
+            if not stalled:
+                omega += h * torque / inertia * pole_pairs
+        V = V_next
+    return log
+
+def TopSpeed(log):
+    # Average over the last 10% of the run
+    tail = log[int(0.9 * len(log)):]
+    return np.mean(tail[:, 1])
+
+def large_test():
+    tests = Tests()
+
+    log_off = Simulate(False)
+    log_on = Simulate(True)
+    speed_off = TopSpeed(log_off)
+    speed_on = TopSpeed(log_on)
+    Id_on = np.mean(log_on[int(0.9 * len(log_on)):, 2])
+    print("Top speed without field weakening: {:.0f} rad/s".format(speed_off))
+    print("Top speed with field weakening:    {:.0f} rad/s (+{:.0f}%, Id = {:.1f} A)".format(
+        speed_on, (speed_on / speed_off - 1) * 100, Id_on))
+    tests.check(speed_on >= 1.3 * speed_off, "field weakening doesn't extend the top speed")
+    tests.check(Id_on >= -fw_current_lim - 0.5, "field weakening current exceeds fw_current_lim")
+    currents = np.hypot(log_on[:, 2], log_on[:, 3])
+    tests.check(max(currents) <= 1.05 * current_lim,
+                "current magnitude of {:.1f} A exceeds the current limit".format(max(currents)))
+    # Below the base speed, field weakening must stay inactive
+    slow = log_on[:, 1] < 0.5 * speed_off
+    tests.check(np.all(log_on[slow, 2] >= -0.5), "field weakening active at low speed")
+    # Stalled with half the voltage the current needs: the modulation saturates,
+    # but field weakening can't help
+    log = Simulate(True, 0.2, V_limit=0.5 * R * current_lim, stalled=True)
+    print("Stalled on a low voltage: field weakening current at most {:.2f} A".format(abs(min(np.min(log[:, 2]), 0.0))))
+    tests.check(np.all(log[:, 2] >= -0.5), "field weakening active on a stalled rotor")
+
+    for saliency_inductance in [20e-6, 100e-6, 400e-6]:
+        table = MtpaTable(saliency_inductance)
+        max_error = 0.0
+        gain = 0.0
+        for I in np.linspace(0.0, current_lim, 101):
+            # Brute force search along the circle of constant current magnitude I
+            angles = np.linspace(0.0, math.pi / 2, 20001)
+            torques = Torque(-I * np.sin(angles), I * np.cos(angles), saliency_inductance)
+            best = np.argmax(torques)
+            Id_best = -I * math.sin(angles[best])
+            Iq_best = I * math.cos(angles[best])
+            # The table is indexed by Iq, compare at the optimal Iq
+            Id_table = MtpaCurrent(table, Iq_best)
+            max_error = max(max_error, abs(Id_table - Id_best))
+            if I > 0:
+                gain = max(gain, torques[best] / Torque(0.0, I, saliency_inductance) - 1)
+        print("Saliency {:.0f} uH: MTPA table error {:.3f} A, torque per amp +{:.1f}%".format(
+            saliency_inductance * 1e6, max_error, gain * 100))
+        tests.check(max_error <= 0.02 * current_lim, "MTPA table deviates from the optimum")
+    return tests.summary()
+
+def graphical_test():
+    fig, axes = plt.subplots(2, 1, sharex=True)
+    for field_weakening in [False, True]:
+        log = Simulate(field_weakening)
+        axes[0].plot(log[:, 0], log[:, 1])
+        axes[1].plot(log[:, 0], log[:, 2])
+        axes[1].plot(log[:, 0], log[:, 3])
+    plt.show()
+
+if __name__ == '__main__':
+    main(large_test, graphical_test)
@@ -0,0 +1,137 @@
+# Derives the over-modulation table of overmodulate() (Firmware/MotorControl/utils.c)
+# and checks the fundamental it produces.
+#
+# Modulation vectors are in the units of SVM(): the vertices of the hexagon
+# have magnitude 1, the largest circle inside it has magnitude sqrt(3)/2 and
+# six-step operation has a fundamental of 3/pi.
+#
+# Beyond sqrt(3)/2, the reference vector is mapped onto a trajectory inside the
+# hexagon whose fundamental equals the reference magnitude:
+#  - Mode I: the vector is rotated at constant angular speed on a circle of
+#    radius r >= sqrt(3)/2 that is cut off by the hexagon. At r = 1 the
+#    trajectory is the hexagon itself.
+#  - Mode II: the vector is held at a vertex for the hold angle alpha_h at both
+#    ends of each sextant and moves along the hexagon in between. At
+#    alpha_h = pi/6 this is six-step operation.
+# Both modes are described by one parameter s: r = sqrt(3)/2 + s * (1 - sqrt(3)/2)
+# for 0 <= s <= 1, and alpha_h = (s - 1) * pi/6 for 1 <= s <= 2.
+# The script tabulates s over the modulation magnitude and prints the table
+# used by the firmware.
+
+import numpy as np
+import math
+import matplotlib.pyplot as plt
+from plant import Tests, main
+
+OVM_TABLE_SIZE = 17
+linear_limit = math.sqrt(3) / 2
+six_step = 3 / math.pi
+hexagon_margin = 0.9999                 # keeps SVM() timings inside [0, 1] despite rounding
+
+
+def Trajectory(theta, s, margin=1.0):
+    # @param theta: angles of the reference vector
+    # @returns the modulation vectors (alpha, beta)
+    sextant = np.floor(theta / (math.pi / 3))
+    phi = theta - sextant * (math.pi / 3)   # angle from the preceding vertex
+    if s > 1:
+        alpha_h = (s - 1) * math.pi / 6
+        if alpha_h < math.pi / 6:
+            phi = np.clip((phi - alpha_h) * (math.pi / 6) / (math.pi / 6 - alpha_h), 0.0, math.pi / 3)
+        else:
+            phi = np.where(phi < math.pi / 6, 0.0, math.pi / 3)
+        r = 1.0
+    else:
+        r = linear_limit + s * (1 - linear_limit)
+    hexagon = linear_limit / np.cos(phi - math.pi / 6)
+    rho = np.minimum(r, hexagon * margin)
+    angle = sextant * (math.pi / 3) + phi
+    return (rho * np.cos(angle), rho * np.sin(angle))
+
+def Fundamental(s, n=6 * 2000):
+    theta = (np.arange(n) + 0.5) * (2 * math.pi / n)
+    (alpha, beta) = Trajectory(theta, s)
+    # Component along the reference vector, the quadrature component vanishes by symmetry
+    return np.mean(alpha * np.cos(theta) + beta * np.sin(theta))
+
+def Table():
+    # Bisection of Fundamental(s) = M on a uniform grid of M
+    magnitudes = np.linspace(linear_limit, six_step, OVM_TABLE_SIZE)
+    table = np.zeros(OVM_TABLE_SIZE)
+    for (i, M) in enumerate(magnitudes):
+        lo, hi = 0.0, 2.0
+        for _ in range(40):
+            mid = 0.5 * (lo + hi)
+            if Fundamental(mid) < M:
+                lo = mid
+            else:
+                hi = mid
+        table[i] = 0.5 * (lo + hi)
+    table[0] = 0.0
+    table[-1] = 2.0
+    return table
+
+def Overmodulate(table, alpha, beta):
+    # Same as overmodulate() in utils.c, for one vector
+    M = math.hypot(alpha, beta)
+    if M <= linear_limit:
+        return (alpha, beta)
+    x = (M - linear_limit) * ((OVM_TABLE_SIZE - 1) / (six_step - linear_limit))
+    if x < OVM_TABLE_SIZE - 1:
+        i = int(x)
+        s = table[i] + (x - i) * (table[i + 1] - table[i])
+    else:
+        s = 2.0
+    theta = math.atan2(beta, alpha) % (2 * math.pi)
+    (a, b) = Trajectory(np.array([theta]), s, hexagon_margin)
+    return (a[0], b[0])
+
+def SVM(alpha, beta):
+    # Total active vector on-time of SVM(), valid up to 1
+    a = alpha
+    b = -0.5 * alpha + 0.5 * math.sqrt(3) * beta
+    c = -0.5 * alpha - 0.5 * math.sqrt(3) * beta
+    return (max(a, b, c) - min(a, b, c)) / 1.5
+
+def large_test():
+    tests = Tests()
+    table = Table()
+    print("static const float ovm_table[OVM_TABLE_SIZE] = {")
+    for i in range(0, OVM_TABLE_SIZE, 6):
+        print("    " + " ".join("{:.6f}f,".format(v) for v in table[i:i + 6]))
+    print("};")
+
+    tests.check(np.all(np.diff(table) > 0), "table is not monotonic")
+
+    n = 6 * 500
+    theta = (np.arange(n) + 0.5) * (2 * math.pi / n)
+    worst_error = 0.0
+    worst_span = 0.0
+    for M in np.linspace(linear_limit, six_step, 101):
+        out = np.array([Overmodulate(table, M * math.cos(t), M * math.sin(t)) for t in theta])
+        fundamental = np.mean(out[:, 0] * np.cos(theta) + out[:, 1] * np.sin(theta))
+        quadrature = np.mean(out[:, 1] * np.cos(theta) - out[:, 0] * np.sin(theta))
+        worst_error = max(worst_error, abs(fundamental - M), abs(quadrature))
+        worst_span = max(worst_span, max(SVM(a, b) for (a, b) in out))
+    print("Largest fundamental error: {:.5f} ({:.3f}% of six-step)".format(worst_error, worst_error / six_step * 100))
+    print("Largest SVM on-time: {:.6f}".format(worst_span))
+    tests.check(worst_error <= 0.002, "fundamental doesn't follow the reference magnitude")
+    tests.check(worst_span <= 1.0, "modulation outside of the hexagon")
+
+    # Continuity at the boundaries of the linear range and six-step
+    tests.check(abs(Fundamental(0.0) - linear_limit) <= 1e-4 and abs(Fundamental(2.0) - six_step) <= 1e-4,
+                "trajectory parameterization doesn't span the over-modulation range")
+    print("Mode I ends at a fundamental of {:.4f} ({:.2f}% of six-step)".format(Fundamental(1.0), Fundamental(1.0) / six_step * 100))
+    return tests.summary()
+
+def graphical_test():
+    table = Table()
+    theta = np.linspace(0, 2 * math.pi, 1000)
+    for M in np.linspace(linear_limit, six_step, 6):
+        out = np.array([Overmodulate(table, M * math.cos(t), M * math.sin(t)) for t in theta])
+        plt.plot(out[:, 0], out[:, 1])
+    plt.axis('equal')
+    plt.show()
+
+if __name__ == '__main__':
+    main(large_test, graphical_test)
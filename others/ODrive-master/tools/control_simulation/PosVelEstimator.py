@@ -0,0 +1,186 @@
+# Compares the PLL and the Kalman filter of PosVelEstimator
+# (Firmware/MotorControl/pos_vel_estimator.cpp) on an encoder and on the
+# sensorless flux observer, and plots the velocity error of both modes.
+#
+# The plant (plant.py) is a rigid inertia with Coulomb friction, driven by a
+# known current profile. The encoder quantizes the position to counts, the flux
+# observer of the sensorless estimator yields the electrical phase with some
+# noise. The PLL with the default bandwidth is compared with the steady-state
+# Kalman filter, which takes the measured current over the configured inertia
+# as an acceleration input. The measured current is noisy and the inertia is
+# off by 10%. The friction is left to the disturbance state of the filter.
+# Firmware/test/test_pos_vel_estimator.cpp runs the same cases on the firmware
+# code and checks bounds on the RMS and the peak velocity error.
+
+import numpy as np
+import math
+import matplotlib.pyplot as plt
+from plant import dt, encoder_bandwidth, Plant, Tests, main
+
+# Firmware defaults
+encoder_estimator = (3.0e4, 1.0e6, 0.29)        # accel_noise [counts/s^2], disturbance_noise [counts/s^3], pos_noise [counts]
+sensorless_estimator = (200.0, 5000.0, 0.02)    # the same in [rad] electrical
+
+# Plant
+inertia = 2e-6                          # [A/(counts/s^2)]
+inertia_error = 1.1                     # configured over actual inertia
+friction = 0.05                         # [A] Coulomb friction
+current_noise = 0.05                    # [A] RMS noise of the current measurement
+cpr = 8192
+pole_pairs = 7
+phase_noise = 0.02                      # [rad] RMS noise of the flux observer phase
+
+ESTIMATOR_PLL = 0
+ESTIMATOR_KALMAN = 1
+
+
+class PosVelEstimator:
+    def __init__(self, mode, config):
+        # Same as PosVelEstimator::configure()
+        (accel_noise, disturbance_noise, pos_noise) = config
+        self.mode = mode
+        self.disturbance = 0.0
+        if mode == ESTIMATOR_PLL:
+            kp = 2.0 * encoder_bandwidth
+            ki = 0.25 * kp**2
+            self.pos_gain = dt * kp
+            self.vel_gain = dt * ki
+            self.disturbance_gain = 0.0
+            return
+        # Steady-state Kalman gains by the Riccati recursion, in units per period
+        F = np.array([[1.0, 1.0, 0.5], [0.0, 1.0, 1.0], [0.0, 0.0, 1.0]], dtype=np.float32)
+        g = np.array([0.5, 1.0, 0.0], dtype=np.float32)
+        Q = np.outer(g, g) * (accel_noise * dt**2)**2
+        Q[2, 2] += (disturbance_noise * dt**3)**2
+        Q = Q.astype(np.float32)
+        P = np.zeros((3, 3), dtype=np.float32)
+        K = np.zeros(3, dtype=np.float32)
+        for self.iterations in range(10000):
+            P = F @ P @ F.T + Q
+            K_next = P[:, 0] / (P[0, 0] + np.float32(pos_noise**2))
+            P = P - np.outer(K_next, P[0, :])
+            converged = np.array_equal(K, K_next)
+            K = K_next
+            if converged:
+                break
+        self.pos_gain = K[0]
+        self.vel_gain = K[1] / dt
+        self.disturbance_gain = K[2] / dt**2
+
+    def predict(self, vel, accel):
+        accel = accel + self.disturbance if self.mode == ESTIMATOR_KALMAN else 0.0
+        return (dt * (vel + 0.5 * dt * accel), vel + dt * accel)
+
+    def correct(self, vel, err):
+        self.disturbance += self.disturbance_gain * err
+        return (self.pos_gain * err, vel + self.vel_gain * err)
+
+
+class Encoder:
+    # Phase detector and velocity snapping as in Encoder::update()
+    units_per_count = 1.0
+
+    def __init__(self, mode):
+        self.estimator = PosVelEstimator(mode, encoder_estimator)
+        self.pos_estimate = 0.0
+        self.vel_estimate = 0.0
+
+    def update(self, pos, accel, rng):
+        (delta, self.vel_estimate) = self.estimator.predict(self.vel_estimate, accel)
+        self.pos_estimate += delta
+        err = math.floor(pos) - math.floor(self.pos_estimate)
+        (delta, self.vel_estimate) = self.estimator.correct(self.vel_estimate, err)
+        self.pos_estimate += delta
+        if abs(self.vel_estimate) < 0.5 * self.estimator.vel_gain:
+            self.vel_estimate = 0.0
+
+
+class SensorlessEstimator:
+    # Phase detector as in SensorlessEstimator::update(), in electrical radians
+    units_per_count = 2.0 * math.pi * pole_pairs / cpr
+
+    def __init__(self, mode):
+        self.estimator = PosVelEstimator(mode, sensorless_estimator)
+        self.pll_pos = 0.0
+        self.vel_estimate = 0.0
+
+    def update(self, pos, accel, rng):
+        wrap_pm_pi = lambda x: (x + math.pi) % (2.0 * math.pi) - math.pi
+        phase = wrap_pm_pi(pos * self.units_per_count + phase_noise * rng.randn())
+        (delta, self.vel_estimate) = self.estimator.predict(self.vel_estimate, accel)
+        self.pll_pos = wrap_pm_pi(self.pll_pos + delta)
+        err = wrap_pm_pi(phase - self.pll_pos)
+        (delta, self.vel_estimate) = self.estimator.correct(self.vel_estimate, err)
+        self.pll_pos = wrap_pm_pi(self.pll_pos + delta)
+
+
+def Simulate(current, duration, estimator, seed=0):
+    # @param current: motor current [A] as a function of time
+    # @param estimator: Encoder or SensorlessEstimator in either mode
+    # @returns the log of time, true velocity and estimated velocity [counts/s]
+    rng = np.random.RandomState(seed)
+    scale = estimator.units_per_count
+    plant = Plant(inertia, friction=friction, current_bandwidth=None, delay=False)
+    n = int(duration / dt)
+    log = np.zeros((n, 3))
+    for k in range(n):
+        Iq = current(k * dt)
+        # The estimator runs on the current of the previous period
+        Iq_measured = Iq + current_noise * rng.randn()
+        estimator.update(plant.pos, Iq_measured / (inertia * inertia_error) * scale, rng)
+        log[k] = (k * dt, plant.vel, estimator.vel_estimate / scale)
+        plant.step(Iq)
+    return log
+
+def Trapezoid(t):
+    # Accelerate, cruise at 25000 counts/s, decelerate
+    I = 0.6
+    if t < 0.1:
+        return I
+    elif t < 0.2:
+        return friction
+    elif t < 0.3:
+        return -I + 2.0 * friction
+    return 0.0
+
+def Slow(t):
+    # Creep at about 100 counts/s against the friction
+    return friction + (0.001 if t < 0.2 else 0.0)
+
+def Sine(t):
+    return 0.5 * math.sin(2.0 * math.pi * 20.0 * t)
+
+trajectories = [
+    # (description, current, duration)
+    ("trapezoidal move", Trapezoid, 0.4),
+    ("slow creep", Slow, 0.6),
+    ("20 Hz sinusoid", Sine, 0.4),
+]
+
+def Errors(log):
+    # RMS velocity error after the initial settling, and the largest error
+    settled = log[:, 0] > 0.01
+    err = log[settled, 2] - log[settled, 1]
+    return (math.sqrt(np.mean(err**2)), np.max(np.abs(err)))
+
+def large_test():
+    tests = Tests()
+    print("                           trajectory | PLL RMS | PLL max | Kalman RMS | Kalman max  [counts/s]")
+    for Estimator in [Encoder, SensorlessEstimator]:
+        for (description, current, duration) in trajectories:
+            pll = Errors(Simulate(current, duration, Estimator(ESTIMATOR_PLL)))
+            kalman = Errors(Simulate(current, duration, Estimator(ESTIMATOR_KALMAN)))
+            print("{:>37} | {:7.1f} | {:7.1f} | {:10.1f} | {:10.1f}".format(
+                Estimator.__name__ + ", " + description, *(pll + kalman)))
+            tests.check(kalman[0] < pll[0], "Kalman filter not more accurate")
+            tests.check(kalman[1] < pll[1], "Kalman filter has larger peak error")
+    return tests.summary()
+
+def graphical_test():
+    for mode in [ESTIMATOR_PLL, ESTIMATOR_KALMAN]:
+        log = Simulate(Trapezoid, 0.4, Encoder(mode))
+        plt.plot(log[:, 0], log[:, 2] - log[:, 1])
+    plt.show()
+
+if __name__ == '__main__':
+    main(large_test, graphical_test)
@@ -0,0 +1,158 @@
+# Phase resistance and inductance from a PRBS experiment, as identified by
+# Motor::identify_phase_rl() (Firmware/MotorControl/motor.cpp).
+#
+# A DC current along phase A is held by a slow integrator, so that the dead
+# time only adds a constant voltage, and a PRBS voltage is superimposed on it.
+# Recursive least squares fits the exact discretization of the R-L circuit
+#   I[k] = alpha * I[k-1] + beta1 * v[k-1] + beta2 * v[k-2] + gamma
+# The voltage computed in cycle k is applied 1 to 2 cycles later depending on
+# the PWM update mode, so its effect is split over two coefficients.
+# With beta = beta1 + beta2, R = (1 - alpha) / beta and L = -R * T / ln(alpha).
+# The simulation covers both update modes.
+
+import numpy as np
+import math
+import matplotlib.pyplot as plt
+from plant import dt, calibration_current, Tests, main
+
+# Firmware defaults
+max_voltage = 2.0                       # [V] resistance_calib_max_voltage
+duration = 0.25                         # [s] rl_calib_duration
+
+# Same constants as identify_phase_rl()
+settle_time = 0.05                      # [s] before the fit starts
+bias_tau = 0.01                         # [s] time constant of the DC current integrator
+bias_period = 0.04                      # [s] between steps of the DC current
+ripple_target = 0.05                    # current change per cycle relative to the test current
+initial_P = 1e4
+
+# Inverter
+vbus = 24.0
+V_dt = 0.22                             # [V] dead time voltage, see DeadTimeCompensation.py
+I_knee = 0.3                            # [A]
+noise = 0.03                            # [A] RMS of the current measurement noise
+
+
+class PRBS:
+    # 15 bit maximum length LFSR, x^15 + x^14 + 1
+    def __init__(self):
+        self.state = 0x7fff
+    def next(self):
+        bit = ((self.state >> 14) ^ (self.state >> 13)) & 1
+        self.state = ((self.state << 1) | bit) & 0x7fff
+        return 1.0 if bit else -1.0
+
+
+class Identification:
+    def __init__(self, R_guess):
+        self.theta = np.zeros(4, dtype=np.float32)      # alpha, beta1, beta2, gamma
+        self.P = np.eye(4, dtype=np.float32) * initial_P
+        self.R_hat = R_guess
+        self.v_bias = 0.0
+        self.v_prbs = 0.02 * max_voltage
+        self.prbs = PRBS()
+        self.I_prev = 0.0
+        self.v_hist = [0.0, 0.0]                        # v[k-1], v[k-2]
+        self.sum_e2 = 0.0
+        self.sum_dI2 = 0.0
+        self.n = 0
+
+    def update(self, k, I):
+        # @returns the test voltage for this cycle, or None on error
+        if k * dt >= settle_time * 0.5:
+            phi = np.array([self.I_prev, self.v_hist[0], self.v_hist[1], 1.0], dtype=np.float32)
+            e = np.float32(I) - phi.dot(self.theta)
+            Pphi = self.P.dot(phi)
+            gain = Pphi / (np.float32(1.0) + phi.dot(Pphi))
+            self.theta = self.theta + gain * e
+            self.P = self.P - np.outer(gain, Pphi)
+            if k * dt >= settle_time:
+                self.sum_e2 += float(e)**2
+                self.sum_dI2 += (I - self.I_prev)**2
+                self.n += 1
+            alpha = self.theta[0]
+            beta = self.theta[1] + self.theta[2]
+            if beta > 0 and 0 < alpha < 1:
+                self.R_hat = min(max((1 - alpha) / beta, 0.01 * max_voltage / calibration_current), max_voltage / calibration_current)
+                self.v_prbs = ripple_target * calibration_current / beta
+        self.I_prev = I
+
+        # Ramp the DC current up to avoid overshoot on slow motors, then alternate
+        # between two levels to excite the resistance well on slow motors
+        I_bias = calibration_current * min(k * dt / (0.5 * settle_time), 1.0)
+        if k * dt >= settle_time and int((k * dt - settle_time) / bias_period) % 2 == 1:
+            I_bias *= 0.5
+        self.v_bias += dt * (self.R_hat / bias_tau) * (I_bias - I)
+        # Leave headroom for the bias voltage
+        self.v_prbs = min(self.v_prbs, 0.5 * (max_voltage - abs(self.v_bias)))
+        v = self.v_bias + self.v_prbs * self.prbs.next()
+        if abs(v) > max_voltage:
+            return None
+        self.v_hist = [v, self.v_hist[0]]
+        return v
+
+    def result(self, T=dt):
+        alpha = self.theta[0]
+        beta = self.theta[1] + self.theta[2]
+        R = (1 - alpha) / beta
+        L = -R * T / math.log(alpha)
+        fit_error = math.sqrt(self.sum_e2 / self.sum_dI2)
+        return (R, L, fit_error)
+
+def Simulate(R, L, double_update=False, seed=0):
+    rng = np.random.RandomState(seed)
+    n = int(duration / dt)
+    substeps = 20
+    h = dt / substeps
+    ident = Identification(max_voltage / calibration_current)
+    I = 0.0
+    v_next = 0.0
+    log = np.zeros((n, 3))
+    for k in range(n):
+        I_meas = I + rng.randn() * noise
+        v = ident.update(k, I_meas)
+        if v is None:
+            return (None, log)
+        # In single update mode, the voltage computed in cycle k-1 is applied
+        # until the next sample. In double update mode, the voltage of this
+        # cycle already takes over half way.
+        (v_applied, v_next) = (v_next, v)
+        for j in range(substeps):
+            if double_update and j >= substeps // 2:
+                v_applied = v
+            I += h * (v_applied - V_dt * math.tanh(I / I_knee) - R * I) / L
+        log[k] = (k * dt, I, v_applied)
+    return (ident.result(), log)
+
+motors = [
+    (0.05, 20e-6),                      # hobby outrunner
+    (0.02, 8e-6),
+    (0.12, 150e-6),
+    (0.1, 500e-6),                      # slow electrical time constant
+]
+
+def large_test():
+    tests = Tests()
+    print("    R [ohm] |   L [uH] | double update | R error [%] | L error [%] | fit error")
+    cases = [(R, L, False) for (R, L) in motors] + [(R, L, True) for (R, L) in motors[:2]]
+    for (R, L, double_update) in cases:
+        (result, _) = Simulate(R, L, double_update)
+        if result is None:
+            tests.check(False, "test voltage out of range")
+            continue
+        (R_fit, L_fit, fit_error) = result
+        R_err = (R_fit / R - 1) * 100
+        L_err = (L_fit / L - 1) * 100
+        print("  {:9.3f} | {:8.1f} | {:13} | {:11.2f} | {:11.2f} | {:9.3f}".format(
+            R, L * 1e6, "yes" if double_update else "no", R_err, L_err, fit_error))
+        tests.check(abs(R_err) <= 5 and abs(L_err) <= 5 and fit_error <= 0.5, "identification inaccurate")
+    return tests.summary()
+
+def graphical_test():
+    (_, log) = Simulate(*motors[0])
+    plt.plot(log[:, 0], log[:, 1])
+    plt.plot(log[:, 0], log[:, 2])
+    plt.show()
+
+if __name__ == '__main__':
+    main(large_test, graphical_test)
@@ -0,0 +1,187 @@
+# Simulation of the winding thermal model and the current derating in
+# Motor::update_winding_temp() and Motor::update_thermal_limits()
+# (Firmware/MotorControl/motor.cpp).
+#
+# The firmware's model has two nodes: the winding heats with the I^2*R losses
+# of the current amplitude and is coupled to the housing, which is coupled to
+# the ambient. The copper resistance rises with the temperature. The current
+# demand is limited by the derating of the model, which never sees the real
+# winding. The motor is simulated separately, as a chain of thermal masses
+# whose parameters may differ from the model's: with the model's parameters,
+# with the winding on a stator iron node, with 10% higher resistances and with
+# a warmer ambient. The winding must stay below winding_temp_limit_upper, or
+# within the stated margin above it where the model is too optimistic. A motor
+# that is still warm must be declared with reset_thermal_model(), which is
+# shown against a model that starts at ambient_temp. A first-order model with
+# only the housing time constant is shown for comparison: it lets short bursts
+# overheat the winding.
+
+import numpy as np
+import math
+import matplotlib.pyplot as plt
+from plant import Tests, main
+
+# Firmware defaults
+winding_temp_limit_lower = 100.0        # [degC]
+winding_temp_limit_upper = 120.0        # [degC]
+ambient_temp = 25.0                     # [degC]
+copper_temp_coeff = 0.00393             # [1/K]
+
+# Motor
+phase_resistance = 0.1                  # [ohm] at ambient_temp
+current_lim = 40.0                      # [A] peak
+winding_thermal_resistance = 1.0        # [K/W]
+winding_thermal_time_constant = 20.0    # [s]
+housing_thermal_resistance = 1.5        # [K/W]
+housing_thermal_time_constant = 600.0   # [s]
+
+dt = 0.01                               # [s] the firmware steps the model at the rate of the checks stage
+
+
+class ThermalModel:
+    # Same as Motor::update_winding_temp()
+    def __init__(self, Rw, tau_w, Rh, tau_h):
+        self.Rw = Rw
+        self.Cw = tau_w / Rw
+        self.Rh = Rh
+        self.Ch = tau_h / Rh if Rh > 0 else 0.0
+        self.winding_temp = ambient_temp
+        self.housing_temp = ambient_temp
+
+    def update(self, I_sq_integral):
+        R = phase_resistance * (1.0 + copper_temp_coeff * (self.winding_temp - ambient_temp))
+        heat = 1.5 * R * I_sq_integral
+        flow = dt * (self.winding_temp - self.housing_temp) / self.Rw
+        self.winding_temp += (heat - flow) / self.Cw
+        if self.Rh > 0:
+            self.housing_temp += (flow - dt * (self.housing_temp - ambient_temp) / self.Rh) / self.Ch
+        else:
+            self.housing_temp = ambient_temp
+
+    def current_lim(self):
+        # Same as the winding derating in Motor::update_thermal_limits()
+        margin = (winding_temp_limit_upper - self.winding_temp) / (winding_temp_limit_upper - winding_temp_limit_lower)
+        return current_lim * min(max(margin, 0.0), 1.0)
+
+class Motor:
+    # The real motor: a chain of thermal masses from the winding to the ambient
+    def __init__(self, resistance_ratio=1.0, thermal_resistance_ratio=1.0, stator_iron=False,
+                 ambient=ambient_temp, temp=ambient_temp):
+        # @param resistance_ratio: phase resistance relative to the model's
+        # @param thermal_resistance_ratio: thermal resistances relative to the model's
+        # @param stator_iron: splits the winding node of the model into the
+        #        copper and the stator iron, with the same total resistance
+        # @param temp: initial temperature of all nodes [degC]
+        if stator_iron:
+            nodes = [(0.4 * winding_thermal_resistance, 0.25 * winding_thermal_time_constant),
+                     (0.6 * winding_thermal_resistance, 3.0 * winding_thermal_time_constant)]
+        else:
+            nodes = [(winding_thermal_resistance, winding_thermal_time_constant)]
+        nodes.append((housing_thermal_resistance, housing_thermal_time_constant))
+        self.R = [thermal_resistance_ratio * Rth for (Rth, tau) in nodes]
+        self.C = [tau / Rth for (Rth, tau) in nodes]
+        self.resistance = resistance_ratio * phase_resistance
+        self.ambient = ambient
+        self.temps = [temp] * len(nodes)
+
+    def update(self, I_sq_integral):
+        T = self.temps
+        R = self.resistance * (1.0 + copper_temp_coeff * (T[0] - ambient_temp))
+        outer = T[1:] + [self.ambient]
+        flows = [dt * (T[i] - outer[i]) / self.R[i] for i in range(len(T))]
+        T[0] += (1.5 * R * I_sq_integral - flows[0]) / self.C[0]
+        for i in range(1, len(T)):
+            T[i] += (flows[i - 1] - flows[i]) / self.C[i]
+
+    @property
+    def winding_temp(self):
+        return self.temps[0]
+
+def ContinuousCurrent(temp):
+    # Current that holds the winding at temp in steady state
+    R = phase_resistance * (1.0 + copper_temp_coeff * (temp - ambient_temp))
+    power = (temp - ambient_temp) / (winding_thermal_resistance + housing_thermal_resistance)
+    return math.sqrt(power / (1.5 * R))
+
+def Simulate(demand, duration, model, motor=None):
+    # @param demand: current demand [A] as a function of time
+    # @param model: the firmware's model, which limits the current
+    # @param motor: the real motor, by default with the model's parameters
+    # @returns the log of time, current and true winding temperature
+    if motor is None:
+        motor = Motor()
+    n = int(duration / dt)
+    log = np.zeros((n, 3))
+    for k in range(n):
+        I = min(demand(k * dt), model.current_lim())
+        motor.update(I**2 * dt)
+        model.update(I**2 * dt)
+        log[k] = (k * dt, I, motor.winding_temp)
+    return log
+
+def FirmwareModel():
+    return ThermalModel(winding_thermal_resistance, winding_thermal_time_constant,
+                        housing_thermal_resistance, housing_thermal_time_constant)
+
+def FirstOrderModel():
+    # Total thermal resistance with the housing time constant, as in many datasheets
+    return ThermalModel(winding_thermal_resistance + housing_thermal_resistance, housing_thermal_time_constant, 0.0, 0.0)
+
+def WarmModel(temp):
+    # The firmware's model after reset_thermal_model(temp)
+    model = FirmwareModel()
+    model.winding_temp = temp
+    model.housing_temp = temp
+    return model
+
+duty_cycle = lambda t: current_lim if t % 4.0 < 1.0 else 0.0
+
+cases = [
+    # (description, real motor, model, allowed excess over winding_temp_limit_upper [K])
+    ("same as the model", lambda: Motor(), FirmwareModel, 0.0),
+    ("winding on the stator iron", lambda: Motor(stator_iron=True), FirmwareModel, 0.0),
+    ("thermal resistances +10%", lambda: Motor(thermal_resistance_ratio=1.1), FirmwareModel, 10.0),
+    ("phase resistance +10%", lambda: Motor(resistance_ratio=1.1), FirmwareModel, 10.0),
+    ("ambient +10 K", lambda: Motor(ambient=ambient_temp + 10.0), FirmwareModel, 10.0),
+    ("warm start, model reset", lambda: Motor(temp=90.0), lambda: WarmModel(90.0), 0.0),
+]
+
+def large_test():
+    tests = Tests()
+    I_cont_lower = ContinuousCurrent(winding_temp_limit_lower)
+    I_cont_upper = ContinuousCurrent(winding_temp_limit_upper)
+    print("Continuous current {:.1f} A to {:.1f} A, peak current {:.1f} A".format(I_cont_lower, I_cont_upper, current_lim))
+
+    # Full demand from cold: a burst at the peak current, then derating to the continuous current
+    log = Simulate(lambda t: current_lim, 3000.0, FirmwareModel())
+    burst = log[np.argmax(log[:, 1] < current_lim), 0]
+    final = log[-1, 1]
+    print("Full demand: {:.1f} s at peak current, {:.1f} A after {:.0f} s".format(burst, final, log[-1, 0]))
+    tests.check(burst >= 3.0, "no headroom for bursts")
+    tests.check(I_cont_lower <= final <= I_cont_upper, "current doesn't settle at the continuous current")
+
+    # Full demand and short moves at the peak current, above the continuous
+    # current on average, on motors that differ from the model
+    print("                      motor | full demand [degC] | duty cycle [degC] | allowed [degC]")
+    for (description, motor, model, allowed) in cases:
+        peaks = [np.max(Simulate(demand, 3000.0, model(), motor())[:, 2]) for demand in [lambda t: current_lim, duty_cycle]]
+        print("{:>27} | {:18.1f} | {:17.1f} | {:14.1f}".format(description, peaks[0], peaks[1], winding_temp_limit_upper + allowed))
+        tests.check(max(peaks) <= winding_temp_limit_upper + allowed, "winding overheated")
+
+    log = Simulate(lambda t: current_lim, 600.0, FirmwareModel(), Motor(temp=90.0))
+    print("Warm start without reset_thermal_model(): winding at most {:.1f} degC".format(np.max(log[:, 2])))
+    log = Simulate(lambda t: current_lim, 300.0, FirstOrderModel())
+    print("First-order model with the housing time constant: winding at most {:.1f} degC".format(np.max(log[:, 2])))
+
+    return tests.summary()
+
+def graphical_test():
+    fig, axes = plt.subplots(2, 1, sharex=True)
+    for model in [FirmwareModel(), FirstOrderModel()]:
+        log = Simulate(duty_cycle, 600.0, model)
+        axes[0].plot(log[:, 0], log[:, 1])
+        axes[1].plot(log[:, 0], log[:, 2])
+    plt.show()
+
+if __name__ == '__main__':
+    main(large_test, graphical_test)
@@ -0,0 +1,129 @@
+# Fixture shared by the simulations in this directory: the firmware defaults
+# they have in common, a rigid inertia driven by the current loop, the encoder
+# PLL of Encoder::update() (Firmware/MotorControl/encoder.cpp) and the
+# bookkeeping of the checks in large_test().
+#
+# The scripts are run from this directory, so they import it as a module:
+#   from plant import dt, Plant, EncoderPll, Tests, main
+
+import math
+import sys
+
+# Firmware defaults
+dt = 1.0 / 8000.0                       # current measurement and control loop period [s]
+current_control_bandwidth = 1000.0      # [rad/s]
+encoder_bandwidth = 1000.0              # [rad/s] encoder PLL
+calibration_current = 10.0              # [A]
+current_lim = 10.0                      # [A]
+vel_limit = 20000.0                     # [counts/s]
+
+
+class Plant:
+    # Rigid inertia with Coulomb friction, optionally coupled to a load inertia
+    # through a spring. The current follows the command with a first-order
+    # response, and the command of one period is applied in the next one.
+    def __init__(self, inertia, load_inertia=0.0, resonance=0.0, friction=0.0,
+                 current_bandwidth=current_control_bandwidth, delay=True, pos=0.3):
+        # @param inertia: of the motor [A/(counts/s^2)], or in any other unit
+        #        of torque over acceleration
+        # @param load_inertia: coupled through a spring that resonates at resonance [rad/s]
+        # @param friction: Coulomb friction of the motor [A]
+        # @param current_bandwidth: of the current response [rad/s], None if
+        #        the current follows the command at once
+        # @param delay: False to apply the command in the same period
+        self.J = inertia
+        self.J_load = load_inertia
+        if load_inertia > 0:
+            # Resonance of the two masses: w^2 = k * (1/J + 1/J_load)
+            self.k = resonance**2 / (1.0 / inertia + 1.0 / load_inertia)
+            self.c = 0.02 * 2 * math.sqrt(self.k * inertia * load_inertia / (inertia + load_inertia))
+        self.friction = friction
+        self.current_bandwidth = current_bandwidth
+        self.delay = delay
+        self.pos = pos
+        self.vel = 0.0
+        self.pos_load = pos
+        self.vel_load = 0.0
+        self.Iq = 0.0
+        self.Iq_cmd = 0.0
+
+    def count(self):
+        return int(math.floor(self.pos))
+
+    def step(self, Iq_cmd, load=0.0, substeps=4):
+        # @param load: torque of the load on the motor, in the units of the current
+        if self.delay:
+            (Iq_cmd, self.Iq_cmd) = (self.Iq_cmd, Iq_cmd)
+        h = dt / substeps
+        for _ in range(substeps):
+            if self.current_bandwidth is None:
+                self.Iq = Iq_cmd
+            else:
+                self.Iq += min(self.current_bandwidth * h, 1.0) * (Iq_cmd - self.Iq)
+            self.integrate(self.Iq - load, h)
+
+    def integrate(self, torque, h):
+        # One step of h [s] of the mechanics
+        if self.J_load > 0:
+            spring = self.k * (self.pos - self.pos_load) + self.c * (self.vel - self.vel_load)
+            torque -= spring
+            self.vel_load += h * spring / self.J_load
+            self.pos_load += h * self.vel_load
+        if self.vel == 0.0 and abs(torque) <= self.friction:
+            return                              # stiction
+        torque -= self.friction * math.copysign(1.0, self.vel if self.vel != 0.0 else torque)
+        vel_next = self.vel + h * torque / self.J
+        if self.vel != 0.0 and math.copysign(1.0, vel_next) != math.copysign(1.0, self.vel):
+            vel_next = 0.0
+        self.pos += h * 0.5 * (self.vel + vel_next)
+        self.vel = vel_next
+
+
+class EncoderPll:
+    # Same as the PLL and the velocity snapping in Encoder::update()
+    def __init__(self, pos=0.0, bandwidth=encoder_bandwidth):
+        self.kp = 2.0 * bandwidth
+        self.ki = 0.25 * self.kp**2
+        self.pos_estimate = pos
+        self.vel_estimate = 0.0
+
+    def update(self, count):
+        # @returns the velocity estimate
+        self.track(count)
+        self.snap()
+        return self.vel_estimate
+
+    def track(self, count):
+        self.pos_estimate += dt * self.vel_estimate
+        delta_pos = count - math.floor(self.pos_estimate)
+        self.pos_estimate += dt * self.kp * delta_pos
+        self.vel_estimate += dt * self.ki * delta_pos
+
+    def snap(self):
+        # Velocities below the resolution of the integrator are zero
+        if abs(self.vel_estimate) < 0.5 * dt * self.ki:
+            self.vel_estimate = 0.0
+
+
+class Tests:
+    # Counts the checks of large_test()
+    def __init__(self):
+        self.count = 0
+        self.failures = 0
+
+    def check(self, ok, message):
+        # @returns ok
+        self.count += 1
+        if not ok:
+            print("ERROR: " + message)
+            self.failures += 1
+        return ok
+
+    def summary(self):
+        print("{} of {} tests failed".format(self.failures, self.count))
+        return self.failures == 0
+
+def main(large_test, graphical_test):
+    ok = large_test()
+    graphical_test()
+    sys.exit(0 if ok else 1)
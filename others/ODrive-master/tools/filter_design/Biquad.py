@@ -0,0 +1,187 @@
+# Reference implementation and frequency-response test of the biquad filters
+# in Firmware/MotorControl/biquad.cpp.
+#
+# The coefficients are designed from an analog prototype in s / w with the
+# bilinear transform, prewarped at the configured frequency w. The test runs
+# the direct form II transposed kernel on sine waves in single precision and
+# compares the measured gain with the designed response.
+
+import numpy as np
+import math
+import matplotlib.pyplot as plt
+import random
+
+BIQUAD_NONE = 0
+BIQUAD_LOWPASS = 1
+BIQUAD_NOTCH = 2
+BIQUAD_LEAD_LAG = 3
+
+# Velocity loop rate at the default PWM frequency
+sample_period = 1.0 / 8000.0
+
+# Measured and designed gains must agree within this ratio
+gain_tolerance_db = 0.05
+
+
+def DesignBiquad(type, frequency, q, gain, sample_period):
+    if type == BIQUAD_NONE:
+        return ([1.0, 0.0, 0.0], [1.0, 0.0, 0.0])
+    if not (0 < frequency < 0.45 / sample_period):
+        return None
+
+    if type == BIQUAD_LOWPASS:
+        if not q > 0:
+            return None
+        b = [0.0, 0.0, 1.0]
+        a = [1.0, 1.0 / q, 1.0]
+    elif type == BIQUAD_NOTCH:
+        if not (q > 0 and gain >= 0):
+            return None
+        b = [1.0, gain / q, 1.0]
+        a = [1.0, 1.0 / q, 1.0]
+    elif type == BIQUAD_LEAD_LAG:
+        if not gain > 0:
+            return None
+        ratio = math.sqrt(gain)
+        b = [0.0, ratio, 1.0]
+        a = [0.0, 1.0 / ratio, 1.0]
+    else:
+        return None
+
+    K = 1.0 / math.tan(math.pi * frequency * sample_period)
+    if a[0] == 0:
+        # First-order prototype, the second-order mapping would add a pole and a zero at z = -1
+        inv_a0 = 1.0 / (a[1] * K + a[2])
+        B = [(b[1] * K + b[2]) * inv_a0, (b[2] - b[1] * K) * inv_a0, 0.0]
+        A = [1.0, (a[2] - a[1] * K) * inv_a0, 0.0]
+    else:
+        K2 = K * K
+        inv_a0 = 1.0 / (a[0] * K2 + a[1] * K + a[2])
+        B = [(b[0] * K2 + b[1] * K + b[2]) * inv_a0,
+             2.0 * (b[2] - b[0] * K2) * inv_a0,
+             (b[0] * K2 - b[1] * K + b[2]) * inv_a0]
+        A = [1.0,
+             2.0 * (a[2] - a[0] * K2) * inv_a0,
+             (a[0] * K2 - a[1] * K + a[2]) * inv_a0]
+    return (B, A)
+
+def RunBiquad(B, A, x):
+    # Direct form II transposed, in single precision like the firmware
+    B = np.float32(B)
+    A = np.float32(A)
+    z1 = np.float32(0)
+    z2 = np.float32(0)
+    y = np.zeros(len(x), dtype=np.float32)
+    for i, xi in enumerate(np.float32(x)):
+        yi = B[0] * xi + z1
+        z1 = B[1] * xi - A[1] * yi + z2
+        z2 = B[2] * xi - A[2] * yi
+        y[i] = yi
+    return y
+
+def DigitalResponse(B, A, f, sample_period):
+    z = np.exp(1j * 2 * math.pi * f * sample_period)
+    return (B[0] + B[1] / z + B[2] / z**2) / (A[0] + A[1] / z + A[2] / z**2)
+
+def AnalogResponse(type, frequency, q, gain, f):
+    s = 1j * f / frequency
+    if type == BIQUAD_LOWPASS:
+        return 1 / (s**2 + s / q + 1)
+    if type == BIQUAD_NOTCH:
+        return (s**2 + s * gain / q + 1) / (s**2 + s / q + 1)
+    if type == BIQUAD_LEAD_LAG:
+        ratio = math.sqrt(gain)
+        return (ratio * s + 1) / (s / ratio + 1)
+    return 1
+
+def MeasureGain(B, A, f, sample_period):
+    # Settle for the decay time of the slowest pole, then fit a sine wave to the output
+    radius = max(np.abs(np.roots(A)), default=0)
+    settle = int(min(20 / max(1 - radius, 1e-6), 200000))
+    n = settle + 2000
+    t = np.arange(n) * sample_period
+    x = np.sin(2 * math.pi * f * t)
+    y = RunBiquad(B, A, x)[settle:]
+    t = t[settle:]
+    basis = np.column_stack([np.sin(2 * math.pi * f * t), np.cos(2 * math.pi * f * t), np.ones(len(t))])
+    (s, c, _) = np.linalg.lstsq(basis, np.float64(y), rcond=None)[0]
+    return math.hypot(s, c)
+
+def CheckBiquad(type, frequency, q, gain):
+    design = DesignBiquad(type, frequency, q, gain, sample_period)
+    if design is None:
+        print("ERROR: valid configuration rejected")
+        return False
+    (B, A) = design
+    error = False
+
+    # The poles must be inside the unit circle
+    if max(np.abs(np.roots(A)), default=0) >= 1:
+        print("ERROR: unstable filter")
+        error = True
+
+    # The response must match the prototype at DC and at the configured frequency
+    # (where the prewarping makes the bilinear transform exact)
+    for f_check in [0, frequency]:
+        designed = abs(DigitalResponse(B, A, f_check, sample_period))
+        expected = abs(AnalogResponse(type, frequency, q, gain, f_check))
+        if abs(designed - expected) > 1e-3 * max(expected, 1e-2):
+            print("ERROR: gain {} at {} Hz, expected {}".format(designed, f_check, expected))
+            error = True
+
+    # The single precision kernel must realize the designed response
+    for f_check in [0.3 * frequency, frequency, 3 * frequency]:
+        if f_check >= 0.45 / sample_period:
+            continue
+        designed = abs(DigitalResponse(B, A, f_check, sample_period))
+        measured = MeasureGain(B, A, f_check, sample_period)
+        if designed < 1e-3:
+            ok = measured < 1e-2
+        else:
+            ok = abs(20 * math.log10(measured / designed)) <= gain_tolerance_db
+        if not ok:
+            print("ERROR: measured gain {} at {} Hz, designed {}".format(measured, f_check, designed))
+            error = True
+
+    return not error
+
+def random_config(type=None):
+    if type is None:
+        type = random.choice([BIQUAD_LOWPASS, BIQUAD_NOTCH, BIQUAD_LEAD_LAG])
+    frequency = 10 ** random.uniform(1, math.log10(0.4 / sample_period))
+    q = random.uniform(0.5, 5)
+    if type == BIQUAD_NOTCH:
+        gain = random.uniform(0, 0.5)
+    else:
+        gain = 10 ** random.uniform(-1, 1)
+    return (type, frequency, q, gain)
+
+def graphical_test():
+    f = np.logspace(0, math.log10(0.5 / sample_period), 500)
+    fig, axes = plt.subplots(2, 3)
+    random.seed(3) # Repeatable tests by using specific seed
+    for col, type in enumerate([BIQUAD_LOWPASS, BIQUAD_NOTCH, BIQUAD_LEAD_LAG]):
+        for _ in range(3):
+            (_, frequency, q, gain) = random_config(type)
+            (B, A) = DesignBiquad(type, frequency, q, gain, sample_period)
+            H = DigitalResponse(B, A, f, sample_period)
+            axes[0, col].semilogx(f, 20 * np.log10(np.abs(H) + 1e-12))
+            axes[1, col].semilogx(f, np.angle(H, deg=True))
+        axes[0, col].set_ylim(-40, 20)
+    plt.show()
+
+def large_test():
+    random.seed(1) # Repeatable tests by using specific seed
+    failures = 0
+    for x in range(100):
+        (type, frequency, q, gain) = random_config()
+        print("Test {}: type {}, frequency {:.1f} Hz, q {:.2f}, gain {:.3f}".format(x, type, frequency, q, gain))
+        if not CheckBiquad(type, frequency, q, gain):
+            print("FAILED: type {}, frequency {:.1f} Hz, q {:.2f}, gain {:.3f}".format(type, frequency, q, gain))
+            failures += 1
+    print("{} of 100 tests failed".format(failures))
+    return failures == 0
+
+if __name__ == '__main__':
+    large_test()
+    graphical_test()
@@ -0,0 +1,262 @@
+# Reference implementation and test of the jerk-limited (S-curve) trajectory
+# planner in Firmware/MotorControl/sCurveTraj.cpp.
+#
+# The profile accelerates from Vi to the reached velocity Vr, coasts and
+# decelerates to standstill at Xf. Each velocity change is made of a jerk,
+# a constant acceleration and a jerk segment, so there are 7 segments in total.
+# Every segment is a cubic polynomial in the time since its start.
+
+import numpy as np
+import math
+import matplotlib.pyplot as plt
+import random
+
+# Symbol                     Description
+# Tj, Tc                     Duration of the jerk and constant acceleration segments of a velocity change
+# Ta, Tv and Td              Duration of the acceleration, coasting and deceleration phases
+# Xi and Vi                  Initial conditions (the initial acceleration is assumed to be zero)
+# Xf                         Position set-point
+# s                          Direction (sign) of the trajectory
+# Vmax, Amax, Dmax and Jmax  Kinematic bounds
+# Vr                         Reached velocity
+
+# Test scales:
+pos_range  = 10000.0
+Vmax_range = 8000.0
+Amax_range = 10000.0
+Jmax_range = 100000.0
+plot_range = 10000.0
+
+# Number of bisection steps to find the reached velocity of short moves
+# in which a velocity change doesn't reach its acceleration limit
+Vr_search_steps = 24
+
+
+def PlanVelocityChange(dV, Amax, Jmax):
+    if dV*Jmax >= Amax**2:
+        Tj = Amax/Jmax
+        Tc = dV/Amax - Tj
+    else:
+        Tj = math.sqrt(dV/Jmax)
+        Tc = 0
+    return (Tj, Tc)
+
+def RampDisplacement(Vi, Vr, Amax, Dmax, Jmax):
+    # The velocity during a velocity change is point symmetric,
+    # so its mean is the mean of the start and end velocities
+    (Tj, Tc) = PlanVelocityChange(abs(Vr - Vi), Amax, Jmax)
+    Ta = 2*Tj + Tc
+    (Tj, Tc) = PlanVelocityChange(abs(Vr), Dmax, Jmax)
+    Td = 2*Tj + Tc
+    return (Vi + Vr)/2.0*Ta + Vr/2.0*Td
+
+def PlanSCurve(Xf, Xi, Vi, Vmax, Amax, Dmax, Jmax):
+    dX = Xf - Xi    # Distance to travel
+    dXstop = RampDisplacement(Vi, Vi, Amax, Dmax, Jmax) # Minimum stopping displacement
+    s = -1.0 if dX - dXstop < 0 else 1.0 # Sign of coast velocity (if any)
+
+    # The displacement grows monotonically with the reached velocity above max(0, s*Vi).
+    # If the move is too short to reach Vmax, solve for the reached velocity.
+    v = Vmax
+    v_min = max(0.0, s*Vi)
+    d = s*dX
+    if v_min < Vmax and s*RampDisplacement(Vi, s*Vmax, Amax, Dmax, Jmax) > d:
+        print("Short Move:")
+        # Above v_lim both velocity changes reach their acceleration limits
+        u = s*Vi
+        v_lim = max(u + Amax**2/Jmax, Dmax**2/Jmax, v_min)
+        if s*RampDisplacement(Vi, s*v_lim, Amax, Dmax, Jmax) <= d:
+            # The displacement is quadratic in v
+            a = 0.5/Amax + 0.5/Dmax
+            b = 0.5*(Amax + Dmax)/Jmax
+            c = -0.5*u**2/Amax + 0.5*u*Amax/Jmax - d
+            v = -2.0*c/(b + math.sqrt(b**2 - 4.0*a*c))
+        else:
+            # At least one velocity change is jerk limited, which leads to a quartic
+            v_max = min(v_lim, Vmax)
+            for i in range(Vr_search_steps):
+                v_mid = (v_min + v_max)/2.0
+                if s*RampDisplacement(Vi, s*v_mid, Amax, Dmax, Jmax) > d:
+                    v_max = v_mid
+                else:
+                    v_min = v_mid
+            v = v_min
+    else:
+        print("Long move:")
+    Vr = s*v
+
+    Tv = 0
+    if v > 0:
+        Tv = max(0, (dX - RampDisplacement(Vi, Vr, Amax, Dmax, Jmax))/Vr) # Coasting time
+
+    (Tj1, Tc1) = PlanVelocityChange(abs(Vr - Vi), Amax, Jmax)
+    (Tj2, Tc2) = PlanVelocityChange(abs(Vr), Dmax, Jmax)
+    j1 = math.copysign(Jmax, Vr - Vi)
+    j2 = math.copysign(Jmax, -Vr)
+    durations = [Tj1, Tc1, Tj1, Tv, Tj2, Tc2, Tj2]
+    jerks = [j1, 0, -j1, 0, j2, 0, -j2]
+
+    # Integrate the segments to get the polynomial coefficients
+    segments = []
+    t = 0.0
+    p = Xi
+    vel = Vi
+    acc = 0.0
+    for k in range(7):
+        if k == 3: # Cruise exactly at Vr
+            vel = Vr
+            acc = 0.0
+        elif k == 4: # Make the deceleration end exactly at Xf
+            p = Xf - 0.5*Vr*(2*Tj2 + Tc2)
+        T = durations[k]
+        j = jerks[k]
+        segments.append((t, p, vel, acc/2.0, j/6.0))
+        p += T*(vel + T*(acc/2.0 + T*j/6.0))
+        vel += T*(acc + T*j/2.0)
+        acc += T*j
+        t += T
+    Tf = t
+
+    print("Xi: {:.2f}\tXf: {:.2f}\tVi: {:.2f}".format(Xi, Xf, Vi))
+    print("Amax: {:.2f}\tVmax: {:.2f}\tDmax: {:.2f}\tJmax: {:.2f}".format(Amax, Vmax, Dmax, Jmax))
+    print("dX: {:.2f}\tdXst: {:.2f}\tVr: {:.2f}".format(dX, dXstop, Vr))
+    print("Tj1: {:.3f}\tTc1: {:.3f}\tTv: {:.3f}\tTj2: {:.3f}\tTc2: {:.3f}".format(Tj1, Tc1, Tv, Tj2, Tc2))
+
+    return (segments, Vr, Tf)
+
+def EvalSCurve(Xf, Xi, Vi, segments, Tf):
+    # Create the time series and preallocate the position, velocity, and acceleration arrays
+    t_traj = np.arange(0, Tf+0.1, 1/10000)
+    y = [None]*len(t_traj)
+    yd = [None]*len(t_traj)
+    ydd = [None]*len(t_traj)
+
+    for i in range(len(t_traj)):
+        t = t_traj[i]
+        if t < 0: # Initial conditions
+            y[i]   = Xi
+            yd[i]  = Vi
+            ydd[i] = 0
+        elif t < Tf:
+            k = 6
+            while k > 0 and t < segments[k][0]:
+                k -= 1
+            (t_start, c0, c1, c2, c3) = segments[k]
+            tau = t - t_start
+            y[i]   = c0 + tau*(c1 + tau*(c2 + tau*c3))
+            yd[i]  = c1 + tau*(2*c2 + tau*3*c3)
+            ydd[i] = 2*c2 + tau*6*c3
+        else: # Final condition
+            y[i]   = Xf
+            yd[i]  = 0
+            ydd[i] = 0
+
+    return (y, yd, ydd, t_traj)
+
+def CheckSCurve(Xf, Xi, Vi, Vmax, Amax, Dmax, Jmax, Y, Yd, Ydd, t):
+    dt = t[1] - t[0]
+    dy_max = np.max(np.abs(np.diff(Y)))
+    dyd_max = np.max(np.abs(np.diff(Yd)))
+    dydd_max = np.max(np.abs(np.diff(Ydd)))
+    print("dy_max: {:.2f}\tdyd_max: {:.2f}\tdydd_max: {:.2f}".format(dy_max, dyd_max, dydd_max))
+
+    error = False
+    if dy_max/pos_range > 0.001:
+        print("---------- Bad Pos Continuity --------------------")
+        error = True
+    if dyd_max/Vmax_range > 0.001:
+        print("---------- Bad Vel Continuity --------------------")
+        error = True
+    # Acceleration is continuous: it changes by at most Jmax per time step
+    if dydd_max > 1.01*Jmax*dt:
+        print("---------- Bad Accel Continuity --------------------")
+        error = True
+    # Speed limit only holds if we didn't start faster
+    if np.max(np.abs(Yd)) > 1.001*max(Vmax, abs(Vi)):
+        print("---------- Bad Vel Limit --------------------")
+        error = True
+    if np.max(np.abs(Ydd)) > 1.001*max(Amax, Dmax):
+        print("---------- Bad Accel Limit --------------------")
+        error = True
+    if abs(Xi-Y[0]) > 0.0001:
+        print("---------- Bad Initial Position --------------------")
+        error = True
+    if abs(Vi-Yd[0]) > 0.0001:
+        print("---------- Bad Initial Velocity --------------------")
+        error = True
+    # The end of the last segment must meet the final condition
+    if abs(Xf-Y[-int(0.1/dt)-2]) > 0.01*pos_range/1000:
+        print("---------- Bad Final Position --------------------")
+        error = True
+    if abs(Yd[-int(0.1/dt)-2]) > 0.001*Vmax_range:
+        print("---------- Bad Final Velocity --------------------")
+        error = True
+
+    return not error
+
+def random_move():
+    Vmax = random.uniform(0.1*Vmax_range, Vmax_range)
+    Amax = random.uniform(0.1*Amax_range, Amax_range)
+    Dmax = random.uniform(0.1*Amax_range, Amax_range)
+    Jmax = random.uniform(0.1*Jmax_range, Jmax_range)
+    Xf = random.uniform(-pos_range, pos_range)
+    Xi = random.uniform(-pos_range, pos_range)
+    if random.random() <= 0.5:
+        # Slower than Vmax: a faster start can overshoot (double deceleration move)
+        Vi = random.uniform(-Vmax, Vmax)
+    else:
+        Vi = 0
+    return (Xf, Xi, Vi, Vmax, Amax, Dmax, Jmax)
+
+def graphical_test():
+    numRows = 3
+    numCols = 5
+    fig, axes = plt.subplots(numRows, numCols)
+    random.seed(3) # Repeatable tests by using specific seed
+    for x in range(numRows*numCols):
+        rownow = int(x/numCols)
+        colnow = x % numCols
+        print("row: {}, col: {}".format(rownow, colnow))
+
+        (Xf, Xi, Vi, Vmax, Amax, Dmax, Jmax) = random_move()
+        (segments, Vr, Tf) = PlanSCurve(Xf, Xi, Vi, Vmax, Amax, Dmax, Jmax)
+        (Y, Yd, Ydd, t) = EvalSCurve(Xf, Xi, Vi, segments, Tf)
+
+        # Plotting
+        ax1 = axes[rownow, colnow]
+        # Vel limits (draw first for clearer z-order)
+        ax1.plot([t[0], t[-1]], [Vmax, Vmax], 'g--')
+        ax1.plot([t[0], t[-1]], [-Vmax, -Vmax], 'g--')
+
+        ax1.plot(t, Y) # Pos
+        ax1.plot(t, Yd) # Vel
+        ax1.plot(t, Ydd) # Accel
+        ax1.plot(0, Xi, 'bo') # Pos Initial
+        ax1.plot(0, Vi, 'ro') # Vel Initial
+        ax1.plot(Tf, Xf, 'b*') # Pos Final
+        ax1.plot(Tf, 0, 'r*') # Vel Final
+
+        ax1.set_ylim(-plot_range, plot_range)
+
+        print()
+
+    plt.show()
+
+def large_test():
+    random.seed(1) # Repeatable tests by using specific seed
+    failures = 0
+    for x in range(100):
+        print("Test {}".format(x))
+        (Xf, Xi, Vi, Vmax, Amax, Dmax, Jmax) = random_move()
+        (segments, Vr, Tf) = PlanSCurve(Xf, Xi, Vi, Vmax, Amax, Dmax, Jmax)
+        (Y, Yd, Ydd, t) = EvalSCurve(Xf, Xi, Vi, segments, Tf)
+        if not CheckSCurve(Xf, Xi, Vi, Vmax, Amax, Dmax, Jmax, Y, Yd, Ydd, t):
+            failures += 1
+
+        print()
+    print("{} of 100 tests failed".format(failures))
+    return failures == 0
+
+if __name__ == '__main__':
+    large_test()
+    graphical_test()
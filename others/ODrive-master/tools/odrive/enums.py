@@ -12,6 +12,7 @@ AXIS_STATE_ENCODER_OFFSET_CALIBRATION = 7
 AXIS_STATE_CLOSED_LOOP_CONTROL = 8
 AXIS_STATE_LOCKIN_SPIN = 9
 AXIS_STATE_ENCODER_DIR_FIND = 10
+AXIS_STATE_AUTOTUNE = 11
 
 class errors:
     class axis:
@@ -43,6 +44,8 @@ class errors:
         ERROR_UNEXPECTED_TIMER_CALLBACK = 0x0200
         ERROR_CURRENT_SENSE_SATURATION = 0x0400
         ERROR_CURRENT_UNSTABLE = 0x1000
+        ERROR_RL_IDENTIFICATION_FIT = 0x2000
+        ERROR_MOTOR_OVER_TEMP = 0x4000
 
     class encoder:
         ERROR_NONE = 0
@@ -52,10 +55,13 @@ class errors:
         ERROR_UNSUPPORTED_ENCODER_MODE = 0x08
         ERROR_ILLEGAL_HALL_STATE = 0x10
         ERROR_INDEX_NOT_FOUND_YET = 0x20
+        ERROR_EDGE_TIMING_CONFLICT = 0x40
 
     class controller:
         ERROR_NONE = 0
         ERROR_OVERSPEED = 0x01
+        ERROR_AUTOTUNE_FAILED = 0x02
+        ERROR_INVALID_ESTIMATE = 0x04
 
 MOTOR_TYPE_HIGH_CURRENT = 0
 #MOTOR_TYPE_LOW_CURRENT = 1
@@ -66,6 +72,31 @@ CTRL_MODE_CURRENT_CONTROL = 1
 CTRL_MODE_VELOCITY_CONTROL = 2
 CTRL_MODE_POSITION_CONTROL = 3
 CTRL_MODE_TRAJECTORY_CONTROL = 4
+CTRL_MODE_SCURVE_TRAJECTORY_CONTROL = 5
+CTRL_MODE_PVT_CONTROL = 6
+
+INPUT_FILTER_NONE = 0
+INPUT_FILTER_FIRST_ORDER_HOLD = 1
+INPUT_FILTER_SECOND_ORDER = 2
+INPUT_FILTER_CUBIC = 3
+
+BIQUAD_NONE = 0
+BIQUAD_LOWPASS = 1
+BIQUAD_NOTCH = 2
+BIQUAD_LEAD_LAG = 3
+
+FILTER_ON_VEL_ERROR = 0
+FILTER_ON_CURRENT = 1
+
+AUTOTUNE_IDLE = 0
+AUTOTUNE_ULTIMATE = 1
+AUTOTUNE_INERTIA = 2
+AUTOTUNE_SWEEP = 3
+AUTOTUNE_DONE = 4
+AUTOTUNE_FAILED = 5
+
+ESTIMATOR_PLL = 0
+ESTIMATOR_KALMAN = 1
 
 ENCODER_MODE_INCREMENTAL = 0
 ENCODER_MODE_HALL = 1
@@ -139,6 +139,40 @@ def print_drv_regs(name, motor):
     print("Control Reg 1: " + str(ctrl_reg_1) + " (" + format(ctrl_reg_1, '#013b') + ")")
     print("Control Reg 2: " + str(ctrl_reg_2) + " (" + format(ctrl_reg_2, '#09b') + ")")
 
+def print_timing_report(odrv, cpu_clock_hz=168000000):
+    """
+    Prints the timing log of both motors and the execution times of the
+    control loop stages in microseconds.
+    Run this once on a build with and once without CONFIG_RAM_HOT_PATH
+    (under the same load) to compare the two.
+    """
+    to_us = lambda clocks: clocks * 1e6 / cpu_clock_hz
+    for name in ['axis0', 'axis1']:
+        axis = getattr(odrv, name)
+        print(name + " timing log (time since start of control period):")
+        timing_log = axis.motor.timing_log
+        for slot in ['TIMING_LOG_ADC_CB_I', 'TIMING_LOG_ADC_CB_DC', 'TIMING_LOG_FOC_CURRENT', 'TIMING_LOG_FOC_VOLTAGE']:
+            print("  {:<24} {:8.2f} us".format(slot, to_us(getattr(timing_log, slot))))
+        print(name + " control stages (divisor, last / max execution time, deadline misses):")
+        for stage in ['checks', 'estimators', 'position', 'velocity', 'current']:
+            stats = getattr(axis.control_stage_stats, stage)
+            config = getattr(axis.config.control_stages, stage)
+            divisor = config.divisor if hasattr(config, 'divisor') else 1
+            print("  {:<24} {:4d} {:8.2f} us {:8.2f} us {:8d}".format(stage, divisor,
+                to_us(stats.last_time), to_us(stats.max_time), stats.deadline_misses))
+
+def stream_pvt(axis, points, poll_interval=0.005):
+    """
+    Appends a list of (dt, pos, vel) points to the PVT queue of an axis.
+    Waits whenever the queue is full, so this returns once all points are queued.
+    Set axis.controller.config.control_mode = CTRL_MODE_PVT_CONTROL to execute them.
+    """
+    for (dt, pos, vel) in points:
+        if not dt > 0:
+            raise ValueError("dt must be positive")
+        while not axis.pvt.push(dt, pos, vel):
+            time.sleep(poll_interval)
+
 def show_oscilloscope(odrv):
     size = 18000
     values = []